@@ -0,0 +1,153 @@
+# Synthetic load for continuous batching (flash_attn/utils/continuous_batching.py) vs. static batches as in
+# flash_attn/utils/generation.py::decode: requests arrive as a Poisson process with random prompt and output lengths,
+# and a small stand-in model runs on the CPU, with the attention over the KV cache done in PyTorch with the same
+# cache_batch_idx / cache_seqlens semantics as flash_attn_with_kvcache. Reports the output throughput and the p50 / p99
+# time to first token and request latency.
+# Example:
+#   python benchmarks/benchmark_continuous_batching.py --num-requests 200 --rate 20 --max-batch-size 16
+import argparse
+import math
+import time
+
+import numpy as np
+import torch
+import torch.nn as nn
+
+from flash_attn.utils.continuous_batching import ContinuousBatchingScheduler, Request
+
+
+def kvcache_attention_ref(q, k, v, k_cache, v_cache, cache_seqlens, cache_batch_idx):
+    """flash_attn_with_kvcache(q, k_cache, v_cache, k, v, cache_seqlens, cache_batch_idx=..., causal=True) in PyTorch.
+    q, k, v: (batch, seqlen_new, nheads, headdim). Appends k, v to the cache in place."""
+    batch, seqlen_new = q.shape[:2]
+    idx = cache_batch_idx.long()
+    positions = cache_seqlens.long()[:, None] + torch.arange(seqlen_new)  # (batch, seqlen_new)
+    k_cache[idx[:, None], positions] = k
+    v_cache[idx[:, None], positions] = v
+    seqlen_k = int(positions.max()) + 1
+    keys, values = k_cache[idx, :seqlen_k], v_cache[idx, :seqlen_k]
+    scores = torch.einsum("bthd,bshd->bhts", q, keys) / math.sqrt(q.shape[-1])
+    mask = torch.arange(seqlen_k)[None, None, :] > positions[:, :, None]  # (batch, seqlen_new, seqlen_k)
+    scores.masked_fill_(mask[:, None], float("-inf"))
+    return torch.einsum("bhts,bshd->bthd", scores.softmax(dim=-1), values)
+
+
+class StandInModel(nn.Module):
+    """One attention layer with a KV cache of max_batch_size slots, and an LM head."""
+
+    def __init__(self, vocab_size, max_batch_size, max_seqlen, nheads=4, headdim=32):
+        super().__init__()
+        d_model = nheads * headdim
+        self.nheads, self.headdim = nheads, headdim
+        self.embedding = nn.Embedding(vocab_size, d_model)
+        self.qkv = nn.Linear(d_model, 3 * d_model)
+        self.out_proj = nn.Linear(d_model, d_model)
+        self.lm_head = nn.Linear(d_model, vocab_size)
+        self.k_cache = torch.zeros(max_batch_size, max_seqlen, nheads, headdim)
+        self.v_cache = torch.zeros_like(self.k_cache)
+
+    @torch.no_grad()
+    def forward(self, input_ids, cache_seqlens, cache_batch_idx):
+        x = self.embedding(input_ids)
+        q, k, v = self.qkv(x).unflatten(-1, (3, self.nheads, self.headdim)).unbind(dim=2)
+        out = kvcache_attention_ref(q, k, v, self.k_cache, self.v_cache, cache_seqlens, cache_batch_idx)
+        x = x + self.out_proj(out.flatten(-2))
+        return self.lm_head(x[:, -1])
+
+
+def make_requests(args, rng):
+    arrivals = np.cumsum(rng.exponential(1.0 / args.rate, args.num_requests))
+    # Lognormal lengths with the given means, as chat traffic tends to be
+    prompt_lens = np.clip(rng.lognormal(math.log(args.prompt_len) - 0.5, 1.0, args.num_requests), 1, args.max_prompt_len)
+    output_lens = np.clip(rng.lognormal(math.log(args.output_len) - 0.5, 1.0, args.num_requests), 1, args.max_output_len)
+    return [
+        Request(prompt=rng.integers(0, args.vocab_size, int(p)).tolist(), max_new_tokens=int(o), arrival_time=float(a))
+        for a, p, o in zip(arrivals, prompt_lens, output_lens)
+    ]
+
+
+def run_continuous(model, requests, args):
+    scheduler = ContinuousBatchingScheduler(args.max_batch_size, args.max_prompt_len + args.max_output_len,
+                                            args.max_num_batched_tokens)
+    pending, finished = list(requests), []
+    start = time.perf_counter()
+    while pending or scheduler.has_unfinished_requests():
+        now = time.perf_counter() - start
+        while pending and pending[0].arrival_time <= now:
+            scheduler.add_request(pending.pop(0))
+        if not scheduler.has_unfinished_requests():
+            time.sleep(max(pending[0].arrival_time - now, 0.0))
+            continue
+        step = scheduler.schedule()
+        next_tokens = {}
+        for batch in step.prefills + ([step.decode] if step.decode is not None else []):
+            logits = model(batch.input_ids, batch.cache_seqlens, batch.cache_batch_idx)
+            next_tokens.update(zip(batch.request_ids, logits.argmax(dim=-1).tolist()))
+        finished += scheduler.update(step, next_tokens, now=time.perf_counter() - start)
+    return finished, time.perf_counter() - start
+
+
+def run_static(model, requests, args):
+    """Batches of up to max_batch_size requests that have arrived, with the prompts right-padded to the longest one,
+    decoding until the longest output is done, as generation.py::decode does. All the requests of a batch finish
+    together."""
+    pending, finished = list(requests), []
+    start = time.perf_counter()
+    while pending:
+        now = time.perf_counter() - start
+        if pending[0].arrival_time > now:
+            time.sleep(pending[0].arrival_time - now)
+            now = pending[0].arrival_time
+        batch = [r for r in pending[: args.max_batch_size] if r.arrival_time <= now]
+        pending = pending[len(batch):]
+        prompt_len = max(len(r.prompt) for r in batch)
+        input_ids = torch.tensor([r.prompt + [0] * (prompt_len - len(r.prompt)) for r in batch])
+        slots = torch.arange(len(batch), dtype=torch.int32)
+        seqlens = torch.zeros(len(batch), dtype=torch.int32)
+        for i in range(max(r.max_new_tokens for r in batch)):
+            tokens = model(input_ids, seqlens, slots).argmax(dim=-1)
+            if i == 0:
+                for r in batch:
+                    r.first_token_time = time.perf_counter() - start
+            seqlens += input_ids.shape[1]
+            input_ids = tokens[:, None]
+            for r, t in zip(batch, tokens.tolist()):
+                if len(r.output) < r.max_new_tokens:
+                    r.output.append(t)
+        for r in batch:
+            r.finish_time = time.perf_counter() - start
+        finished += batch
+    return finished, time.perf_counter() - start
+
+
+def report(name, finished, elapsed):
+    num_tokens = sum(len(r.output) for r in finished)
+    ttft = np.array([r.first_token_time - r.arrival_time for r in finished]) * 1e3
+    latency = np.array([r.finish_time - r.arrival_time for r in finished]) * 1e3
+    print(f"{name:>10}: {num_tokens / elapsed:8.1f} tokens/s, {len(finished) / elapsed:6.2f} requests/s, "
+          f"TTFT p50 {np.percentile(ttft, 50):8.1f}ms p99 {np.percentile(ttft, 99):8.1f}ms, "
+          f"latency p50 {np.percentile(latency, 50):8.1f}ms p99 {np.percentile(latency, 99):8.1f}ms")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Continuous vs. static batching under Poisson arrivals")
+    parser.add_argument("--num-requests", type=int, default=200)
+    parser.add_argument("--rate", type=float, default=20.0, help="Mean arrivals per second")
+    parser.add_argument("--prompt-len", type=int, default=64, help="Mean prompt length")
+    parser.add_argument("--output-len", type=int, default=32, help="Mean output length")
+    parser.add_argument("--max-prompt-len", type=int, default=512)
+    parser.add_argument("--max-output-len", type=int, default=256)
+    parser.add_argument("--max-batch-size", type=int, default=16)
+    parser.add_argument("--max-num-batched-tokens", type=int, default=1024)
+    parser.add_argument("--vocab-size", type=int, default=1000)
+    parser.add_argument("--seed", type=int, default=0)
+    args = parser.parse_args()
+    torch.manual_seed(args.seed)
+    model = StandInModel(args.vocab_size, args.max_batch_size, args.max_prompt_len + args.max_output_len)
+    for name, run in [("continuous", run_continuous), ("static", run_static)]:
+        requests = make_requests(args, np.random.default_rng(args.seed))
+        report(name, *run(model, requests, args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,178 @@
+# Copyright (c) 2024, Tri Dao.
+"""Chunked prefill: long prompts are processed a chunk at a time, packed into the same varlen call as the decodes
+of the other running sequences, so that a long prompt doesn't stall everyone else's next token.
+
+Each step is one varlen attention call over a paged KV cache (hopper's flash_attn_with_kvcache with cu_seqlens_q):
+row i is the next query_lens[i] tokens of a sequence, starting at position cache_seqlens[i]. Its keys / values are
+appended to the cache and it attends, causally, to the cache up to seqused_k[i] = cache_seqlens[i] + query_lens[i]:
+
+    planner = ChunkedPrefillPlanner(max_num_batched_tokens=512, chunk_multiple=page_size, block_manager=manager)
+    planner.add_request(request_id, prompt_len, max_new_tokens)
+    while planner.has_unfinished_requests():
+        step = planner.plan()
+        copy_kv_pages(k_cache, v_cache, step.page_copies)
+        # q, k_new, v_new: (step.num_tokens, nheads, headdim), the rows' tokens packed in order
+        out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, cache_seqlens=step.cache_seqlens,
+                                      page_table=step.page_table, cu_seqlens_q=step.cu_seqlens_q,
+                                      cu_seqlens_k_new=step.cu_seqlens_q, max_seqlen_q=step.max_seqlen_q, causal=True)
+        logits = lm_head(hidden[step.sample_indices])  # One token for each of step.sample_request_ids
+        planner.update(step, finished_request_ids=...)
+
+Token budget: each step takes at most max_num_batched_tokens tokens. The decoding sequences get their one token
+first (as many of them as the budget and max_num_seqs allow), then the prompts still being prefilled get chunks, in
+arrival order, of as many tokens as the budget has left. A chunk that isn't the end of its prompt is rounded down to a
+multiple of chunk_multiple (e.g. the page size, or the kernel's kBlockM so that the chunk fills whole tiles). A smaller
+budget means less time between tokens for the decoding sequences, a larger one more prefill throughput.
+
+With a block_manager (hopper's KVBlockManager, or anything with its add_sequence / pages_needed / num_free_pages /
+append_batch / page_table / free_sequence methods), the planner allocates the pages of the step's tokens and returns
+the page table; without one, page_table and page_copies are None and the cache layout is up to the caller. plan()
+raises if there aren't enough free pages for a decoding sequence's next token, or for the next prefill chunk when
+nothing is decoding (the step would be empty, and the loop above would never finish).
+"""
+from dataclasses import dataclass
+from typing import Iterable, List, Optional
+
+import torch
+from torch import Tensor
+
+
+@dataclass
+class ChunkedSequence:
+    request_id: int
+    prompt_len: int
+    max_new_tokens: int
+    num_computed: int = 0  # Tokens in the KV cache
+    num_generated: int = 0
+    seq_id: Optional[int] = None  # In the block manager
+
+    @property
+    def is_prefilling(self):
+        return self.num_computed < self.prompt_len
+
+
+@dataclass
+class ChunkedPrefillStep:
+    request_ids: List[int]
+    query_lens: List[int]
+    cu_seqlens_q: Tensor  # (batch + 1,), int32
+    cache_seqlens: Tensor  # (batch,), int32, tokens in the cache before this step
+    seqused_k: Tensor  # (batch,), int32, tokens in the cache after this step
+    max_seqlen_q: int
+    sample_indices: Tensor  # Packed index of the last token of each row that produces a token, int64
+    sample_request_ids: List[int]
+    num_decode_tokens: int
+    num_prefill_tokens: int
+    page_table: Optional[Tensor] = None  # (batch, max_num_pages_per_seq), int32
+    page_copies: Optional[Tensor] = None  # Copy-on-write page copies to do before the call
+
+    @property
+    def num_tokens(self):
+        return self.num_decode_tokens + self.num_prefill_tokens
+
+
+class ChunkedPrefillPlanner:
+    def __init__(self, max_num_batched_tokens, max_num_seqs=256, chunk_multiple=1, block_manager=None, device=None):
+        assert max_num_batched_tokens >= chunk_multiple, "The token budget must fit at least one chunk"
+        self.max_num_batched_tokens = max_num_batched_tokens
+        self.max_num_seqs = max_num_seqs
+        self.chunk_multiple = chunk_multiple
+        self.block_manager = block_manager
+        self.device = device
+        self.sequences: List[ChunkedSequence] = []  # In arrival order
+
+    def add_request(self, request_id, prompt_len, max_new_tokens):
+        assert prompt_len > 0 and max_new_tokens > 0
+        seq = ChunkedSequence(request_id, prompt_len, max_new_tokens)
+        if self.block_manager is not None:
+            seq.seq_id = self.block_manager.add_sequence([], 0)
+        self.sequences.append(seq)
+
+    def has_unfinished_requests(self):
+        return len(self.sequences) > 0
+
+    def plan(self) -> ChunkedPrefillStep:
+        budget = self.max_num_batched_tokens
+        num_free_pages = self.block_manager.num_free_pages if self.block_manager is not None else None
+        rows = []  # (sequence, number of tokens)
+
+        def reserve(seq, num_tokens):
+            nonlocal num_free_pages
+            if self.block_manager is None:
+                return True
+            # Conservative: the exact count for the batch (shared pages copied once) can only be lower
+            needed = self.block_manager.pages_needed(seq.seq_id, num_tokens)
+            if needed > num_free_pages:
+                return False
+            num_free_pages -= needed
+            return True
+
+        for seq in self.sequences:
+            if not seq.is_prefilling and len(rows) < self.max_num_seqs and budget > 0:
+                if not reserve(seq, 1):
+                    raise RuntimeError(f"Out of KV cache pages to decode request {seq.request_id}")
+                rows.append((seq, 1))
+                budget -= 1
+        for seq in self.sequences:
+            if not seq.is_prefilling or len(rows) >= self.max_num_seqs:
+                continue
+            remaining = seq.prompt_len - seq.num_computed
+            chunk = min(remaining, budget)
+            if chunk < remaining:
+                chunk -= chunk % self.chunk_multiple
+            if chunk == 0 or not reserve(seq, chunk):
+                if not rows:
+                    raise RuntimeError(f"Out of KV cache pages to prefill request {seq.request_id}")
+                break
+            rows.append((seq, chunk))
+            budget -= chunk
+        return self._step(rows)
+
+    def update(self, step: ChunkedPrefillStep, finished_request_ids: Iterable[int] = ()):
+        """Advances the sequences of the step, and removes the ones that generated max_new_tokens tokens or are in
+        finished_request_ids (e.g. they sampled EOS). Returns the removed request ids."""
+        finished_request_ids = set(finished_request_ids)
+        sampled = set(step.sample_request_ids)
+        by_id = {seq.request_id: seq for seq in self.sequences}
+        for request_id, query_len in zip(step.request_ids, step.query_lens):
+            seq = by_id[request_id]
+            seq.num_computed += query_len
+            if request_id in sampled:
+                seq.num_generated += 1
+                if seq.num_generated >= seq.max_new_tokens:
+                    finished_request_ids.add(request_id)
+        removed = []
+        for seq in self.sequences:
+            if seq.request_id in finished_request_ids:
+                if self.block_manager is not None:
+                    self.block_manager.free_sequence(seq.seq_id)
+                removed.append(seq.request_id)
+        self.sequences = [seq for seq in self.sequences if seq.request_id not in finished_request_ids]
+        return removed
+
+    def _step(self, rows) -> ChunkedPrefillStep:
+        query_lens = [n for _, n in rows]
+        cu_seqlens_q = [0]
+        for n in query_lens:
+            cu_seqlens_q.append(cu_seqlens_q[-1] + n)
+        cache_seqlens = [seq.num_computed for seq, _ in rows]
+        # A row produces a token if it reaches the end of the prompt, or is a decode
+        sampling = [i for i, (seq, n) in enumerate(rows) if seq.num_computed + n >= seq.prompt_len]
+        tensor = lambda x, dtype=torch.int32: torch.tensor(x, dtype=dtype, device=self.device)
+        step = ChunkedPrefillStep(
+            request_ids=[seq.request_id for seq, _ in rows],
+            query_lens=query_lens,
+            cu_seqlens_q=tensor(cu_seqlens_q),
+            cache_seqlens=tensor(cache_seqlens),
+            seqused_k=tensor([s + n for s, n in zip(cache_seqlens, query_lens)]),
+            max_seqlen_q=max(query_lens, default=0),
+            sample_indices=tensor([cu_seqlens_q[i + 1] - 1 for i in sampling], dtype=torch.long),
+            sample_request_ids=[rows[i][0].request_id for i in sampling],
+            num_decode_tokens=sum(n for seq, n in rows if not seq.is_prefilling),
+            num_prefill_tokens=sum(n for seq, n in rows if seq.is_prefilling),
+        )
+        if self.block_manager is not None and rows:
+            seq_ids = [seq.seq_id for seq, _ in rows]
+            step.page_copies = self.block_manager.append_batch(seq_ids, query_lens)
+            step.page_table, _ = self.block_manager.page_table(seq_ids, 0, self.device)
+        return step
@@ -0,0 +1,156 @@
+# Copyright (c) 2024, Tri Dao.
+"""Iteration-level (continuous) batching for decoding with flash_attn_with_kvcache.
+
+`decode` in generation.py runs one static batch: every sequence occupies its row of the KV cache until the longest
+one finishes. Here requests are admitted and retired at every step instead. Each running request owns a slot (a row)
+of a KV cache of shape (max_batch_size, max_seqlen, nheads_k, headdim), and each step the scheduler builds the
+cache_batch_idx / cache_seqlens tensors that map the rows of the step's batch onto those slots:
+
+    scheduler = ContinuousBatchingScheduler(max_batch_size, max_seqlen, max_num_batched_tokens=2048)
+    scheduler.add_request(Request(prompt=prompt_ids, max_new_tokens=128))
+    while scheduler.has_unfinished_requests():
+        step = scheduler.schedule()
+        next_tokens = {}
+        for batch in step.prefills + ([step.decode] if step.decode is not None else []):
+            # batch.input_ids: (batch, seqlen_new). In the attention layers:
+            # flash_attn_with_kvcache(q, k_cache, v_cache, k, v, cache_seqlens=batch.cache_seqlens,
+            #                         cache_batch_idx=batch.cache_batch_idx, causal=True)
+            logits = model(batch.input_ids, ...)[:, -1]
+            next_tokens.update(zip(batch.request_ids, sample(logits).tolist()))
+        finished = scheduler.update(step, next_tokens)
+
+Token budget: a step processes one token per running request (decode) plus the prompts of the requests it admits
+(prefill), at most max_num_batched_tokens in total. Decodes come first so that running requests never stall; waiting
+requests are admitted first come first served while their whole prompt fits in the budget and there is a free slot.
+A prompt longer than the budget is admitted alone when nothing else is scheduled, so that it can't starve.
+Since the rows of one flash_attn_with_kvcache call all append the same number of tokens, a step has one batch of
+decodes, and one prefill batch per group of admitted prompts of the same length.
+"""
+import itertools
+from collections import deque
+from dataclasses import dataclass, field
+from typing import Dict, List, Optional, Sequence
+
+import torch
+from torch import Tensor
+
+_request_ids = itertools.count()
+
+
+@dataclass
+class Request:
+    prompt: Sequence[int]
+    max_new_tokens: int
+    eos_token_id: Optional[int] = None
+    request_id: int = field(default_factory=lambda: next(_request_ids))
+    arrival_time: float = 0.0
+    # Filled in by the scheduler
+    slot: Optional[int] = None
+    output: List[int] = field(default_factory=list)
+    first_token_time: Optional[float] = None
+    finish_time: Optional[float] = None
+
+    @property
+    def num_tokens(self):
+        return len(self.prompt) + len(self.output)
+
+    def is_finished(self):
+        return len(self.output) >= self.max_new_tokens or (
+            self.eos_token_id is not None and len(self.output) > 0 and self.output[-1] == self.eos_token_id
+        )
+
+
+@dataclass
+class BatchInputs:
+    """One flash_attn_with_kvcache batch: row i appends input_ids[i] to cache slot cache_batch_idx[i], which holds
+    cache_seqlens[i] tokens so far."""
+
+    request_ids: List[int]
+    input_ids: Tensor  # (batch, seqlen_new), int64
+    cache_batch_idx: Tensor  # (batch,), int32
+    cache_seqlens: Tensor  # (batch,), int32
+
+    @property
+    def num_tokens(self):
+        return self.input_ids.numel()
+
+
+@dataclass
+class SchedulerStep:
+    prefills: List[BatchInputs]
+    decode: Optional[BatchInputs]
+
+    @property
+    def num_tokens(self):
+        return sum(b.num_tokens for b in self.prefills) + (self.decode.num_tokens if self.decode is not None else 0)
+
+
+class ContinuousBatchingScheduler:
+    def __init__(self, max_batch_size, max_seqlen, max_num_batched_tokens=2048, device=None):
+        self.max_batch_size = max_batch_size
+        self.max_seqlen = max_seqlen
+        self.max_num_batched_tokens = max_num_batched_tokens
+        self.device = device
+        self.waiting: deque = deque()
+        self.running: Dict[int, Request] = {}  # By request id, in admission order
+        self.free_slots = list(range(max_batch_size - 1, -1, -1))
+
+    def add_request(self, request: Request):
+        if len(request.prompt) + request.max_new_tokens > self.max_seqlen:
+            raise ValueError(
+                f"Request {request.request_id} needs {len(request.prompt) + request.max_new_tokens} tokens of KV cache, "
+                f"more than max_seqlen = {self.max_seqlen}"
+            )
+        self.waiting.append(request)
+
+    def has_unfinished_requests(self):
+        return len(self.waiting) > 0 or len(self.running) > 0
+
+    def schedule(self) -> SchedulerStep:
+        decoding = list(self.running.values())
+        budget = self.max_num_batched_tokens - len(decoding)
+        admitted = []
+        while self.waiting and self.free_slots:
+            prompt_len = len(self.waiting[0].prompt)
+            nothing_scheduled = not decoding and not admitted
+            if prompt_len > budget and not nothing_scheduled:
+                break
+            request = self.waiting.popleft()
+            request.slot = self.free_slots.pop()
+            admitted.append(request)
+            budget -= prompt_len
+        prefills = []
+        for _, group in itertools.groupby(sorted(admitted, key=lambda r: len(r.prompt)), key=lambda r: len(r.prompt)):
+            group = list(group)
+            prefills.append(self._batch(group, [r.prompt for r in group], [0] * len(group)))
+        for request in admitted:
+            self.running[request.request_id] = request
+        decode = None
+        if decoding:
+            decode = self._batch(decoding, [[r.output[-1]] for r in decoding], [r.num_tokens - 1 for r in decoding])
+        return SchedulerStep(prefills=prefills, decode=decode)
+
+    def update(self, step: SchedulerStep, next_tokens: Dict[int, int], now: Optional[float] = None) -> List[Request]:
+        """Appends the token sampled for each request of the step, and retires the finished requests, whose slots
+        can be reused from the next step on. Returns the finished requests."""
+        finished = []
+        for batch in step.prefills + ([step.decode] if step.decode is not None else []):
+            for request_id in batch.request_ids:
+                request = self.running[request_id]
+                request.output.append(int(next_tokens[request_id]))
+                if request.first_token_time is None:
+                    request.first_token_time = now
+                if request.is_finished():
+                    request.finish_time = now
+                    del self.running[request_id]
+                    self.free_slots.append(request.slot)
+                    finished.append(request)
+        return finished
+
+    def _batch(self, requests, input_ids, cache_seqlens):
+        return BatchInputs(
+            request_ids=[r.request_id for r in requests],
+            input_ids=torch.tensor(input_ids, dtype=torch.long, device=self.device),
+            cache_batch_idx=torch.tensor([r.slot for r in requests], dtype=torch.int32, device=self.device),
+            cache_seqlens=torch.tensor(cache_seqlens, dtype=torch.int32, device=self.device),
+        )
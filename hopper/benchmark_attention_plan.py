@@ -0,0 +1,67 @@
+# Host overhead per decode call: flash_attn_with_kvcache, which redoes the checks, params, heuristics and workspace
+# allocations at every call, vs. an AttentionPlan (get_attention_plan), which only swaps pointers and launches.
+# The problem is batch 1 decode with a short cache, so that the calls are bound by the host, not the GPU.
+# Example:
+#   python benchmark_attention_plan.py --headdim 128 --nheads 32 --nheads-kv 8 --seqlen-k 512 --page-size 0 256
+
+import argparse
+import math
+import time
+
+import torch
+
+from flash_attn_interface import flash_attn_with_kvcache, get_attention_plan
+
+
+def host_time_per_call(fn, device, iters):
+    """Mean wall time per call. On the GPU, as long as the calls take longer to launch than to run, this is the
+    host overhead (plus a final synchronization spread over all calls). Otherwise the GPU is the bottleneck and
+    this is the kernel time."""
+    for _ in range(10):
+        fn()
+    if device == "cuda":
+        torch.cuda.synchronize()
+    start = time.perf_counter()
+    for _ in range(iters):
+        fn()
+    if device == "cuda":
+        torch.cuda.synchronize()
+    return (time.perf_counter() - start) / iters
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Per-call host overhead of AttentionPlan vs. flash_attn_with_kvcache")
+    parser.add_argument("--device", default="cuda" if torch.cuda.is_available() else "cpu")
+    parser.add_argument("--batch", type=int, nargs="+", default=[1, 8])
+    parser.add_argument("--headdim", type=int, default=128)
+    parser.add_argument("--nheads", type=int, default=32)
+    parser.add_argument("--nheads-kv", type=int, default=8)
+    parser.add_argument("--seqlen-k", type=int, default=512)
+    parser.add_argument("--page-size", type=int, nargs="+", default=[0], help="0 means no paged KV")
+    parser.add_argument("--iters", type=int, default=1000)
+    args = parser.parse_args()
+    device, dtype = args.device, torch.bfloat16
+    for batch, page_size in [(b, p) for b in args.batch for p in args.page_size]:
+        q = torch.randn(batch, 1, args.nheads, args.headdim, device=device, dtype=dtype)
+        if not page_size:
+            k_cache = torch.randn(batch, args.seqlen_k, args.nheads_kv, args.headdim, device=device, dtype=dtype)
+            page_table = None
+        else:
+            num_pages_per_seq = math.ceil(args.seqlen_k / page_size)
+            k_cache = torch.randn(batch * num_pages_per_seq, page_size, args.nheads_kv, args.headdim, device=device, dtype=dtype)
+            page_table = torch.randperm(batch * num_pages_per_seq, dtype=torch.int32, device=device).reshape(batch, num_pages_per_seq)
+        v_cache = torch.randn_like(k_cache)
+        cache_seqlens = torch.full((batch,), args.seqlen_k // 2, dtype=torch.int32, device=device)
+        plan = get_attention_plan(q, k_cache, v_cache, cache_seqlens, page_table=page_table, causal=True)
+        out = torch.empty_like(q)
+        t_call = host_time_per_call(
+            lambda: flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, page_table=page_table, causal=True),
+            device, args.iters)
+        t_plan = host_time_per_call(lambda: plan.run(q, k_cache, v_cache, cache_seqlens, page_table, out), device, args.iters)
+        print(f"{device} batch {batch:4d}, page size {page_size:4d}, num_splits {plan.num_splits:3d}: "
+              f"flash_attn_with_kvcache {t_call * 1e6:8.1f}us, plan {t_plan * 1e6:8.1f}us, "
+              f"saved {(t_call - t_plan) * 1e6:7.1f}us per call")
+
+
+if __name__ == "__main__":
+    main()
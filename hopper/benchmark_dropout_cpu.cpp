@@ -0,0 +1,66 @@
+// Throughput of the CPU dropout mask generation in dropout_cpu.h. Doesn't need a GPU or PyTorch:
+//   g++ -std=c++17 -O3 -march=native -o benchmark_dropout_cpu benchmark_dropout_cpu.cpp && ./benchmark_dropout_cpu
+// Prints, on one thread, the rate of Philox-4x32 calls one lane at a time (philox) and a warp of lanes at a time
+// (philox_warp, vectorized with AVX2 / AVX-512 when compiled for them), and of DropoutCpu::keep_mask for the
+// tiles of the CPU forward and a whole attention matrix.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "dropout_cpu.h"
+
+using namespace flash::cpu;
+
+// Best of a few repeats of fn, in ns per call
+template <typename Fn>
+double time_ns(int const iters, Fn&& fn) {
+    double best = 1e30;
+    for (int rep = 0; rep < 5; ++rep) {
+        auto const start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; ++i) { fn(i); }
+        auto const end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / iters);
+    }
+    return best;
+}
+
+int main() {
+    uint64_t const seed = 0x2a2a2a2a2a2a2a2aull, offset = 1 << 20;
+    uint32_t sink = 0;
+#if defined(__AVX512F__)
+    char const* isa = "avx512";
+#elif defined(__AVX2__)
+    char const* isa = "avx2";
+#else
+    char const* isa = "scalar";
+#endif
+    std::printf("isa: %s\n", isa);
+
+    int const iters = 1 << 14;
+    double const scalar_ns = time_ns(iters, [&](int const i) {
+        for (int lane = 0; lane < kPhiloxLanes; ++lane) { sink ^= philox(seed, uint64_t(i), offset + lane).x; }
+    }) / kPhiloxLanes;
+    uint32_t rnd[4][kPhiloxLanes];
+    double const warp_ns = time_ns(iters, [&](int const i) {
+        philox_warp(seed, uint64_t(i), offset, rnd);
+        sink ^= rnd[0][i % kPhiloxLanes];
+    }) / kPhiloxLanes;
+    // Each call gives 16 random bytes, i.e. the bits of 16 elements of the attention matrix
+    std::printf("philox,      %.2f ns/call, %.1f Melem/s\n", scalar_ns, 16e3 / scalar_ns);
+    std::printf("philox_warp, %.2f ns/call, %.1f Melem/s, %.2fx\n", warp_ns, 16e3 / warp_ns, scalar_ns / warp_ns);
+
+    std::printf("rows,cols,ns,melem_per_s\n");
+    for (auto const& [rows, cols] : std::vector<std::pair<int, int>>{{64, 64}, {64, 128}, {32, 64}, {1, 128}, {1024, 1024}, {4096, 4096}}) {
+        std::vector<uint8_t> keep(size_t(rows) * cols);
+        DropoutCpu const dropout(seed, offset, uint8_t(0.9 * 255), 0, 0, 1);
+        int const reps = std::max(1, int(int64_t(1) << 22) / (rows * cols));
+        double const ns = time_ns(reps, [&](int const i) {
+            dropout.keep_mask(0, rows, (i % 8) * cols, cols, keep.data(), cols);
+            sink ^= keep[i % keep.size()];
+        });
+        std::printf("%d,%d,%.0f,%.1f\n", rows, cols, ns, double(rows) * cols / ns * 1e3);
+    }
+    return sink == 0x12345678 ? 1 : 0;  // Keep the results alive
+}
@@ -0,0 +1,83 @@
+// Host-side evaluator for the split-KV selection in heuristics.h. Doesn't need a GPU or PyTorch:
+//   g++ -std=c++17 -O2 -o benchmark_split_heuristic benchmark_split_heuristic.cpp && ./benchmark_split_heuristic [--curve]
+// Prints, for a sweep of decode / short-prefill shapes on a few device presets, the number of splits chosen by
+// SplitKVCostModel and by the previous wave-efficiency rule (num_splits_heuristic), with the predicted latency of each.
+// With --curve, also prints the predicted latency for every number of splits.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "heuristics.h"
+#include "tile_size.h"
+
+struct Device {
+    char const* name;
+    int arch;
+    int num_SMs;
+    int size_l2;
+    float flops_per_ns_per_sm;
+    float hbm_bytes_per_ns;
+};
+
+struct Model {
+    char const* name;
+    int num_heads, num_heads_k, headdim;
+};
+
+int main(int argc, char** argv) {
+    bool const print_curve = argc > 1 && std::strcmp(argv[1], "--curve") == 0;
+    std::vector<Device> devices = {
+        {"H100-SXM", 90, 132, 50 * 1024 * 1024, 7500.f, 3350.f},
+        {"H20", 90, 78, 60 * 1024 * 1024, 1900.f, 4000.f},
+        {"A100-80GB", 80, 108, 40 * 1024 * 1024, 2900.f, 2000.f},
+        {"L40S", 89, 142, 96 * 1024 * 1024, 2600.f, 860.f},
+    };
+    std::vector<Model> models = {
+        {"Llama-3.1-8B", 32, 8, 128},
+        {"Llama-3.1-70B", 64, 8, 128},
+        {"Qwen-2.5-7B", 28, 4, 128},
+        {"Gemma-2-9B", 16, 8, 256},
+    };
+    std::printf("device,model,batch,seqlen_q,seqlen_k,num_splits,predicted_us,legacy_num_splits,legacy_predicted_us,no_split_predicted_us\n");
+    for (auto const& dev : devices) {
+        SplitKVCostModel cost_model{dev.num_SMs, dev.size_l2, dev.flops_per_ns_per_sm, dev.hbm_bytes_per_ns};
+        for (auto const& model : models) {
+            int const d = model.headdim, dv = model.headdim;
+            int const qhead_per_khead = model.num_heads / model.num_heads_k;
+            // Same tile sizes as get_num_splits, for non-causal bf16 with PackGQA
+            int const kBlockM = dev.arch >= 90 ? std::get<0>(tile_size_fwd_sm90(d, dv, false, false)) : std::get<0>(tile_size_fwd_sm8x(dev.arch == 86 || dev.arch == 89, d, dv, false, false, 2, false, false, false, false));
+            int const kBlockN = dev.arch >= 90 ? std::get<1>(tile_size_fwd_sm90(d, dv, false, false)) : std::get<1>(tile_size_fwd_sm8x(dev.arch == 86 || dev.arch == 89, d, dv, false, false, 2, false, false, false, false));
+            for (int batch : {1, 4, 16, 64}) {
+                for (int seqlen_q : {1, 4, 64}) {
+                    for (int seqlen_k : {512, 2048, 8192, 32768, 131072}) {
+                        int const num_m_blocks = (seqlen_q * qhead_per_khead + kBlockM - 1) / kBlockM;
+                        int const num_n_blocks = (seqlen_k + kBlockN - 1) / kBlockN;
+                        int const size_one_kv_head = seqlen_k * (d + dv) * 2;
+                        int const total_mblocks = batch * model.num_heads_k * num_m_blocks;
+                        SplitKVProblem problem{total_mblocks, num_m_blocks, num_n_blocks,
+                                               2.f * kBlockM * kBlockN * (d + dv), float(kBlockN) * (d + dv) * 2,
+                                               float(size_one_kv_head),
+                                               float(batch) * model.num_heads * seqlen_q * (dv + 1) * sizeof(float),
+                                               float(batch) * model.num_heads * seqlen_q * dv * 2};
+                        int const num_splits = cost_model.num_splits(problem, 128);
+                        int const legacy = num_splits_heuristic(total_mblocks, dev.num_SMs, num_n_blocks, num_m_blocks, size_one_kv_head, false, 128);
+                        std::printf("%s,%s,%d,%d,%d,%d,%.1f,%d,%.1f,%.1f\n", dev.name, model.name, batch, seqlen_q, seqlen_k,
+                                    num_splits, cost_model.predict_ns(problem, num_splits) * 1e-3f,
+                                    legacy, cost_model.predict_ns(problem, legacy) * 1e-3f,
+                                    cost_model.predict_ns(problem, 1) * 1e-3f);
+                        if (print_curve) {
+                            std::string curve;
+                            for (int s = 1; s <= std::min({128, dev.num_SMs, num_n_blocks}); ++s) {
+                                curve += " " + std::to_string(s) + ":" + std::to_string(int(cost_model.predict_ns(problem, s)));
+                            }
+                            std::printf("#%s\n", curve.c_str());
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
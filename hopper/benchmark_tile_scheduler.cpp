@@ -0,0 +1,127 @@
+// Offline replay of the forward tile schedulers (tile_scheduler_sim.h). Doesn't need a GPU or PyTorch:
+//   g++ -std=c++17 -O2 -o benchmark_tile_scheduler benchmark_tile_scheduler.cpp
+//   ./benchmark_tile_scheduler [--trace FILE] [--num-sm 132] [--heads 32] [--heads-k 8] [--hdim 128]
+//                              [--causal] [--window LEFT RIGHT] [--pack-gqa] [--splits N] [--l2-mb 32]
+// The trace has one "seqlen_q seqlen_k" pair per line, one line per sequence in the batch. Without a trace,
+// a few synthetic batches are used. Prints per-scheduler makespan, tail imbalance, waves and the number of
+// KV heads in flight (a proxy for L2 pressure), plus the per-SM busy time with --per-sm.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "prepare_scheduler.h"
+#include "tile_scheduler_sim.h"
+#include "tile_size.h"
+
+using flash::sim::Problem;
+using flash::sim::Scheduler;
+
+static void run(char const* name, Problem p, int num_sm, bool per_sm) {
+    bool const uniform = std::all_of(p.seqlens_q.begin(), p.seqlens_q.end(), [&](int s) { return s == p.seqlens_q[0]; })
+        && std::all_of(p.seqlens_k.begin(), p.seqlens_k.end(), [&](int s) { return s == p.seqlens_k[0]; });
+    std::printf("== %s: batch %d, heads %d/%d, hdim %d, kBlockM %d, kBlockN %d, causal %d, local %d, pack_gqa %d, num_splits %d\n",
+                name, p.num_batch(), p.num_heads, p.num_heads_k, p.headdim, p.kBlockM, p.kBlockN,
+                p.is_causal, p.is_local, p.pack_gqa, p.num_splits);
+    std::vector<Scheduler> schedulers = {Scheduler::SingleTile, Scheduler::VarlenDynamicPersistent};
+    // The LPT work list is only built with causal / local masks
+    if (p.is_causal || p.is_local) { schedulers.push_back(Scheduler::VarlenDynamicPersistentLPT); }
+    // The non-varlen persistent schedulers assume all sequences have the same length
+    if (uniform) { schedulers.insert(schedulers.begin() + 1, {Scheduler::StaticPersistent, Scheduler::DynamicPersistent}); }
+    for (Scheduler s : schedulers) {
+        Problem q = p;
+        bool const varlen_persistent = s == Scheduler::VarlenDynamicPersistent || s == Scheduler::VarlenDynamicPersistentLPT;
+        if (varlen_persistent && q.num_splits > 1) {
+            // Varlen with Split always uses dynamic splits, computed the same way as prepare_varlen_num_blocks
+            std::vector<int> const cu_seqlens_q = q.cu_seqlens_q();
+            flash::PrepareSchedulerArgs const args = q.prepare_scheduler_args(cu_seqlens_q, num_sm);
+            q.num_splits_dynamic.resize(q.num_batch());
+            flash::prepare_varlen_num_blocks_host(args, nullptr, q.num_splits_dynamic.data());
+        }
+        auto const r = flash::sim::simulate(q, s, num_sm);
+        std::printf("%-26s makespan %10.1f us  mean busy %10.1f us  tail imbalance %6.1f%%  waves %6.2f  kv heads in flight max %4d avg %7.1f\n",
+                    flash::sim::scheduler_name(s), r.makespan_ns * 1e-3, r.mean_busy_ns * 1e-3, r.tail_imbalance * 100.0,
+                    r.num_waves, r.max_kv_heads_in_flight, r.avg_kv_heads_in_flight);
+        if (per_sm) {
+            for (int sm = 0; sm < num_sm; ++sm) {
+                std::printf("    sm %3d: %4d tiles, busy %10.1f us\n", sm, r.sm_num_tiles[sm], r.sm_busy_ns[sm] * 1e-3);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int num_sm = 132, heads = 32, heads_k = 8, hdim = 128, num_splits = 1, l2_mb = 32;
+    int window_left = -1, window_right = -1;
+    bool causal = false, pack_gqa = false, per_sm = false;
+    char const* trace = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string const arg = argv[i];
+        auto next = [&]() { if (i + 1 >= argc) { std::fprintf(stderr, "Missing value for %s\n", arg.c_str()); std::exit(1); } return argv[++i]; };
+        if (arg == "--trace") { trace = next(); }
+        else if (arg == "--num-sm") { num_sm = std::atoi(next()); }
+        else if (arg == "--heads") { heads = std::atoi(next()); }
+        else if (arg == "--heads-k") { heads_k = std::atoi(next()); }
+        else if (arg == "--hdim") { hdim = std::atoi(next()); }
+        else if (arg == "--splits") { num_splits = std::atoi(next()); }
+        else if (arg == "--l2-mb") { l2_mb = std::atoi(next()); }
+        else if (arg == "--window") { window_left = std::atoi(next()); window_right = std::atoi(next()); }
+        else if (arg == "--causal") { causal = true; }
+        else if (arg == "--pack-gqa") { pack_gqa = true; }
+        else if (arg == "--per-sm") { per_sm = true; }
+        else { std::fprintf(stderr, "Unknown argument %s\n", arg.c_str()); return 1; }
+    }
+    bool const local = !causal && (window_left >= 0 || window_right >= 0);
+    auto [kBlockM, kBlockN, mma_pv_is_rs, intra_wg_overlap] = tile_size_fwd_sm90(hdim, hdim, causal, local);
+    auto make_problem = [&](std::vector<int> seqlens_q, std::vector<int> seqlens_k) {
+        Problem p;
+        p.seqlens_q = std::move(seqlens_q);
+        p.seqlens_k = std::move(seqlens_k);
+        p.num_heads = heads;
+        p.num_heads_k = heads_k;
+        p.headdim = p.headdim_v = hdim;
+        p.kBlockM = kBlockM;
+        p.kBlockN = kBlockN;
+        p.is_causal = causal;
+        p.is_local = local;
+        // Same normalization as mha_fwd
+        p.window_size_left = causal ? -1 : (local && window_left < 0 ? p.max_seqlen_k() - 1 : window_left);
+        p.window_size_right = causal ? 0 : (local && window_right < 0 ? p.max_seqlen_q() - 1 : window_right);
+        p.pack_gqa = pack_gqa;
+        p.num_splits = num_splits;
+        p.size_l2 = l2_mb * 1024 * 1024;
+        return p;
+    };
+    if (trace) {
+        std::ifstream f(trace);
+        if (!f) { std::fprintf(stderr, "Can't open %s\n", trace); return 1; }
+        std::vector<int> seqlens_q, seqlens_k;
+        int sq, sk;
+        while (f >> sq >> sk) { seqlens_q.push_back(sq); seqlens_k.push_back(sk); }
+        if (seqlens_q.empty()) { std::fprintf(stderr, "Empty trace %s\n", trace); return 1; }
+        run(trace, make_problem(seqlens_q, seqlens_k), num_sm, per_sm);
+        return 0;
+    }
+    std::mt19937 gen(0);
+    run("uniform prefill 8 x 4096", make_problem(std::vector<int>(8, 4096), std::vector<int>(8, 4096)), num_sm, per_sm);
+    {
+        // Mixed prefill lengths, as in continuous batching
+        std::uniform_int_distribution<int> len(64, 8192);
+        std::vector<int> seqlens(32);
+        for (int& s : seqlens) { s = len(gen); }
+        run("mixed prefill 32 x [64, 8192]", make_problem(seqlens, seqlens), num_sm, per_sm);
+    }
+    {
+        // Decode: one query per sequence, long-tailed context lengths
+        std::lognormal_distribution<double> len(7.5, 1.0);
+        std::vector<int> seqlens_k(256);
+        for (int& s : seqlens_k) { s = std::max(1, std::min(int(len(gen)), 131072)); }
+        run("decode 256 x lognormal", make_problem(std::vector<int>(256, 1), seqlens_k), num_sm, per_sm);
+    }
+    return 0;
+}
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include "block_range.h"
+
 namespace flash {
 
 template <class SeqlenInfo_t, int kBlockM, int kBlockN, bool Is_causal, bool Is_local, bool PackGQA=false, bool Split=false>
@@ -18,39 +20,11 @@ struct BlockMN {
             cutlass::FastDivmod const& attention_chunk_divmod,
             cutlass::FastDivmod const& qhead_per_khead_divmod) {
 
-        int const seqlen_k = seqlen_info.seqlen_k;
-        int const seqlen_q = seqlen_info.seqlen_q;
-        int n_block_max = cute::ceil_div(seqlen_k, kBlockN);
-        if constexpr (Is_causal || Is_local) {
-            int m_idx_max = (m_block + 1) * kBlockM;
-            // TODO: check off-by-1 error
-            if (PackGQA) { m_idx_max = qhead_per_khead_divmod.divide(m_idx_max - 1) + 1 ; }
-            n_block_max = std::min(n_block_max,
-                                   cute::ceil_div(m_idx_max + seqlen_k - seqlen_q + window_size_right, kBlockN));
-        }
-        int n_block_min = 0;
-        if constexpr (Is_local) {
-            int m_idx_min = m_block * kBlockM;
-            if (PackGQA) { m_idx_min = qhead_per_khead_divmod.divide(m_idx_min); }
-            int const n_idx = m_idx_min + seqlen_k - seqlen_q;
-            int n_idx_left = n_idx - window_size_left;
-            if (attention_chunk_divmod.divisor > 0) {
-                n_idx_left = std::max(n_idx_left, attention_chunk_divmod.divide(n_idx) * attention_chunk_divmod.divisor);
-            }
-            n_block_min = std::max(int(0), n_idx_left / kBlockN);
-        }
+        auto const [n_block_min, n_block_max] = get_n_block_range(
+            seqlen_info.seqlen_q, seqlen_info.seqlen_k, kBlockM, kBlockN, Is_causal, Is_local, PackGQA, Split,
+            m_block, split_idx, num_splits, window_size_left, window_size_right,
+            attention_chunk_divmod, qhead_per_khead_divmod);
         // if (threadIdx.x == 128) { printf("Inside, bid.x = %d, bid.y = %d, bid.z = %d, split_idx = %d, n_block_min: %d, n_block_max: %d\n", blockIdx.x, blockIdx.y, blockIdx.z, split_idx, n_block_min, n_block_max); }
-        if constexpr (Split) {
-            uint32_t num_splits_dynamic_u = reinterpret_cast<uint32_t const&>(split_idx) >> 16; // first 16 bits are for num_splits
-            int num_splits_dynamic = reinterpret_cast<int&>(num_splits_dynamic_u);
-            int split_idx_actual = split_idx & 0x0000FFFF;
-            int num_splits_actual = num_splits_dynamic > 0 ? num_splits_dynamic : num_splits;
-            int num_n_blocks_per_split = n_block_max <= n_block_min ? 0 : cute::ceil_div(n_block_max - n_block_min, num_splits_actual);
-            n_block_min = n_block_min + split_idx_actual * num_n_blocks_per_split;
-            n_block_max = std::min(n_block_min + num_n_blocks_per_split, n_block_max);
-            // if (threadIdx.x == 128) { printf("Inside, bid.x = %d, bid.y = %d, bid.z = %d, split_idx = %d, num_splits_dynamic = %d, num_splits_actual = %d, num_n_blocks_per_split = %d, n_block_min: %d, n_block_max: %d\n", blockIdx.x, blockIdx.y, blockIdx.z, split_idx, num_splits_dynamic, num_splits_actual, num_n_blocks_per_split, n_block_min, n_block_max); }
-        }
-        // if (threadIdx.x == 128) { printf("After split, inside, bid.y = %d, bid.z = %d, split_idx = %d, n_block_min: %d, n_block_max: %d\n", blockIdx.y, blockIdx.z, split_idx, n_block_min, n_block_max); }
         return {n_block_min, n_block_max};
     }
 
@@ -80,19 +54,9 @@ struct BlockMN {
             SeqlenInfo_t const& seqlen_info,
             int const n_block, int const bidb,
             int const window_size_left, int const window_size_right, int const sink_token_length) {
-        // TODO: support attention_chunk
-        int const seqlen_q = seqlen_info.seqlen_q;
-        int const seqlen_k = seqlen_info.seqlen_k;
-        int m_block_max = cute::ceil_div(seqlen_q, kBlockM);
-        if constexpr (Is_local) {
-            if (n_block >= cute::ceil_div(sink_token_length, kBlockN)) {
-                m_block_max = std::min(m_block_max, cute::ceil_div((n_block + 1) * kBlockN + seqlen_q - seqlen_k + window_size_left, kBlockM));
-            }
-        }
-        int m_block_min = 0;
-        if constexpr (Is_causal || Is_local) {
-            m_block_min = std::max(m_block_min, (n_block * kBlockN + seqlen_q - seqlen_k - window_size_right) / kBlockM);
-        }
+        auto const [m_block_min, m_block_max] = get_m_block_range(
+            seqlen_info.seqlen_q, seqlen_info.seqlen_k, kBlockM, kBlockN, Is_causal, Is_local,
+            n_block, window_size_left, window_size_right, sink_token_length);
         return {m_block_min, m_block_max};
     }
 
@@ -0,0 +1,89 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#ifndef FLASH_HOST_DEVICE
+#if defined(__CUDACC__)
+#define FLASH_HOST_DEVICE __host__ __device__ __forceinline__
+#else
+#define FLASH_HOST_DEVICE inline
+#endif
+#endif
+
+namespace flash {
+
+// Which n_blocks an m_block visits (forward) and which m_blocks an n_block visits (backward), given the
+// causal / local masks and the split. BlockMN (block.h) calls these with cutlass::FastDivmod, while host code
+// (the CPU engine, benchmark_tile_scheduler.cpp) calls them with IntDivmod, so both see the same block ranges.
+
+// Same interface as cutlass::FastDivmod for the parts we need. Agrees with it for non-negative numerators.
+struct IntDivmod {
+    int divisor = 1;
+    FLASH_HOST_DEVICE int divide(int x) const { return x / divisor; }
+};
+
+struct BlockRange {
+    int block_min, block_max;
+};
+
+template <class Divmod>
+FLASH_HOST_DEVICE BlockRange get_n_block_range(
+        int const seqlen_q, int const seqlen_k, int const kBlockM, int const kBlockN,
+        bool const is_causal, bool const is_local, bool const pack_gqa, bool const split,
+        int const m_block, int const split_idx, int const num_splits,
+        int const window_size_left, int const window_size_right,
+        Divmod const& attention_chunk_divmod, Divmod const& qhead_per_khead_divmod) {
+    int n_block_max = (seqlen_k + kBlockN - 1) / kBlockN;
+    if (is_causal || is_local) {
+        int m_idx_max = (m_block + 1) * kBlockM;
+        // TODO: check off-by-1 error
+        if (pack_gqa) { m_idx_max = qhead_per_khead_divmod.divide(m_idx_max - 1) + 1 ; }
+        n_block_max = std::min(n_block_max, (m_idx_max + seqlen_k - seqlen_q + window_size_right + kBlockN - 1) / kBlockN);
+    }
+    int n_block_min = 0;
+    if (is_local) {
+        int m_idx_min = m_block * kBlockM;
+        if (pack_gqa) { m_idx_min = qhead_per_khead_divmod.divide(m_idx_min); }
+        int const n_idx = m_idx_min + seqlen_k - seqlen_q;
+        int n_idx_left = n_idx - window_size_left;
+        if (attention_chunk_divmod.divisor > 0) {
+            n_idx_left = std::max(n_idx_left, attention_chunk_divmod.divide(n_idx) * attention_chunk_divmod.divisor);
+        }
+        n_block_min = std::max(int(0), n_idx_left / kBlockN);
+    }
+    if (split) {
+        uint32_t num_splits_dynamic_u = reinterpret_cast<uint32_t const&>(split_idx) >> 16; // first 16 bits are for num_splits
+        int num_splits_dynamic = reinterpret_cast<int&>(num_splits_dynamic_u);
+        int split_idx_actual = split_idx & 0x0000FFFF;
+        int num_splits_actual = num_splits_dynamic > 0 ? num_splits_dynamic : num_splits;
+        int num_n_blocks_per_split = n_block_max <= n_block_min ? 0 : (n_block_max - n_block_min + num_splits_actual - 1) / num_splits_actual;
+        n_block_min = n_block_min + split_idx_actual * num_n_blocks_per_split;
+        n_block_max = std::min(n_block_min + num_n_blocks_per_split, n_block_max);
+    }
+    return {n_block_min, n_block_max};
+}
+
+FLASH_HOST_DEVICE BlockRange get_m_block_range(
+        int const seqlen_q, int const seqlen_k, int const kBlockM, int const kBlockN,
+        bool const is_causal, bool const is_local, int const n_block,
+        int const window_size_left, int const window_size_right, int const sink_token_length) {
+    // TODO: support attention_chunk
+    int m_block_max = (seqlen_q + kBlockM - 1) / kBlockM;
+    if (is_local) {
+        if (n_block >= (sink_token_length + kBlockN - 1) / kBlockN) {
+            m_block_max = std::min(m_block_max, ((n_block + 1) * kBlockN + seqlen_q - seqlen_k + window_size_left + kBlockM - 1) / kBlockM);
+        }
+    }
+    int m_block_min = 0;
+    if (is_causal || is_local) {
+        m_block_min = std::max(m_block_min, (n_block * kBlockN + seqlen_q - seqlen_k - window_size_right) / kBlockM);
+    }
+    return {m_block_min, m_block_max};
+}
+
+} // namespace flash
@@ -0,0 +1,183 @@
+/******************************************************************************
+ * Copyright (c) 2024, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host version of philox.cuh: Philox-4x32 with 7 rounds (6 key bumps), counter = (offset, subsequence) and
+// key = seed, so that the random bits are bitwise identical to the ones the GPU kernels draw.
+struct Philox4x32 { uint32_t x, y, z, w; };
+
+static constexpr uint32_t kPhiloxSA = 0xD2511F53;
+static constexpr uint32_t kPhiloxSB = 0xCD9E8D57;
+static constexpr uint32_t kPhilox10A = 0x9E3779B9;
+static constexpr uint32_t kPhilox10B = 0xBB67AE85;
+
+inline Philox4x32 philox_single_round(Philox4x32 const ctr, uint32_t const key_x, uint32_t const key_y) {
+    uint64_t const res0 = uint64_t(kPhiloxSA) * ctr.x;
+    uint64_t const res1 = uint64_t(kPhiloxSB) * ctr.z;
+    return {uint32_t(res1 >> 32) ^ ctr.y ^ key_x, uint32_t(res1), uint32_t(res0 >> 32) ^ ctr.w ^ key_y, uint32_t(res0)};
+}
+
+inline Philox4x32 philox(uint64_t const seed, uint64_t const subsequence, uint64_t const offset) {
+    uint32_t key_x = uint32_t(seed), key_y = uint32_t(seed >> 32);
+    Philox4x32 counter{uint32_t(offset), uint32_t(offset >> 32), uint32_t(subsequence), uint32_t(subsequence >> 32)};
+    for (int i = 0; i < 6; ++i) {
+        counter = philox_single_round(counter, key_x, key_y);
+        key_x += kPhilox10A;
+        key_y += kPhilox10B;
+    }
+    return philox_single_round(counter, key_x, key_y);
+}
+
+// Threads of a warp, each drawing its own philox(seed, subsequence, offset + lane) in dropout.h
+static constexpr int kPhiloxLanes = 32;
+
+// philox(seed, subsequence, offset + lane) for the kPhiloxLanes lanes, computed a vector of lanes at a time.
+// out[k][lane] is word k (x, y, z, w) of the lane.
+inline void philox_warp(uint64_t const seed, uint64_t const subsequence, uint64_t const offset,
+                        uint32_t (&out)[4][kPhiloxLanes]) {
+#if defined(__AVX512F__) || defined(__AVX2__)
+    for (int lane = 0; lane < kPhiloxLanes; ++lane) {
+        out[0][lane] = uint32_t(offset + lane);
+        out[1][lane] = uint32_t((offset + lane) >> 32);
+    }
+#endif
+#if defined(__AVX512F__)
+    // mul_epu32 multiplies the even 32-bit lanes: the odd ones are shifted down and their products blended back
+    __m512i const sa = _mm512_set1_epi32(int(kPhiloxSA)), sb = _mm512_set1_epi32(int(kPhiloxSB));
+    auto const mulhilo = [](__m512i const a, __m512i const b, __m512i& hi, __m512i& lo) {
+        __m512i const even = _mm512_mul_epu32(a, b);
+        __m512i const odd = _mm512_mul_epu32(a, _mm512_srli_epi64(b, 32));
+        hi = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+        lo = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+    };
+    for (int lane = 0; lane < kPhiloxLanes; lane += 16) {
+        __m512i x = _mm512_loadu_si512(out[0] + lane), y = _mm512_loadu_si512(out[1] + lane);
+        __m512i z = _mm512_set1_epi32(int(uint32_t(subsequence))), w = _mm512_set1_epi32(int(uint32_t(subsequence >> 32)));
+        uint32_t kx = uint32_t(seed), ky = uint32_t(seed >> 32);
+        for (int i = 0; i < 7; ++i) {
+            __m512i hi0, lo0, hi1, lo1;
+            mulhilo(sa, x, hi0, lo0);
+            mulhilo(sb, z, hi1, lo1);
+            x = _mm512_xor_si512(_mm512_xor_si512(hi1, y), _mm512_set1_epi32(int(kx)));
+            y = lo1;
+            z = _mm512_xor_si512(_mm512_xor_si512(hi0, w), _mm512_set1_epi32(int(ky)));
+            w = lo0;
+            kx += kPhilox10A;
+            ky += kPhilox10B;
+        }
+        _mm512_storeu_si512(out[0] + lane, x);
+        _mm512_storeu_si512(out[1] + lane, y);
+        _mm512_storeu_si512(out[2] + lane, z);
+        _mm512_storeu_si512(out[3] + lane, w);
+    }
+#elif defined(__AVX2__)
+    __m256i const sa = _mm256_set1_epi32(int(kPhiloxSA)), sb = _mm256_set1_epi32(int(kPhiloxSB));
+    auto const mulhilo = [](__m256i const a, __m256i const b, __m256i& hi, __m256i& lo) {
+        __m256i const even = _mm256_mul_epu32(a, b);
+        __m256i const odd = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+        hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+        lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    };
+    for (int lane = 0; lane < kPhiloxLanes; lane += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(out[0] + lane));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(out[1] + lane));
+        __m256i z = _mm256_set1_epi32(int(uint32_t(subsequence))), w = _mm256_set1_epi32(int(uint32_t(subsequence >> 32)));
+        uint32_t kx = uint32_t(seed), ky = uint32_t(seed >> 32);
+        for (int i = 0; i < 7; ++i) {
+            __m256i hi0, lo0, hi1, lo1;
+            mulhilo(sa, x, hi0, lo0);
+            mulhilo(sb, z, hi1, lo1);
+            x = _mm256_xor_si256(_mm256_xor_si256(hi1, y), _mm256_set1_epi32(int(kx)));
+            y = lo1;
+            z = _mm256_xor_si256(_mm256_xor_si256(hi0, w), _mm256_set1_epi32(int(ky)));
+            w = lo0;
+            kx += kPhilox10A;
+            ky += kPhilox10B;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[0] + lane), x);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[1] + lane), y);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[2] + lane), z);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[3] + lane), w);
+    }
+#else
+    for (int lane = 0; lane < kPhiloxLanes; ++lane) {
+        Philox4x32 const r = philox(seed, subsequence, offset + lane);
+        out[0][lane] = r.x;
+        out[1][lane] = r.y;
+        out[2][lane] = r.z;
+        out[3][lane] = r.w;
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host version of Dropout in dropout.h, with the same keep-masks as the GPU for a given (seed, offset), so that the
+// CPU and GPU can be checked against each other and the backward recomputes the mask instead of storing it.
+// The GPU draws the bits of a 16 x 32 block of the attention matrix of (bidb, bidh) with one philox call per lane of
+// a warp, subsequence (block_row, block_col) and offset + (bidb * nheads + bidh) * 32 + lane; element (row, col)
+// then gets the byte that its place in the m16n8k16 accumulator layout (convert_layout_acc_dropout) picks.
+// An element is kept if that byte is <= p_dropout_in_uint8_t.
+struct DropoutCpu {
+
+    uint64_t const seed, offset;
+    uint8_t const p_dropout_in_uint8_t;
+
+    DropoutCpu(uint64_t const seed, uint64_t const offset, uint8_t const p_dropout_in_uint8_t,
+               int const bidb, int const bidh, int const nheads)
+        : seed(seed)
+        , offset(offset + (uint64_t(bidb) * nheads + bidh) * kPhiloxLanes)
+        , p_dropout_in_uint8_t(p_dropout_in_uint8_t) {}
+
+    // keep[(row - row_start) * row_stride + col - col_start] = 1 if (row, col) is kept, 0 if dropped, for rows
+    // [row_start, row_start + rows) and cols [col_start, col_start + cols) relative to the start of the sequences.
+    void keep_mask(int const row_start, int const rows, int const col_start, int const cols,
+                   uint8_t* keep, int64_t const row_stride) const {
+        uint32_t rnd[4][kPhiloxLanes];
+        uint8_t block[16][32];
+        for (int block_row = row_start / 16; block_row * 16 < row_start + rows; ++block_row) {
+            int const r_min = std::max(row_start, block_row * 16), r_max = std::min(row_start + rows, block_row * 16 + 16);
+            for (int block_col = col_start / 32; block_col * 32 < col_start + cols; ++block_col) {
+                int const c_min = std::max(col_start, block_col * 32), c_max = std::min(col_start + cols, block_col * 32 + 32);
+                philox_warp(seed, uint64_t(uint32_t(block_row)) | (uint64_t(uint32_t(block_col)) << 32), offset, rnd);
+                for (int rr = r_min - block_row * 16; rr < r_max - block_row * 16; ++rr) {
+                    // Thread (rr % 8) * 4 + (cc % 8) / 2 holds (rr, cc) as accumulator (rr / 8) * 2 + cc % 2 of the
+                    // (cc % 16) / 8-th MMA of the cc / 16-th group of 16 columns, so it gets byte (rr / 8) * 2 + cc % 2
+                    // of word cc / 8 of the thread's random bits
+                    uint8_t bytes[32];
+                    for (int k = 0; k < 4; ++k) {
+                        for (int t = 0; t < 4; ++t) {
+                            uint32_t const half = rnd[k][(rr % 8) * 4 + t] >> (16 * (rr / 8));
+                            bytes[k * 8 + t * 2] = uint8_t(half);
+                            bytes[k * 8 + t * 2 + 1] = uint8_t(half >> 8);
+                        }
+                    }
+                    for (int cc = 0; cc < 32; ++cc) { block[rr][cc] = bytes[cc] <= p_dropout_in_uint8_t; }
+                    std::memcpy(keep + (block_row * 16 + rr - row_start) * row_stride + c_min - col_start,
+                                &block[rr][c_min - block_col * 32], c_max - c_min);
+                }
+            }
+        }
+    }
+
+};
+
+} // namespace cpu
+
+} // namespace flash
@@ -61,6 +61,15 @@ struct Flash_fwd_params : public Qkv_params {
     index_t v_descale_batch_stride;
     index_t v_descale_head_stride;
 
+    // Quantized KV cache (CPU only): 8 for int8, 4 for int4 packed two per byte along the headdim, 0 if K / V have the
+    // same type as Q. One scale per token and head, laid out like the cache without the headdim.
+    int kv_quant_bits;
+    float * __restrict__ k_scale_ptr;
+    float * __restrict__ v_scale_ptr;
+    index_t kv_scale_batch_stride;
+    index_t kv_scale_row_stride;
+    index_t kv_scale_head_stride;
+
     // The dimensions.
     int b, seqlen_q, seqlen_k, seqlen_knew, d, seqlen_q_rounded, seqlen_k_rounded, d_rounded, rotary_dim;
     int total_q, total_k, total_knew;
@@ -137,6 +146,12 @@ struct Flash_fwd_params : public Qkv_params {
     int window_size_left, window_size_right;
     int attention_chunk;
 
+    // Draft tree for speculative decoding (see Mask in mask.h): bit j of tree_ancestors[bidb][i] is set if node j
+    // is node i or one of its ancestors. nullptr if there's no tree.
+    uint64_t * __restrict__ tree_ancestors;
+    index_t tree_ancestors_batch_stride;
+    int tree_size;
+
     // Pointer to the RNG seed (idx 0) and offset (idx 1).
     uint64_t * rng_state;
 
@@ -156,9 +171,13 @@ struct Flash_fwd_params : public Qkv_params {
     // int * __restrict__ num_n_blocks_ptr;
     int * __restrict__ num_splits_dynamic_ptr;
     bool skip_scheduler_metadata_computation;
+    // Longest-processing-time-first work list for varlen causal / local, see prepare_scheduler.h. nullptr to
+    // hand out tiles in batch order.
+    int * __restrict__ varlen_lpt_workspace;
 
-    int arch;
-    int num_sm;
+    int arch;  // 0 when running on the CPU engine
+    int num_sm;  // Number of worker threads when running on the CPU engine
+    int l2_size;  // In bytes, used by the split-KV cost model
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -212,7 +231,10 @@ struct Flash_bwd_params : public Flash_fwd_params {
 template <int Arch, typename T, int kHeadDim, int kHeadDimV, bool Split, bool PagedKVNonTMA, bool Has_softcap, bool PackGQA>
 void run_mha_fwd_(Flash_fwd_params &params, cudaStream_t stream);
 void prepare_varlen_num_blocks(Flash_fwd_params &params, cudaStream_t stream, bool packgqa, int blockM, int blockN, bool enable_pdl);
+void prepare_varlen_lpt_work_list(Flash_fwd_params &params, cudaStream_t stream, bool packgqa, int blockM, int blockN);
 template <int Arch, typename T, int kHeadDim, bool Has_softcap>
 void run_mha_bwd_(Flash_bwd_params &params, cudaStream_t stream);
 template <typename T, typename Tpartial, int kBlockK>
 void run_mha_fwd_combine_(Flash_fwd_params &params, cudaStream_t stream, bool enable_pdl);
+void run_mha_fwd_cpu(Flash_fwd_params &params);
+void run_mha_bwd_cpu(Flash_bwd_params &params);
@@ -6,15 +6,30 @@
 #include <torch/python.h>
 #include <torch/nn/functional.h>
 #include <torch/version.h>  // For TORCH_VERSION* macros
+#include <ATen/CPUGeneratorImpl.h>
+#include <ATen/Parallel.h>
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
 
 #include <cutlass/numeric_types.h>
 
+#include <unordered_set>
+
 #include "flash.h"
 #include "static_switch.h"
 #include "tile_size.h"
 #include "heuristics.h"
+#include "prepare_scheduler.h"
+#include "tuning_table.h"
+#include "kernel_manifest.h"
+#include "kernel_registry.h"
+#include "workspace_arena.h"
+#include "kv_block_manager.h"
+#include "prefix_cache.h"
+#include "kv_compaction.h"
+#include "tiered_kv_cache.h"
+#include "utils_cpu.h"
+#include "dropout_cpu.h"
 #include "cuda_check.h"
 
 // Copied from https://github.com/pytorch/pytorch/commit/7931eee5c5ebcdf468bff4d308510b03355cd909
@@ -57,6 +72,7 @@ namespace pybind11::detail {
 #endif
 
 #define CHECK_DEVICE(x) TORCH_CHECK(x.is_cuda(), #x " must be on CUDA")
+#define CHECK_DEVICE_LIKE(x, ref) TORCH_CHECK(x.device().type() == ref.device().type(), #x " must be on the same device type as " #ref)
 #define CHECK_SHAPE(x, ...) TORCH_CHECK(x.sizes() == torch::IntArrayRef({__VA_ARGS__}), #x " must have shape (" #__VA_ARGS__ ")")
 #define CHECK_CONTIGUOUS(x) TORCH_CHECK(x.is_contiguous(), #x " must be contiguous")
 
@@ -168,8 +184,15 @@ void set_params_fprop(Flash_fwd_params &params,
     params.window_size_right = window_size_right;
     params.attention_chunk = attention_chunk;
 
-    params.arch = at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
-    params.num_sm = at::cuda::getCurrentDeviceProperties()->multiProcessorCount - sm_margin;
+    if (q.is_cpu()) {
+        // The CPU engine treats each worker thread as an "SM" for the purpose of the heuristics
+        params.arch = 0;
+        params.num_sm = std::max(at::get_num_threads() - sm_margin, 1);
+    } else {
+        params.arch = at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
+        params.num_sm = at::cuda::getCurrentDeviceProperties()->multiProcessorCount - sm_margin;
+        params.l2_size = at::cuda::getCurrentDeviceProperties()->l2CacheSize;
+    }
 
     #ifdef FLASHATTENTION_DISABLE_LOCAL
         TORCH_CHECK(!params.is_local, "This flash attention build does not support local attention.");
@@ -261,6 +284,73 @@ void set_params_dgrad(Flash_bwd_params &params,
     params.deterministic = deterministic;
 }
 
+// Dropout seed (idx 0) and offset (idx 1), read by the kernels through params.rng_state. Passing the rng_state of a
+// flash-attention 2 GPU run reproduces its dropout masks. Otherwise the seed is drawn from the default CPU generator.
+at::Tensor get_dropout_rng_state(std::optional<at::Tensor> &rng_state_) {
+    at::Tensor rng_state;
+    if (rng_state_.has_value()) {
+        rng_state = rng_state_.value();
+        TORCH_CHECK(rng_state.is_cpu(), "rng_state must be on CPU");
+        TORCH_CHECK(rng_state.dtype() == torch::kInt64, "rng_state must have dtype torch.int64");
+        CHECK_CONTIGUOUS(rng_state);
+        CHECK_SHAPE(rng_state, 2);
+    } else {
+        rng_state = torch::empty({2}, at::TensorOptions().dtype(torch::kInt64));
+        auto gen = at::get_generator_or_default<at::CPUGeneratorImpl>(std::nullopt, at::detail::getDefaultCPUGenerator());
+        std::lock_guard<std::mutex> lock(gen->mutex_);
+        rng_state.data_ptr<int64_t>()[0] = int64_t(gen->random64());
+        rng_state.data_ptr<int64_t>()[1] = 0;
+    }
+    return rng_state;
+}
+
+// Name of the data type in generate_kernels.py and kernel manifests
+template <typename T>
+constexpr char const* kernel_dtype_name() {
+    if constexpr (std::is_same_v<T, cutlass::half_t>) { return "fp16"; }
+    else if constexpr (std::is_same_v<T, cutlass::bfloat16_t>) { return "bf16"; }
+    else { return "e4m3"; }
+}
+
+// With a kernel manifest (kernel_manifest.h), only some instantiations exist, so the others must not be referenced.
+// With lazy kernel modules (kernel_registry.h), the kernels are in other shared libraries, loaded on first use.
+template <int Arch, typename T, int kHeadDim, int kHeadDimV, bool Split, bool PagedKVNonTMA, bool Has_softcap, bool PackGQA>
+void run_mha_fwd_if_compiled(Flash_fwd_params &params, cudaStream_t stream) {
+    static constexpr flash::FwdKernelConfig config{Arch, kernel_dtype_name<T>(), kHeadDim, kHeadDimV, Split, PagedKVNonTMA, Has_softcap, PackGQA};
+    if constexpr (flash::is_compiled(config)) {
+        #ifdef FLASHATTENTION_LAZY_KERNELS
+        // Looked up (and the module loaded) once per kernel
+        static flash::FwdKernelFn const run = flash::KernelRegistry::instance().fwd(config);
+        TORCH_CHECK(run, "Failed to load the forward kernel for ", flash::to_string(config), " from ",
+                    flash::KernelRegistry::module_path(flash::kernel_module_name(Arch, kHeadDim)), ", see flash_attn_3_cuda.kernel_modules()");
+        run(params, stream);
+        #else
+        run_mha_fwd_<Arch, T, kHeadDim, kHeadDimV, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+        #endif
+    } else {
+        TORCH_CHECK(false, "The forward kernel for ", flash::to_string(config), " is not compiled in this flash attention build. "
+                    "Compiled forward kernels: ", flash::compiled_kernels_string<flash::FwdKernelConfig>());
+    }
+}
+
+template <int Arch, typename T, int kHeadDim, bool Has_softcap>
+void run_mha_bwd_if_compiled(Flash_bwd_params &params, cudaStream_t stream) {
+    static constexpr flash::BwdKernelConfig config{Arch, kernel_dtype_name<T>(), kHeadDim, Has_softcap};
+    if constexpr (flash::is_compiled(config)) {
+        #ifdef FLASHATTENTION_LAZY_KERNELS
+        static flash::BwdKernelFn const run = flash::KernelRegistry::instance().bwd(config);
+        TORCH_CHECK(run, "Failed to load the backward kernel for ", flash::to_string(config), " from ",
+                    flash::KernelRegistry::module_path(flash::kernel_module_name(Arch, kHeadDim)), ", see flash_attn_3_cuda.kernel_modules()");
+        run(params, stream);
+        #else
+        run_mha_bwd_<Arch, T, kHeadDim, Has_softcap>(params, stream);
+        #endif
+    } else {
+        TORCH_CHECK(false, "The backward kernel for ", flash::to_string(config), " is not compiled in this flash attention build. "
+                    "Compiled backward kernels: ", flash::compiled_kernels_string<flash::BwdKernelConfig>());
+    }
+}
+
 void run_mha_fwd(Flash_fwd_params &params, cudaStream_t stream) {
     // HEADDIM_SWITCH(params.d, [&] {
     //     run_mha_fwd_<cutlass::half_t, kHeadSize>(params, stream);
@@ -278,62 +368,62 @@ void run_mha_fwd(Flash_fwd_params &params, cudaStream_t stream) {
                                 #ifndef FLASHATTENTION_DISABLE_HDIM64
                                 if (params.d <= 64) {
                                     if (params.dv > 256 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::bfloat16_t, 64, 512, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 64, 512, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else if (params.dv > 64 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::bfloat16_t, 64, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 64, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else {
-                                        return run_mha_fwd_<Arch, cutlass::bfloat16_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     }
                                 }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM96
-                                if (params.d <= 96) { return run_mha_fwd_<Arch, cutlass::bfloat16_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 96) { return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM128
-                                if (params.d <= 128) { return run_mha_fwd_<Arch, cutlass::bfloat16_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 128) { return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM192
                                 if (params.d <= 192) {
                                     if (params.dv <= 128 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::bfloat16_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else {
-                                        return run_mha_fwd_<Arch, cutlass::bfloat16_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     }
                                 }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM256
-                                if (params.d <= 256) { return run_mha_fwd_<Arch, cutlass::bfloat16_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 256) { return run_mha_fwd_if_compiled<Arch, cutlass::bfloat16_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                             } else {
                                 #ifndef FLASHATTENTION_DISABLE_FP16
                                 #ifndef FLASHATTENTION_DISABLE_HDIM64
                                 if (params.d <= 64) {
                                     if (params.dv > 256 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::half_t, 64, 512, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 64, 512, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else if (params.dv > 64 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::half_t, 64, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 64, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else {
-                                        return run_mha_fwd_<Arch, cutlass::half_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     }
                                 }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM96
-                                if (params.d <= 96) { return run_mha_fwd_<Arch, cutlass::half_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 96) { return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM128
-                                if (params.d <= 128) { return run_mha_fwd_<Arch, cutlass::half_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 128) { return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM192
                                 if (params.d <= 192) {
                                     if (params.dv <= 128 && Arch == 90) {
-                                        return run_mha_fwd_<Arch, cutlass::half_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     } else {
-                                        return run_mha_fwd_<Arch, cutlass::half_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                        return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                     }
                                 }
                                 #endif
                                 #ifndef FLASHATTENTION_DISABLE_HDIM256
-                                if (params.d <= 256) { return run_mha_fwd_<Arch, cutlass::half_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                                if (params.d <= 256) { return run_mha_fwd_if_compiled<Arch, cutlass::half_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                                 #endif
                                 #else
                                 TORCH_CHECK(false, "This flash attention build does not support FP16.");
@@ -342,25 +432,25 @@ void run_mha_fwd(Flash_fwd_params &params, cudaStream_t stream) {
                         } else {
                             #ifndef FLASHATTENTION_DISABLE_FP8
                             #ifndef FLASHATTENTION_DISABLE_HDIM64
-                            if (params.d <= 64) { return run_mha_fwd_<90, cutlass::float_e4m3_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                            if (params.d <= 64) { return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 64, 64, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                             #endif
                             #ifndef FLASHATTENTION_DISABLE_HDIM96
-                            if (params.d <= 96) { return run_mha_fwd_<90, cutlass::float_e4m3_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                            if (params.d <= 96) { return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 96, 96, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                             #endif
                             #ifndef FLASHATTENTION_DISABLE_HDIM128
-                            if (params.d <= 128) { return run_mha_fwd_<90, cutlass::float_e4m3_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                            if (params.d <= 128) { return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 128, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                             #endif
                             #ifndef FLASHATTENTION_DISABLE_HDIM192
                             if (params.d <= 192) {
                                 if (params.dv <= 128 && Arch == 90) {
-                                    return run_mha_fwd_<90, cutlass::float_e4m3_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                    return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 192, 128, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                 } else {
-                                    return run_mha_fwd_<90, cutlass::float_e4m3_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
+                                    return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 192, 192, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream);
                                 }
                             }
                             #endif
                             #ifndef FLASHATTENTION_DISABLE_HDIM256
-                            if (params.d <= 256) { return run_mha_fwd_<90, cutlass::float_e4m3_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
+                            if (params.d <= 256) { return run_mha_fwd_if_compiled<90, cutlass::float_e4m3_t, 256, 256, Split, PagedKVNonTMA, Has_softcap, PackGQA>(params, stream); }
                             #endif
                             #else
                             TORCH_CHECK(false, "This flash attention build does not support FP8.");
@@ -401,29 +491,44 @@ void run_mha_fwd_combine(Flash_fwd_params &params, cudaStream_t stream, bool ena
     #endif
 }
 
+// Entry of the tuning table (tuning_table.h) for this problem, if there is one. The table only overrides the
+// heuristics below, and only among the choices that are valid for the problem.
+inline std::optional<flash::TuningConfig> get_tuning_config(Flash_fwd_params const& params) {
+    if (params.arch == 0) { return std::nullopt; }  // The CPU engine has a single config
+    std::string error;
+    std::shared_ptr<flash::TuningTable const> table = flash::TuningTable::global(&error);
+    if (!error.empty()) { TORCH_WARN_ONCE("Ignoring FLASH_ATTENTION_TUNING_TABLE: ", error); }
+    flash::TuningConfig const* config = table ? table->lookup(flash::make_tuning_key(params)) : nullptr;
+    if (!config) { return std::nullopt; }
+    return *config;
+}
+
 inline bool get_pagedkv_tma(Flash_fwd_params const& params) {
     if (params.arch < 90 || !params.page_table || params.leftpad_k || params.knew_ptr) { return false; }
     // This needs to match the kernel configs
     auto kBlockMN_kernel_args_sm90 = tile_size_fwd_sm90(params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, false /*v_colmajor*/, false /*paged_kv_non_TMA*/, params.softcap > 0.f);
     int const kBlockM = std::get<0>(kBlockMN_kernel_args_sm90);
     int const kBlockN = std::get<1>(kBlockMN_kernel_args_sm90);
+    if (params.page_size % kBlockN != 0) { return false; }
+    if (auto const tuned = get_tuning_config(params); tuned && tuned->pagedkv_tma >= 0) { return tuned->pagedkv_tma > 0; }
     // Heuristic: when seqlen_q <= kBlockM, we're not compute bound, and somehow using TMA is slower,
     // at least for MLA.
-    return params.page_size % kBlockN == 0 && params.seqlen_q * (params.h / params.h_k) > kBlockM;
+    return params.seqlen_q * (params.h / params.h_k) > kBlockM;
 }
 
 inline bool get_pack_gqa(Flash_fwd_params const& params) {
     // Always enable PackGQA for Sm8x or PagedKVNonTMA or Split to reduce compilation and binary size.
-    // Has little effect on speed.
-    if (params.arch < 90 || (params.page_table && !params.pagedkv_tma) || params.num_splits > 1) { return true; }
+    // Has little effect on speed. The CPU engine isn't specialized on PackGQA, so it only uses the heuristic.
+    if (params.arch > 0 && (params.arch < 90 || (params.page_table && !params.pagedkv_tma) || params.num_splits > 1)) { return true; }
     #ifdef FLASHATTENTION_DISABLE_PACKGQA
     return false;
     #else
     // params.page_table must already be set
     if (params.h == params.h_k) { return false; }
+    if (auto const tuned = get_tuning_config(params); tuned && tuned->pack_gqa >= 0) { return tuned->pack_gqa > 0; }
     // This needs to match the kernel configs
     auto kBlockMN_kernel_args_sm90 = tile_size_fwd_sm90(params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, false /*v_colmajor*/, params.page_table && !params.pagedkv_tma, params.softcap > 0.f);
-    int const kBlockM = std::get<0>(kBlockMN_kernel_args_sm90);
+    int const kBlockM = params.arch == 0 ? std::get<0>(tile_size_fwd_cpu(params.d, params.dv)) : std::get<0>(kBlockMN_kernel_args_sm90);
     return should_pack_gqa(params.cu_seqlens_q || params.seqused_q, params.seqlen_q, params.h / params.h_k, kBlockM);
     #endif
 }
@@ -432,6 +537,7 @@ inline int get_num_splits(Flash_fwd_params const& params) {
     #ifdef FLASHATTENTION_DISABLE_SPLIT
     return 1;
     #else
+    if (auto const tuned = get_tuning_config(params); tuned && tuned->num_splits > 0) { return std::min(tuned->num_splits, 128); }
     // Always enable PackGQA for Split
     // params.page_table must already be set
     // This needs to match the kernel configs
@@ -440,22 +546,65 @@ inline int get_num_splits(Flash_fwd_params const& params) {
     // Strictly speaking we need to pass in (varlen && params.num_splits > 1) but num_splits
     // has not been set here. It's OK though because we might just underestimate kBlockN a bit
     auto kBlockMN_kernel_args_sm8x = tile_size_fwd_sm8x(params.arch == 86 || params.arch == 89, params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, params.page_table, varlen, params.softcap > 0.f, params.knew_ptr);
-    int const kBlockM = params.arch >= 90 ? std::get<0>(kBlockMN_kernel_args_sm90) : std::get<0>(kBlockMN_kernel_args_sm8x);
-    int const kBlockN = params.arch >= 90 ? std::get<1>(kBlockMN_kernel_args_sm90) : std::get<1>(kBlockMN_kernel_args_sm8x);
+    auto kBlockMN_cpu = tile_size_fwd_cpu(params.d, params.dv);
+    int const kBlockM = params.arch == 0 ? std::get<0>(kBlockMN_cpu) : (params.arch >= 90 ? std::get<0>(kBlockMN_kernel_args_sm90) : std::get<0>(kBlockMN_kernel_args_sm8x));
+    int const kBlockN = params.arch == 0 ? std::get<1>(kBlockMN_cpu) : (params.arch >= 90 ? std::get<1>(kBlockMN_kernel_args_sm90) : std::get<1>(kBlockMN_kernel_args_sm8x));
     int seqlen_q_packgqa = params.seqlen_q * (params.h / params.h_k);
     // If is_local, we're not going to load all of seqlen_k
     int const seqlen_k_loaded = !params.is_local
         ? params.seqlen_k
         : std::max(0, std::min(params.seqlen_k, params.window_size_right + std::max(params.window_size_left, params.attention_chunk) + 1 + kBlockM));
     int const num_n_blocks = (seqlen_k_loaded + kBlockN - 1) / kBlockN;
-    int const num_m_blocks = (seqlen_q_packgqa + kBlockM - 1) / kBlockM;
-    int const size_one_kv_head = params.seqlen_k * (params.d + params.dv) * (params.is_e4m3 ? 1 : 2);
+    // The CPU engine packs GQA only if get_pack_gqa says so, otherwise each query head has its own m_blocks
+    bool const cpu_no_pack_gqa = params.arch == 0 && !get_pack_gqa(params);
+    int const num_m_blocks = cpu_no_pack_gqa
+        ? (params.h / params.h_k) * ((params.seqlen_q + kBlockM - 1) / kBlockM)
+        : (seqlen_q_packgqa + kBlockM - 1) / kBlockM;
+    int const element_size = params.is_e4m3 ? 1 : 2;
+    float const kv_element_size = params.kv_quant_bits > 0 ? params.kv_quant_bits / 8.f : float(element_size);
+    float const size_one_kv_head = float(params.seqlen_k) * (params.d + params.dv) * kv_element_size;
     // Always enable PackGQA for Split
     // If varlen, we use dynamic split, so this heuristic just needs to get an upper bound on num_splits.
     // We assume the case where there's 1 long sequence and the rest are short, i.e. pretending
     // that batch = 1.
-    int total_mblocks = (params.num_splits_dynamic_ptr ? 1 : params.b) * params.h_k * num_m_blocks;
-    return num_splits_heuristic(total_mblocks, params.num_sm, num_n_blocks, num_m_blocks, size_one_kv_head, params.is_causal || params.is_local, 128);
+    int const batch = params.num_splits_dynamic_ptr ? 1 : params.b;
+    int total_mblocks = batch * params.h_k * num_m_blocks;
+    // With a causal mask (bottom-right aligned), query row i sees seqlen_k - seqlen_q + i + 1 keys, and the n_blocks
+    // past the diagonal are neither loaded nor computed. Scale the per-tile cost by the visible fraction instead of
+    // costing full tiles. It is ~1 for decode; local is already accounted for by seqlen_k_loaded.
+    float const causal_fraction = !params.is_causal || params.seqlen_k <= 0
+        ? 1.f
+        : std::clamp((params.seqlen_k - (params.seqlen_q - 1) * 0.5f) / params.seqlen_k, 0.f, 1.f);
+    SplitKVProblem problem{total_mblocks, num_m_blocks, num_n_blocks,
+                           // The CPU engine only computes the rows of a tile that are there
+                           causal_fraction * 2.f * (params.arch == 0 ? std::min(kBlockM, cpu_no_pack_gqa ? params.seqlen_q : seqlen_q_packgqa) : kBlockM) * kBlockN * (params.d + params.dv) /*tile_flops*/,
+                           causal_fraction * float(kBlockN) * (params.d + params.dv) * kv_element_size /*tile_kv_bytes*/,
+                           size_one_kv_head,
+                           float(batch) * params.h * params.seqlen_q * (params.dv + 1) * sizeof(float) /*o_partial_bytes*/,
+                           float(batch) * params.h * params.seqlen_q * params.dv * 2 /*o_bytes*/};
+    SplitKVCostModel cost_model{params.num_sm};
+    if (params.l2_size > 0) { cost_model.size_l2 = params.l2_size; }
+    if (params.arch == 0) {
+        // CPU engine, with an "SM" per thread: fp32 FMAs on one core, ~10 GB/s of DRAM bandwidth per core up to
+        // ~100 GB/s, the last-level cache, and combine() costs a round trip through the thread pool
+        cost_model.size_l2 = 32 * 1024 * 1024;
+        cost_model.flops_per_ns_per_sm = 50.f;
+        cost_model.hbm_bytes_per_ns = std::min(10.f * params.num_sm, 100.f);
+        cost_model.combine_launch_ns = 10000.f;
+    } else if (params.arch == 86) {
+        // A10 / A40 / RTX 30xx: ~150 TFLOPS / 84 SMs (A40), ~700 GB/s
+        cost_model.flops_per_ns_per_sm = 1750.f;
+        cost_model.hbm_bytes_per_ns = 700.f;
+    } else if (params.arch == 89) {
+        // L40S / L4 / RTX 40xx: ~360 TFLOPS / 142 SMs (L40S), ~860 GB/s
+        cost_model.flops_per_ns_per_sm = 2600.f;
+        cost_model.hbm_bytes_per_ns = 860.f;
+    } else if (params.arch < 90) {
+        // A100: ~312 TFLOPS / 108 SMs, ~2 TB/s
+        cost_model.flops_per_ns_per_sm = 2900.f;
+        cost_model.hbm_bytes_per_ns = 2000.f;
+    }
+    return cost_model.num_splits(problem, 128);
     #endif
 }
 
@@ -506,9 +655,10 @@ inline int round_up_headdimv(int head_size) {
     return 512;
 }
 
-// Only applicable to the case where seqused_k (i.e. cache_seqlens) is available
-at::Tensor
-mha_fwd_get_scheduler_metadata(
+// Parameters for the scheduler metadata, shared by mha_fwd_get_scheduler_metadata and IncrementalSchedulerMetadata.
+// The seqlen pointers are taken from the tensors as is, i.e. they are host pointers if the tensors are on the CPU.
+Flash_fwd_params
+get_scheduler_metadata_params(
         int batch_size,
         int max_seqlen_q,
         int max_seqlen_k,
@@ -521,10 +671,10 @@ mha_fwd_get_scheduler_metadata(
         std::optional<const at::Tensor> &cu_seqlens_q_,  // b+1
         std::optional<const at::Tensor> &cu_seqlens_k_,  // b+1
         std::optional<const at::Tensor> &cu_seqlens_k_new_,  // b+1
-        std::optional<const at::Tensor> &seqused_q_, // b. If given, only this many elements of each batch element's queries and outputs are used.
+        std::optional<const at::Tensor> &seqused_q_, // b
         std::optional<const at::Tensor> &leftpad_k_, // b
         std::optional<int> page_size,
-        int max_seqlen_k_new,  // 0 means we're not appending new KV
+        int max_seqlen_k_new,
         bool is_causal,
         int window_size_left,
         int window_size_right,
@@ -534,10 +684,16 @@ mha_fwd_get_scheduler_metadata(
         std::optional<bool> pack_gqa_,
         int const sm_margin
         ) {
-
     TORCH_CHECK(qkv_dtype == at::ScalarType::Half || qkv_dtype == at::ScalarType::BFloat16 || qkv_dtype == at::ScalarType::Float8_e4m3fn,
                 "FlashAttention only supports fp16, bf16, and fp8_e4m3 data type");
     TORCH_CHECK(num_heads % num_heads_k == 0, "Number of heads in key/value must divide number of heads in query");
+    // If seqused_k is on the CPU, the metadata is computed on the host for the CPU engine
+    bool const is_cpu = seqused_k.is_cpu();
+    if (cu_seqlens_q_.has_value()) { CHECK_DEVICE_LIKE(cu_seqlens_q_.value(), seqused_k); }
+    if (cu_seqlens_k_.has_value()) { CHECK_DEVICE_LIKE(cu_seqlens_k_.value(), seqused_k); }
+    if (cu_seqlens_k_new_.has_value()) { CHECK_DEVICE_LIKE(cu_seqlens_k_new_.value(), seqused_k); }
+    if (seqused_q_.has_value()) { CHECK_DEVICE_LIKE(seqused_q_.value(), seqused_k); }
+    if (leftpad_k_.has_value()) { CHECK_DEVICE_LIKE(leftpad_k_.value(), seqused_k); }
 
     // Reset the parameters
     Flash_fwd_params params{};
@@ -581,14 +737,15 @@ mha_fwd_get_scheduler_metadata(
     params.window_size_left = window_size_left;
     params.window_size_right = window_size_right;
     params.attention_chunk = attention_chunk;
-    params.arch = at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
-    params.num_sm = at::cuda::getCurrentDeviceProperties()->multiProcessorCount - sm_margin;
+    params.arch = is_cpu ? 0 : at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
+    params.num_sm = is_cpu ? std::max(at::get_num_threads() - sm_margin, 1) : at::cuda::getCurrentDeviceProperties()->multiProcessorCount - sm_margin;
+    params.l2_size = is_cpu ? 0 : at::cuda::getCurrentDeviceProperties()->l2CacheSize;
     params.softcap = has_softcap ? 1.0f : 0.0f;
 
     params.page_size = page_size.has_value() ? page_size.value() : 1;
     params.page_table = !page_size.has_value() ? nullptr : reinterpret_cast<int*>(1);
 
-    bool const use_dynamic_split = params.b <= 992;
+    bool const use_dynamic_split = true;
     params.num_splits_dynamic_ptr = !use_dynamic_split ? nullptr : reinterpret_cast<int*>(1);
 
     params.pagedkv_tma = get_pagedkv_tma(params);
@@ -596,16 +753,136 @@ mha_fwd_get_scheduler_metadata(
     // Always enable PackGQA for Split, and get_pack_gqa requires params.num_splits to decide
     params.pack_gqa = pack_gqa_.has_value() ? pack_gqa_.value() : get_pack_gqa(params);
 
-    bool is_varlen = true;
+    return params;
+}
+
+// kBlockM, kBlockN of the forward kernel that will consume the scheduler metadata
+std::tuple<int, int>
+get_scheduler_metadata_tile_size(Flash_fwd_params const& params) {
+    if (params.arch == 0) { return tile_size_fwd_cpu(params.d, params.dv); }
+    bool const is_varlen = true;
+    auto kBlockMN_kernel_args_sm90 = tile_size_fwd_sm90(params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, false /*v_colmajor*/, params.page_table && !params.pagedkv_tma, params.softcap > 0.f);
+    auto kBlockMN_kernel_args_sm8x = tile_size_fwd_sm8x(params.arch == 86 || params.arch == 89, params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, params.page_table, is_varlen && params.num_splits > 1, params.softcap > 0.f, params.knew_ptr);
+    int const kBlockM = params.arch >= 90 ? std::get<0>(kBlockMN_kernel_args_sm90) : std::get<0>(kBlockMN_kernel_args_sm8x);
+    int const kBlockN = params.arch >= 90 ? std::get<1>(kBlockMN_kernel_args_sm90) : std::get<1>(kBlockMN_kernel_args_sm8x);
+    return {kBlockM, kBlockN};
+}
+
+// Replaces the tuning table (tuning_table.h) used by mha_fwd and get_scheduler_metadata, e.g. by tune_fwd.py.
+// An empty path goes back to the heuristics.
+void load_tuning_table(std::string const& path) {
+    if (path.empty()) {
+        flash::TuningTable::set_global(nullptr);
+        return;
+    }
+    auto table = std::make_shared<flash::TuningTable>();
+    std::string error;
+    TORCH_CHECK(table->load(path, &error), "Can't load tuning table: ", error);
+    flash::TuningTable::set_global(table);
+}
+
+// Counters of the pool of forward workspaces (workspace_arena.h)
+std::map<std::string, int64_t> workspace_arena_stats() {
+    flash::WorkspaceArena::Stats const stats = flash::WorkspaceArena::instance().stats();
+    return {{"bytes_allocated", stats.bytes_allocated}, {"bytes_reused", stats.bytes_reused},
+            {"num_allocated", stats.num_allocated}, {"num_reused", stats.num_reused},
+            {"bytes_cached", stats.bytes_cached}};
+}
+
+void empty_workspace_arena() { flash::WorkspaceArena::instance().empty_cache(); }
+
+// Per-thread counters of the CPU forward tile loop (flash::cpu::ThreadStats), summed since the last reset.
+// busy_ns / wall_ns is each thread's utilization.
+std::map<std::string, std::vector<int64_t>> cpu_thread_stats() {
+    std::map<std::string, std::vector<int64_t>> stats;
+    for (flash::cpu::ThreadStats const& s : flash::cpu::ThreadPool::get().stats()) {
+        stats["num_tasks"].push_back(s.num_tasks);
+        stats["num_steals"].push_back(s.num_steals);
+        stats["busy_ns"].push_back(s.busy_ns);
+        stats["wall_ns"].push_back(s.wall_ns);
+    }
+    return stats;
+}
+
+void reset_cpu_thread_stats() { flash::cpu::ThreadPool::get().reset_stats(); }
+
+void set_cpu_work_stealing(bool work_stealing) { flash::cpu::ThreadPool::get().set_work_stealing(work_stealing); }
+
+// Keep-mask (batch_size, num_heads, seqlen_q, seqlen_k) of dropout with this rng_state, as the CPU engine and the
+// flash-attention 2 GPU kernels draw it (there, the entries of S_dmask that are >= 0 with return_attn_probs=True)
+at::Tensor dropout_mask(at::Tensor rng_state, int batch_size, int num_heads, int seqlen_q, int seqlen_k, float p_dropout) {
+    TORCH_CHECK(p_dropout >= 0.f && p_dropout < 1.f, "p_dropout must be in [0, 1)");
+    std::optional<at::Tensor> rng_state_ = rng_state;
+    uint64_t const* state = reinterpret_cast<uint64_t const*>(get_dropout_rng_state(rng_state_).data_ptr());
+    // Same rounding as set_params_fprop
+    float const p_keep = 1.f - p_dropout;
+    uint8_t const p_dropout_in_uint8_t = uint8_t(std::floor(p_keep * 255.0));
+    at::Tensor mask = torch::empty({batch_size, num_heads, seqlen_q, seqlen_k}, at::TensorOptions().dtype(torch::kBool));
+    uint8_t* mask_ptr = reinterpret_cast<uint8_t*>(mask.data_ptr<bool>());
+    flash::cpu::ThreadPool::get().parallel_for(batch_size * num_heads, at::get_num_threads(), [&](int const idx, int) {
+        flash::cpu::DropoutCpu const dropout(state[0], state[1], p_dropout_in_uint8_t, idx / num_heads, idx % num_heads, num_heads);
+        dropout.keep_mask(0, seqlen_q, 0, seqlen_k, mask_ptr + int64_t(idx) * seqlen_q * seqlen_k, seqlen_k);
+    });
+    return mask;
+}
+
+// Kernel modules loaded so far with lazy kernel modules (kernel_registry.h): name, path, load time and error if any.
+// Empty if the kernels are linked into this extension.
+std::vector<std::tuple<std::string, std::string, double, std::string>> kernel_modules() {
+    std::vector<std::tuple<std::string, std::string, double, std::string>> modules;
+    #ifdef FLASHATTENTION_LAZY_KERNELS
+    for (flash::KernelModuleRecord const& r : flash::KernelRegistry::instance().modules()) {
+        modules.emplace_back(r.name, r.path, r.load_time_ms, r.error);
+    }
+    #endif
+    return modules;
+}
+
+// Only applicable to the case where seqused_k (i.e. cache_seqlens) is available
+at::Tensor
+mha_fwd_get_scheduler_metadata(
+        int batch_size,
+        int max_seqlen_q,
+        int max_seqlen_k,
+        int num_heads,
+        int num_heads_k,
+        int headdim,
+        int headdim_v,
+        at::ScalarType qkv_dtype,
+        const at::Tensor &seqused_k, // b
+        std::optional<const at::Tensor> &cu_seqlens_q_,  // b+1
+        std::optional<const at::Tensor> &cu_seqlens_k_,  // b+1
+        std::optional<const at::Tensor> &cu_seqlens_k_new_,  // b+1
+        std::optional<const at::Tensor> &seqused_q_, // b. If given, only this many elements of each batch element's queries and outputs are used.
+        std::optional<const at::Tensor> &leftpad_k_, // b
+        std::optional<int> page_size,
+        int max_seqlen_k_new,  // 0 means we're not appending new KV
+        bool is_causal,
+        int window_size_left,
+        int window_size_right,
+        int attention_chunk,
+        bool has_softcap,
+        int num_splits,
+        std::optional<bool> pack_gqa_,
+        int const sm_margin
+        ) {
+
+    Flash_fwd_params params = get_scheduler_metadata_params(
+        batch_size, max_seqlen_q, max_seqlen_k, num_heads, num_heads_k, headdim, headdim_v, qkv_dtype,
+        seqused_k, cu_seqlens_q_, cu_seqlens_k_, cu_seqlens_k_new_, seqused_q_, leftpad_k_, page_size, max_seqlen_k_new,
+        is_causal, window_size_left, window_size_right, attention_chunk, has_softcap, num_splits, pack_gqa_, sm_margin);
+    bool const is_cpu = params.arch == 0;
+    bool const use_dynamic_split = true;
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)seqused_k.get_device()};
+    at::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)seqused_k.get_device()); }
 
     auto opts = seqused_k.options();
     // This needs to be set after get_num_splits
     at::Tensor tile_count_semaphore;  // Contains the semaphore and optionally num_splits_dynamic
-    bool const scheduler_needs_semaphore = params.arch >= 90 || params.num_splits > 1;
+    bool const scheduler_needs_semaphore = !is_cpu && (params.arch >= 90 || params.num_splits > 1);
     if (scheduler_needs_semaphore || use_dynamic_split) {
         tile_count_semaphore = torch::empty({int(scheduler_needs_semaphore) + int(use_dynamic_split) * params.b}, opts.dtype(torch::kInt32));
         if (scheduler_needs_semaphore) {
@@ -614,21 +891,135 @@ mha_fwd_get_scheduler_metadata(
         } else {
             params.tile_count_semaphore = nullptr;
         }
-        params.num_splits_dynamic_ptr = use_dynamic_split ? tile_count_semaphore.data_ptr<int>() + 1 : nullptr;
+        params.num_splits_dynamic_ptr = use_dynamic_split ? tile_count_semaphore.data_ptr<int>() + int(scheduler_needs_semaphore) : nullptr;
     }
 
     if (params.num_splits_dynamic_ptr) {
-        auto kBlockMN_kernel_args_sm90 = tile_size_fwd_sm90(params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, false /*v_colmajor*/, params.page_table && !params.pagedkv_tma, params.softcap > 0.f);
-        auto kBlockMN_kernel_args_sm8x = tile_size_fwd_sm8x(params.arch == 86 || params.arch == 89, params.d_rounded, params.dv_rounded, params.is_causal, params.is_local, params.is_e4m3 ? 1 : 2 /*element_size*/, params.page_table, is_varlen && params.num_splits > 1, params.softcap > 0.f, params.knew_ptr);
-        int const kBlockM = params.arch >= 90 ? std::get<0>(kBlockMN_kernel_args_sm90) : std::get<0>(kBlockMN_kernel_args_sm8x);
-        int const kBlockN = params.arch >= 90 ? std::get<1>(kBlockMN_kernel_args_sm90) : std::get<1>(kBlockMN_kernel_args_sm8x);
-        auto stream = at::cuda::getCurrentCUDAStream().stream();
-        prepare_varlen_num_blocks(params, stream, params.pack_gqa, kBlockM, kBlockN, false /*enable_pdl*/);
-        CHECK_CUDA_KERNEL_LAUNCH();
+        auto [kBlockM, kBlockN] = get_scheduler_metadata_tile_size(params);
+        if (is_cpu) {
+            flash::prepare_varlen_num_blocks_host(flash::make_prepare_scheduler_args(params, params.pack_gqa, kBlockM, kBlockN),
+                                                  params.tile_count_semaphore, params.num_splits_dynamic_ptr);
+        } else {
+            auto stream = at::cuda::getCurrentCUDAStream().stream();
+            prepare_varlen_num_blocks(params, stream, params.pack_gqa, kBlockM, kBlockN, false /*enable_pdl*/);
+            CHECK_CUDA_KERNEL_LAUNCH();
+        }
     }
     return tile_count_semaphore;
 }
 
+// Scheduler metadata that is kept up to date across decode steps, where every sequence grows by the same number of
+// tokens. Takes the same arguments as mha_fwd_get_scheduler_metadata, copies the sequence lengths to the host once,
+// and from then on advance() updates the split counts on the host (flash::VarlenSchedulerPlanner) and only copies
+// them to the device when one of them changes, instead of launching prepare_varlen_num_blocks at every step.
+// The static decisions (num_splits, pack_gqa, tile size) are made once from max_seqlen_k, so max_seqlen_k should
+// be the longest the sequences will get, and the same max_seqlen_k has to be passed to mha_fwd.
+class IncrementalSchedulerMetadata {
+public:
+    IncrementalSchedulerMetadata(
+            int batch_size,
+            int max_seqlen_q,
+            int max_seqlen_k,
+            int num_heads,
+            int num_heads_k,
+            int headdim,
+            int headdim_v,
+            at::ScalarType qkv_dtype,
+            const at::Tensor &seqused_k, // b
+            std::optional<const at::Tensor> &cu_seqlens_q_,  // b+1
+            std::optional<const at::Tensor> &cu_seqlens_k_,  // b+1
+            std::optional<const at::Tensor> &cu_seqlens_k_new_,  // b+1
+            std::optional<const at::Tensor> &seqused_q_, // b
+            std::optional<const at::Tensor> &leftpad_k_, // b
+            std::optional<int> page_size,
+            int max_seqlen_k_new,
+            bool is_causal,
+            int window_size_left,
+            int window_size_right,
+            int attention_chunk,
+            bool has_softcap,
+            int num_splits,
+            std::optional<bool> pack_gqa_,
+            int const sm_margin
+            ) {
+        auto to_host = [](std::optional<const at::Tensor> const& t) -> std::optional<const at::Tensor> {
+            if (!t.has_value()) { return std::nullopt; }
+            return t.value().to(torch::kCPU).contiguous();
+        };
+        at::Tensor const seqused_k_host = seqused_k.to(torch::kCPU).contiguous();
+        std::optional<const at::Tensor> cu_seqlens_q_host = to_host(cu_seqlens_q_), cu_seqlens_k_host = to_host(cu_seqlens_k_);
+        std::optional<const at::Tensor> cu_seqlens_k_new_host = to_host(cu_seqlens_k_new_), seqused_q_host = to_host(seqused_q_);
+        std::optional<const at::Tensor> leftpad_k_host = to_host(leftpad_k_);
+        // Device properties are needed for the static decisions, so get the params as if for the original device
+        at::cuda::OptionalCUDAGuard device_guard;
+        if (!seqused_k.is_cpu()) { device_guard.set_index((char)seqused_k.get_device()); }
+        Flash_fwd_params params = get_scheduler_metadata_params(
+            batch_size, max_seqlen_q, max_seqlen_k, num_heads, num_heads_k, headdim, headdim_v, qkv_dtype,
+            seqused_k, cu_seqlens_q_, cu_seqlens_k_, cu_seqlens_k_new_, seqused_q_, leftpad_k_, page_size, max_seqlen_k_new,
+            is_causal, window_size_left, window_size_right, attention_chunk, has_softcap, num_splits, pack_gqa_, sm_margin);
+        params.seqused_k = seqused_k_host.data_ptr<int>();
+        params.cu_seqlens_q = cu_seqlens_q_host.has_value() ? cu_seqlens_q_host.value().data_ptr<int>() : nullptr;
+        params.cu_seqlens_k = cu_seqlens_k_host.has_value() ? cu_seqlens_k_host.value().data_ptr<int>() : nullptr;
+        params.cu_seqlens_knew = cu_seqlens_k_new_host.has_value() ? cu_seqlens_k_new_host.value().data_ptr<int>() : nullptr;
+        params.seqused_q = seqused_q_host.has_value() ? seqused_q_host.value().data_ptr<int>() : nullptr;
+        params.leftpad_k = leftpad_k_host.has_value() ? leftpad_k_host.value().data_ptr<int>() : nullptr;
+        auto [kBlockM, kBlockN] = get_scheduler_metadata_tile_size(params);
+        planner_.emplace(flash::make_prepare_scheduler_args(params, params.pack_gqa, kBlockM, kBlockN));
+        // Same layout as mha_fwd_get_scheduler_metadata
+        scheduler_needs_semaphore_ = params.arch != 0 && (params.arch >= 90 || params.num_splits > 1);
+        metadata_ = torch::empty({int(scheduler_needs_semaphore_) + params.b}, seqused_k.options().dtype(torch::kInt32));
+        upload();
+    }
+
+    // Grow every sequence by num_tokens. Returns the metadata, which is updated in place.
+    at::Tensor advance(int num_tokens) {
+        TORCH_CHECK(num_tokens >= 0, "num_tokens must be non-negative");
+        if (planner_->advance(num_tokens)) { upload(); }
+        return metadata_;
+    }
+
+    at::Tensor metadata() const { return metadata_; }
+
+    int num_tokens_advanced() const { return planner_->num_tokens_advanced(); }
+
+private:
+    void upload() {
+        bool const is_cpu = metadata_.is_cpu();
+        // A new pinned buffer each time, the caching host allocator won't reuse it until the copy is done
+        at::Tensor metadata_host = torch::empty({metadata_.numel()}, torch::dtype(torch::kInt32).pinned_memory(!is_cpu));
+        int* ptr = metadata_host.data_ptr<int>();
+        if (scheduler_needs_semaphore_) { *ptr++ = 0; }
+        std::copy(planner_->num_splits_dynamic().begin(), planner_->num_splits_dynamic().end(), ptr);
+        if (is_cpu) {
+            metadata_.copy_(metadata_host);
+        } else {
+            at::cuda::CUDAGuard device_guard{(char)metadata_.get_device()};
+            metadata_.copy_(metadata_host, /*non_blocking=*/true);
+        }
+    }
+
+    std::optional<flash::VarlenSchedulerPlanner> planner_;
+    bool scheduler_needs_semaphore_;
+    at::Tensor metadata_;
+};
+
+// Ancestor bitmasks of a draft tree, from the parent of each node (-1 for a child of the tokens before the tree):
+// bit j of the result [..., i] is set if node j is node i or one of its ancestors. Parents come before their
+// children. By pointer jumping, so log2(tree_size) steps of tensor ops on the tree's device.
+at::Tensor tree_ancestors_from_parents(at::Tensor const& tree_parents) {
+    int64_t const tree_size = tree_parents.size(-1);
+    at::Tensor const node = at::arange(tree_size, tree_parents.options().dtype(at::kLong));
+    at::Tensor ancestors = at::bitwise_left_shift(at::ones_like(node), node).expand(tree_parents.sizes()).contiguous();
+    at::Tensor jump = tree_parents.to(at::kLong);
+    for (int64_t hops = 1; hops < tree_size; hops *= 2) {
+        at::Tensor const has_parent = jump >= 0;
+        at::Tensor const parent = jump.clamp(0, tree_size - 1);
+        ancestors = at::where(has_parent, ancestors.bitwise_or(ancestors.gather(-1, parent)), ancestors);
+        jump = at::where(has_parent, jump.gather(-1, parent), jump);
+    }
+    return ancestors;
+}
+
 // b: batch_size
 // b_k: batch_size_k
 // s_q: seqlen_q
@@ -637,8 +1028,19 @@ mha_fwd_get_scheduler_metadata(
 // h: num_heads
 // h_k: num_heads_k
 // d: head_size
-std::vector<at::Tensor>
-mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seqlens_q
+// What mha_fwd needs to launch the kernels: the params and the tensors they point to
+struct FwdLaunch {
+    Flash_fwd_params params;
+    at::Tensor out, softmax_lse, out_accum, softmax_lse_accum, tile_count_semaphore, varlen_lpt_workspace, tree_ancestors, rng_state;
+    at::ScalarType out_type;
+    bool is_cpu, scheduler_needs_semaphore;
+    bool has_work;  // Otherwise nothing to launch, and is_empty says whether out and softmax_lse need to be filled
+    bool is_empty;
+};
+
+// Everything mha_fwd does before launching the kernels: checks, params, heuristics and workspaces
+FwdLaunch
+mha_fwd_setup(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seqlens_q
         const at::Tensor &k,  // (b_k, s_k, h_k, d) or (total_k, h_k, d) if there is cu_seqlens_k or (num_pages, page_size, h_k, d) if there is page_table.
         const at::Tensor &v,  // (b_k, s_k, h_k, dv) or (total_k, h_k, dv) if there is cu_seqlens_k or (num_pages, page_size, h_k, dv) if there is page_table.
         std::optional<const at::Tensor> &k_new_,  // (b, s_k_new, h_k, d) or (total_k_new, h_k, d) if there is cu_seqlens_k_new
@@ -662,12 +1064,17 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         std::optional<at::Tensor> &q_descale_,  // (b, h_k), not (b, h)
         std::optional<at::Tensor> &k_descale_,  // (b, h_k)
         std::optional<at::Tensor> &v_descale_,  // (b, h_k)
+        std::optional<const at::Tensor> &tree_parents_,  // (b, tree_size) or (tree_size). Parent of each draft tree node, -1 for the roots
+        std::optional<const at::Tensor> &k_cache_scale_,  // k without the last dim, float32. If k is int8 / int4
+        std::optional<const at::Tensor> &v_cache_scale_,  // v without the last dim, float32. If v is int8 / int4
         float const softmax_scale,
         bool is_causal,
         int window_size_left,
         int window_size_right,
         int attention_chunk,
         float const softcap,
+        float const p_dropout,
+        std::optional<at::Tensor> &rng_state_,  // (2,), int64: dropout seed and offset. Drawn if not given
         bool const is_rotary_interleaved,   // if true, rotary combines indices 0 & 1, else indices 0 & rotary_dim / 2
         std::optional<at::Tensor> &scheduler_metadata_,  // (b + 1)
         int num_splits,
@@ -675,21 +1082,38 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         int const sm_margin
         ) {
 
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    bool is_sm8x = dprops->major >= 8;
-    TORCH_CHECK(is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+    // CPU tensors are handled by the CPU engine (flash_fwd_kernel_cpu.h)
+    bool const is_cpu = q.is_cpu();
+    auto dprops = is_cpu ? nullptr : at::cuda::getCurrentDeviceProperties();
+    if (!is_cpu) {
+        bool is_sm8x = dprops->major >= 8;
+        TORCH_CHECK(is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+    }
 
     auto q_type = q.scalar_type();
     TORCH_CHECK(q_type == at::ScalarType::Half || q_type == at::ScalarType::BFloat16 || q_type == at::ScalarType::Float8_e4m3fn,
                 "FlashAttention only supports fp16, bf16, and fp8_e4m3 data type");
-    if (dprops->major < 9) {
+    if (is_cpu) {
+        TORCH_CHECK(q_type == at::ScalarType::Half || q_type == at::ScalarType::BFloat16,
+                    "FlashAttention on CPU only supports fp16 and bf16 data type");
+    } else if (dprops->major < 9) {
         TORCH_CHECK(q_type == at::ScalarType::Half || q_type == at::ScalarType::BFloat16,
                     "FlashAttention on Ampere/Ada cards only supports fp16 and bf16 data type");
     }
-    TORCH_CHECK(k.scalar_type() == q_type, "query and key must have the same dtype");
-    TORCH_CHECK(v.scalar_type() == q_type, "query and value must have the same dtype");
+    // A quantized KV cache (CPU only): int8, or int4 packed two per byte along the headdim and stored as uint8
+    int const kv_quant_bits = k.scalar_type() == at::ScalarType::Char ? 8 : (k.scalar_type() == at::ScalarType::Byte ? 4 : 0);
+    int const kv_pack = kv_quant_bits == 4 ? 2 : 1;
+    if (kv_quant_bits == 0) {
+        TORCH_CHECK(k.scalar_type() == q_type, "query and key must have the same dtype");
+        TORCH_CHECK(v.scalar_type() == q_type, "query and value must have the same dtype");
+    } else {
+        TORCH_CHECK(is_cpu, "A quantized KV cache is only supported on CPU");
+        TORCH_CHECK(v.scalar_type() == k.scalar_type(), "key and value must have the same dtype");
+        TORCH_CHECK(k_cache_scale_.has_value() && v_cache_scale_.has_value(), "A quantized KV cache needs k_cache_scale and v_cache_scale");
+    }
 
-    CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v);
+    if (!is_cpu) { CHECK_DEVICE(q); }
+    CHECK_DEVICE_LIKE(k, q); CHECK_DEVICE_LIKE(v, q);
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -699,7 +1123,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     const bool paged_KV = page_table_.has_value();
     if (paged_KV) {
         page_table = page_table_.value();
-        CHECK_DEVICE(page_table);
+        CHECK_DEVICE_LIKE(page_table, q);
         TORCH_CHECK(page_table.dtype() == torch::kInt32, "page_table must have dtype torch.int32");
         TORCH_CHECK(page_table.stride(-1) == 1, "page_table must have contiguous last dimension");
     }
@@ -708,7 +1132,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     bool const is_varlen_q = cu_seqlens_q_.has_value();
     if (is_varlen_q) {
         cu_seqlens_q = cu_seqlens_q_.value();
-        CHECK_DEVICE(cu_seqlens_q); CHECK_CONTIGUOUS(cu_seqlens_q);
+        CHECK_DEVICE_LIKE(cu_seqlens_q, q); CHECK_CONTIGUOUS(cu_seqlens_q);
         TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "cu_seqlens_q must have dtype torch.int32");
         TORCH_CHECK(max_seqlen_q_.has_value(), "max_seqlen_q must be provided if cu_seqlens_q is provided");
     }
@@ -716,7 +1140,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     bool const is_varlen_k = cu_seqlens_k_.has_value();
     if (is_varlen_k) {
         cu_seqlens_k = cu_seqlens_k_.value();
-        CHECK_DEVICE(cu_seqlens_k); CHECK_CONTIGUOUS(cu_seqlens_k);
+        CHECK_DEVICE_LIKE(cu_seqlens_k, q); CHECK_CONTIGUOUS(cu_seqlens_k);
         TORCH_CHECK(cu_seqlens_k.dtype() == torch::kInt32, "cu_seqlens_k must have dtype torch.int32");
         TORCH_CHECK(max_seqlen_k_.has_value(), "max_seqlen_k must be provided if cu_seqlens_k is provided");
         TORCH_CHECK(!paged_KV, "If cu_seqlens_k is passed in, then page table is not supported");
@@ -729,7 +1153,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     int total_q = !is_varlen_q ? batch_size * sizes[1] : sizes[0];
     int num_heads = q.size(-2);
     int const head_size = q.size(-1);
-    int const head_size_v = v.size(-1);
+    int const head_size_v = v.size(-1) * kv_pack;
     int const max_num_pages_per_seq = !paged_KV ? 0 : page_table.size(1);
     int const num_pages = !paged_KV ? 0 : k.size(0);
     int const page_size = !paged_KV ? 1 : k.size(1);
@@ -748,7 +1172,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
                    (head_size <= 64 && head_size_v <= 512),
                    "If V headdim is different from Q/K dim, we only support Q/K headdim in (128, 192] and V headdim in (96, 128], "
                    "or (Q/K <= 64 and V <= 512).");
-        TORCH_CHECK(dprops->major == 9, "Only Hopper supports different V headdim");
+        TORCH_CHECK(is_cpu || dprops->major == 9, "Only Hopper and the CPU engine support different V headdim");
         if (head_size_v > 256) {
             TORCH_CHECK(q_type == at::ScalarType::Half || q_type == at::ScalarType::BFloat16,
                         "HeaddimV > 256 requires fp16 and bf16 data type");
@@ -759,8 +1183,8 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     // TODO: check this
     if (window_size_left >= seqlen_k - 1) { window_size_left = -1; }
     if (window_size_right >= seqlen_q - 1) { window_size_right = -1; }
-    // causal=true is the same as causal=false in this case
-    if (seqlen_q == 1 && window_size_left == -1 && window_size_right == -1 && attention_chunk == 0) {
+    // causal=true is the same as causal=false in this case, unless the query is a node of a draft tree
+    if (seqlen_q == 1 && window_size_left == -1 && window_size_right == -1 && attention_chunk == 0 && !tree_parents_.has_value()) {
         // Special case of hdim 128 where we want causal to have kBlockN=128, better for pagedKV and TMA
         if ((head_size <= 64 || head_size > 128) || !paged_KV) {
             is_causal = false;
@@ -779,36 +1203,36 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     }
     if (!paged_KV) {
         if (!is_varlen_k) {
-            CHECK_SHAPE(k, batch_size_k, seqlen_k, num_heads_k, head_size);
-            CHECK_SHAPE(v, batch_size_k, seqlen_k, num_heads_k, head_size_v);
+            CHECK_SHAPE(k, batch_size_k, seqlen_k, num_heads_k, head_size / kv_pack);
+            CHECK_SHAPE(v, batch_size_k, seqlen_k, num_heads_k, head_size_v / kv_pack);
         } else {
-            CHECK_SHAPE(k, total_k, num_heads_k, head_size);
-            CHECK_SHAPE(v, total_k, num_heads_k, head_size_v);
+            CHECK_SHAPE(k, total_k, num_heads_k, head_size / kv_pack);
+            CHECK_SHAPE(v, total_k, num_heads_k, head_size_v / kv_pack);
             CHECK_SHAPE(cu_seqlens_k, batch_size + 1);
         }
     } else {
-        CHECK_SHAPE(k, num_pages, page_size, num_heads_k, head_size);
-        CHECK_SHAPE(v, num_pages, page_size, num_heads_k, head_size_v);
+        CHECK_SHAPE(k, num_pages, page_size, num_heads_k, head_size / kv_pack);
+        CHECK_SHAPE(v, num_pages, page_size, num_heads_k, head_size_v / kv_pack);
         CHECK_SHAPE(page_table, batch_size_k, max_num_pages_per_seq);
     }
 
     if (seqused_q_.has_value()){
         auto seqused_q = seqused_q_.value();
         TORCH_CHECK(seqused_q.dtype() == torch::kInt32, "seqused_q must have dtype int32");
-        CHECK_DEVICE(seqused_q); CHECK_CONTIGUOUS(seqused_q);
+        CHECK_DEVICE_LIKE(seqused_q, q); CHECK_CONTIGUOUS(seqused_q);
         CHECK_SHAPE(seqused_q, batch_size);
     }
     if (seqused_k_.has_value()) {
         auto seqused_k = seqused_k_.value();
         TORCH_CHECK(seqused_k.dtype() == torch::kInt32, "seqused_k must have dtype int32");
-        CHECK_DEVICE(seqused_k); CHECK_CONTIGUOUS(seqused_k);
+        CHECK_DEVICE_LIKE(seqused_k, q); CHECK_CONTIGUOUS(seqused_k);
         CHECK_SHAPE(seqused_k, batch_size);
     }
 
     if (leftpad_k_.has_value()) {
         auto leftpad_k = leftpad_k_.value();
         TORCH_CHECK(leftpad_k.dtype() == torch::kInt32, "leftpad_k must have dtype int32");
-        CHECK_DEVICE(leftpad_k); CHECK_CONTIGUOUS(leftpad_k);
+        CHECK_DEVICE_LIKE(leftpad_k, q); CHECK_CONTIGUOUS(leftpad_k);
         CHECK_SHAPE(leftpad_k, batch_size);
     }
 
@@ -828,7 +1252,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     if (out_.has_value()) {
         out = out_.value();
         TORCH_CHECK(out.scalar_type() == out_type, "For FP16/BF16 input, output must have the same dtype as inputs. For FP8 input, output must have dtype BF16");
-        CHECK_DEVICE(out);
+        CHECK_DEVICE_LIKE(out, q);
         TORCH_CHECK(out.stride(-1) == 1, "Output tensor must have contiguous last dimension");
         if (!is_varlen_q) {
             CHECK_SHAPE(out, batch_size, seqlen_q, num_heads, head_size_v);
@@ -849,7 +1273,8 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    at::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     at::Tensor softmax_lse;
     if (!is_varlen_q) {
@@ -871,7 +1296,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
                      seqused_q_.has_value() ? seqused_q_.value().data_ptr() : nullptr,
                      seqused_k_.has_value() ? seqused_k_.value().data_ptr() : nullptr,
                      softmax_lse.data_ptr(),
-                     /*p_dropout=*/0.f,
+                     p_dropout,
                      softmax_scale,
                      window_size_left,
                      window_size_right,
@@ -881,6 +1306,12 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     params.total_q = total_q;
     params.total_k = total_k;
     params.b_k = batch_size_k;
+    at::Tensor rng_state;
+    if (p_dropout > 0.f) {
+        TORCH_CHECK(is_cpu, "Dropout is only supported by the CPU engine");
+        rng_state = get_dropout_rng_state(rng_state_);
+        params.rng_state = reinterpret_cast<uint64_t*>(rng_state.data_ptr());
+    }
     params.dv = head_size_v;
     params.dv_rounded = head_size_v_rounded;
     if (leftpad_k_.has_value()) {  // This needs to be set before get_pagedkv_tma
@@ -902,14 +1333,14 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         bool const is_varlen_k_new = cu_seqlens_k_new_.has_value();
         if (is_varlen_k_new) {
             cu_seqlens_k_new = cu_seqlens_k_new_.value();
-            CHECK_DEVICE(cu_seqlens_k_new); CHECK_CONTIGUOUS(cu_seqlens_k_new);
+            CHECK_DEVICE_LIKE(cu_seqlens_k_new, q); CHECK_CONTIGUOUS(cu_seqlens_k_new);
             TORCH_CHECK(cu_seqlens_k_new.dtype() == torch::kInt32, "cu_seqlens_k_new must have dtype torch.int32");
         }
         k_new = k_new_.value();
         v_new = v_new_.value();
         TORCH_CHECK(k_new.dtype() == q_type, "k_new must have the same dtype as query");
         TORCH_CHECK(v_new.dtype() == q_type, "v_new must have the same dtype as query");
-        CHECK_DEVICE(k_new); CHECK_DEVICE(v_new);
+        CHECK_DEVICE_LIKE(k_new, q); CHECK_DEVICE_LIKE(v_new, q);
         TORCH_CHECK(k_new.stride(-1) == 1, "k_new tensor must have contiguous last dimension");
         TORCH_CHECK(v_new.stride(-1) == 1, "v_new tensor must have contiguous last dimension");
         // We don't need max_seqlen_k_new, so seqlen_k_new can be whatever when is_varlen_k_new
@@ -941,8 +1372,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         }
     }
 
-    // 992 = 32 * 31 is the max supported batch in prepare_varlen_num_blocks kernel
-    bool const use_dynamic_split = is_varlen && params.b <= 992;
+    bool const use_dynamic_split = is_varlen;
     // Temporarily set num_splits_dynamic_ptr to 1 since get_num_splits checks it
     params.num_splits_dynamic_ptr = !use_dynamic_split ? nullptr : reinterpret_cast<int*>(1);
 
@@ -954,27 +1384,52 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     // This needs to be set after get_num_splits
     at::Tensor tile_count_semaphore;  // Contains the semaphore and optionally num_splits_dynamic
     // We don't use the persistent scheduler if Split and not Varlen
-    bool const scheduler_needs_semaphore = params.arch >= 90
+    // The CPU engine hands out tiles from its own thread pool and doesn't need the semaphore
+    bool const scheduler_needs_semaphore = !is_cpu && (params.arch >= 90
         ? (((params.is_causal || params.is_local) && (params.num_splits == 1)) || is_varlen)
-        : ((params.is_causal && !is_varlen) || (is_varlen && params.num_splits > 1));
+        : ((params.is_causal && !is_varlen) || (is_varlen && params.num_splits > 1)));
     if (scheduler_needs_semaphore || use_dynamic_split) {
         int metadata_size = int(scheduler_needs_semaphore) + int(use_dynamic_split) * params.b;
         params.skip_scheduler_metadata_computation = scheduler_metadata_.has_value();
         if (scheduler_metadata_.has_value()) {
             at::Tensor scheduler_metadata = scheduler_metadata_.value();
-            CHECK_DEVICE(scheduler_metadata);
+            CHECK_DEVICE_LIKE(scheduler_metadata, q);
             CHECK_SHAPE(scheduler_metadata, metadata_size);
             CHECK_CONTIGUOUS(scheduler_metadata);
             TORCH_CHECK(scheduler_metadata.dtype() == torch::kInt32, "scheduler_metadata must have dtype int32");
             tile_count_semaphore = scheduler_metadata;
         } else {
-            tile_count_semaphore = torch::empty({metadata_size}, opts.dtype(torch::kInt32));
+            tile_count_semaphore = flash::WorkspaceArena::instance().empty({metadata_size}, opts.dtype(torch::kInt32));
         }
         if (scheduler_needs_semaphore && !use_dynamic_split) {
             tile_count_semaphore.zero_();  // If varlen we'll manually do the zero-ing
         }
         params.tile_count_semaphore = scheduler_needs_semaphore ? tile_count_semaphore.data_ptr<int>() : nullptr;
-        params.num_splits_dynamic_ptr = use_dynamic_split ? tile_count_semaphore.data_ptr<int>() + 1 : nullptr;
+        params.num_splits_dynamic_ptr = use_dynamic_split ? tile_count_semaphore.data_ptr<int>() + int(scheduler_needs_semaphore) : nullptr;
+        // The GPU computes the splits of each batch in run_mha_fwd, the CPU engine needs them before it starts
+        if (is_cpu && use_dynamic_split && !params.skip_scheduler_metadata_computation) {
+            auto [kBlockM, kBlockN] = tile_size_fwd_cpu(params.d, params.dv);
+            flash::prepare_varlen_num_blocks_host(flash::make_prepare_scheduler_args(params, params.pack_gqa, kBlockM, kBlockN),
+                                                  nullptr, params.num_splits_dynamic_ptr);
+        }
+    }
+
+    // With causal / local masks, the varlen persistent scheduler can hand out tiles longest first (prepare_scheduler.h).
+    // That costs a workspace and a few small kernels per call, which only pay off for prefill batches of very uneven
+    // lengths: here the longest sequence has at least twice the mean number of queries. Decode (seqlen_q == 1, e.g.
+    // flash_attn_with_kvcache with cache_seqlens) keeps the batch order, and so do calls with precomputed
+    // scheduler_metadata, which are meant to do no scheduling work per call.
+    at::Tensor varlen_lpt_workspace;
+    bool const uneven_prefill = is_varlen_q && seqlen_q > 1 && int64_t(seqlen_q) * batch_size >= 2 * int64_t(total_q);
+    bool const use_varlen_lpt = !is_cpu && use_dynamic_split && (params.is_causal || params.is_local)
+        && (params.arch >= 90 || params.num_splits > 1) && uneven_prefill && !params.skip_scheduler_metadata_computation;
+    if (use_varlen_lpt) {
+        int const qhead_per_khead = !params.pack_gqa ? 1 : (params.h + params.h_k - 1) / params.h_k;
+        int64_t const workspace_size = flash::get_varlen_lpt_workspace_size(
+            params.total_q, params.b, !params.pack_gqa ? params.h : params.h_k, qhead_per_khead, params.num_splits,
+            64 /*smallest kBlockM of the forward kernels*/);
+        varlen_lpt_workspace = flash::WorkspaceArena::instance().empty({workspace_size}, opts.dtype(torch::kInt32));
+        params.varlen_lpt_workspace = varlen_lpt_workspace.data_ptr<int>();
     }
 
     if (q_v_.has_value()) {
@@ -984,7 +1439,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         TORCH_CHECK(params.arch == 90, "q_v is only supported for Hopper GPUs");
         at::Tensor q_v = q_v_.value();
         TORCH_CHECK(q_v.dtype() == q_type, "q_v must have the same dtype as query");
-        CHECK_DEVICE(q_v);
+        CHECK_DEVICE_LIKE(q_v, q);
         TORCH_CHECK(q_v.stride(-1) == 1, "q_v tensor must have contiguous last dimension");
         if (!is_varlen_q) {
             CHECK_SHAPE(q_v, batch_size, seqlen_q, num_heads, head_size_v);
@@ -1002,8 +1457,9 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
 
     if (rotary_cos_.has_value()) {
         TORCH_CHECK(k_new_.has_value(), "If rotary cos/sin are provided, new key / value to be appended to KV cache must also be provided");
+        TORCH_CHECK(!is_cpu, "Rotary embedding is not supported on CPU");
         auto rotary_cos = rotary_cos_.value();
-        CHECK_DEVICE(rotary_cos); CHECK_CONTIGUOUS(rotary_cos);
+        CHECK_DEVICE_LIKE(rotary_cos, q); CHECK_CONTIGUOUS(rotary_cos);
         params.rotary_dim = rotary_cos.size(1) * 2;
         TORCH_CHECK(params.rotary_dim <= head_size, "rotary_dim must be <= headdim");
         TORCH_CHECK(params.rotary_dim % 16 == 0, "Only rotary dimensions divisible by 16 are currently supported");
@@ -1016,7 +1472,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
 
         TORCH_CHECK(rotary_sin_.has_value(), "If rotary cos is provided, rotary sin must also be provided");
         auto rotary_sin = rotary_sin_.value();
-        CHECK_DEVICE(rotary_sin); CHECK_CONTIGUOUS(rotary_sin);
+        CHECK_DEVICE_LIKE(rotary_sin, q); CHECK_CONTIGUOUS(rotary_sin);
         CHECK_SHAPE(rotary_sin, seqlen_ro, params.rotary_dim / 2);
         TORCH_CHECK(rotary_sin.scalar_type() == q_type, "rotary_cos must have the same dtype as query");
         params.rotary_cos_ptr = rotary_cos.data_ptr();
@@ -1024,7 +1480,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         params.is_rotary_interleaved = is_rotary_interleaved;
         if (seqlens_rotary_.has_value()) {
             at::Tensor seqlens_rotary = seqlens_rotary_.value();
-            CHECK_DEVICE(seqlens_rotary); CHECK_CONTIGUOUS(seqlens_rotary);
+            CHECK_DEVICE_LIKE(seqlens_rotary, q); CHECK_CONTIGUOUS(seqlens_rotary);
             TORCH_CHECK(seqlens_rotary.dtype() == torch::kInt32, "seqlens_rotary must have dtype torch.int32");
             CHECK_SHAPE(seqlens_rotary, batch_size);
             params.seqlens_rotary = seqlens_rotary.data_ptr<int>();
@@ -1033,9 +1489,53 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         params.rotary_dim = 0;
     }
 
+    at::Tensor tree_ancestors;
+    if (tree_parents_.has_value()) {
+        at::Tensor tree_parents = tree_parents_.value();
+        CHECK_DEVICE_LIKE(tree_parents, q);
+        TORCH_CHECK(tree_parents.scalar_type() == torch::kInt32, "tree_parents must have dtype int32");
+        TORCH_CHECK(tree_parents.dim() == 1 || tree_parents.dim() == 2, "tree_parents must have shape (tree_size) or (batch_size, tree_size)");
+        if (tree_parents.dim() == 2) { CHECK_SHAPE(tree_parents, batch_size, tree_parents.size(1)); }
+        int const tree_size = tree_parents.size(-1);
+        TORCH_CHECK(tree_size >= 1 && tree_size <= 64, "tree_parents supports trees of 1 to 64 nodes");
+        TORCH_CHECK(params.is_causal, "tree_parents requires causal=True, without window_size or attention_chunk");
+        TORCH_CHECK(tree_size <= seqlen_k, "The draft tree can't have more nodes than seqlen_k");
+        // tree_ancestors_from_parents clamps out-of-range parents, which would silently give the wrong mask. On the GPU
+        // the check is a device-side assert, so that it doesn't synchronize with the host.
+        at::Tensor const node = at::arange(tree_size, tree_parents.options());
+        at::Tensor const parents_valid = (tree_parents >= -1).logical_and(tree_parents < node).all();
+        char const* parents_error = "tree_parents: each node's parent must be -1 or an earlier node";
+        if (is_cpu) {
+            TORCH_CHECK(parents_valid.item<bool>(), parents_error);
+        } else {
+            at::_assert_async(parents_valid, parents_error);
+        }
+        tree_ancestors = tree_ancestors_from_parents(tree_parents);
+        params.tree_ancestors = reinterpret_cast<uint64_t*>(tree_ancestors.data_ptr<int64_t>());
+        params.tree_ancestors_batch_stride = tree_ancestors.dim() == 2 ? tree_ancestors.stride(0) : 0;
+        params.tree_size = tree_size;
+    }
+
+    if (kv_quant_bits > 0) {
+        TORCH_CHECK(!is_varlen_k, "A quantized KV cache doesn't support cu_seqlens_k");
+        at::Tensor const k_cache_scale = k_cache_scale_.value(), v_cache_scale = v_cache_scale_.value();
+        for (at::Tensor const& scale : {k_cache_scale, v_cache_scale}) {
+            CHECK_DEVICE_LIKE(scale, q);
+            TORCH_CHECK(scale.scalar_type() == at::kFloat, "k_cache_scale and v_cache_scale must have dtype float32");
+            TORCH_CHECK(scale.sizes() == k.sizes().slice(0, 3), "k_cache_scale and v_cache_scale must have the shape of k_cache without the last dim");
+        }
+        TORCH_CHECK(k_cache_scale.strides() == v_cache_scale.strides(), "k_cache_scale and v_cache_scale must have the same strides");
+        params.kv_quant_bits = kv_quant_bits;
+        params.k_scale_ptr = k_cache_scale.data_ptr<float>();
+        params.v_scale_ptr = v_cache_scale.data_ptr<float>();
+        params.kv_scale_batch_stride = k_cache_scale.stride(0);
+        params.kv_scale_row_stride = k_cache_scale.stride(1);
+        params.kv_scale_head_stride = k_cache_scale.stride(2);
+    }
+
     if (kv_batch_idx_.has_value()) {
         auto kv_batch_idx = kv_batch_idx_.value();
-        CHECK_DEVICE(kv_batch_idx); CHECK_CONTIGUOUS(kv_batch_idx);
+        CHECK_DEVICE_LIKE(kv_batch_idx, q); CHECK_CONTIGUOUS(kv_batch_idx);
         TORCH_CHECK(kv_batch_idx.scalar_type() == torch::kInt32, "kv_batch_idx must have dtype int32");
         params.kv_batch_idx = reinterpret_cast<int *>(kv_batch_idx.data_ptr());
     }
@@ -1045,13 +1545,13 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     if (params.num_splits > 1) {
         TORCH_CHECK(params.num_splits <= 256, "num_splits > 256 not supported");
         if (!is_varlen_q) {
-            out_accum = torch::empty({params.num_splits, batch_size, num_heads, seqlen_q, head_size_v}, opts.dtype(outaccum_type));
-            softmax_lse_accum = torch::empty({params.num_splits, batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
+            out_accum = flash::WorkspaceArena::instance().empty({params.num_splits, batch_size, num_heads, seqlen_q, head_size_v}, opts.dtype(outaccum_type));
+            softmax_lse_accum = flash::WorkspaceArena::instance().empty({params.num_splits, batch_size, num_heads, seqlen_q}, opts.dtype(at::kFloat));
             params.oaccum_batch_stride = out_accum.stride(1);
             params.lseaccum_batch_stride = softmax_lse_accum.stride(1);
         } else {
-            out_accum = torch::empty({params.num_splits, num_heads, total_q, head_size_v}, opts.dtype(outaccum_type));
-            softmax_lse_accum = torch::empty({params.num_splits, num_heads, total_q}, opts.dtype(at::kFloat));
+            out_accum = flash::WorkspaceArena::instance().empty({params.num_splits, num_heads, total_q, head_size_v}, opts.dtype(outaccum_type));
+            softmax_lse_accum = flash::WorkspaceArena::instance().empty({params.num_splits, num_heads, total_q}, opts.dtype(at::kFloat));
         }
         params.is_fp32 = false;
         params.oaccum_ptr = out_accum.data_ptr();
@@ -1066,7 +1566,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     if (q_type == at::ScalarType::Float8_e4m3fn) {
         if (q_descale_.has_value()) {
             auto q_descale = q_descale_.value();
-            CHECK_DEVICE(q_descale);
+            CHECK_DEVICE_LIKE(q_descale, q);
             CHECK_SHAPE(q_descale, batch_size, num_heads_k);
             params.q_descale_ptr = q_descale.data_ptr<float>();
             params.q_descale_batch_stride = q_descale.stride(0);
@@ -1076,7 +1576,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         }
         if (k_descale_.has_value()) {
             auto k_descale = k_descale_.value();
-            CHECK_DEVICE(k_descale);
+            CHECK_DEVICE_LIKE(k_descale, q);
             CHECK_SHAPE(k_descale, batch_size, num_heads_k);
             params.k_descale_ptr = k_descale.data_ptr<float>();
             params.k_descale_batch_stride = k_descale.stride(0);
@@ -1086,7 +1586,7 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
         }
         if (v_descale_.has_value()) {
             auto v_descale = v_descale_.value();
-            CHECK_DEVICE(v_descale);
+            CHECK_DEVICE_LIKE(v_descale, q);
             CHECK_SHAPE(v_descale, batch_size, num_heads_k);
             params.v_descale_ptr = v_descale.data_ptr<float>();
             params.v_descale_batch_stride = v_descale.stride(0);
@@ -1115,39 +1615,365 @@ mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seq
     TORCH_CHECK(!k_new_.has_value(), "This flash attention build does not support appending KV.");
     #endif
 
-    if (total_q > 0 && (total_k + params.total_knew) > 0 && num_heads_k > 0) {
-        auto stream = at::cuda::getCurrentCUDAStream().stream();
-        run_mha_fwd(params, stream);
-        if (params.num_splits > 1) {
-            if (out_type == at::ScalarType::BFloat16) {
-                // Since we want output in BF16. Otherwise fwd_combine will output to FP16
-                params.is_bf16 = true;
+    FwdLaunch launch;
+    launch.params = params;
+    launch.out = out;
+    launch.softmax_lse = softmax_lse;
+    launch.out_accum = out_accum;
+    launch.softmax_lse_accum = softmax_lse_accum;
+    launch.tile_count_semaphore = tile_count_semaphore;
+    launch.varlen_lpt_workspace = varlen_lpt_workspace;
+    launch.tree_ancestors = tree_ancestors;
+    launch.rng_state = rng_state;
+    launch.out_type = out_type;
+    launch.is_cpu = is_cpu;
+    launch.scheduler_needs_semaphore = scheduler_needs_semaphore;
+    launch.has_work = total_q > 0 && (total_k + params.total_knew) > 0 && num_heads_k > 0;
+    launch.is_empty = total_q > 0 && num_heads_k > 0 && !launch.has_work;
+    return launch;
+}
+
+// Runs the kernels set up by mha_fwd_setup
+void mha_fwd_launch(FwdLaunch &launch) {
+    Flash_fwd_params &params = launch.params;
+    at::cuda::OptionalCUDAGuard device_guard;
+    if (!launch.is_cpu) { device_guard.set_index((char)launch.out.get_device()); }
+    if (launch.has_work) {
+        if (launch.is_cpu) {
+            run_mha_fwd_cpu(params);
+        } else {
+            auto stream = at::cuda::getCurrentCUDAStream().stream();
+            run_mha_fwd(params, stream);
+            if (params.num_splits > 1) {
+                if (launch.out_type == at::ScalarType::BFloat16) {
+                    // Since we want output in BF16. Otherwise fwd_combine will output to FP16
+                    params.is_bf16 = true;
+                }
+                // Unless there's seqused_q, for the purpose of attn_combine, we can just treat it as batch=1
+                // and seqlen = total_q, and don't need to dispatch to Varlen there.
+                // However, with dynamic split, each row needs to know which batch it belongs to
+                // to read the number of splits, so we just use the varlen version of combine kernel.
+                // if (is_varlen_q && !seqused_q_.has_value()) {
+                // if (is_varlen_q) {
+                //     params.b = 1;
+                //     params.seqlen_q = total_q;
+                // }
+                // This will zero out the semaphore if needed
+                run_mha_fwd_combine(params, stream, true /*enable_pdl*/);
+            } else if (launch.scheduler_needs_semaphore && params.skip_scheduler_metadata_computation) {
+                // need to zero out the semaphore in this case
+                launch.tile_count_semaphore.index({torch::indexing::Slice(0, 1)}).zero_();
             }
-            // Unless there's seqused_q, for the purpose of attn_combine, we can just treat it as batch=1
-            // and seqlen = total_q, and don't need to dispatch to Varlen there.
-            // However, with dynamic split, each row needs to know which batch it belongs to
-            // to read the number of splits, so we just use the varlen version of combine kernel.
-            // if (is_varlen_q && !seqused_q_.has_value()) {
-            // if (is_varlen_q) {
-            //     params.b = 1;
-            //     params.seqlen_q = total_q;
-            // }
-            // This will zero out the semaphore if needed
-            run_mha_fwd_combine(params, stream, true /*enable_pdl*/);
-        } else if (scheduler_needs_semaphore && params.skip_scheduler_metadata_computation) {
-            // need to zero out the semaphore in this case
-            tile_count_semaphore.index({torch::indexing::Slice(0, 1)}).zero_();
         }
-    } else if (total_q > 0 && num_heads_k > 0) {
+    } else if (launch.is_empty) {
         // If seqlen_k == 0, then we have an empty tensor. We need to set the output to 0.
-        out.zero_();
-        softmax_lse.fill_(std::numeric_limits<float>::infinity());
+        launch.out.zero_();
+        launch.softmax_lse.fill_(std::numeric_limits<float>::infinity());
     }
+}
 
+std::vector<at::Tensor>
+mha_fwd(at::Tensor &q,   // (b, s_q, h, d) or (total_q, h, d) if there is cu_seqlens_q
+        const at::Tensor &k,  // (b_k, s_k, h_k, d) or (total_k, h_k, d) if there is cu_seqlens_k or (num_pages, page_size, h_k, d) if there is page_table.
+        const at::Tensor &v,  // (b_k, s_k, h_k, dv) or (total_k, h_k, dv) if there is cu_seqlens_k or (num_pages, page_size, h_k, dv) if there is page_table.
+        std::optional<const at::Tensor> &k_new_,  // (b, s_k_new, h_k, d) or (total_k_new, h_k, d) if there is cu_seqlens_k_new
+        std::optional<const at::Tensor> &v_new_,  // (b, s_k_new, h_k, dv) or (total_k_new, h_k, dv) if there is cu_seqlens_k_new
+        std::optional<const at::Tensor> &q_v_,  // (b, s_q, h, dv) or (total_q_new, h, dv) if there is cu_seqlens_q
+        std::optional<at::Tensor> &out_,  // (b, s_q, h, dv) or (total_q, h, dv) if there is cu_seqlens_q
+        std::optional<const at::Tensor> &cu_seqlens_q_,  // b+1
+        std::optional<const at::Tensor> &cu_seqlens_k_,  // b+1
+        std::optional<const at::Tensor> &cu_seqlens_k_new_,  // b+1
+        std::optional<const at::Tensor> &seqused_q_, // b. If given, only this many elements of each batch element's queries and outputs are used.
+        std::optional<const at::Tensor> &seqused_k_, // b. If given, only this many elements of each batch element's keys are used.
+        std::optional<int> max_seqlen_q_,
+        // TODO: check if we need max_seqlen_k
+        std::optional<int> max_seqlen_k_,
+        std::optional<const at::Tensor> &page_table_, // (b_k, max_num_pages_per_seq)
+        std::optional<const at::Tensor> &kv_batch_idx_, // b. indices to index into the KV cache
+        std::optional<const at::Tensor> &leftpad_k_, // b
+        std::optional<const at::Tensor> &rotary_cos_, // seqlen_ro x (rotary_dim / 2)
+        std::optional<const at::Tensor> &rotary_sin_, // seqlen_ro x (rotary_dim / 2)
+        std::optional<const at::Tensor> &seqlens_rotary_, // b
+        std::optional<at::Tensor> &q_descale_,  // (b, h_k), not (b, h)
+        std::optional<at::Tensor> &k_descale_,  // (b, h_k)
+        std::optional<at::Tensor> &v_descale_,  // (b, h_k)
+        std::optional<const at::Tensor> &tree_parents_,  // (b, tree_size) or (tree_size). Parent of each draft tree node, -1 for the roots
+        std::optional<const at::Tensor> &k_cache_scale_,  // k without the last dim, float32. If k is int8 / int4
+        std::optional<const at::Tensor> &v_cache_scale_,  // v without the last dim, float32. If v is int8 / int4
+        float const softmax_scale,
+        bool is_causal,
+        int window_size_left,
+        int window_size_right,
+        int attention_chunk,
+        float const softcap,
+        float const p_dropout,
+        std::optional<at::Tensor> &rng_state_,  // (2,), int64: dropout seed and offset. Drawn if not given
+        bool const is_rotary_interleaved,   // if true, rotary combines indices 0 & 1, else indices 0 & rotary_dim / 2
+        std::optional<at::Tensor> &scheduler_metadata_,  // (b + 1)
+        int num_splits,
+        std::optional<bool> pack_gqa_,
+        int const sm_margin
+        ) {
+    FwdLaunch launch = mha_fwd_setup(
+        q, k, v, k_new_, v_new_, q_v_, out_, cu_seqlens_q_, cu_seqlens_k_, cu_seqlens_k_new_, seqused_q_, seqused_k_,
+        max_seqlen_q_, max_seqlen_k_, page_table_, kv_batch_idx_, leftpad_k_, rotary_cos_, rotary_sin_, seqlens_rotary_,
+        q_descale_, k_descale_, v_descale_, tree_parents_, k_cache_scale_, v_cache_scale_, softmax_scale, is_causal,
+        window_size_left, window_size_right, attention_chunk, softcap, p_dropout, rng_state_, is_rotary_interleaved,
+        scheduler_metadata_, num_splits, pack_gqa_, sm_margin);
+    mha_fwd_launch(launch);
     // return {out, softmax_lse};
-    return {out, softmax_lse, out_accum, softmax_lse_accum};
+    return {launch.out, launch.softmax_lse, launch.out_accum, launch.softmax_lse_accum, launch.rng_state};
 }
 
+// Forward pass with a KV cache (as flash_attn_with_kvcache without appending to the cache), set up once. The
+// constructor does everything mha_fwd does before launching for one set of shapes and flags: the checks,
+// set_params_fprop, the pagedkv_tma / num_splits / pack_gqa heuristics and allocating the scheduler metadata and the
+// split-KV accumulators. run() only swaps in the data pointers and cache_seqlens and launches, which takes most of
+// the host overhead off the decode step at small batch sizes.
+// run() needs tensors with the same shapes, strides, dtype and device as the ones the plan was built with. The
+// returned softmax_lse, and the output unless out is passed in, belong to the plan and are overwritten by the next run.
+class AttentionPlan {
+public:
+    AttentionPlan(
+            const at::Tensor &q,  // (b, s_q, h, d)
+            const at::Tensor &k_cache,  // (b_k, s_k, h_k, d) or (num_pages, page_size, h_k, d) if there is page_table
+            const at::Tensor &v_cache,  // (b_k, s_k, h_k, dv) or (num_pages, page_size, h_k, dv) if there is page_table
+            const at::Tensor &cache_seqlens,  // b
+            std::optional<const at::Tensor> &page_table_,  // (b_k, max_num_pages_per_seq)
+            float const softmax_scale,
+            bool is_causal,
+            int window_size_left,
+            int window_size_right,
+            int attention_chunk,
+            float const softcap,
+            int num_splits,
+            std::optional<bool> pack_gqa_,
+            int const sm_margin
+            ) : q_(q), k_cache_(k_cache), v_cache_(v_cache), cache_seqlens_(cache_seqlens) {
+        if (page_table_.has_value()) { page_table_example_ = page_table_.value(); }
+        std::optional<const at::Tensor> none;
+        std::optional<at::Tensor> none_out, none_descale, none_rng_state, none_metadata;
+        std::optional<const at::Tensor> seqused_k = cache_seqlens;
+        launch_ = mha_fwd_setup(
+            q_, k_cache, v_cache, none /*k_new*/, none /*v_new*/, none /*q_v*/, none_out, none /*cu_seqlens_q*/,
+            none /*cu_seqlens_k*/, none /*cu_seqlens_k_new*/, none /*seqused_q*/, seqused_k, std::nullopt, std::nullopt,
+            page_table_, none /*kv_batch_idx*/, none /*leftpad_k*/, none /*rotary_cos*/, none /*rotary_sin*/,
+            none /*seqlens_rotary*/, none_descale, none_descale, none_descale, none /*tree_parents*/, none /*k_cache_scale*/,
+            none /*v_cache_scale*/, softmax_scale, is_causal,
+            window_size_left, window_size_right, attention_chunk, softcap, 0.f /*p_dropout*/, none_rng_state,
+            false /*is_rotary_interleaved*/, none_metadata, num_splits, pack_gqa_, sm_margin);
+        out_ = launch_.out;
+    }
+
+    std::vector<at::Tensor> run(
+            const at::Tensor &q,
+            const at::Tensor &k_cache,
+            const at::Tensor &v_cache,
+            const at::Tensor &cache_seqlens,
+            std::optional<const at::Tensor> &page_table_,
+            std::optional<at::Tensor> &out_opt
+            ) {
+        check_like(q, q_, "q");
+        check_like(k_cache, k_cache_, "k_cache");
+        check_like(v_cache, v_cache_, "v_cache");
+        check_like(cache_seqlens, cache_seqlens_, "cache_seqlens");
+        TORCH_CHECK(page_table_.has_value() == page_table_example_.defined(),
+                    "page_table must be passed to run if and only if the plan was built with one");
+        if (page_table_.has_value()) { check_like(page_table_.value(), page_table_example_, "page_table"); }
+        launch_.out = out_;
+        if (out_opt.has_value()) {
+            check_like(out_opt.value(), out_, "out");
+            launch_.out = out_opt.value();
+        }
+        Flash_fwd_params &params = launch_.params;
+        params.q_ptr = q.data_ptr();
+        params.k_ptr = k_cache.data_ptr();
+        params.v_ptr = v_cache.data_ptr();
+        params.o_ptr = launch_.out.data_ptr();
+        params.seqused_k = static_cast<int *>(cache_seqlens.data_ptr());
+        if (page_table_.has_value()) { params.page_table = page_table_.value().data_ptr<int>(); }
+        // The GPU computes the splits of each batch at every launch, the CPU engine from the lengths at the time
+        // of mha_fwd_setup, which are stale by now
+        if (params.arch == 0 && params.num_splits_dynamic_ptr != nullptr && !params.skip_scheduler_metadata_computation) {
+            auto [kBlockM, kBlockN] = tile_size_fwd_cpu(params.d, params.dv);
+            flash::prepare_varlen_num_blocks_host(flash::make_prepare_scheduler_args(params, params.pack_gqa, kBlockM, kBlockN),
+                                                  nullptr, params.num_splits_dynamic_ptr);
+        }
+        mha_fwd_launch(launch_);
+        return {launch_.out, launch_.softmax_lse};
+    }
+
+    int num_splits() const { return launch_.params.num_splits; }
+    bool pack_gqa() const { return launch_.params.pack_gqa; }
+    // Splits of each batch in the last run (or as set up), CPU only. Empty if the splits aren't chosen per batch.
+    std::vector<int> num_splits_dynamic() const {
+        Flash_fwd_params const &params = launch_.params;
+        if (params.arch != 0 || params.num_splits_dynamic_ptr == nullptr) { return {}; }
+        return std::vector<int>(params.num_splits_dynamic_ptr, params.num_splits_dynamic_ptr + params.b);
+    }
+
+private:
+    static void check_like(at::Tensor const& t, at::Tensor const& like, char const* name) {
+        TORCH_CHECK(t.scalar_type() == like.scalar_type() && t.device() == like.device()
+                    && t.sizes() == like.sizes() && t.strides() == like.strides(),
+                    name, " must have the same shape, strides, dtype and device as the one the plan was built with");
+    }
+
+    // The tensors the plan was built with, to check the ones passed to run
+    at::Tensor q_, k_cache_, v_cache_, cache_seqlens_, page_table_example_;
+    at::Tensor out_;
+    FwdLaunch launch_;
+};
+
+// Python side of flash::KVBlockManager: argument checks, and tensors in and out instead of arrays.
+// The page copies are returned as a (num_copies, 2) int64 CPU tensor of (src, dst) pages, for copy_kv_pages.
+
+static void check_sequences(flash::KVBlockManager const& manager, std::vector<int64_t> const& seq_ids) {
+    for (int64_t seq_id : seq_ids) { TORCH_CHECK(manager.has_sequence(seq_id), "Unknown sequence ", seq_id); }
+}
+
+static at::Tensor page_copies_tensor(std::vector<flash::PageCopy> const& copies) {
+    at::Tensor t = torch::empty({int64_t(copies.size()), 2}, at::kLong);
+    auto t_a = t.accessor<int64_t, 2>();
+    for (size_t i = 0; i < copies.size(); ++i) {
+        t_a[i][0] = copies[i].src;
+        t_a[i][1] = copies[i].dst;
+    }
+    return t;
+}
+
+int64_t kv_block_manager_add_sequence(flash::KVBlockManager &manager, std::vector<int> const& prefix_pages, int prefix_len) {
+    int const num_prefix_pages = prefix_pages.size();
+    TORCH_CHECK(prefix_len <= num_prefix_pages * manager.page_size() && prefix_len > (num_prefix_pages - 1) * manager.page_size(),
+                "prefix_len must fill the last of the prefix pages");
+    for (int page : prefix_pages) {
+        TORCH_CHECK(page >= 0 && page < manager.num_pages() && manager.refcount(page) > 0, "Prefix page ", page, " is not allocated");
+    }
+    return manager.add_sequence(prefix_pages, prefix_len);
+}
+
+int64_t kv_block_manager_fork(flash::KVBlockManager &manager, int64_t seq_id) {
+    check_sequences(manager, {seq_id});
+    return manager.fork(seq_id);
+}
+
+void kv_block_manager_free_sequence(flash::KVBlockManager &manager, int64_t seq_id) {
+    check_sequences(manager, {seq_id});
+    manager.free_sequence(seq_id);
+}
+
+at::Tensor kv_block_manager_append(flash::KVBlockManager &manager, int64_t seq_id, int num_tokens) {
+    check_sequences(manager, {seq_id});
+    TORCH_CHECK(num_tokens >= 0, "num_tokens must be non-negative");
+    std::vector<flash::PageCopy> copies;
+    TORCH_CHECK(manager.append(seq_id, num_tokens, &copies), "Out of KV cache pages: appending ", num_tokens,
+                " tokens needs ", manager.pages_needed(seq_id, num_tokens), " pages, ", manager.num_free_pages(), " are free");
+    return page_copies_tensor(copies);
+}
+
+at::Tensor kv_block_manager_append_batch(flash::KVBlockManager &manager, std::vector<int64_t> const& seq_ids, std::vector<int> const& num_tokens) {
+    check_sequences(manager, seq_ids);
+    TORCH_CHECK(seq_ids.size() == num_tokens.size(), "seq_ids and num_tokens must have the same length");
+    for (int n : num_tokens) { TORCH_CHECK(n >= 0, "num_tokens must be non-negative"); }
+    std::vector<flash::PageCopy> copies;
+    TORCH_CHECK(manager.append_batch(seq_ids, num_tokens, &copies), "Out of KV cache pages: ", manager.num_free_pages(),
+                " are free, not enough for the batch");
+    return page_copies_tensor(copies);
+}
+
+// page_table (num_seqs, max_pages_per_seq) and seqused_k (num_seqs), int32, for flash_attn_with_kvcache.
+// max_pages_per_seq <= 0 means the most pages any of these sequences has.
+std::vector<at::Tensor> kv_block_manager_page_table(flash::KVBlockManager const& manager, std::vector<int64_t> const& seq_ids,
+                                                    int max_pages_per_seq, std::optional<at::Device> device_) {
+    check_sequences(manager, seq_ids);
+    int const max_num_pages = manager.max_num_pages(seq_ids);
+    if (max_pages_per_seq <= 0) { max_pages_per_seq = std::max(max_num_pages, 1); }
+    TORCH_CHECK(max_num_pages <= max_pages_per_seq, "A sequence has ", max_num_pages, " pages, more than max_pages_per_seq = ", max_pages_per_seq);
+    at::Device const device = device_.value_or(at::kCPU);
+    // Filled on the host, then copied in one go without waiting for it
+    auto opts = torch::TensorOptions().dtype(at::kInt).pinned_memory(device.is_cuda());
+    int64_t const num_seqs = seq_ids.size();
+    at::Tensor page_table = torch::empty({num_seqs, max_pages_per_seq}, opts);
+    at::Tensor seqused_k = torch::empty({num_seqs}, opts);
+    manager.fill_page_table(seq_ids, max_pages_per_seq, page_table.data_ptr<int>(), seqused_k.data_ptr<int>());
+    if (!device.is_cpu()) {
+        page_table = page_table.to(device, /*non_blocking=*/true);
+        seqused_k = seqused_k.to(device, /*non_blocking=*/true);
+    }
+    return {page_table, seqused_k};
+}
+
+// Applies the page copies returned by KVBlockManager.append: page dst of k_cache / v_cache becomes a copy of page src
+void copy_kv_pages(at::Tensor &k_cache,  // (num_pages, page_size, h_k, d)
+                   at::Tensor &v_cache,  // (num_pages, page_size, h_k, dv)
+                   const at::Tensor &copies  // (num_copies, 2)
+                   ) {
+    TORCH_CHECK(copies.dim() == 2 && copies.size(1) == 2, "copies must have shape (num_copies, 2)");
+    TORCH_CHECK(k_cache.size(0) == v_cache.size(0), "k_cache and v_cache must have the same number of pages");
+    if (copies.size(0) == 0) { return; }
+    at::Tensor const src = copies.select(1, 0).to(k_cache.device(), at::kLong);
+    at::Tensor const dst = copies.select(1, 1).to(k_cache.device(), at::kLong);
+    k_cache.index_copy_(0, dst, k_cache.index_select(0, src));
+    v_cache.index_copy_(0, dst, v_cache.index_select(0, src));
+}
+
+// One step of compaction (kv_compaction.h): moves up to max_moves pages (all that are needed if max_moves <= 0) in
+// k_cache / v_cache and in the manager, and returns the moves. page_table() gives the new page tables afterwards.
+at::Tensor kv_block_manager_compact(flash::KVBlockManager &manager, at::Tensor &k_cache, at::Tensor &v_cache, int max_moves) {
+    TORCH_CHECK(k_cache.size(0) == manager.num_pages() && v_cache.size(0) == manager.num_pages(),
+                "k_cache and v_cache must have the manager's number of pages");
+    std::vector<flash::PageCopy> const moves = flash::plan_compaction(manager, max_moves);
+    // A move can read a page that an earlier one wrote (moving a page aside and then on), which one batched copy
+    // (all reads, then all writes) would get wrong, so such a move starts a new batch
+    std::vector<flash::PageCopy> batch;
+    std::unordered_set<int> written;
+    for (flash::PageCopy const& move : moves) {
+        if (written.count(move.src)) {
+            copy_kv_pages(k_cache, v_cache, page_copies_tensor(batch));
+            batch.clear();
+            written.clear();
+        }
+        batch.push_back(move);
+        written.insert(move.dst);
+    }
+    copy_kv_pages(k_cache, v_cache, page_copies_tensor(batch));
+    manager.move_pages(moves);
+    return page_copies_tensor(moves);
+}
+
+int kv_block_manager_num_page_breaks(flash::KVBlockManager const& manager) {
+    return flash::num_page_breaks(manager, manager.sequence_ids());
+}
+
+std::map<std::string, int64_t> tiered_kv_cache_stats(flash::TieredKVCache const& cache) {
+    flash::KVPageStore::Stats const& stats = cache.stats();
+    return {{"num_device_hits", stats.num_device_hits},
+            {"num_host_loads", stats.num_host_loads},
+            {"num_file_loads", stats.num_file_loads},
+            {"num_host_spills", stats.num_host_spills},
+            {"num_file_spills", stats.num_file_spills}};
+}
+
+std::map<std::string, int64_t> prefix_cache_stats(flash::PrefixCache const& cache) {
+    flash::PrefixCache::Stats const stats = cache.stats();
+    return {{"num_lookups", stats.num_lookups},
+            {"num_hits", stats.num_hits},
+            {"num_lookup_tokens", stats.num_lookup_tokens},
+            {"num_hit_tokens", stats.num_hit_tokens},
+            {"num_inserted_pages", stats.num_inserted_pages},
+            {"num_evicted_pages", stats.num_evicted_pages},
+            {"num_cached_pages", cache.num_cached_pages()}};
+}
+
+int prefix_cache_insert(flash::PrefixCache &cache, std::vector<int> const& tokens, std::vector<int> const& pages) {
+    flash::KVBlockManager const& manager = cache.manager();
+    for (int page : pages) {
+        TORCH_CHECK(page >= 0 && page < manager.num_pages() && manager.refcount(page) > 0, "Page ", page, " is not allocated");
+    }
+    return cache.insert(tokens, pages);
+}
+
+
 void run_mha_bwd(Flash_bwd_params &params, cudaStream_t stream) {
     #ifndef FLASHATTENTION_DISABLE_BACKWARD
         // FP16_SWITCH(!params.is_bf16, [&] {
@@ -1160,38 +1986,38 @@ void run_mha_bwd(Flash_bwd_params &params, cudaStream_t stream) {
             if (!params.is_bf16) {
                 #ifndef FLASHATTENTION_DISABLE_FP16
                 #ifndef FLASHATTENTION_DISABLE_HDIM64
-                if (params.d <= 64) { return run_mha_bwd_<Arch, cutlass::half_t, 64, Has_softcap>(params, stream); }
+                if (params.d <= 64) { return run_mha_bwd_if_compiled<Arch, cutlass::half_t, 64, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM96
-                if (params.d <= 96) { return run_mha_bwd_<Arch, cutlass::half_t, 96, Has_softcap>(params, stream); }
+                if (params.d <= 96) { return run_mha_bwd_if_compiled<Arch, cutlass::half_t, 96, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM128
-                if (params.d <= 128) { return run_mha_bwd_<Arch, cutlass::half_t, 128, Has_softcap>(params, stream); }
+                if (params.d <= 128) { return run_mha_bwd_if_compiled<Arch, cutlass::half_t, 128, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM192
-                if (params.d <= 192) { return run_mha_bwd_<Arch, cutlass::half_t, 192, Has_softcap>(params, stream); }
+                if (params.d <= 192) { return run_mha_bwd_if_compiled<Arch, cutlass::half_t, 192, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM256
-                if (params.d <= 256) { return run_mha_bwd_<Arch, cutlass::half_t, 256, Has_softcap>(params, stream); }
+                if (params.d <= 256) { return run_mha_bwd_if_compiled<Arch, cutlass::half_t, 256, Has_softcap>(params, stream); }
                 #endif
                 #else
                 TORCH_CHECK(false, "This flash attention build does not support FP16.");
                 #endif
             } else {
                 #ifndef FLASHATTENTION_DISABLE_HDIM64
-                if (params.d <= 64) { return run_mha_bwd_<Arch, cutlass::bfloat16_t, 64, Has_softcap>(params, stream); }
+                if (params.d <= 64) { return run_mha_bwd_if_compiled<Arch, cutlass::bfloat16_t, 64, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM96
-                if (params.d <= 96) { return run_mha_bwd_<Arch, cutlass::bfloat16_t, 96, Has_softcap>(params, stream); }
+                if (params.d <= 96) { return run_mha_bwd_if_compiled<Arch, cutlass::bfloat16_t, 96, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM128
-                if (params.d <= 128) { return run_mha_bwd_<Arch, cutlass::bfloat16_t, 128, Has_softcap>(params, stream); }
+                if (params.d <= 128) { return run_mha_bwd_if_compiled<Arch, cutlass::bfloat16_t, 128, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM192
-                if (params.d <= 192) { return run_mha_bwd_<Arch, cutlass::bfloat16_t, 192, Has_softcap>(params, stream); }
+                if (params.d <= 192) { return run_mha_bwd_if_compiled<Arch, cutlass::bfloat16_t, 192, Has_softcap>(params, stream); }
                 #endif
                 #ifndef FLASHATTENTION_DISABLE_HDIM256
-                if (params.d <= 256) { return run_mha_bwd_<Arch, cutlass::bfloat16_t, 256, Has_softcap>(params, stream); }
+                if (params.d <= 256) { return run_mha_bwd_if_compiled<Arch, cutlass::bfloat16_t, 256, Has_softcap>(params, stream); }
                 #endif
             }
         });
@@ -1227,6 +2053,8 @@ std::vector<at::Tensor> mha_bwd(
     int window_size_left,
     int window_size_right,
     float const softcap,
+    float const p_dropout,
+    std::optional<at::Tensor> &rng_state_,  // (2,), int64: dropout seed and offset returned by the forward pass
     bool const deterministic,
     int const sm_margin) {
 
@@ -1234,9 +2062,13 @@ std::vector<at::Tensor> mha_bwd(
         TORCH_CHECK(false, "This flash attention build does not support backward.");
     #endif
 
-    auto dprops = at::cuda::getCurrentDeviceProperties();
-    bool is_sm8x = dprops->major >= 8;
-    TORCH_CHECK(is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+    // CPU tensors are handled by the CPU engine (flash_bwd_kernel_cpu.h)
+    bool const is_cpu = q.is_cpu();
+    if (!is_cpu) {
+        auto dprops = at::cuda::getCurrentDeviceProperties();
+        bool is_sm8x = dprops->major >= 8;
+        TORCH_CHECK(is_sm8x, "FlashAttention only supports Ampere GPUs or newer.");
+    }
 
     auto q_type = q.dtype();
     TORCH_CHECK(q_type == torch::kFloat16 || q_type == torch::kBFloat16,
@@ -1246,8 +2078,9 @@ std::vector<at::Tensor> mha_bwd(
     TORCH_CHECK(out.dtype() == q_type, "query and out must have the same dtype");
     TORCH_CHECK(dout.dtype() == q_type, "query and dout must have the same dtype");
 
-    CHECK_DEVICE(q); CHECK_DEVICE(k); CHECK_DEVICE(v);
-    CHECK_DEVICE(out); CHECK_DEVICE(dout); CHECK_DEVICE(softmax_lse);
+    if (!is_cpu) { CHECK_DEVICE(q); }
+    CHECK_DEVICE_LIKE(k, q); CHECK_DEVICE_LIKE(v, q);
+    CHECK_DEVICE_LIKE(out, q); CHECK_DEVICE_LIKE(dout, q); CHECK_DEVICE_LIKE(softmax_lse, q);
 
     TORCH_CHECK(q.stride(-1) == 1, "Input tensor must have contiguous last dimension");
     TORCH_CHECK(k.stride(-1) == 1, "Input tensor must have contiguous last dimension");
@@ -1259,7 +2092,7 @@ std::vector<at::Tensor> mha_bwd(
     bool const is_varlen_q = cu_seqlens_q_.has_value();
     if (is_varlen_q) {
         cu_seqlens_q = cu_seqlens_q_.value();
-        CHECK_DEVICE(cu_seqlens_q); CHECK_CONTIGUOUS(cu_seqlens_q);
+        CHECK_DEVICE_LIKE(cu_seqlens_q, q); CHECK_CONTIGUOUS(cu_seqlens_q);
         TORCH_CHECK(cu_seqlens_q.dtype() == torch::kInt32, "cu_seqlens_q must have dtype torch.int32");
         TORCH_CHECK(max_seqlen_q_.has_value(), "max_seqlen_q must be provided if cu_seqlens_q is provided");
     }
@@ -1267,7 +2100,7 @@ std::vector<at::Tensor> mha_bwd(
     bool const is_varlen_k = cu_seqlens_k_.has_value();
     if (is_varlen_k) {
         cu_seqlens_k = cu_seqlens_k_.value();
-        CHECK_DEVICE(cu_seqlens_k); CHECK_CONTIGUOUS(cu_seqlens_k);
+        CHECK_DEVICE_LIKE(cu_seqlens_k, q); CHECK_CONTIGUOUS(cu_seqlens_k);
         TORCH_CHECK(cu_seqlens_k.dtype() == torch::kInt32, "cu_seqlens_k must have dtype torch.int32");
         TORCH_CHECK(max_seqlen_k_.has_value(), "max_seqlen_k must be provided if cu_seqlens_k is provided");
     }
@@ -1299,7 +2132,7 @@ std::vector<at::Tensor> mha_bwd(
     // If we don't have is_causal here matching params.is_causal, we might get the wrong kBlockM (and cause IMA).
     is_causal = window_size_left < 0 && window_size_right == 0;
 
-    int const arch = at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
+    int const arch = is_cpu ? 0 : at::cuda::getCurrentDeviceProperties()->major * 10 + at::cuda::getCurrentDeviceProperties()->minor;
     int const head_size_rounded = round_up_headdim(head_size);
     // Very important that these match the kernel configs
     bool const is_local = (window_size_left >= 0 || window_size_right >= 0) && !is_causal;
@@ -1309,7 +2142,8 @@ std::vector<at::Tensor> mha_bwd(
               : 64));
     int const kBlockM_sm80 = head_size_rounded <= 64 ? 128 : 64;
     int const kBlockM_sm86 = head_size_rounded <= 192 ? 64 : 32;
-    int const kBlockM = arch >= 90 ? kBlockM_sm90 : (arch == 86 || arch == 89 ? kBlockM_sm86 : kBlockM_sm80);
+    int const kBlockM_cpu = std::get<0>(tile_size_bwd_cpu(head_size));
+    int const kBlockM = is_cpu ? kBlockM_cpu : (arch >= 90 ? kBlockM_sm90 : (arch == 86 || arch == 89 ? kBlockM_sm86 : kBlockM_sm80));
     int const kBlockN_sm90 = head_size_rounded <= 128
         ? 128
         : (head_size_rounded <= 192 ? 96 : 80);
@@ -1320,7 +2154,8 @@ std::vector<at::Tensor> mha_bwd(
         : (head_size_rounded <= 96 ? 128
            : (head_size_rounded <= 128 ? 96
               : (head_size_rounded <= 192 ? 64 : 64)));
-    int const kBlockN = arch >= 90 ? kBlockN_sm90 : (arch == 86 || arch == 89 ? kBlockN_sm86 : kBlockN_sm80);
+    int const kBlockN_cpu = std::get<1>(tile_size_bwd_cpu(head_size));
+    int const kBlockN = is_cpu ? kBlockN_cpu : (arch >= 90 ? kBlockN_sm90 : (arch == 86 || arch == 89 ? kBlockN_sm86 : kBlockN_sm80));
     auto round_multiple = [](int x, int m) { return (x + m - 1) / m * m; };
     int const seqlen_q_rounded = round_multiple(seqlen_q, kBlockM);
     int const seqlen_k_rounded = round_multiple(seqlen_k, kBlockN);
@@ -1349,13 +2184,13 @@ std::vector<at::Tensor> mha_bwd(
     if (seqused_q_.has_value()){
         auto seqused_q = seqused_q_.value();
         TORCH_CHECK(seqused_q.dtype() == torch::kInt32, "seqused_q must have dtype int32");
-        CHECK_DEVICE(seqused_q); CHECK_CONTIGUOUS(seqused_q);
+        CHECK_DEVICE_LIKE(seqused_q, q); CHECK_CONTIGUOUS(seqused_q);
         CHECK_SHAPE(seqused_q, batch_size);
     }
     if (seqused_k_.has_value()){
         auto seqused_k = seqused_k_.value();
         TORCH_CHECK(seqused_k.dtype() == torch::kInt32, "seqused_k must have dtype int32");
-        CHECK_DEVICE(seqused_k); CHECK_CONTIGUOUS(seqused_k);
+        CHECK_DEVICE_LIKE(seqused_k, q); CHECK_CONTIGUOUS(seqused_k);
         CHECK_SHAPE(seqused_k, batch_size);
     }
 
@@ -1363,7 +2198,7 @@ std::vector<at::Tensor> mha_bwd(
     if (dq_.has_value()) {
         dq = dq_.value();
         TORCH_CHECK(dq.dtype() == q_type, "dq must have the same dtype as q");
-        CHECK_DEVICE(dq);
+        CHECK_DEVICE_LIKE(dq, q);
         TORCH_CHECK(dq.stride(-1) == 1, "dq must have contiguous last dimension");
         if (!is_varlen_q) {
             CHECK_SHAPE(dq, batch_size, seqlen_q, num_heads, head_size);
@@ -1376,7 +2211,7 @@ std::vector<at::Tensor> mha_bwd(
     if (dk_.has_value()) {
         dk = dk_.value();
         TORCH_CHECK(dk.dtype() == q_type, "dk must have the same dtype as q");
-        CHECK_DEVICE(dk);
+        CHECK_DEVICE_LIKE(dk, q);
         TORCH_CHECK(dk.stride(-1) == 1, "dk must have contiguous last dimension");
         if (!is_varlen_k) {
             CHECK_SHAPE(dk, batch_size, seqlen_k, num_heads_k, head_size);
@@ -1389,7 +2224,7 @@ std::vector<at::Tensor> mha_bwd(
     if (dv_.has_value()) {
         dv = dv_.value();
         TORCH_CHECK(dv.dtype() == q_type, "dv must have the same dtype as q");
-        CHECK_DEVICE(dv);
+        CHECK_DEVICE_LIKE(dv, q);
         TORCH_CHECK(dv.stride(-1) == 1, "dv must have contiguous last dimension");
         if (!is_varlen_k) {
             CHECK_SHAPE(dv, batch_size, seqlen_k, num_heads_k, head_size);
@@ -1402,7 +2237,8 @@ std::vector<at::Tensor> mha_bwd(
 
     // Otherwise the kernel will be launched from cuda:0 device
     // Cast to char to avoid compiler warning about narrowing
-    at::cuda::CUDAGuard device_guard{(char)q.get_device()};
+    at::cuda::OptionalCUDAGuard device_guard;
+    if (!is_cpu) { device_guard.set_index((char)q.get_device()); }
 
     auto opts = q.options();
     // Need softmax_d to have total_q_padded_rounded since we want its address to be aligned by 16/8 bytes for TMA / LDG.64
@@ -1421,7 +2257,8 @@ std::vector<at::Tensor> mha_bwd(
     } else {
         dq_accum = torch::empty({num_heads, total_q_padded_rounded * head_size_rounded}, opts.dtype(at::kFloat));
     }
-    if (num_heads_k != num_heads) {  // MQA / GQA
+    // The CPU engine reduces dK / dV over the query heads of a group directly, without dk_accum / dv_accum
+    if (num_heads_k != num_heads && !is_cpu) {  // MQA / GQA
         if (!is_varlen) {
             dk_accum = torch::zeros({batch_size, num_heads_k, seqlen_k_rounded * head_size_rounded}, opts.dtype(at::kFloat));
             dv_accum = torch::zeros({batch_size, num_heads_k, seqlen_k_rounded * head_size_rounded}, opts.dtype(at::kFloat));
@@ -1445,11 +2282,11 @@ std::vector<at::Tensor> mha_bwd(
                      seqused_q_.has_value() ? seqused_q_.value().data_ptr() : nullptr,
                      seqused_k_.has_value() ? seqused_k_.value().data_ptr() : nullptr,
                      dq_accum.data_ptr(),
-                     num_heads_k != num_heads ? dk_accum.data_ptr() : nullptr,
-                     num_heads_k != num_heads ? dv_accum.data_ptr() : nullptr,
+                     dk_accum.defined() ? dk_accum.data_ptr() : nullptr,
+                     dv_accum.defined() ? dv_accum.data_ptr() : nullptr,
                      softmax_lse.data_ptr(),
                      softmax_d.data_ptr(),
-                     /*p_dropout=*/0.f,
+                     p_dropout,
                      softmax_scale,
                      window_size_left,
                      window_size_right,
@@ -1461,13 +2298,22 @@ std::vector<at::Tensor> mha_bwd(
     params.total_k = total_k;
     params.softmax_lse_log2_ptr = softmax_lse_log2.data_ptr();
     params.dv = head_size;  // We don't support hdim_v being different from hdim_qk for now
+    at::Tensor rng_state;
+    if (p_dropout > 0.f) {
+        TORCH_CHECK(is_cpu, "Dropout is only supported by the CPU engine");
+        TORCH_CHECK(rng_state_.has_value(), "Dropout needs the rng_state returned by the forward pass");
+        rng_state = get_dropout_rng_state(rng_state_);
+        params.rng_state = reinterpret_cast<uint64_t*>(rng_state.data_ptr());
+    }
 
     // auto tile_count_semaphore = (params.is_causal || params.is_local) ? torch::zeros({1}, opts.dtype(torch::kInt32)) : torch::empty({1}, opts.dtype(torch::kInt32));
     // params.tile_count_semaphore = tile_count_semaphore.data_ptr<int>();
     // Will be zero'ed out in the backward preprocess kernel
-    at::Tensor dq_semaphore = torch::empty({(seqlen_q + kBlockM - 1) / kBlockM, batch_size, num_heads}, opts.dtype(torch::kInt32));
-    params.dq_semaphore = dq_semaphore.data_ptr<int>();
-    if (num_heads_k != num_heads && params.deterministic) {
+    if (!is_cpu) {
+        at::Tensor dq_semaphore = torch::empty({(seqlen_q + kBlockM - 1) / kBlockM, batch_size, num_heads}, opts.dtype(torch::kInt32));
+        params.dq_semaphore = dq_semaphore.data_ptr<int>();
+    }
+    if (num_heads_k != num_heads && params.deterministic && !is_cpu) {
         // TODO: do we need to zero them out?
         at::Tensor dk_semaphore = torch::empty({(seqlen_k + kBlockN - 1) / kBlockN, batch_size, num_heads_k}, opts.dtype(torch::kInt32));
         at::Tensor dv_semaphore = torch::empty({(seqlen_k + kBlockN - 1) / kBlockN, batch_size, num_heads_k}, opts.dtype(torch::kInt32));
@@ -1483,8 +2329,14 @@ std::vector<at::Tensor> mha_bwd(
     #endif
 
     if (total_q > 0 && total_k > 0 && num_heads_k > 0) {
-        auto stream = at::cuda::getCurrentCUDAStream().stream();
-        run_mha_bwd(params, stream);
+        if (is_cpu) {
+            #ifndef FLASHATTENTION_DISABLE_BACKWARD
+            run_mha_bwd_cpu(params);
+            #endif
+        } else {
+            auto stream = at::cuda::getCurrentCUDAStream().stream();
+            run_mha_bwd(params, stream);
+        }
     } else if (total_k > 0 && num_heads_k > 0) {
         // If seqlen_q == 0, then we have an empty tensor. We need to set the output to 0.
         dk.zero_();
@@ -1607,4 +2459,63 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.def("bwd", &mha_bwd, "Backward pass");
     m.def("fwd_combine", &mha_combine, "Combine partial attention outputs");
     m.def("get_scheduler_metadata", &mha_fwd_get_scheduler_metadata, "Get scheduler metadata for varlen forward pass");
+    m.def("load_tuning_table", &load_tuning_table, "Replace the tuning table for the forward pass, an empty path removes it");
+    m.def("workspace_arena_stats", &workspace_arena_stats, "Bytes and number of forward workspaces allocated, reused and cached");
+    m.def("empty_workspace_arena", &empty_workspace_arena, "Free the idle forward workspaces");
+    m.def("cpu_thread_stats", &cpu_thread_stats, "Tasks, steals, busy and wall time in ns of each thread of the CPU forward");
+    m.def("reset_cpu_thread_stats", &reset_cpu_thread_stats);
+    m.def("set_cpu_work_stealing", &set_cpu_work_stealing, "Work stealing between the threads of the CPU forward, or a static partition");
+    m.def("dropout_mask", &dropout_mask, "Dropout keep-mask for an rng_state (seed, offset), same as flash-attention 2 on GPU");
+    m.def("kernel_modules", &kernel_modules, "Lazily loaded kernel modules: (name, path, load time in ms, error)");
+    py::class_<IncrementalSchedulerMetadata>(m, "IncrementalSchedulerMetadata")
+        .def(py::init<int, int, int, int, int, int, int, at::ScalarType, const at::Tensor &,
+                      std::optional<const at::Tensor> &, std::optional<const at::Tensor> &, std::optional<const at::Tensor> &,
+                      std::optional<const at::Tensor> &, std::optional<const at::Tensor> &, std::optional<int>, int,
+                      bool, int, int, int, bool, int, std::optional<bool>, int>())
+        .def("advance", &IncrementalSchedulerMetadata::advance, "Grow every sequence by num_tokens and return the updated metadata")
+        .def_property_readonly("metadata", &IncrementalSchedulerMetadata::metadata)
+        .def_property_readonly("num_tokens_advanced", &IncrementalSchedulerMetadata::num_tokens_advanced);
+    py::class_<AttentionPlan>(m, "AttentionPlan")
+        .def(py::init<const at::Tensor &, const at::Tensor &, const at::Tensor &, const at::Tensor &,
+                      std::optional<const at::Tensor> &, float, bool, int, int, int, float, int, std::optional<bool>, int>())
+        .def("run", &AttentionPlan::run, "Forward pass with the plan's shapes and flags on these tensors")
+        .def_property_readonly("num_splits", &AttentionPlan::num_splits)
+        .def_property_readonly("pack_gqa", &AttentionPlan::pack_gqa)
+        .def_property_readonly("num_splits_dynamic", &AttentionPlan::num_splits_dynamic);
+    m.def("copy_kv_pages", &copy_kv_pages, "Copy the pages of the KV cache returned by KVBlockManager.append");
+    py::class_<flash::KVBlockManager>(m, "KVBlockManager")
+        .def(py::init<int, int>())
+        .def("add_sequence", &kv_block_manager_add_sequence, "New sequence sharing the first prefix_len tokens in these pages")
+        .def("fork", &kv_block_manager_fork, "New sequence sharing all the pages of this one")
+        .def("free_sequence", &kv_block_manager_free_sequence)
+        .def("append", &kv_block_manager_append, "Make room for num_tokens more tokens and return the page copies")
+        .def("append_batch", &kv_block_manager_append_batch, "append for each sequence, all or nothing")
+        .def("page_table", &kv_block_manager_page_table, "page_table and seqused_k for these sequences")
+        .def("compact", &kv_block_manager_compact, "Move up to max_moves pages so that each sequence's pages are consecutive")
+        .def("pages_needed", &flash::KVBlockManager::pages_needed, "Free pages that append would take")
+        .def("seqlen", &flash::KVBlockManager::seqlen)
+        .def("pages", &flash::KVBlockManager::pages)
+        .def("refcount", &flash::KVBlockManager::refcount)
+        .def_property_readonly("num_pages", &flash::KVBlockManager::num_pages)
+        .def_property_readonly("page_size", &flash::KVBlockManager::page_size)
+        .def_property_readonly("num_free_pages", &flash::KVBlockManager::num_free_pages)
+        .def_property_readonly("num_page_breaks", &kv_block_manager_num_page_breaks);
+    py::class_<flash::PrefixCache>(m, "PrefixCache")
+        .def(py::init<flash::KVBlockManager &, int>(), py::keep_alive<1, 2>())
+        .def("match", &flash::PrefixCache::match, "Cached pages of the longest prefix of the tokens, and their number of tokens")
+        .def("insert", &prefix_cache_insert, "Cache the full pages of a sequence with these tokens")
+        .def("evict", &flash::PrefixCache::evict, "Free up to num_pages pages that only the cache holds, least recently used first")
+        .def("clear", &flash::PrefixCache::clear)
+        .def("stats", &prefix_cache_stats)
+        .def_property_readonly("token_hit_rate", &flash::PrefixCache::token_hit_rate)
+        .def_property_readonly("num_cached_pages", &flash::PrefixCache::num_cached_pages)
+        .def_property_readonly("max_pages", &flash::PrefixCache::max_pages);
+    py::class_<flash::TieredKVCache>(m, "TieredKVCache")
+        .def(py::init<at::Tensor, at::Tensor, int, int, int, std::string const&>())
+        .def("prepare", &flash::TieredKVCache::prepare, "Bring the pages of this page table to the device and return the device page table")
+        .def("prefetch", &flash::TieredKVCache::prefetch, "Start bringing the pages of this page table to the device")
+        .def("discard", &flash::TieredKVCache::discard, "Forget these freed pages")
+        .def("tier", &flash::TieredKVCache::tier, "Where the page is: -1 nowhere yet, 0 device, 1 host, 2 spill file")
+        .def("stats", &tiered_kv_cache_stats)
+        .def_property_readonly("spill_path", &flash::TieredKVCache::spill_path);
 }
@@ -44,7 +44,12 @@ def _flash_attn_forward(
         causal,
         window_size=(-1, -1),
         attention_chunk=0,
+        tree_parents=None,
+        k_cache_scale=None,
+        v_cache_scale=None,
         softcap=0.0,
+        dropout_p=0.0,
+        rng_state=None,
         rotary_interleaved=True,
         scheduler_metadata=None,
         num_splits=1,
@@ -85,12 +90,17 @@ def _flash_attn_forward(
         q_descale,
         k_descale,
         v_descale,
+        tree_parents,
+        k_cache_scale,
+        v_cache_scale,
         softmax_scale,
         causal,
         window_size[0],
         window_size[1],
         attention_chunk,
         softcap,
+        dropout_p,
+        rng_state,
         rotary_interleaved,
         scheduler_metadata,
         num_splits,
@@ -122,6 +132,8 @@ def _flash_attn_backward(
         softcap=0.0,
         deterministic=False,
         sm_margin=0,
+        dropout_p=0.0,
+        rng_state=None,
 ):
     # dq, dk, dv are allocated by us so they should already be contiguous
     dout, q, k, v, out = [maybe_contiguous(x) for x in (dout, q, k, v, out)]
@@ -146,6 +158,8 @@ def _flash_attn_backward(
         window_size[0],
         window_size[1],
         softcap,
+        dropout_p,
+        rng_state,
         deterministic,
         sm_margin,
     )
@@ -264,11 +278,12 @@ class FlashAttnFunc(torch.autograd.Function):
         pack_gqa=None,
         deterministic=False,
         sm_margin=0,
+        dropout_p=0.0,
     ):
         if softmax_scale is None:
             softmax_scale = (q.shape[-1] + (qv.shape[-1] if qv is not None else 0)) ** (-0.5)
         # out, q, k, v, out_padded, softmax_lse = _flash_attn_forward(
-        out, softmax_lse, *rest = _flash_attn_forward(
+        out, softmax_lse, _, _, rng_state = _flash_attn_forward(
             q,
             k,
             v,
@@ -286,12 +301,14 @@ class FlashAttnFunc(torch.autograd.Function):
             window_size=window_size,
             attention_chunk=attention_chunk,
             softcap=softcap,
+            dropout_p=dropout_p,
             num_splits=num_splits,
             pack_gqa=pack_gqa,
             sm_margin=sm_margin,
         )
         # ctx.save_for_backward(q, k, v, out_padded, softmax_lse)
-        ctx.save_for_backward(q, k, v, out, softmax_lse)
+        # The backward recomputes the dropout mask from rng_state
+        ctx.save_for_backward(q, k, v, out, softmax_lse, rng_state)
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
         ctx.window_size = window_size
@@ -299,11 +316,12 @@ class FlashAttnFunc(torch.autograd.Function):
         ctx.softcap = softcap
         ctx.deterministic = deterministic
         ctx.sm_margin = sm_margin
+        ctx.dropout_p = dropout_p
         return out, softmax_lse
 
     @staticmethod
     def backward(ctx, dout, *args):
-        q, k, v, out, softmax_lse = ctx.saved_tensors
+        q, k, v, out, softmax_lse, rng_state = ctx.saved_tensors
         assert ctx.attention_chunk == 0, "FA3 backward does not support attention_chunk"
         dq, dk, dv = torch.empty_like(q), torch.empty_like(k), torch.empty_like(v)
         _flash_attn_backward(
@@ -325,11 +343,13 @@ class FlashAttnFunc(torch.autograd.Function):
             ctx.softcap,
             ctx.deterministic,
             ctx.sm_margin,
+            ctx.dropout_p,
+            rng_state,
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dk = dk[..., : dout.shape[-1]]
         dv = dv[..., : dout.shape[-1]]
-        return dq, dk, dv, None, None, None, None, None, None, None, None, None, None, None, None, None, None
+        return dq, dk, dv, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None
 
 
 class FlashAttnVarlenFunc(torch.autograd.Function):
@@ -357,11 +377,12 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
         pack_gqa=None,
         deterministic=False,
         sm_margin=0,
+        dropout_p=0.0,
     ):
         if softmax_scale is None:
             softmax_scale = (q.shape[-1] + (qv.shape[-1] if qv is not None else 0)) ** (-0.5)
         # out, q, k, v, out_padded, softmax_lse = _flash_attn_varlen_forward(
-        out, softmax_lse, *rest = _flash_attn_forward(
+        out, softmax_lse, _, _, rng_state = _flash_attn_forward(
             q,
             k,
             v,
@@ -383,12 +404,14 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
             window_size=window_size,
             attention_chunk=attention_chunk,
             softcap=softcap,
+            dropout_p=dropout_p,
             num_splits=num_splits,
             pack_gqa=pack_gqa,
             sm_margin=sm_margin,
         )
         # ctx.save_for_backward(q, k, v, out_padded, softmax_lse, cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k)
-        ctx.save_for_backward(q, k, v, out, softmax_lse, cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k)
+        # The backward recomputes the dropout mask from rng_state
+        ctx.save_for_backward(q, k, v, out, softmax_lse, cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k, rng_state)
         ctx.max_seqlen_q = max_seqlen_q
         ctx.max_seqlen_k = max_seqlen_k
         ctx.softmax_scale = softmax_scale
@@ -398,11 +421,12 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
         ctx.softcap = softcap
         ctx.deterministic = deterministic
         ctx.sm_margin = sm_margin
+        ctx.dropout_p = dropout_p
         return out, softmax_lse
 
     @staticmethod
     def backward(ctx, dout, *args):
-        q, k, v, out, softmax_lse, cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k = ctx.saved_tensors
+        q, k, v, out, softmax_lse, cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k, rng_state = ctx.saved_tensors
         assert ctx.attention_chunk == 0, "FA3 backward does not support attention_chunk"
         dq, dk, dv = torch.empty_like(q), torch.empty_like(k), torch.empty_like(v)
         _flash_attn_backward(
@@ -427,6 +451,8 @@ class FlashAttnVarlenFunc(torch.autograd.Function):
             ctx.softcap,
             ctx.deterministic,
             ctx.sm_margin,
+            ctx.dropout_p,
+            rng_state,
         )
         dq = dq[..., : dout.shape[-1]]  # We could have padded the head dimension
         dk = dk[..., : dout.shape[-1]]
@@ -507,6 +533,7 @@ def flash_attn_func(
     pack_gqa=None,
     deterministic=False,
     sm_margin=0,
+    dropout_p=0.0,
 ):
     """dropout_p should be set to 0.0 during evaluation
     Supports multi-query and grouped-query attention (MQA/GQA) by passing in KV with fewer heads
@@ -534,7 +561,8 @@ def flash_attn_func(
         q: (batch_size, seqlen, nheads, headdim)
         k: (batch_size, seqlen, nheads_k, headdim)
         v: (batch_size, seqlen, nheads_k, headdim)
-        dropout_p: float. Dropout probability.
+        dropout_p: float. Dropout probability. Only supported on CPU, with the same masks as flash-attention 2 on
+            GPU for the same seed and offset (see flash_attn_3_cuda.dropout_mask).
         softmax_scale: float. The scaling of QK^T before applying softmax.
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
@@ -568,6 +596,7 @@ def flash_attn_func(
         pack_gqa,
         deterministic,
         sm_margin,
+        dropout_p,
     )
 
 
@@ -592,7 +621,11 @@ def flash_attn_varlen_func(
     pack_gqa=None,
     deterministic=False,
     sm_margin=0,
+    dropout_p=0.0,
 ):
+    """dropout_p should be set to 0.0 during evaluation. As in flash_attn_func, dropout is only supported on CPU,
+    and the mask of each sequence is that of the same batch index in flash_attn_func.
+    """
     return FlashAttnVarlenFunc.apply(
         q,
         k,
@@ -614,6 +647,7 @@ def flash_attn_varlen_func(
         pack_gqa,
         deterministic,
         sm_margin,
+        dropout_p,
     )
 
 
@@ -641,10 +675,13 @@ def flash_attn_with_kvcache(
     q_descale: Optional[torch.Tensor] = None,
     k_descale: Optional[torch.Tensor] = None,
     v_descale: Optional[torch.Tensor] = None,
+    k_cache_scale: Optional[torch.Tensor] = None,
+    v_cache_scale: Optional[torch.Tensor] = None,
     softmax_scale=None,
     causal=False,
     window_size=(-1, -1),  # -1 means infinite context window
     attention_chunk=0,
+    tree_parents: Optional[torch.Tensor] = None,
     softcap=0.0, # 0.0 means deactivated
     rotary_interleaved=True,
     scheduler_metadata=None,
@@ -693,6 +730,24 @@ def flash_attn_with_kvcache(
     will only attend to keys between
     [i + seqlen_k - seqlen_q - window_size[0], i + seqlen_k - seqlen_q + window_size[1]] inclusive.
 
+    If tree_parents is not None (with causal=True), the last tree_size queries and the last tree_size keys are the
+    nodes of a draft tree, as in tree-based speculative decoding: a node attends to the keys before the tree, to its
+    ancestors and to itself, so that all the branches of the draft are verified in one call. For example, with
+    tree_parents = [-1, 0, 0, 1] (two candidates for the 2nd token, and a 3rd token after the first of them), the mask
+    over the tree's keys is:
+        1 0 0 0
+        1 1 0 0
+        1 0 1 0
+        1 1 0 1
+
+    On CPU, k_cache / v_cache can be quantized (see quantize_kv): int8, or int4 packed two per byte along the
+    headdim (dtype torch.uint8, last dim headdim / 2), with one float32 scale per token and head in k_cache_scale /
+    v_cache_scale. Appended k / v are quantized as they are written, and the cache is dequantized as it is read.
+    The scales are paged along with the cache, so the page_table, copy_kv_pages and KVBlockManager work the same:
+        k_cache, k_cache_scale = quantize_kv(k_cache, bits=4)  # (num_blocks, page_block_size, nheads_k, headdim / 2)
+        out = flash_attn_with_kvcache(q, k_cache, v_cache, k, v, k_cache_scale=k_cache_scale,
+                                      v_cache_scale=v_cache_scale, cache_seqlens=cache_seqlens, page_table=page_table)
+
     Note: Does not support backward pass.
 
     Arguments:
@@ -721,6 +776,12 @@ def flash_attn_with_kvcache(
             Default to 1 / sqrt(headdim).
         causal: bool. Whether to apply causal attention mask (e.g., for auto-regressive modeling).
         window_size: (left, right). If not (-1, -1), implements sliding window local attention.
+        tree_parents [optional]: (tree_size,) or (batch_size, tree_size), dtype torch.int32, tree_size <= 64.
+            The parent of each node of the draft tree, -1 for a child of the last token before the tree.
+            Parents must come before their children. This is checked on every device; on GPU by a device-side
+            assert, so an invalid tree surfaces as a CUDA error at the next synchronization.
+        k_cache_scale [optional]: k_cache.shape[:-1], dtype torch.float32, if k_cache is int8 or int4 (torch.uint8).
+        v_cache_scale [optional]: v_cache.shape[:-1], dtype torch.float32. Similar to k_cache_scale.
         softcap: float. Anything > 0 activates softcapping attention.
         rotary_interleaved: bool. Only applicable if rotary_cos and rotary_sin are passed in.
             If True, rotary embedding will combine dimensions 0 & 1, 2 & 3, etc. If False,
@@ -773,6 +834,9 @@ def flash_attn_with_kvcache(
         causal=causal,
         window_size=window_size,
         attention_chunk=attention_chunk,
+        tree_parents=tree_parents,
+        k_cache_scale=k_cache_scale,
+        v_cache_scale=v_cache_scale,
         softcap=softcap,
         rotary_interleaved=rotary_interleaved,
         scheduler_metadata=scheduler_metadata,
@@ -825,3 +889,179 @@ def get_scheduler_metadata(
         sm_margin,
     )
     return scheduler_metadata
+
+
+def get_incremental_scheduler_metadata(
+    batch_size, max_seqlen_q, max_seqlen_k, num_heads_q, num_heads_kv, headdim,
+    cache_seqlens: torch.Tensor,
+    qkv_dtype=torch.bfloat16,
+    headdim_v=None,
+    cu_seqlens_q: Optional[torch.Tensor] = None,
+    cu_seqlens_k_new: Optional[torch.Tensor] = None,
+    cache_leftpad: Optional[torch.Tensor] = None,
+    page_size: Optional[int] = None,
+    max_seqlen_k_new=0,
+    causal=False,
+    window_size=(-1, -1),  # -1 means infinite context window
+    attention_chunk=0,
+    has_softcap=False,
+    num_splits=0,    # Can be tuned for speed
+    pack_gqa=None,   # Can be tuned for speed
+    sm_margin=0,     # Can be tuned if some SMs are used for communication
+):
+    """Same as get_scheduler_metadata, but returns an object that keeps the metadata up to date
+    across decode steps: call .advance(num_tokens) after every sequence has grown by num_tokens
+    (e.g. after cache_seqlens += 1), and pass .metadata as scheduler_metadata. Only the split counts
+    of the sequences that cross a block boundary are recomputed, on the host, and the metadata is
+    copied to the GPU only when it changes.
+    max_seqlen_k should be the longest the sequences will get, since the number of splits, pack_gqa and the
+    tile size are chosen from it once.
+    """
+    cache_seqlens = maybe_contiguous(cache_seqlens)
+    if headdim_v is None:
+        headdim_v = headdim
+    return flash_attn_3_cuda.IncrementalSchedulerMetadata(
+        batch_size, max_seqlen_q, max_seqlen_k, num_heads_q, num_heads_kv, headdim, headdim_v,
+        qkv_dtype,
+        cache_seqlens,
+        cu_seqlens_q,
+        None,  # cu_seqlens_k
+        cu_seqlens_k_new,
+        None,  # seqused_q
+        cache_leftpad,
+        page_size,
+        max_seqlen_k_new,
+        causal,
+        window_size[0], window_size[1],
+        attention_chunk,
+        has_softcap,
+        num_splits,
+        pack_gqa,
+        sm_margin,
+    )
+
+
+def get_attention_plan(
+    q,
+    k_cache,
+    v_cache,
+    cache_seqlens: torch.Tensor,
+    page_table: Optional[torch.Tensor] = None,
+    softmax_scale=None,
+    causal=False,
+    window_size=(-1, -1),  # -1 means infinite context window
+    attention_chunk=0,
+    softcap=0.0, # 0.0 means deactivated
+    num_splits=0,    # Can be tuned for speed
+    pack_gqa=None,   # Can be tuned for speed
+    sm_margin=0,     # Can be tuned if some SMs are used for communication
+):
+    """Sets up flash_attn_with_kvcache (without appending to the cache) once for these shapes and flags,
+    so that each decode step only has to launch the kernels:
+        plan = get_attention_plan(q, k_cache, v_cache, cache_seqlens, causal=True)
+        for step in ...:
+            out, softmax_lse = plan.run(q, k_cache, v_cache, cache_seqlens, page_table, None)
+    run() takes tensors with the same shapes, strides, dtype and device as the ones given here (typically the
+    same tensors, updated in place). The returned softmax_lse, and out unless an output tensor is passed as the last
+    argument, belong to the plan and are overwritten by the next run.
+    """
+    assert k_cache.stride(-1) == 1, "k_cache must have contiguous last dimension"
+    assert v_cache.stride(-1) == 1, "v_cache must have contiguous last dimension"
+    if softmax_scale is None:
+        softmax_scale = q.shape[-1] ** (-0.5)
+    return flash_attn_3_cuda.AttentionPlan(
+        q,
+        k_cache,
+        v_cache,
+        maybe_contiguous(cache_seqlens),
+        page_table,
+        softmax_scale,
+        causal,
+        window_size[0], window_size[1],
+        attention_chunk,
+        softcap,
+        num_splits,
+        pack_gqa,
+        sm_margin,
+    )
+
+
+def get_kv_block_manager(num_pages, page_size):
+    """Allocator for the pages of a paged KV cache (k_cache / v_cache of shape (num_pages, page_size, nheads_k, d)),
+    with reference-counted pages shared between forked sequences:
+        manager = get_kv_block_manager(num_pages, page_size)
+        seq = manager.add_sequence([], 0)
+        beams = [manager.fork(seq) for _ in range(4)]
+        copy_kv_pages(k_cache, v_cache, manager.append_batch(beams, [1] * 4))
+        page_table, cache_seqlens = manager.page_table(beams, 0, k_cache.device)
+    append and append_batch raise if there are not enough free pages. They return the (src, dst) pages to copy
+    before writing the new tokens, when a partial last page shared with other sequences is copied on write.
+    cache_seqlens already counts the appended tokens, as seqused_k.
+    Between decode steps, manager.compact(k_cache, v_cache, max_moves) moves up to max_moves pages (0 for no limit)
+    so that each sequence's pages become consecutive; page_table() then returns the new page tables.
+    """
+    return flash_attn_3_cuda.KVBlockManager(num_pages, page_size)
+
+
+def copy_kv_pages(k_cache, v_cache, copies):
+    """Copies page src to page dst of k_cache and v_cache, in place, for each row (src, dst) of copies.
+    For a quantized cache, call it on k_cache_scale / v_cache_scale too."""
+    flash_attn_3_cuda.copy_kv_pages(k_cache, v_cache, copies)
+
+
+def quantize_kv(x, bits=8):
+    """Quantizes a KV cache x (..., headdim) for flash_attn_with_kvcache on CPU, with one scale per row of headdim
+    values: x ~= scale * q. Returns (q, scale), q int8 in [-127, 127] for bits=8, or for bits=4 int4 in [-7, 7] packed
+    two per byte (element 2i in the low nibble of byte i) as torch.uint8 of last dim headdim / 2, and scale float32
+    of shape x.shape[:-1]."""
+    assert bits in (4, 8), "bits must be 4 or 8"
+    qmax = 127 if bits == 8 else 7
+    x = x.float()
+    scale = x.abs().amax(dim=-1) / qmax
+    q = torch.where(scale[..., None] > 0, x / scale[..., None], torch.zeros_like(x)).round().clamp(-qmax, qmax)
+    q = q.to(torch.int8)
+    if bits == 4:
+        q = ((q[..., 0::2] & 0xF) | (q[..., 1::2] << 4)).view(torch.uint8)
+    return q, scale
+
+
+def dequantize_kv(q, scale, bits=8, dtype=torch.float32):
+    """Inverse of quantize_kv."""
+    if bits == 4:
+        q = q.view(torch.int8)
+        # Sign-extend each nibble
+        q = torch.stack([(q << 4) >> 4, q >> 4], dim=-1).flatten(-2)
+    return (q.float() * scale[..., None]).to(dtype)
+
+
+def get_prefix_cache(kv_block_manager, max_pages):
+    """Cache of the KV pages of token prefixes, on top of a KVBlockManager, holding at most max_pages pages
+    (least recently used first out). A request only prefills the tokens after its longest cached prefix:
+        pages, num_cached = cache.match(tokens)
+        seq = manager.add_sequence(pages, num_cached)
+        manager.append(seq, len(tokens) - num_cached)
+        page_table, seqused_k = manager.page_table([seq], 0, device)
+        out = flash_attn_with_kvcache(q[:, num_cached:], k_cache, v_cache, k_new, v_new,
+                                      cache_seqlens=seqused_k - (len(tokens) - num_cached), page_table=page_table, causal=True)
+        cache.insert(tokens, manager.pages(seq))
+    Cached pages stay allocated while cached; cache.evict(n) frees up to n of them for the manager when it runs out.
+    cache.stats() and cache.token_hit_rate count the lookups and reused tokens.
+    """
+    return flash_attn_3_cuda.PrefixCache(kv_block_manager, max_pages)
+
+
+def get_tiered_kv_cache(k_cache, v_cache, num_pages, num_host_pages, num_file_pages=0, spill_path=None):
+    """Paged KV cache of num_pages logical pages, more than the device pool k_cache / v_cache
+    (num_device_pages, page_size, nheads_k, d) holds: the least recently used pages are spilled to num_host_pages
+    pages of pinned host memory, and from there to num_file_pages pages of a memory-mapped file at spill_path.
+    The tiers together need more pages than are in use. The page tables (e.g. from a KVBlockManager of num_pages pages)
+    hold logical pages, which prepare() brings to the device pool:
+        page_table, seqused_k = manager.page_table(seqs, 0, None)  # On the CPU
+        device_page_table = tiered.prepare(page_table, seqused_k)
+        tiered.prefetch(next_page_table, next_seqused_k)  # Overlaps with this step
+        out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, cache_seqlens=seqused_k - seqlen_new,
+                                      page_table=device_page_table)
+    seqused_k counts the tokens about to be appended, so that their pages are brought in too. Call
+    tiered.discard(pages) with the pages freed by the manager, so that they are not spilled anymore.
+    """
+    return flash_attn_3_cuda.TieredKVCache(k_cache, v_cache, num_pages, num_host_pages, num_file_pages, spill_path or "")
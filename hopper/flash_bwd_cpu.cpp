@@ -0,0 +1,21 @@
+// Copyright (c) 2024, Tri Dao.
+// CPU backward engine, see flash_fwd_cpu.cpp.
+
+#include "flash.h"
+#include "tile_size.h"
+#include "flash_bwd_kernel_cpu.h"
+
+template <typename Element>
+void run_mha_bwd_cpu_(Flash_bwd_params &params) {
+    auto [kBlockM, kBlockN] = tile_size_bwd_cpu(params.d);
+    flash::cpu::FlashAttnBwdCpu<Element> attn(params, kBlockM, kBlockN);
+    attn.run(params.num_sm);
+}
+
+void run_mha_bwd_cpu(Flash_bwd_params &params) {
+    if (params.is_bf16) {
+        run_mha_bwd_cpu_<flash::cpu::bfloat16_t>(params);
+    } else {
+        run_mha_bwd_cpu_<flash::cpu::half_t>(params);
+    }
+}
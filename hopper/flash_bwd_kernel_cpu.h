@@ -0,0 +1,330 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+#include "flash.h"
+#include "utils_cpu.h"
+#include "flash_fwd_kernel_cpu.h"
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Backward pass with the same structure as the GPU kernels:
+// 1. Preprocess (flash_bwd_preprocess_kernel.h): dPsum = rowsum(dO * O), LSE_log2 = LSE * log2(e), zero dQaccum.
+// 2. Mainloop over (batch, kv head, n_block): recompute P from LSE, compute dP / dS per tile, accumulate
+//    dK / dV for the n_block in registers (here: per-thread scratch) and dQ into the fp32 dQaccum buffer.
+// 3. Postprocess (flash_bwd_postprocess_kernel.h): dQ = dQaccum * softmax_scale, converted to Element.
+// With GQA, each task loops over all query heads of its kv head, so dK / dV don't need dk_accum / dv_accum.
+// Without `deterministic`, dQ tiles are added to dQaccum under a lock (the analog of the GPU atomicAdd),
+// so the summation order depends on scheduling. With `deterministic`, dQ is instead computed in a
+// separate pass over (batch, head, m_block) that owns its rows of dQaccum.
+// With dropout, each tile recomputes the keep-mask Z of the forward (DropoutCpu) instead of reading it back:
+// dV += (P * Z * rp_dropout)^T dO and dS = P * (dP * Z * rp_dropout - dPsum).
+template <typename Element>
+class FlashAttnBwdCpu {
+
+public:
+
+    static constexpr float kLog2e = 1.4426950408889634f;
+
+    FlashAttnBwdCpu(Flash_bwd_params const& params, int const kBlockM, int const kBlockN)
+        : params(params), kBlockM(kBlockM), kBlockN(kBlockN)
+        , qhead_per_khead(params.h / params.h_k)
+        , num_m_blocks((params.seqlen_q + kBlockM - 1) / kBlockM)
+        , num_n_blocks((params.seqlen_k + kBlockN - 1) / kBlockN)
+        , softmax_scale_log2(params.softcap > 0.f ? params.softcap * kLog2e : params.scale_softmax * kLog2e)
+        , softcap_val(params.softcap > 0.f ? params.scale_softmax / params.softcap : 0.f)
+        , is_dropout(params.p_dropout < 1.f)
+        , total_q_padded_rounded((params.total_q + params.b * kBlockM + kBlockM - 1) / kBlockM * kBlockM)
+        , dq_locks(kNumLocks) {}
+
+    struct Scratch {
+        std::vector<float> q, k, v, dout, s, dp, dq, dk, dv, lse_log2, dpsum;
+        std::vector<uint8_t> keep;  // Dropout keep-mask of the tile
+    };
+
+    void run(int const num_threads) {
+        int const nthreads = std::max(1, num_threads);
+        std::vector<Scratch> scratch(nthreads);
+        for (auto& s : scratch) { init_scratch(s); }
+        auto& pool = ThreadPool::get();
+        pool.parallel_for(params.b * params.h * num_m_blocks, nthreads, [&](int const idx, int) {
+            preprocess(idx / (params.h * num_m_blocks), (idx / num_m_blocks) % params.h, idx % num_m_blocks);
+        });
+        pool.parallel_for(params.b * params.h_k * num_n_blocks, nthreads, [&](int const idx, int const thread_idx) {
+            // Longest first: with the causal mask aligned to the bottom right, n_block is seen by the m_blocks from
+            // (n_block * kBlockN - (seqlen_k - seqlen_q)) / kBlockM on, so the low n_blocks have the most work.
+            // n_block is outermost so that this holds across all (batch, kv head), not just within each one.
+            int const n_block = idx / (params.b * params.h_k);
+            int const bidh_kv = idx % params.h_k;
+            int const bidb = (idx / params.h_k) % params.b;
+            compute_dkdv(bidb, bidh_kv, n_block, scratch[thread_idx], !params.deterministic /*accumulate_dq*/);
+        });
+        if (params.deterministic) {
+            pool.parallel_for(params.b * params.h * num_m_blocks, nthreads, [&](int const idx, int const thread_idx) {
+                compute_dq(idx / (params.h * num_m_blocks), (idx / num_m_blocks) % params.h, idx % num_m_blocks, scratch[thread_idx]);
+            });
+        }
+        pool.parallel_for(params.b * params.h * num_m_blocks, nthreads, [&](int const idx, int) {
+            postprocess(idx / (params.h * num_m_blocks), (idx / num_m_blocks) % params.h, idx % num_m_blocks);
+        });
+    }
+
+private:
+
+    using index_t = Flash_bwd_params::index_t;
+    static constexpr int kNumLocks = 1024;
+
+    void init_scratch(Scratch& s) const {
+        int const d = params.d, dv = params.dv;
+        s.q.resize(kBlockM * d);
+        s.dout.resize(kBlockM * dv);
+        s.k.resize(kBlockN * d);
+        s.v.resize(kBlockN * dv);
+        s.s.resize(kBlockM * kBlockN);
+        s.dp.resize(kBlockM * kBlockN);
+        s.dq.resize(kBlockM * d);
+        s.dk.resize(kBlockN * d);
+        s.dv.resize(kBlockN * dv);
+        s.lse_log2.resize(kBlockM);
+        s.dpsum.resize(kBlockM);
+        if (is_dropout) { s.keep.resize(kBlockM * kBlockN); }
+    }
+
+    // Offsets into dPsum / LSE_log2 / dQaccum. If varlen, each sequence is padded by kBlockM (see SeqlenInfoQK).
+    index_t offset_q_padded(int const bidb) const {
+        return params.cu_seqlens_q ? (params.cu_seqlens_q[bidb] + bidb * kBlockM) / kBlockM * kBlockM : 0;
+    }
+    index_t seqlen_q_rounded() const { return params.cu_seqlens_q ? total_q_padded_rounded : params.seqlen_q_rounded; }
+    index_t rowvec_offset(int const bidb, int const bidh) const {
+        return (params.cu_seqlens_q ? 0 : index_t(bidb) * params.h * params.seqlen_q_rounded)
+            + bidh * seqlen_q_rounded() + offset_q_padded(bidb);
+    }
+    float* dq_accum_ptr(int const bidb, int const bidh) const {
+        return static_cast<float*>(params.dq_accum_ptr)
+            + (params.cu_seqlens_q ? 0 : index_t(bidb) * params.h * params.seqlen_q_rounded * params.d_rounded)
+            + (bidh * seqlen_q_rounded() + offset_q_padded(bidb)) * params.d_rounded;
+    }
+    index_t q_offset(SeqlenInfoCpu const& seqlen_info, int const bidb, int const bidh, index_t const batch_stride,
+                     index_t const row_stride, index_t const head_stride) const {
+        return (params.cu_seqlens_q ? index_t(seqlen_info.offset_q) * row_stride : bidb * batch_stride) + bidh * head_stride;
+    }
+    float const* lse_ptr(SeqlenInfoCpu const& seqlen_info, int const bidb, int const bidh) const {
+        return static_cast<float const*>(params.softmax_lse_ptr) + (params.cu_seqlens_q
+            ? index_t(bidh) * params.total_q + seqlen_info.offset_q
+            : (index_t(bidb) * params.h + bidh) * params.seqlen_q);
+    }
+
+    void preprocess(int const bidb, int const bidh, int const m_block) const {
+        SeqlenInfoCpu const seqlen_info(params, bidb);
+        int const m_start = m_block * kBlockM;
+        int const seqlen_rounded = (seqlen_info.seqlen_q + kBlockM - 1) / kBlockM * kBlockM;
+        if (m_start >= seqlen_rounded) { return; }
+        int const rows = std::min(kBlockM, seqlen_info.seqlen_q - m_start);
+        int const dv = params.dv;
+        Element const* o_ptr = static_cast<Element const*>(params.o_ptr)
+            + q_offset(seqlen_info, bidb, bidh, params.o_batch_stride, params.o_row_stride, params.o_head_stride);
+        Element const* do_ptr = static_cast<Element const*>(params.do_ptr)
+            + q_offset(seqlen_info, bidb, bidh, params.do_batch_stride, params.do_row_stride, params.do_head_stride);
+        float const* lse = lse_ptr(seqlen_info, bidb, bidh);
+        float* dpsum = static_cast<float*>(params.dsoftmax_sum) + rowvec_offset(bidb, bidh);
+        float* lse_log2 = static_cast<float*>(params.softmax_lse_log2_ptr) + rowvec_offset(bidb, bidh);
+        std::vector<float> o_row(dv), do_row(dv);
+        for (int i = 0; i < kBlockM; ++i) {
+            int const m = m_start + i;
+            if (i < rows) {
+                load_row(o_ptr + m * params.o_row_stride, o_row.data(), dv);
+                load_row(do_ptr + m * params.do_row_stride, do_row.data(), dv);
+                dpsum[m] = dot(o_row.data(), do_row.data(), dv);
+                lse_log2[m] = lse[m] == -INFINITY ? 0.f : lse[m] * kLog2e;
+            } else {
+                dpsum[m] = 0.f;
+                lse_log2[m] = 0.f;
+            }
+        }
+        float* dq_accum = dq_accum_ptr(bidb, bidh) + index_t(m_start) * params.d_rounded;
+        std::fill_n(dq_accum, index_t(kBlockM) * params.d_rounded, 0.f);
+    }
+
+    // Recompute P and compute dS for one (m_block, n_block) tile. K and V must already be in scratch.
+    // Returns false if the whole tile is masked out.
+    bool compute_ds(SeqlenInfoCpu const& seqlen_info, MaskCpu const& mask, int const bidb, int const bidh,
+                    int const m_start, int const rows, int const n_start, int const cols, Scratch& scratch) const {
+        int const d = params.d, dv = params.dv;
+        // The visible columns are non-decreasing in the row index, so checking the first and last rows is enough
+        int col_min_first, col_max_first, col_min_last, col_max_last;
+        mask.col_limits(m_start, col_min_first, col_max_first);
+        mask.col_limits(m_start + rows - 1, col_min_last, col_max_last);
+        if (col_max_last <= n_start || col_min_first >= n_start + cols) { return false; }
+        Element const* q_ptr = static_cast<Element const*>(params.q_ptr)
+            + q_offset(seqlen_info, bidb, bidh, params.q_batch_stride, params.q_row_stride, params.q_head_stride);
+        Element const* do_ptr = static_cast<Element const*>(params.do_ptr)
+            + q_offset(seqlen_info, bidb, bidh, params.do_batch_stride, params.do_row_stride, params.do_head_stride);
+        float const* lse_log2 = static_cast<float const*>(params.softmax_lse_log2_ptr) + rowvec_offset(bidb, bidh);
+        float const* dpsum = static_cast<float const*>(params.dsoftmax_sum) + rowvec_offset(bidb, bidh);
+        for (int i = 0; i < rows; ++i) {
+            int const m = m_start + i;
+            load_row(q_ptr + m * params.q_row_stride, scratch.q.data() + i * d, d);
+            load_row(do_ptr + m * params.do_row_stride, scratch.dout.data() + i * dv, dv);
+            scratch.lse_log2[i] = lse_log2[m];
+            scratch.dpsum[i] = dpsum[m];
+        }
+        if (is_dropout) {
+            DropoutCpu const dropout(params.rng_state[0], params.rng_state[1], params.p_dropout_in_uint8_t, bidb, bidh, params.h);
+            dropout.keep_mask(m_start, rows, n_start, cols, scratch.keep.data(), kBlockN);
+        }
+        for (int i = 0; i < rows; ++i) {
+            float* s_row = scratch.s.data() + i * kBlockN;  // Holds P, or P * Z * rp_dropout with dropout
+            float* dp_row = scratch.dp.data() + i * kBlockN;  // Holds dS
+            float const* q_row = scratch.q.data() + i * d;
+            float const* do_row = scratch.dout.data() + i * dv;
+            for (int j = 0; j < cols; ++j) { s_row[j] = dot(q_row, scratch.k.data() + j * d, d); }
+            if (params.softcap > 0.f) {
+                apply_softcap(s_row, softcap_val, cols);
+                // dtanh needs to happen before masking, otherwise we get 1 - (-inf)^2 = NaN
+                for (int j = 0; j < cols; ++j) { dp_row[j] = 1.f - s_row[j] * s_row[j]; }
+            }
+            mask.apply(s_row, m_start + i, n_start, cols);
+            // P = exp2(S * scale_log2 - LSE_log2)
+            scale_apply_exp2(s_row, softmax_scale_log2, scratch.lse_log2[i], cols);
+            uint8_t const* keep_row = is_dropout ? scratch.keep.data() + i * kBlockN : nullptr;
+            for (int j = 0; j < cols; ++j) {
+                bool const kept = !keep_row || keep_row[j];
+                float const dp = s_row[j] == 0.f || !kept ? 0.f : dot(do_row, scratch.v.data() + j * dv, dv);
+                float const ds = s_row[j] * ((keep_row ? params.rp_dropout : 1.f) * dp - scratch.dpsum[i]);
+                dp_row[j] = params.softcap > 0.f ? ds * dp_row[j] : ds;
+                if (keep_row) { s_row[j] = kept ? s_row[j] * params.rp_dropout : 0.f; }
+            }
+        }
+        return true;
+    }
+
+    void load_kv_tile(KVCacheCpu<Element> const& kv, int const n_start, int const cols, Scratch& scratch) const {
+        for (int j = 0; j < cols; ++j) {
+            load_row(kv.k_row(n_start + j), scratch.k.data() + j * params.d, params.d);
+            load_row(kv.v_row(n_start + j), scratch.v.data() + j * params.dv, params.dv);
+        }
+    }
+
+    void compute_dkdv(int const bidb, int const bidh_kv, int const n_block, Scratch& scratch, bool const accumulate_dq) {
+        SeqlenInfoCpu const seqlen_info(params, bidb);
+        int const n_start = n_block * kBlockN;
+        if (n_start >= seqlen_info.seqlen_k) { return; }
+        int const cols = std::min(kBlockN, seqlen_info.seqlen_k - n_start);
+        int const d = params.d, dv = params.dv;
+        KVCacheCpu<Element> const kv(params, seqlen_info, bidb, bidh_kv);
+        MaskCpu const mask(params, seqlen_info, bidb);
+        load_kv_tile(kv, n_start, cols, scratch);
+        std::fill_n(scratch.dk.begin(), cols * d, 0.f);
+        std::fill_n(scratch.dv.begin(), cols * dv, 0.f);
+        int const m_block_max = (seqlen_info.seqlen_q + kBlockM - 1) / kBlockM;
+        for (int bidh = bidh_kv * qhead_per_khead; bidh < (bidh_kv + 1) * qhead_per_khead; ++bidh) {
+            for (int m_block = 0; m_block < m_block_max; ++m_block) {
+                int const m_start = m_block * kBlockM;
+                int const rows = std::min(kBlockM, seqlen_info.seqlen_q - m_start);
+                if (!compute_ds(seqlen_info, mask, bidb, bidh, m_start, rows, n_start, cols, scratch)) { continue; }
+                if (accumulate_dq) { std::fill_n(scratch.dq.begin(), rows * d, 0.f); }
+                for (int i = 0; i < rows; ++i) {
+                    float const* p_row = scratch.s.data() + i * kBlockN;
+                    float const* ds_row = scratch.dp.data() + i * kBlockN;
+                    float const* q_row = scratch.q.data() + i * d;
+                    float const* do_row = scratch.dout.data() + i * dv;
+                    for (int j = 0; j < cols; ++j) {
+                        if (p_row[j] != 0.f) { axpy(p_row[j], do_row, scratch.dv.data() + j * dv, dv); }  // dV += P^T dO
+                        if (ds_row[j] != 0.f) {
+                            axpy(ds_row[j], q_row, scratch.dk.data() + j * d, d);  // dK += dS^T Q
+                            if (accumulate_dq) { axpy(ds_row[j], scratch.k.data() + j * d, scratch.dq.data() + i * d, d); }  // dQ += dS K
+                        }
+                    }
+                }
+                if (accumulate_dq) {
+                    float* dq_accum = dq_accum_ptr(bidb, bidh) + index_t(m_start) * params.d_rounded;
+                    std::lock_guard<std::mutex> lock(dq_locks[((index_t(bidb) * params.h + bidh) * num_m_blocks + m_block) % kNumLocks]);
+                    for (int i = 0; i < rows; ++i) {
+                        axpy(1.f, scratch.dq.data() + i * d, dq_accum + i * params.d_rounded, d);
+                    }
+                }
+            }
+        }
+        // Epilogue: dK is scaled by softmax_scale, same as CollectiveEpilogueBwd
+        Element* dk_ptr = static_cast<Element*>(params.dk_ptr) + bidh_kv * params.dk_head_stride
+            + (params.cu_seqlens_k ? index_t(seqlen_info.offset_k) * params.dk_row_stride : bidb * params.dk_batch_stride);
+        Element* dv_ptr = static_cast<Element*>(params.dv_ptr) + bidh_kv * params.dv_head_stride
+            + (params.cu_seqlens_k ? index_t(seqlen_info.offset_k) * params.dv_row_stride : bidb * params.dv_batch_stride);
+        for (int j = 0; j < cols; ++j) {
+            scale(scratch.dk.data() + j * d, params.scale_softmax, d);
+            store_row(scratch.dk.data() + j * d, dk_ptr + (n_start + j) * params.dk_row_stride, d);
+            store_row(scratch.dv.data() + j * dv, dv_ptr + (n_start + j) * params.dv_row_stride, dv);
+        }
+    }
+
+    void compute_dq(int const bidb, int const bidh, int const m_block, Scratch& scratch) const {
+        SeqlenInfoCpu const seqlen_info(params, bidb);
+        int const m_start = m_block * kBlockM;
+        if (m_start >= seqlen_info.seqlen_q) { return; }
+        int const rows = std::min(kBlockM, seqlen_info.seqlen_q - m_start);
+        int const d = params.d;
+        KVCacheCpu<Element> const kv(params, seqlen_info, bidb, bidh / qhead_per_khead);
+        MaskCpu const mask(params, seqlen_info, bidb);
+        std::fill_n(scratch.dq.begin(), rows * d, 0.f);
+        int const n_block_max = (seqlen_info.seqlen_k + kBlockN - 1) / kBlockN;
+        for (int n_block = 0; n_block < n_block_max; ++n_block) {
+            int const n_start = n_block * kBlockN;
+            int const cols = std::min(kBlockN, seqlen_info.seqlen_k - n_start);
+            load_kv_tile(kv, n_start, cols, scratch);
+            if (!compute_ds(seqlen_info, mask, bidb, bidh, m_start, rows, n_start, cols, scratch)) { continue; }
+            for (int i = 0; i < rows; ++i) {
+                float const* ds_row = scratch.dp.data() + i * kBlockN;
+                for (int j = 0; j < cols; ++j) {
+                    if (ds_row[j] != 0.f) { axpy(ds_row[j], scratch.k.data() + j * d, scratch.dq.data() + i * d, d); }
+                }
+            }
+        }
+        float* dq_accum = dq_accum_ptr(bidb, bidh) + index_t(m_start) * params.d_rounded;
+        for (int i = 0; i < rows; ++i) {
+            std::copy_n(scratch.dq.data() + i * d, d, dq_accum + i * params.d_rounded);
+        }
+    }
+
+    void postprocess(int const bidb, int const bidh, int const m_block) const {
+        SeqlenInfoCpu const seqlen_info(params, bidb);
+        int const m_start = m_block * kBlockM;
+        if (m_start >= seqlen_info.seqlen_q) { return; }
+        int const rows = std::min(kBlockM, seqlen_info.seqlen_q - m_start);
+        int const d = params.d;
+        float const* dq_accum = dq_accum_ptr(bidb, bidh) + index_t(m_start) * params.d_rounded;
+        Element* dq_ptr = static_cast<Element*>(params.dq_ptr)
+            + q_offset(seqlen_info, bidb, bidh, params.dq_batch_stride, params.dq_row_stride, params.dq_head_stride);
+        std::vector<float> dq_row(d);
+        for (int i = 0; i < rows; ++i) {
+            std::copy_n(dq_accum + i * params.d_rounded, d, dq_row.data());
+            scale(dq_row.data(), params.scale_softmax, d);
+            store_row(dq_row.data(), dq_ptr + (m_start + i) * params.dq_row_stride, d);
+        }
+    }
+
+    Flash_bwd_params const& params;
+    int const kBlockM, kBlockN;
+    int const qhead_per_khead;
+    int const num_m_blocks, num_n_blocks;
+    float const softmax_scale_log2;
+    float const softcap_val;
+    bool const is_dropout;
+    int const total_q_padded_rounded;
+    std::vector<std::mutex> dq_locks;
+
+};
+
+} // namespace cpu
+
+} // namespace flash
@@ -0,0 +1,22 @@
+// Copyright (c) 2024, Tri Dao.
+// CPU forward engine. Compiled as a regular C++ translation unit, the vector width is picked up
+// from the -mavx2 / -mavx512f flags set via FLASH_ATTENTION_CPU_ISA in setup.py.
+
+#include "flash.h"
+#include "tile_size.h"
+#include "flash_fwd_kernel_cpu.h"
+
+template <typename Element>
+void run_mha_fwd_cpu_(Flash_fwd_params &params) {
+    auto [kBlockM, kBlockN] = tile_size_fwd_cpu(params.d, params.dv);
+    flash::cpu::FlashAttnFwdCpu<Element> attn(params, kBlockM, kBlockN);
+    attn.run(params.num_sm);
+}
+
+void run_mha_fwd_cpu(Flash_fwd_params &params) {
+    if (params.is_bf16) {
+        run_mha_fwd_cpu_<flash::cpu::bfloat16_t>(params);
+    } else {
+        run_mha_fwd_cpu_<flash::cpu::half_t>(params);
+    }
+}
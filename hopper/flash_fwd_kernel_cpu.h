@@ -0,0 +1,542 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <vector>
+
+#include "block_range.h"
+#include "dropout_cpu.h"
+#include "flash.h"
+#include "utils_cpu.h"
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host version of SeqlenInfoQKNewK in seqlen.h, with Varlen / AppendKV decided at runtime.
+struct SeqlenInfoCpu {
+
+    int leftpad_k;
+    int offset_q, offset_k, offset_k_new;
+    int seqlen_q, seqlen_k_og, seqlen_k_new, seqlen_k;
+
+    SeqlenInfoCpu(Flash_fwd_params const& params, int const bidb) {
+        bool const varlen = params.cu_seqlens_q || params.cu_seqlens_k || params.seqused_q || params.seqused_k || params.leftpad_k;
+        bool const append_kv = params.knew_ptr != nullptr;
+        leftpad_k = params.leftpad_k ? params.leftpad_k[bidb] : 0;
+        offset_q = !varlen || params.cu_seqlens_q == nullptr ? 0 : params.cu_seqlens_q[bidb];
+        offset_k = !varlen ? 0 : (params.cu_seqlens_k ? params.cu_seqlens_k[bidb] : 0) + leftpad_k;
+        offset_k_new = !append_kv || params.cu_seqlens_knew == nullptr ? 0 : params.cu_seqlens_knew[bidb];
+        seqlen_q = !varlen
+            ? params.seqlen_q
+            : (params.seqused_q ? params.seqused_q[bidb] : (params.cu_seqlens_q ? params.cu_seqlens_q[bidb + 1] - params.cu_seqlens_q[bidb] : params.seqlen_q));
+        seqlen_k_og = !varlen
+            ? params.seqlen_k
+            : (params.seqused_k ? params.seqused_k[bidb] : (params.cu_seqlens_k ? params.cu_seqlens_k[bidb + 1] - params.cu_seqlens_k[bidb] : params.seqlen_k)) - leftpad_k;
+        seqlen_k_new = !append_kv
+            ? 0
+            : (params.cu_seqlens_knew ? params.cu_seqlens_knew[bidb + 1] - params.cu_seqlens_knew[bidb] : params.seqlen_knew);
+        seqlen_k = seqlen_k_og + seqlen_k_new;
+    }
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Row addressing of the K / V cache for one (batch, kv head), covering the contiguous, varlen
+// and paged layouts. Row indices are relative to the start of the sequence (i.e. after leftpad_k).
+template <typename Element>
+struct KVCacheCpu {
+
+    using index_t = Flash_fwd_params::index_t;
+
+    Element* k_base;
+    Element* v_base;
+    index_t k_row_stride, v_row_stride;
+    // Paged KV
+    int const* page_table;
+    index_t k_page_stride, v_page_stride;
+    int page_size, leftpad_k;
+
+    KVCacheCpu(Flash_fwd_params const& params, SeqlenInfoCpu const& seqlen_info, int const bidb, int const bidh_kv) {
+        int const bidb_kv = params.kv_batch_idx ? params.kv_batch_idx[bidb] : bidb;
+        k_row_stride = params.k_row_stride;
+        v_row_stride = params.v_row_stride;
+        page_size = params.page_size;
+        leftpad_k = seqlen_info.leftpad_k;
+        k_base = static_cast<Element*>(params.k_ptr) + bidh_kv * params.k_head_stride;
+        v_base = static_cast<Element*>(params.v_ptr) + bidh_kv * params.v_head_stride;
+        if (params.page_table) {
+            page_table = params.page_table + bidb_kv * params.page_table_batch_stride;
+            k_page_stride = params.k_batch_stride;
+            v_page_stride = params.v_batch_stride;
+        } else {
+            page_table = nullptr;
+            index_t const k_offset = (params.cu_seqlens_k ? 0 : bidb_kv * params.k_batch_stride) + index_t(seqlen_info.offset_k) * params.k_row_stride;
+            index_t const v_offset = (params.cu_seqlens_k ? 0 : bidb_kv * params.v_batch_stride) + index_t(seqlen_info.offset_k) * params.v_row_stride;
+            k_base += k_offset;
+            v_base += v_offset;
+        }
+    }
+
+    Element* k_row(int const row) const {
+        if (!page_table) { return k_base + row * k_row_stride; }
+        int const idx = row + leftpad_k;
+        return k_base + page_table[idx / page_size] * k_page_stride + (idx % page_size) * k_row_stride;
+    }
+
+    Element* v_row(int const row) const {
+        if (!page_table) { return v_base + row * v_row_stride; }
+        int const idx = row + leftpad_k;
+        return v_base + page_table[idx / page_size] * v_page_stride + (idx % page_size) * v_row_stride;
+    }
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Addressing of the per-token scales of a quantized KV cache for one (batch, kv head), following the rows of
+// KVCacheCpu: (num_pages, page_size, h_k) with a page table, (b_k, seqlen_k, h_k) otherwise.
+struct KVScaleCpu {
+
+    using index_t = Flash_fwd_params::index_t;
+
+    float* k_base;
+    float* v_base;
+    index_t row_stride, page_stride;
+    int const* page_table;
+    int page_size, leftpad_k;
+
+    KVScaleCpu(Flash_fwd_params const& params, SeqlenInfoCpu const& seqlen_info, int const bidb, int const bidh_kv) {
+        int const bidb_kv = params.kv_batch_idx ? params.kv_batch_idx[bidb] : bidb;
+        row_stride = params.kv_scale_row_stride;
+        page_stride = params.kv_scale_batch_stride;
+        page_size = params.page_size;
+        leftpad_k = seqlen_info.leftpad_k;
+        index_t const offset = bidh_kv * params.kv_scale_head_stride
+            + (params.page_table ? 0 : bidb_kv * params.kv_scale_batch_stride + index_t(seqlen_info.offset_k) * row_stride);
+        page_table = params.page_table ? params.page_table + bidb_kv * params.page_table_batch_stride : nullptr;
+        k_base = params.k_scale_ptr + offset;
+        v_base = params.v_scale_ptr + offset;
+    }
+
+    index_t row_offset(int const row) const {
+        if (!page_table) { return row * row_stride; }
+        int const idx = row + leftpad_k;
+        return page_table[idx / page_size] * page_stride + (idx % page_size) * row_stride;
+    }
+
+    float* k_row(int const row) const { return k_base + row_offset(row); }
+    float* v_row(int const row) const { return v_base + row_offset(row); }
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Host version of the masking in mask.h: causal, local (window_size_left / right), attention_chunk and the
+// draft tree of speculative decoding.
+struct MaskCpu {
+
+    int seqlen_q, seqlen_k;
+    int window_size_left, window_size_right, attention_chunk;
+    bool is_causal, is_local;
+    uint64_t const* tree_ancestors;
+    int tree_size;
+
+    MaskCpu(Flash_fwd_params const& params, SeqlenInfoCpu const& seqlen_info, int const bidb)
+        : seqlen_q(seqlen_info.seqlen_q), seqlen_k(seqlen_info.seqlen_k)
+        , window_size_left(params.window_size_left), window_size_right(params.window_size_right)
+        , attention_chunk(params.attention_chunk), is_causal(params.is_causal), is_local(params.is_local)
+        , tree_ancestors(params.tree_ancestors ? params.tree_ancestors + bidb * params.tree_ancestors_batch_stride : nullptr)
+        , tree_size(params.tree_size) {}
+
+    static int floor_div(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+    // Column range [col_min, col_max) of keys that query row m_idx may attend to. The tree mask can mask out more
+    // keys inside it.
+    void col_limits(int const m_idx, int& col_min, int& col_max) const {
+        col_min = 0;
+        col_max = seqlen_k;
+        if (is_causal || is_local) {
+            int const diag = m_idx + seqlen_k - seqlen_q;
+            col_max = std::min(col_max, diag + (is_causal ? 0 : window_size_right) + 1);
+            if (is_local) {
+                col_min = diag - window_size_left;
+                if (attention_chunk > 0) { col_min = std::max(col_min, floor_div(diag, attention_chunk) * attention_chunk); }
+                col_min = std::max(col_min, 0);
+            }
+        }
+    }
+
+    // Whether any of the n_cols keys starting at n_idx_start is masked out for one of the rows [m_idx_min, m_idx_max].
+    // The column limits only grow with the row, so the first and last rows bound those of the others. Blocks
+    // that aren't on a boundary skip apply(), as mask.h only masks the boundary blocks.
+    bool needs_mask(int const m_idx_min, int const m_idx_max, int const n_idx_start, int const n_cols) const {
+        int col_min_first, col_max_first, col_min_last, col_max_last;
+        col_limits(m_idx_min, col_min_first, col_max_first);
+        col_limits(m_idx_max, col_min_last, col_max_last);
+        if (n_idx_start < col_min_last || n_idx_start + n_cols > col_max_first) { return true; }
+        return tree_ancestors && m_idx_max >= seqlen_q - tree_size && n_idx_start + n_cols > seqlen_k - tree_size;
+    }
+
+    // Set scores for the n_cols keys starting at n_idx_start to -inf where they are masked out.
+    void apply(float* __restrict__ scores, int const m_idx, int const n_idx_start, int const n_cols) const {
+        int col_min, col_max;
+        col_limits(m_idx, col_min, col_max);
+        for (int j = 0; j < n_cols; ++j) {
+            int const n_idx = n_idx_start + j;
+            if (n_idx < col_min || n_idx >= col_max) { scores[j] = -INFINITY; }
+        }
+        int const tree_row = m_idx - (seqlen_q - tree_size);
+        if (tree_ancestors && tree_row >= 0 && tree_row < tree_size) {
+            uint64_t const ancestors = tree_ancestors[tree_row];
+            int const tree_col_start = seqlen_k - tree_size;
+            for (int j = std::max(0, tree_col_start - n_idx_start); j < n_cols; ++j) {
+                int const tree_col = n_idx_start + j - tree_col_start;
+                if (tree_col < tree_size && !((ancestors >> tree_col) & 1)) { scores[j] = -INFINITY; }
+            }
+        }
+    }
+
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Tiled forward pass: the same kBlockM x kBlockN online softmax recurrence as the GPU mainloop,
+// with Q / K / V tiles converted to fp32 in per-thread scratch so that they stay cache resident.
+// With params.num_splits > 1, each tile's n_blocks are split as in the GPU kernels: every split writes its
+// normalized partial output and LSE to oaccum_ptr / softmax_lseaccum_ptr, and combine() merges them.
+// With params.pack_gqa, a tile is a KV head whose qhead_per_khead query heads are folded into M as in pack_gqa.h
+// (packed row i is row i / qhead_per_khead of query head i % qhead_per_khead), so that each K / V block is loaded
+// and converted once for all the query heads that read it.
+// With dropout (params.p_dropout < 1), P is multiplied by the keep-mask of DropoutCpu after it's added to the row sum,
+// and O by rp_dropout in the epilogue, as in flash_fwd_kernel.h, so the LSE doesn't depend on the mask.
+template <typename Element>
+class FlashAttnFwdCpu {
+
+public:
+
+    static constexpr float kLog2e = 1.4426950408889634f;
+
+    FlashAttnFwdCpu(Flash_fwd_params const& params, int const kBlockM, int const kBlockN)
+        : params(params), kBlockM(kBlockM), kBlockN(kBlockN)
+        , qhead_per_khead(params.h / params.h_k)
+        , qhead_per_tile(params.pack_gqa ? qhead_per_khead : 1)
+        , is_dropout(params.p_dropout < 1.f)
+        , softmax_scale_log2(params.softcap > 0.f ? params.softcap * kLog2e : params.scale_softmax * kLog2e)
+        , softcap_val(params.softcap > 0.f ? params.scale_softmax / params.softcap : 0.f) {}
+
+    struct Scratch {
+        std::vector<float> q, k, v, s, o, row_max, row_sum;
+        std::vector<uint8_t> keep;  // Dropout keep-mask of the S tile
+    };
+
+    void run(int const num_threads) {
+        // KVStorage is the type of the KV cache: Element, or int8 / packed int4 dequantized as tiles are loaded
+        switch (params.kv_quant_bits) {
+            case 8: run_kv<int8_t>(num_threads); break;
+            case 4: run_kv<int4x2_t>(num_threads); break;
+            default: run_kv<Element>(num_threads);
+        }
+    }
+
+private:
+
+    using index_t = Flash_fwd_params::index_t;
+
+    // A (batch, head, m_block, split) tile, with a KV head if PackGQA, and its cost: the rows times the n_blocks it visits
+    struct Task {
+        int bidb, bidh, m_block, split_idx;
+        int64_t cost;
+    };
+
+    template <typename KVStorage>
+    void run_kv(int const num_threads) {
+        if (params.knew_ptr) { append_kv<KVStorage>(num_threads); }
+        // Only the tiles with rows, from the length of each sequence (cu_seqlens_q / seqused_q, cu_seqlens_k /
+        // seqused_k), so that a varlen batch with a few long sequences doesn't hand out mostly empty tiles.
+        // The splits of a tile are consecutive tasks.
+        std::vector<Task> tasks;
+        int64_t total_cost = 0;
+        for (int bidb = 0; bidb < params.b; ++bidb) {
+            SeqlenInfoCpu const seqlen_info(params, bidb);
+            int const num_splits = num_splits_of(bidb);
+            int const seqlen_q_packed = seqlen_info.seqlen_q * qhead_per_tile;
+            for (int bidh = 0; bidh < params.h / qhead_per_tile; ++bidh) {
+                for (int m_block = 0; m_block * kBlockM < seqlen_q_packed; ++m_block) {
+                    int const rows = std::min(kBlockM, seqlen_q_packed - m_block * kBlockM);
+                    for (int split_idx = 0; split_idx < num_splits; ++split_idx) {
+                        auto const [n_block_min, n_block_max] = n_block_range(seqlen_info, m_block, split_idx, num_splits);
+                        int64_t const cost = int64_t(rows) * (std::max(n_block_max - n_block_min, 0) + 1);
+                        tasks.push_back({bidb, bidh, m_block, split_idx, cost});
+                        total_cost += cost;
+                    }
+                }
+            }
+        }
+        int const num_tasks = int(tasks.size());
+        int const nthreads = std::max(1, std::min(num_threads, num_tasks));
+        // Each thread starts with consecutive tasks (the m_blocks and splits of the same heads, which read the same
+        // K / V) of about the same total cost, and steals from the others once it's done (ThreadPool::parallel_for_ranges)
+        std::vector<int> range_begin(nthreads + 1, num_tasks);
+        range_begin[0] = 0;
+        int64_t cost_before = 0;
+        for (int i = 0, t = 1; i < num_tasks; ++i) {
+            while (t < nthreads && cost_before * nthreads >= total_cost * t) { range_begin[t++] = i; }
+            cost_before += tasks[i].cost;
+        }
+        std::vector<Scratch> scratch(nthreads);
+        for (auto& s : scratch) { init_scratch(s); }
+        ThreadPool::get().parallel_for_ranges(range_begin, [&](int const task_idx, int const thread_idx) {
+            Task const& task = tasks[task_idx];
+            compute_tile<KVStorage>(task.bidb, task.bidh, task.m_block, task.split_idx, scratch[thread_idx]);
+        });
+        if (params.num_splits > 1) { combine(num_threads); }
+    }
+
+    // num_splits_dynamic_ptr holds the number of splits of each batch for varlen (prepare_scheduler.h)
+    int num_splits_of(int const bidb) const {
+        return params.num_splits_dynamic_ptr ? params.num_splits_dynamic_ptr[bidb] : params.num_splits;
+    }
+
+    // The n_blocks that the rows of m_block can see with the causal / local / chunked masks, as BlockMN computes
+    // them, so that fully masked blocks are never loaded. A split's share of them is the same as on the GPU, with
+    // the number of splits in the upper 16 bits of split_idx.
+    BlockRange n_block_range(SeqlenInfoCpu const& seqlen_info, int const m_block, int const split_idx, int const num_splits) const {
+        return get_n_block_range(
+            seqlen_info.seqlen_q, seqlen_info.seqlen_k, kBlockM, kBlockN, params.is_causal, params.is_local,
+            params.pack_gqa, params.num_splits > 1, m_block, split_idx | (num_splits << 16), params.num_splits,
+            params.window_size_left, params.window_size_right, IntDivmod{params.attention_chunk}, IntDivmod{qhead_per_khead});
+    }
+
+    // O / LSE of (bidb, bidh), and the partial O / LSE of one of its splits, starting at the sequence's first row
+    Element* o_ptr(int const bidb, int const bidh, SeqlenInfoCpu const& seqlen_info) const {
+        index_t const o_offset = (params.cu_seqlens_q ? index_t(seqlen_info.offset_q) * params.o_row_stride : bidb * params.o_batch_stride)
+            + bidh * params.o_head_stride;
+        return static_cast<Element*>(params.o_ptr) + o_offset;
+    }
+
+    float* lse_ptr(int const bidb, int const bidh, SeqlenInfoCpu const& seqlen_info) const {
+        return static_cast<float*>(params.softmax_lse_ptr) + (params.cu_seqlens_q
+            ? index_t(bidh) * params.total_q + seqlen_info.offset_q
+            : (index_t(bidb) * params.h + bidh) * params.seqlen_q);
+    }
+
+    float* oaccum_ptr(int const bidb, int const bidh, int const split_idx, SeqlenInfoCpu const& seqlen_info) const {
+        return static_cast<float*>(params.oaccum_ptr) + split_idx * params.oaccum_split_stride
+            + bidb * params.oaccum_batch_stride + bidh * params.oaccum_head_stride + index_t(seqlen_info.offset_q) * params.oaccum_row_stride;
+    }
+
+    float* lseaccum_ptr(int const bidb, int const bidh, int const split_idx, SeqlenInfoCpu const& seqlen_info) const {
+        return static_cast<float*>(params.softmax_lseaccum_ptr) + split_idx * params.lseaccum_split_stride
+            + bidb * params.lseaccum_batch_stride + bidh * params.lseaccum_head_stride + seqlen_info.offset_q;
+    }
+
+    // Merge the partial outputs of the splits, weighted by exp(lse_split - lse), as flash_fwd_combine_kernel.h does
+    void combine(int const num_threads) const {
+        ThreadPool::get().parallel_for(params.b * params.h, num_threads, [&](int const idx, int) {
+            int const bidb = idx / params.h, bidh = idx % params.h;
+            SeqlenInfoCpu const seqlen_info(params, bidb);
+            int const num_splits = num_splits_of(bidb);
+            int const dv = params.dv;
+            std::vector<float> o(dv), split_scale(num_splits);
+            Element* o_out = o_ptr(bidb, bidh, seqlen_info);
+            float* lse_out = lse_ptr(bidb, bidh, seqlen_info);
+            for (int m = 0; m < seqlen_info.seqlen_q; ++m) {
+                float lse_max = -INFINITY;
+                for (int s = 0; s < num_splits; ++s) { lse_max = std::max(lse_max, lseaccum_ptr(bidb, bidh, s, seqlen_info)[m]); }
+                float const lse_max_cur = lse_max == -INFINITY ? 0.f : lse_max;  // In case all local LSEs are -inf
+                float lse_sum = 0.f;
+                for (int s = 0; s < num_splits; ++s) {
+                    split_scale[s] = std::exp(lseaccum_ptr(bidb, bidh, s, seqlen_info)[m] - lse_max_cur);
+                    lse_sum += split_scale[s];
+                }
+                float const inv_sum = (lse_sum == 0.f || lse_sum != lse_sum) ? 0.f : 1.f / lse_sum;
+                std::fill(o.begin(), o.end(), 0.f);
+                for (int s = 0; s < num_splits; ++s) {
+                    float const scale_s = split_scale[s] * inv_sum;
+                    if (scale_s > 0.f) { axpy(scale_s, oaccum_ptr(bidb, bidh, s, seqlen_info) + m * params.oaccum_row_stride, o.data(), dv); }
+                }
+                store_row(o.data(), o_out + m * params.o_row_stride, dv);
+                lse_out[m] = std::log(lse_sum) + lse_max;
+            }
+        });
+    }
+
+    void init_scratch(Scratch& s) const {
+        s.q.resize(kBlockM * params.d);
+        s.k.resize(kBlockN * params.d);
+        s.v.resize(kBlockN * params.dv);
+        s.s.resize(kBlockM * kBlockN);
+        s.o.resize(kBlockM * params.dv);
+        s.row_max.resize(kBlockM);
+        s.row_sum.resize(kBlockM);
+        if (is_dropout) { s.keep.resize(kBlockM * kBlockN); }
+    }
+
+    // Keep-mask of rows [m_start, m_start + rows) of the (packed) tile and cols [n_start, n_start + cols). With
+    // PackGQA, the rows of each query head are every qhead_per_khead-th row of the tile.
+    void dropout_keep_mask(int const bidb, int const bidh, int const m_start, int const rows, int const n_start,
+                           int const cols, uint8_t* keep) const {
+        for (int h = 0; h < qhead_per_tile; ++h) {
+            int const first = (h - m_start % qhead_per_tile + qhead_per_tile) % qhead_per_tile;  // First row of head h
+            if (first >= rows) { continue; }
+            int const head = params.pack_gqa ? bidh * qhead_per_khead + h : bidh;
+            DropoutCpu const dropout(params.rng_state[0], params.rng_state[1], params.p_dropout_in_uint8_t, bidb, head, params.h);
+            dropout.keep_mask((m_start + first) / qhead_per_tile, (rows - 1 - first) / qhead_per_tile + 1, n_start, cols,
+                              keep + first * kBlockN, int64_t(qhead_per_tile) * kBlockN);
+        }
+    }
+
+    // Copy K_new / V_new into the KV cache at [seqlen_k_og, seqlen_k_og + seqlen_k_new), as the
+    // GPU kernel does before attending over the cache. A quantized cache gets the quantized rows and their scales.
+    template <typename KVStorage>
+    void append_kv(int const num_threads) const {
+        ThreadPool::get().parallel_for(params.b * params.h_k, num_threads, [&](int const idx, int) {
+            int const bidb = idx / params.h_k, bidh_kv = idx % params.h_k;
+            SeqlenInfoCpu const seqlen_info(params, bidb);
+            KVCacheCpu<KVStorage> const kv(params, seqlen_info, bidb, bidh_kv);
+            Element const* knew = static_cast<Element const*>(params.knew_ptr) + bidh_kv * params.knew_head_stride
+                + (params.cu_seqlens_knew ? index_t(seqlen_info.offset_k_new) * params.knew_row_stride : bidb * params.knew_batch_stride);
+            Element const* vnew = static_cast<Element const*>(params.vnew_ptr) + bidh_kv * params.vnew_head_stride
+                + (params.cu_seqlens_knew ? index_t(seqlen_info.offset_k_new) * params.vnew_row_stride : bidb * params.vnew_batch_stride);
+            if constexpr (std::is_same_v<KVStorage, Element>) {
+                for (int i = 0; i < seqlen_info.seqlen_k_new; ++i) {
+                    std::memcpy(kv.k_row(seqlen_info.seqlen_k_og + i), knew + i * params.knew_row_stride, params.d * sizeof(Element));
+                    std::memcpy(kv.v_row(seqlen_info.seqlen_k_og + i), vnew + i * params.vnew_row_stride, params.dv * sizeof(Element));
+                }
+            } else {
+                KVScaleCpu const kv_scale(params, seqlen_info, bidb, bidh_kv);
+                std::vector<float> row(std::max(params.d, params.dv));
+                for (int i = 0; i < seqlen_info.seqlen_k_new; ++i) {
+                    int const row_idx = seqlen_info.seqlen_k_og + i;
+                    load_row(knew + i * params.knew_row_stride, row.data(), params.d);
+                    *kv_scale.k_row(row_idx) = quantize_row(row.data(), kv.k_row(row_idx), params.d);
+                    load_row(vnew + i * params.vnew_row_stride, row.data(), params.dv);
+                    *kv_scale.v_row(row_idx) = quantize_row(row.data(), kv.v_row(row_idx), params.dv);
+                }
+            }
+        });
+    }
+
+    template <typename KVStorage>
+    void compute_tile(int const bidb, int const bidh, int const m_block, int const split_idx, Scratch& scratch) const {
+        SeqlenInfoCpu const seqlen_info(params, bidb);
+        int const m_start = m_block * kBlockM;
+        int const num_splits = num_splits_of(bidb);
+        int const seqlen_q_packed = seqlen_info.seqlen_q * qhead_per_tile;
+        if (m_start >= seqlen_q_packed || split_idx >= num_splits) { return; }
+        int const rows = std::min(kBlockM, seqlen_q_packed - m_start);
+        int const d = params.d, dv = params.dv;
+        int const bidh_kv = params.pack_gqa ? bidh : bidh / qhead_per_khead;
+        KVCacheCpu<KVStorage> const kv(params, seqlen_info, bidb, bidh_kv);
+        std::optional<KVScaleCpu> kv_scale;  // Only for a quantized cache
+        if constexpr (!std::is_same_v<KVStorage, Element>) { kv_scale.emplace(params, seqlen_info, bidb, bidh_kv); }
+        MaskCpu const mask(params, seqlen_info, bidb);
+        // Query head and row of packed row i of the tile
+        auto const row_head = [&](int const i) { return params.pack_gqa ? bidh * qhead_per_khead + (m_start + i) % qhead_per_khead : bidh; };
+        auto const row_idx = [&](int const i) { return (m_start + i) / qhead_per_tile; };
+
+        index_t const q_offset = params.cu_seqlens_q ? index_t(seqlen_info.offset_q) * params.q_row_stride : bidb * params.q_batch_stride;
+        Element const* q_ptr = static_cast<Element const*>(params.q_ptr) + q_offset;
+        for (int i = 0; i < rows; ++i) {
+            load_row(q_ptr + row_head(i) * params.q_head_stride + row_idx(i) * params.q_row_stride, scratch.q.data() + i * d, d);
+        }
+        std::fill_n(scratch.o.begin(), rows * dv, 0.f);
+        std::fill_n(scratch.row_max.begin(), rows, -INFINITY);
+        std::fill_n(scratch.row_sum.begin(), rows, 0.f);
+
+        bool const split = params.num_splits > 1;
+        auto const [n_block_min, n_block_max] = n_block_range(seqlen_info, m_block, split_idx, num_splits);
+        int const m_idx_min = row_idx(0), m_idx_max = row_idx(rows - 1);
+        for (int n_block = n_block_min; n_block < n_block_max; ++n_block) {
+            int const n_start = n_block * kBlockN;
+            int const cols = std::min(kBlockN, seqlen_info.seqlen_k - n_start);
+            bool const mask_block = mask.needs_mask(m_idx_min, m_idx_max, n_start, cols);
+            if constexpr (std::is_same_v<KVStorage, Element>) {
+                for (int j = 0; j < cols; ++j) {
+                    load_row(kv.k_row(n_start + j), scratch.k.data() + j * d, d);
+                    load_row(kv.v_row(n_start + j), scratch.v.data() + j * dv, dv);
+                }
+            } else {
+                for (int j = 0; j < cols; ++j) {
+                    dequantize_row(kv.k_row(n_start + j), *kv_scale->k_row(n_start + j), scratch.k.data() + j * d, d);
+                    dequantize_row(kv.v_row(n_start + j), *kv_scale->v_row(n_start + j), scratch.v.data() + j * dv, dv);
+                }
+            }
+            if (is_dropout) { dropout_keep_mask(bidb, bidh, m_start, rows, n_start, cols, scratch.keep.data()); }
+            for (int i = 0; i < rows; ++i) {
+                float* s_row = scratch.s.data() + i * kBlockN;
+                float const* q_row = scratch.q.data() + i * d;
+                for (int j = 0; j < cols; ++j) { s_row[j] = dot(q_row, scratch.k.data() + j * d, d); }
+                if (params.softcap > 0.f) { apply_softcap(s_row, softcap_val, cols); }
+                if (mask_block) { mask.apply(s_row, row_idx(i), n_start, cols); }
+                online_softmax_step(s_row, cols, scratch.v.data(), scratch.o.data() + i * dv,
+                                    scratch.row_max[i], scratch.row_sum[i], is_dropout ? scratch.keep.data() + i * kBlockN : nullptr);
+            }
+        }
+
+        // Epilogue: normalize O and write O and LSE, same conventions as Softmax::finalize. A split writes its
+        // partial O in fp32 for combine().
+        for (int i = 0; i < rows; ++i) {
+            int const head = row_head(i), m = row_idx(i);
+            float const sum = scratch.row_sum[i];
+            bool const empty = sum == 0.f || sum != sum;
+            float* o_row = scratch.o.data() + i * dv;
+            scale(o_row, empty ? 0.f : (is_dropout ? params.rp_dropout : 1.f) / sum, dv);
+            float const lse = empty ? -INFINITY : scratch.row_max[i] * (softmax_scale_log2 * float(M_LN2)) + std::log(sum);
+            if (split) {
+                std::copy_n(o_row, dv, oaccum_ptr(bidb, head, split_idx, seqlen_info) + m * params.oaccum_row_stride);
+                lseaccum_ptr(bidb, head, split_idx, seqlen_info)[m] = lse;
+            } else {
+                store_row(o_row, o_ptr(bidb, head, seqlen_info) + m * params.o_row_stride, dv);
+                lse_ptr(bidb, head, seqlen_info)[m] = lse;
+            }
+        }
+    }
+
+    // One step of the online softmax for a single query row: update the running max and sum,
+    // rescale the output accumulator and add P @ V for this tile. If keep isn't nullptr, the dropped entries of P
+    // still count in the row sum but not in P @ V.
+    void online_softmax_step(float* __restrict__ s_row, int const cols, float const* __restrict__ v_tile,
+                             float* __restrict__ o_row, float& row_max, float& row_sum, uint8_t const* keep) const {
+        float const tile_max = max(s_row, cols);
+        float const prev_max = row_max;
+        row_max = std::max(prev_max, tile_max);
+        // If the whole row is masked so far, use 0 as the max to avoid (-inf) - (-inf)
+        float const cur_max = row_max == -INFINITY ? 0.f : row_max;
+        float const max_scaled = cur_max * softmax_scale_log2;
+        if (prev_max != row_max) {
+            float const rescale = exp2f((prev_max - cur_max) * softmax_scale_log2);
+            row_sum *= rescale;
+            scale(o_row, rescale, params.dv);
+        }
+        row_sum += scale_apply_exp2(s_row, softmax_scale_log2, max_scaled, cols);
+        if (keep) {
+            for (int j = 0; j < cols; ++j) { s_row[j] = keep[j] ? s_row[j] : 0.f; }
+        }
+        for (int j = 0; j < cols; ++j) {
+            if (s_row[j] != 0.f) { axpy(s_row[j], v_tile + j * params.dv, o_row, params.dv); }
+        }
+    }
+
+    Flash_fwd_params const& params;
+    int const kBlockM, kBlockN;
+    int const qhead_per_khead;
+    int const qhead_per_tile;
+    bool const is_dropout;
+    float const softmax_scale_log2;
+    float const softcap_val;
+
+};
+
+} // namespace cpu
+
+} // namespace flash
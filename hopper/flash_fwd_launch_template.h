@@ -71,6 +71,9 @@ void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
     // On Sm80, noncausal persistent seems a bit slower.
     static constexpr bool UsePersistentScheduler = Arch >= 90 ? !(Split && !Varlen) : ((Is_causal && !Varlen) || (Varlen && Split));
     using Scheduler = std::conditional_t<!UsePersistentScheduler, SchedulerSingleTile, SchedulerPersistent>;
+    // Only the varlen persistent scheduler can consume the LPT work list, and without causal / local masks all the
+    // tiles of a sequence cost the same
+    static constexpr bool UseLptWorkList = Varlen && UsePersistentScheduler && (Is_causal || Is_local);
     using AttnKernel = std::conditional_t<
         Arch >= 90,
         flash::enable_sm90_or_later<flash::FlashAttnFwdSm90<CollectiveMainloop, CollectiveEpilogue, Scheduler>>,
@@ -126,7 +129,8 @@ void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
         params.kv_batch_idx,
         params.cu_seqlens_q, params.cu_seqlens_k, params.cu_seqlens_knew,
         params.seqused_q, params.seqused_k,
-        params.leftpad_k, params.seqlens_rotary
+        params.leftpad_k, params.seqlens_rotary,
+        params.tree_ancestors, params.tree_ancestors_batch_stride, params.tree_size
     };
     typename CollectiveEpilogue::Arguments epilogue_args {
         static_cast<ElementOut*>(params.o_ptr),
@@ -153,12 +157,18 @@ void run_flash_fwd(Flash_fwd_params &params, cudaStream_t stream) {
         params.tile_count_semaphore, params.cu_seqlens_q, params.seqused_q,
         // params.num_m_blocks_ptr,
         params.num_splits_dynamic_ptr,
+        UseLptWorkList ? params.varlen_lpt_workspace : nullptr,
     };
 
     if (Varlen && params.num_splits_dynamic_ptr && !params.skip_scheduler_metadata_computation) {
         prepare_varlen_num_blocks(params, stream, PackGQA, kBlockM, kBlockN, Arch >= 90 /*enable_pdl*/);
         CHECK_CUDA_KERNEL_LAUNCH();
     }
+    // Needs num_splits_dynamic, so this runs after prepare_varlen_num_blocks (or after get_scheduler_metadata)
+    if (UseLptWorkList && params.varlen_lpt_workspace) {
+        prepare_varlen_lpt_work_list(params, stream, PackGQA, kBlockM, kBlockN);
+        CHECK_CUDA_KERNEL_LAUNCH();
+    }
 
     int device;
     CHECK_CUDA(cudaGetDevice(&device));
@@ -5,10 +5,11 @@
 
 import argparse
 import itertools
+import json
 from collections import namedtuple
 from dataclasses import dataclass
 from pathlib import Path
-from typing import List, Optional
+from typing import Dict, List, Optional
 
 KERNEL_BATCH = namedtuple("Kernel", ["template", "filename"])
 
@@ -184,6 +185,152 @@ def batch_softcap(kernels_all) -> List[KERNEL_BATCH]:
             yield KERNEL_BATCH(template, filename)
 
 
+# A manifest restricts the build to a subset of the kernels, e.g. for a deployment that only serves one model:
+#   {"arch": [90], "dtype": ["bf16"], "hdim": [128, "192x128"], "split": [false, true], "paged": [false],
+#    "softcap": [false], "packgqa": [false, true], "backward": false}
+# "hdim" entries are either a head dim (same head dim for V) or "{hdim}x{hdim_v}". A missing key means all values.
+# Sm8x kernels always have PackGQA, and Sm90 kernels always have it with Split or PagedKV, regardless of "packgqa".
+MANIFEST_KEYS = ["arch", "dtype", "hdim", "split", "paged", "softcap", "packgqa", "backward"]
+
+
+def load_manifest(path: str) -> Dict:
+    with open(path) as f:
+        manifest = json.load(f)
+    unknown = set(manifest) - set(MANIFEST_KEYS)
+    if unknown:
+        raise ValueError(f"{path}: unknown manifest keys {sorted(unknown)}, expected a subset of {MANIFEST_KEYS}")
+    if "hdim" in manifest:
+        hdims = []
+        for hdim in manifest["hdim"]:
+            head_dim, _, head_dim_v = str(hdim).partition("x")
+            hdims.append((int(head_dim), int(head_dim_v) if head_dim_v else int(head_dim)))
+    else:  # Including the pairs with a different head dim for V
+        hdims = sorted({(k.head_dim, k.head_dim_v) for k in get_all_kernels()})
+    return {
+        "arch": manifest.get("arch", SM),
+        "dtype": manifest.get("dtype", list(DTYPE_MAP.keys())),
+        "hdim": hdims,
+        "split": manifest.get("split", SPLIT),
+        "paged": manifest.get("paged", PAGEDKV),
+        "softcap": manifest.get("softcap", SOFTCAP),
+        "packgqa": manifest.get("packgqa", PACKGQA),
+        "backward": manifest.get("backward", True),
+    }
+
+
+def in_manifest(kernel: Kernel, manifest: Dict) -> bool:
+    if kernel.sm not in manifest["arch"] or kernel.dtype not in manifest["dtype"]:
+        return False
+    if (kernel.head_dim, kernel.head_dim_v) not in manifest["hdim"] or kernel.softcap not in manifest["softcap"]:
+        return False
+    if kernel.direction == "bwd":
+        return manifest["backward"]
+    return kernel.split in manifest["split"] and kernel.paged_kv in manifest["paged"] and kernel.packgqa in manifest["packgqa"]
+
+
+def manifest_disabled_features(manifest: Dict) -> List[str]:
+    """Features that no kernel in the manifest has, so that the heuristics in flash_api.cpp never pick them.
+    Returns the suffixes of the FLASHATTENTION_DISABLE_* macros."""
+    head_dims = {head_dim for head_dim, _ in manifest["hdim"]}
+    return (
+        []
+        + (["BACKWARD"] if not manifest["backward"] else [])
+        + (["SPLIT"] if True not in manifest["split"] else [])
+        + (["PAGEDKV"] if True not in manifest["paged"] else [])
+        + (["SOFTCAP"] if True not in manifest["softcap"] else [])
+        + (["PACKGQA"] if True not in manifest["packgqa"] else [])
+        + (["FP16"] if "fp16" not in manifest["dtype"] else [])
+        + (["FP8"] if "e4m3" not in manifest["dtype"] else [])
+        + [f"HDIM{d}" for d in HEAD_DIMENSIONS if d not in head_dims]
+        + (["SM8x"] if 80 not in manifest["arch"] else [])
+    )
+
+
+def manifest_table(kernels: List[Kernel]) -> str:
+    """kernel_manifest.inc, the list of compiled kernels read by kernel_manifest.h."""
+    def cpp_bool(b):
+        return "true" if b else "false"
+    fwd, bwd = [], []
+    for k in kernels:
+        # Sm8x files instantiate both Sm80 and Sm86, and the template argument PackGQA is forced as in Kernel.template
+        for arch in ([k.sm] if k.sm >= 90 else [80, 86]):
+            if k.direction == "fwd":
+                packgqa = k.packgqa or k.paged_kv or k.split or k.sm < 90
+                fwd.append(f"    FwdKernelConfig{{{arch}, \"{k.dtype}\", {k.head_dim}, {k.head_dim_v}, {cpp_bool(k.split)}, "
+                           f"{cpp_bool(k.paged_kv)}, {cpp_bool(k.softcap)}, {cpp_bool(packgqa)}}},")
+            else:
+                bwd.append(f"    BwdKernelConfig{{{arch}, \"{k.dtype}\", {k.head_dim}, {cpp_bool(k.softcap)}}},")
+    return (
+        "// This file is auto-generated from a kernel manifest. See \"generate_kernels.py\"\n\n"
+        f"inline constexpr std::array<FwdKernelConfig, {len(fwd)}> kCompiledFwdKernels = {{{{\n" + "\n".join(fwd) + "\n}};\n"
+        f"inline constexpr std::array<BwdKernelConfig, {len(bwd)}> kCompiledBwdKernels = {{{{\n" + "\n".join(bwd) + "\n}};\n"
+    )
+
+
+# With lazy kernel modules, the kernels of each (arch, hdim) are linked into their own shared library, which
+# flash_api.cpp loads on first use (kernel_registry.h). A module exports a table of its kernels.
+KERNEL_MODULE_TEMPLATE = """#include <cutlass/numeric_types.h>
+
+#include "flash.h"
+#include "kernel_registry.h"
+
+namespace {{
+
+flash::FwdKernelEntry const kFwdKernels[] = {{
+{FWD}
+}};
+
+flash::BwdKernelEntry const kBwdKernels[] = {{
+{BWD}
+}};
+
+}} // namespace
+
+extern "C" __attribute__((visibility("default"))) flash::KernelModule const* {SYMBOL}() {{
+    static flash::KernelModule const module{{flash::kKernelModuleVersion, {NUM_FWD}, kFwdKernels, {NUM_BWD}, kBwdKernels}};
+    return &module;
+}}
+"""
+
+
+def kernel_module_name(kernel: Kernel) -> str:
+    return f"sm{kernel.sm}_hdim{kernel.head_dim}"
+
+
+def kernel_module_source(kernels: List[Kernel]) -> str:
+    def cpp_bool(b):
+        return "true" if b else "false"
+    fwd, bwd = [], []
+    for k in kernels:
+        for arch in ([k.sm] if k.sm >= 90 else [80, 86]):
+            if k.direction == "fwd":
+                packgqa = k.packgqa or k.paged_kv or k.split or k.sm < 90
+                args = (f"{arch}, {DTYPE_MAP[k.dtype]}, {k.head_dim}, {k.head_dim_v}, {cpp_bool(k.split)}, {cpp_bool(k.paged_kv)}, "
+                        f"{cpp_bool(k.softcap)}, {cpp_bool(packgqa)}")
+                fwd.append(f"    {{{{{arch}, \"{k.dtype}\", {k.head_dim}, {k.head_dim_v}, {cpp_bool(k.split)}, {cpp_bool(k.paged_kv)}, "
+                           f"{cpp_bool(k.softcap)}, {cpp_bool(packgqa)}}}, &run_mha_fwd_<{args}>}},")
+            else:
+                args = f"{arch}, {DTYPE_MAP[k.dtype]}, {k.head_dim}, {cpp_bool(k.softcap)}"
+                bwd.append(f"    {{{{{arch}, \"{k.dtype}\", {k.head_dim}, {cpp_bool(k.softcap)}}}, &run_mha_bwd_<{args}>}},")
+    # Zero-length arrays aren't allowed, so a module without fwd or bwd kernels gets a placeholder entry
+    return KERNEL_MODULE_TEMPLATE.format(
+        FWD="\n".join(fwd) if fwd else "    {{0, \"\", 0, 0, false, false, false, false}, nullptr},",
+        BWD="\n".join(bwd) if bwd else "    {{0, \"\", 0, false}, nullptr},",
+        NUM_FWD=len(fwd), NUM_BWD=len(bwd), SYMBOL="flash_attn_kernel_module",
+    )
+
+
+def write_kernel_modules(kernels: List[Kernel], output_dir: Path) -> Dict[str, List[Kernel]]:
+    """Writes flash_module_{name}.cu for each (arch, hdim) and returns the kernels of each module."""
+    modules = {}
+    for kernel in kernels:
+        modules.setdefault(kernel_module_name(kernel), []).append(kernel)
+    output_dir.mkdir(parents=True, exist_ok=True)
+    for name, module_kernels in modules.items():
+        write_kernel(KERNEL_BATCH(kernel_module_source(module_kernels), f"flash_module_{name}.cu"), output_dir)
+    return modules
+
+
 def write_kernel(kernel: Kernel, autogen_dir: Path) -> None:
     prelude = """// Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
 // Splitting the different template instantiations to different files to speed up compilation.
@@ -192,16 +339,25 @@ def write_kernel(kernel: Kernel, autogen_dir: Path) -> None:
     (autogen_dir / kernel.filename).write_text(prelude + kernel.template)
 
 
-def main(output_dir: Optional[str]) -> None:
+def main(output_dir: Optional[str], manifest: Optional[Dict] = None) -> List[Kernel]:
+    """Returns the kernels that need to be compiled. With a manifest, these are only the kernels it lists, each in
+    its own file (there are few of them, so batching would only reduce build parallelism), and kernel_manifest.inc."""
     output_dir = Path(output_dir) if output_dir is not None else Path(__file__).parent
     output_dir.mkdir(parents=True, exist_ok=True)
     kernels_all = list(get_all_kernels())
+    if manifest is not None:
+        kernels = [k for k in kernels_all if in_manifest(k, manifest)]
+        for kernel in kernels:
+            write_kernel(kernel, output_dir)
+        (output_dir / "kernel_manifest.inc").write_text(manifest_table(kernels))
+        return kernels
     for kernel in kernels_all:
         write_kernel(kernel, output_dir)
     for kernel in batch_hdim(kernels_all):
         write_kernel(kernel, output_dir)
     for kernel in batch_softcap(kernels_all):
         write_kernel(kernel, output_dir)
+    return kernels_all
 
 
 if __name__ == "__main__":
@@ -218,5 +374,18 @@ if __name__ == "__main__":
         help="Where to generate the kernels "
         " will default to the current directory ",
     )
+    parser.add_argument(
+        "--lazy_modules",
+        action="store_true",
+        help="Also write the registration file of each per-(arch, hdim) kernel module, see kernel_registry.h",
+    )
+    parser.add_argument(
+        "--manifest",
+        default=None,
+        required=False,
+        help="JSON file listing the kernel configs to generate, see load_manifest",
+    )
     args = parser.parse_args()
-    main(args.output_dir)
+    kernels = main(args.output_dir, load_manifest(args.manifest) if args.manifest is not None else None)
+    if args.lazy_modules:
+        write_kernel_modules(kernels, Path(args.output_dir))
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 inline bool should_pack_gqa(bool varlen_q, int seqlen_q, int qhead_per_khead, int blockM) {
@@ -22,6 +24,7 @@ inline bool should_pack_gqa(bool varlen_q, int seqlen_q, int qhead_per_khead, in
 // splits as that would incur more HBM reads/writes.
 // So we find the best efficiency, then find the smallest number of splits that gets 85%
 // of the best efficiency.
+// Baseline heuristic, compared against SplitKVCostModel in benchmark_split_heuristic.cpp.
 inline int num_splits_heuristic(int total_mblocks, int num_SMs, int num_n_blocks, int num_m_blocks, int size_one_kv_head, bool is_causal_or_local, int max_splits) {
     // If we have enough to almost fill the SMs, then just use 1 split
     // However, in the case of super long seqlen where each head of KV doesn't even fit into
@@ -57,3 +60,61 @@ inline int num_splits_heuristic(int total_mblocks, int num_SMs, int num_n_blocks
     }
     return 1;
 }
+
+// Split-KV selection by predicted latency instead of wave efficiency alone.
+// All sizes are in bytes and all times in ns. The device-dependent inputs (SM count, L2 size, throughputs)
+// are fields so that callers can plug in what they know about the device (see get_num_splits).
+struct SplitKVProblem {
+    int total_mblocks;     // Number of thread blocks without splitting, i.e. batch * num_heads(_k) * num_m_blocks
+    int num_m_blocks;      // Number of m_blocks reading the same KV head
+    int num_n_blocks;
+    float tile_flops;      // QK^T + PV for one (m_block, n_block) tile
+    float tile_kv_bytes;   // K and V for one n_block
+    float size_one_kv_head;
+    float o_partial_bytes; // O_partial + LSE_partial (fp32) for one split, read back by the combine kernel
+    float o_bytes;         // Final O written by the combine kernel
+};
+
+struct SplitKVCostModel {
+    int num_SMs;
+    int size_l2 = 50 * 1024 * 1024;
+    float flops_per_ns_per_sm = 7500.f;  // H100 SXM dense bf16: ~990 TFLOPS / 132 SMs
+    float hbm_bytes_per_ns = 3350.f;     // H100 SXM: 3.35 TB/s
+    float combine_launch_ns = 3000.f;    // Fixed cost of launching flash_fwd_combine_kernel
+
+    float predict_ns(SplitKVProblem const& p, int num_splits) const {
+        int const num_ctas = p.total_mblocks * num_splits;
+        int const n_blocks_per_split = (p.num_n_blocks + num_splits - 1) / num_splits;
+        int const num_waves = (num_ctas + num_SMs - 1) / num_SMs;
+        float const compute_ns = float(num_waves) * float(n_blocks_per_split) * p.tile_flops / flops_per_ns_per_sm;
+        // A few thread blocks can't saturate HBM, bandwidth scales with the number of busy SMs
+        int const active_sms = std::min(num_ctas, num_SMs);
+        float const bandwidth = hbm_bytes_per_ns * float(active_sms) / float(num_SMs);
+        // The m_blocks of a head that run in the same wave stream K/V roughly in lockstep and share it through L2.
+        // If they span several waves, each wave reloads K/V from HBM unless the head's chunk stays in L2,
+        // which is what splitting helps with for long seqlen_k.
+        int const waves_per_head = (p.num_m_blocks + num_SMs - 1) / num_SMs;
+        bool const chunk_fits_in_l2 = p.size_one_kv_head / float(num_splits) <= float(size_l2);
+        float const kv_reloads = chunk_fits_in_l2 ? 1.f : float(waves_per_head);
+        float const kv_bytes_read = float(num_ctas) * float(n_blocks_per_split) * p.tile_kv_bytes / float(p.num_m_blocks) * kv_reloads;
+        float const hbm_bytes = kv_bytes_read + (num_splits > 1 ? float(num_splits) * p.o_partial_bytes : p.o_bytes);
+        float const mainloop_ns = std::max(compute_ns, hbm_bytes / bandwidth);
+        // flash_fwd_combine_kernel reads all partial outputs and writes O
+        float const combine_ns = num_splits > 1
+            ? combine_launch_ns + (float(num_splits) * p.o_partial_bytes + p.o_bytes) / hbm_bytes_per_ns
+            : 0.f;
+        return mainloop_ns + combine_ns;
+    }
+
+    // Smallest number of splits whose predicted latency is within 2% of the best one
+    int num_splits(SplitKVProblem const& p, int max_splits) const {
+        max_splits = std::max(1, std::min({max_splits, num_SMs, p.num_n_blocks}));
+        std::vector<float> latency(max_splits);
+        for (int s = 1; s <= max_splits; ++s) { latency[s - 1] = predict_ns(p, s); }
+        float const best = *std::min_element(latency.begin(), latency.end());
+        for (int s = 1; s <= max_splits; ++s) {
+            if (latency[s - 1] <= 1.02f * best) { return s; }
+        }
+        return 1;
+    }
+};
@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Which kernel instantiations are compiled into this build. By default all of them are (minus the ones removed
+// with FLASHATTENTION_DISABLE_*). When building with FLASH_ATTENTION_KERNEL_MANIFEST, setup.py defines
+// FLASHATTENTION_KERNEL_MANIFEST and generate_kernels.py writes the list of compiled kernels to
+// instantiations_manifest/kernel_manifest.inc, so that dispatching to any other kernel raises an error
+// listing what is available instead of failing to link.
+
+#include <array>
+#include <string>
+#include <type_traits>
+
+namespace flash {
+
+// Template arguments of run_mha_fwd_ / run_mha_bwd_, with the data type as its name in generate_kernels.py
+struct FwdKernelConfig {
+    int arch;
+    char const* dtype;
+    int headdim, headdim_v;
+    bool split, paged_kv_non_tma, softcap, pack_gqa;
+};
+
+struct BwdKernelConfig {
+    int arch;
+    char const* dtype;
+    int headdim;
+    bool softcap;
+};
+
+#ifdef FLASHATTENTION_KERNEL_MANIFEST
+#include "instantiations_manifest/kernel_manifest.inc"
+#endif
+
+namespace detail {
+
+constexpr bool str_equal(char const* a, char const* b) {
+    while (*a != '\0' && *a == *b) { ++a; ++b; }
+    return *a == *b;
+}
+
+} // namespace detail
+
+constexpr bool is_compiled(FwdKernelConfig const& c) {
+    #ifdef FLASHATTENTION_KERNEL_MANIFEST
+    for (FwdKernelConfig const& k : kCompiledFwdKernels) {
+        if (k.arch == c.arch && detail::str_equal(k.dtype, c.dtype) && k.headdim == c.headdim && k.headdim_v == c.headdim_v
+            && k.split == c.split && k.paged_kv_non_tma == c.paged_kv_non_tma && k.softcap == c.softcap && k.pack_gqa == c.pack_gqa) {
+            return true;
+        }
+    }
+    return false;
+    #else
+    return true;
+    #endif
+}
+
+constexpr bool is_compiled(BwdKernelConfig const& c) {
+    #ifdef FLASHATTENTION_KERNEL_MANIFEST
+    for (BwdKernelConfig const& k : kCompiledBwdKernels) {
+        if (k.arch == c.arch && detail::str_equal(k.dtype, c.dtype) && k.headdim == c.headdim && k.softcap == c.softcap) {
+            return true;
+        }
+    }
+    return false;
+    #else
+    return true;
+    #endif
+}
+
+inline std::string to_string(FwdKernelConfig const& c) {
+    return "sm" + std::to_string(c.arch) + " " + c.dtype + " hdim" + std::to_string(c.headdim)
+        + (c.headdim_v != c.headdim ? "x" + std::to_string(c.headdim_v) : "")
+        + (c.split ? " split" : "") + (c.paged_kv_non_tma ? " paged" : "") + (c.softcap ? " softcap" : "")
+        + (c.pack_gqa ? " packgqa" : "");
+}
+
+inline std::string to_string(BwdKernelConfig const& c) {
+    return "sm" + std::to_string(c.arch) + " " + c.dtype + " hdim" + std::to_string(c.headdim) + (c.softcap ? " softcap" : "");
+}
+
+// Comma-separated list of the kernels in the manifest, for error messages
+template <typename Config>
+inline std::string compiled_kernels_string() {
+    #ifdef FLASHATTENTION_KERNEL_MANIFEST
+    std::string s;
+    auto append = [&](auto const& kernels) {
+        for (auto const& k : kernels) { s += (s.empty() ? "" : ", ") + to_string(k); }
+    };
+    if constexpr (std::is_same_v<Config, FwdKernelConfig>) { append(kCompiledFwdKernels); } else { append(kCompiledBwdKernels); }
+    return s.empty() ? "none" : s;
+    #else
+    return "all";
+    #endif
+}
+
+} // namespace flash
@@ -0,0 +1,143 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Lazily loaded kernel modules. With FLASH_ATTENTION_LAZY_KERNELS, setup.py links the kernels of each (arch, hdim)
+// into their own shared library, flash_attn_3_kernels_sm{arch}_hdim{hdim}, next to flash_attn_3_cuda. Importing
+// flash_attn_3_cuda then loads no kernels, and run_mha_fwd / run_mha_bwd load a module the first time one of its
+// kernels is needed, so a process only pages in the kernels of the head dims it uses.
+// A module exports flash_attn_kernel_module(), which returns its table of kernels (written by generate_kernels.py).
+
+#include <string>
+#include <vector>
+
+#include "kernel_manifest.h"
+
+struct Flash_fwd_params;
+struct Flash_bwd_params;
+typedef struct CUstream_st* cudaStream_t;
+
+#ifdef FLASHATTENTION_LAZY_KERNELS
+#include <chrono>
+#include <dlfcn.h>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#endif
+
+namespace flash {
+
+// Bumped whenever KernelModule, the entries or the params structs change, so that a stale module is rejected
+static constexpr int kKernelModuleVersion = 1;
+
+using FwdKernelFn = void (*)(Flash_fwd_params &, cudaStream_t);
+using BwdKernelFn = void (*)(Flash_bwd_params &, cudaStream_t);
+
+struct FwdKernelEntry {
+    FwdKernelConfig config;
+    FwdKernelFn run;
+};
+
+struct BwdKernelEntry {
+    BwdKernelConfig config;
+    BwdKernelFn run;
+};
+
+struct KernelModule {
+    int version;
+    int num_fwd;
+    FwdKernelEntry const* fwd;
+    int num_bwd;
+    BwdKernelEntry const* bwd;
+};
+
+// What was loaded, for diagnostics. error is empty if the module was loaded.
+struct KernelModuleRecord {
+    std::string name, path, error;
+    double load_time_ms;
+};
+
+#ifdef FLASHATTENTION_LAZY_KERNELS
+
+// Name of the module holding a kernel, as kernel_module_name in generate_kernels.py. Sm86 uses the Sm80 module.
+inline std::string kernel_module_name(int arch, int headdim) {
+    return "sm" + std::to_string(arch < 90 ? 80 : arch) + "_hdim" + std::to_string(headdim);
+}
+
+class KernelRegistry {
+public:
+    static KernelRegistry& instance() {
+        static KernelRegistry registry;
+        return registry;
+    }
+
+    // nullptr if the module can't be loaded or doesn't have the kernel. The error is then in modules().
+    FwdKernelFn fwd(FwdKernelConfig const& config) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        load(kernel_module_name(config.arch, config.headdim));
+        auto it = fwd_.find(to_string(config));
+        return it != fwd_.end() ? it->second : nullptr;
+    }
+
+    BwdKernelFn bwd(BwdKernelConfig const& config) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        load(kernel_module_name(config.arch, config.headdim));
+        auto it = bwd_.find(to_string(config));
+        return it != bwd_.end() ? it->second : nullptr;
+    }
+
+    std::vector<KernelModuleRecord> modules() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return records_;
+    }
+
+    // Path the module would be loaded from: same directory and file name suffix (e.g. .cpython-310-x86_64-linux-gnu.so)
+    // as the shared library this registry is in
+    static std::string module_path(std::string const& name) {
+        Dl_info info;
+        std::string self = dladdr(reinterpret_cast<void *>(&KernelRegistry::instance), &info) && info.dli_fname ? info.dli_fname : "";
+        size_t const slash = self.rfind('/');
+        std::string const dir = slash == std::string::npos ? "." : self.substr(0, slash);
+        std::string const base = slash == std::string::npos ? self : self.substr(slash + 1);
+        size_t const dot = base.find('.');
+        std::string const suffix = dot == std::string::npos ? ".so" : base.substr(dot);
+        return dir + "/flash_attn_3_kernels_" + name + suffix;
+    }
+
+private:
+    KernelRegistry() = default;
+
+    // Loads the module once. Failures are recorded and not retried.
+    void load(std::string const& name) {
+        if (!loaded_.emplace(name).second) { return; }
+        KernelModuleRecord record{name, module_path(name), "", 0.0};
+        auto const start = std::chrono::steady_clock::now();
+        // Modules are never unloaded: the kernel function pointers must stay valid
+        void* handle = dlopen(record.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            char const* error = dlerror();
+            record.error = error ? error : "dlopen failed";
+        } else if (auto get_module = reinterpret_cast<KernelModule const* (*)()>(dlsym(handle, "flash_attn_kernel_module")); !get_module) {
+            record.error = "missing flash_attn_kernel_module";
+        } else if (KernelModule const* module = get_module(); module->version != kKernelModuleVersion) {
+            record.error = "module version " + std::to_string(module->version) + ", expected " + std::to_string(kKernelModuleVersion);
+        } else {
+            for (int i = 0; i < module->num_fwd; ++i) { fwd_[to_string(module->fwd[i].config)] = module->fwd[i].run; }
+            for (int i = 0; i < module->num_bwd; ++i) { bwd_[to_string(module->bwd[i].config)] = module->bwd[i].run; }
+        }
+        record.load_time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        records_.push_back(std::move(record));
+    }
+
+    mutable std::mutex mutex_;
+    std::unordered_set<std::string> loaded_;
+    std::unordered_map<std::string, FwdKernelFn> fwd_;
+    std::unordered_map<std::string, BwdKernelFn> bwd_;
+    std::vector<KernelModuleRecord> records_;
+};
+
+#endif  // FLASHATTENTION_LAZY_KERNELS
+
+} // namespace flash
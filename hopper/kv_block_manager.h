@@ -0,0 +1,223 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Host-side allocator for the pages of a paged KV cache, i.e. the rows of the page_table that mha_fwd reads
+// (num_pages pages of page_size tokens, k_cache / v_cache of shape (num_pages, page_size, h_k, d)).
+// Pages are reference counted so that sequences forked from one another (beam search, parallel sampling) or
+// started from a cached prefix share the pages of their common prefix. Full pages are never written again, so they
+// can be shared as is. The last page of a sequence can be partial, and appending to it while it is shared would
+// overwrite the other sequences' tokens, so append copies it to a new page first (copy-on-write) and returns the
+// page copies for the caller to apply to k_cache / v_cache before writing the new tokens.
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace flash {
+
+struct PageCopy {
+    int src, dst;
+};
+
+class KVBlockManager {
+public:
+    KVBlockManager(int num_pages, int page_size) : page_size_(page_size), refcount_(num_pages, 0) {
+        assert(num_pages > 0 && page_size > 0);
+        // Hand out low page indices first
+        free_pages_.reserve(num_pages);
+        for (int page = num_pages - 1; page >= 0; --page) { free_pages_.push_back(page); }
+    }
+
+    int num_pages() const { return int(refcount_.size()); }
+    int page_size() const { return page_size_; }
+    int num_free_pages() const { return int(free_pages_.size()); }
+    int refcount(int page) const { return refcount_[page]; }
+
+    bool has_sequence(int64_t seq_id) const { return sequences_.count(seq_id) > 0; }
+    int seqlen(int64_t seq_id) const { return sequences_.at(seq_id).seqlen; }
+    std::vector<int> const& pages(int64_t seq_id) const { return sequences_.at(seq_id).pages; }
+
+    // New sequence holding the first prefix_len tokens of prefix_pages, which must already be allocated
+    // (e.g. the pages of a cached prefix). They are shared, not copied.
+    int64_t add_sequence(std::vector<int> const& prefix_pages = {}, int prefix_len = 0) {
+        assert(prefix_len <= int(prefix_pages.size()) * page_size_);
+        assert(prefix_len > (int(prefix_pages.size()) - 1) * page_size_);
+        for (int page : prefix_pages) { incref(page); }
+        int64_t const seq_id = next_seq_id_++;
+        sequences_[seq_id] = Sequence{prefix_pages, prefix_len};
+        return seq_id;
+    }
+
+    // New sequence sharing all of seq_id's pages
+    int64_t fork(int64_t seq_id) {
+        Sequence const& seq = sequences_.at(seq_id);
+        return add_sequence(seq.pages, seq.seqlen);
+    }
+
+    void free_sequence(int64_t seq_id) {
+        auto it = sequences_.find(seq_id);
+        assert(it != sequences_.end());
+        for (int page : it->second.pages) { decref(page); }
+        sequences_.erase(it);
+    }
+
+    // Free pages that append(seq_id, num_tokens) would take, including the copy-on-write of a shared last page
+    int pages_needed(int64_t seq_id, int num_tokens) const {
+        Sequence const& seq = sequences_.at(seq_id);
+        return pages_needed_with(seq, num_tokens, seq.pages.empty() ? 0 : refcount_[seq.pages.back()]);
+    }
+
+    // Makes room for num_tokens more tokens at the end of the sequence. Returns false, and changes nothing, if there
+    // aren't enough free pages. Otherwise appends to copies the pages to copy before writing the new tokens.
+    bool append(int64_t seq_id, int num_tokens, std::vector<PageCopy>* copies) {
+        if (pages_needed(seq_id, num_tokens) > num_free_pages()) { return false; }
+        append_unchecked(sequences_.at(seq_id), num_tokens, copies);
+        return true;
+    }
+
+    // append for several sequences, all or nothing: returns false and changes nothing if the pages for all of them
+    // aren't available. Sequences sharing a last page that all append only need n - 1 copies of it.
+    bool append_batch(std::vector<int64_t> const& seq_ids, std::vector<int> const& num_tokens, std::vector<PageCopy>* copies) {
+        assert(seq_ids.size() == num_tokens.size());
+        // References to each shared last page that are left after the previous sequences copied it
+        std::unordered_map<int, int> last_page_refcount;
+        int total = 0;
+        for (size_t i = 0; i < seq_ids.size(); ++i) {
+            Sequence const& seq = sequences_.at(seq_ids[i]);
+            if (seq.pages.empty()) {
+                total += pages_needed_with(seq, num_tokens[i], 0);
+                continue;
+            }
+            auto it = last_page_refcount.emplace(seq.pages.back(), refcount_[seq.pages.back()]).first;
+            int const needed = pages_needed_with(seq, num_tokens[i], it->second);
+            if (needed > 0 && seq.seqlen % page_size_ != 0 && it->second > 1) { --it->second; }  // It will copy
+            total += needed;
+        }
+        if (total > num_free_pages()) { return false; }
+        for (size_t i = 0; i < seq_ids.size(); ++i) { append_unchecked(sequences_.at(seq_ids[i]), num_tokens[i], copies); }
+        return true;
+    }
+
+    // Rows of page_table (num_seqs x max_pages_per_seq, row-major) and seqused_k for these sequences, in order.
+    // Entries past the end of a sequence are 0, which is a valid page that the kernels won't read.
+    void fill_page_table(std::vector<int64_t> const& seq_ids, int max_pages_per_seq, int* page_table, int* seqused_k) const {
+        for (size_t i = 0; i < seq_ids.size(); ++i) {
+            Sequence const& seq = sequences_.at(seq_ids[i]);
+            assert(int(seq.pages.size()) <= max_pages_per_seq);
+            int* row = page_table + i * max_pages_per_seq;
+            for (int j = 0; j < max_pages_per_seq; ++j) { row[j] = j < int(seq.pages.size()) ? seq.pages[j] : 0; }
+            seqused_k[i] = seq.seqlen;
+        }
+    }
+
+    // Ids of the live sequences, in increasing order
+    std::vector<int64_t> sequence_ids() const {
+        std::vector<int64_t> seq_ids;
+        seq_ids.reserve(sequences_.size());
+        for (auto const& [seq_id, seq] : sequences_) { seq_ids.push_back(seq_id); }
+        std::sort(seq_ids.begin(), seq_ids.end());
+        return seq_ids;
+    }
+
+    // Moves pages held by a single sequence to free pages, in order: after each move dst holds src's tokens and src
+    // is free. Only the bookkeeping: the caller copies the pages of k_cache / v_cache (plan_compaction in
+    // kv_compaction.h plans such moves).
+    void move_pages(std::vector<PageCopy> const& moves) {
+        // Page each moved page ended up in, by the page it started in
+        std::unordered_map<int, int> start_of, end_of;
+        for (PageCopy const& move : moves) {
+            assert(refcount_[move.src] == 1);
+            take_free_page(move.dst);
+            refcount_[move.dst] = 1;
+            refcount_[move.src] = 0;
+            free_pages_.push_back(move.src);
+            auto it = start_of.find(move.src);
+            int const start = it != start_of.end() ? it->second : move.src;
+            if (it != start_of.end()) { start_of.erase(it); }
+            start_of[move.dst] = start;
+        }
+        for (auto const& [end, start] : start_of) { end_of[start] = end; }
+        for (auto& [seq_id, seq] : sequences_) {
+            for (int& page : seq.pages) {
+                auto it = end_of.find(page);
+                if (it != end_of.end()) { page = it->second; }
+            }
+        }
+    }
+
+    int max_num_pages(std::vector<int64_t> const& seq_ids) const {
+        int max_pages = 0;
+        for (int64_t seq_id : seq_ids) { max_pages = std::max(max_pages, int(sequences_.at(seq_id).pages.size())); }
+        return max_pages;
+    }
+
+    // For holders of pages other than sequences, e.g. a prefix cache. incref of a free page takes it off the free list.
+    void incref(int page) {
+        if (refcount_[page]++ == 0) { take_free_page(page); }
+    }
+
+    void decref(int page) {
+        assert(refcount_[page] > 0);
+        if (--refcount_[page] == 0) { free_pages_.push_back(page); }
+    }
+
+    // Takes a free page with refcount 1, or returns -1 if there is none
+    int allocate_page() {
+        if (free_pages_.empty()) { return -1; }
+        int const page = free_pages_.back();
+        free_pages_.pop_back();
+        refcount_[page] = 1;
+        return page;
+    }
+
+private:
+    struct Sequence {
+        std::vector<int> pages;
+        int seqlen;
+    };
+
+    // With this many references to the last page
+    int pages_needed_with(Sequence const& seq, int num_tokens, int last_page_refcount) const {
+        if (num_tokens <= 0) { return 0; }
+        int const new_pages = (seq.seqlen + num_tokens + page_size_ - 1) / page_size_ - int(seq.pages.size());
+        bool const copy_last = seq.seqlen % page_size_ != 0 && last_page_refcount > 1;
+        return new_pages + int(copy_last);
+    }
+
+    void append_unchecked(Sequence& seq, int num_tokens, std::vector<PageCopy>* copies) {
+        if (num_tokens <= 0) { return; }
+        if (seq.seqlen % page_size_ != 0 && refcount_[seq.pages.back()] > 1) {
+            int const dst = allocate_page();
+            copies->push_back({seq.pages.back(), dst});
+            decref(seq.pages.back());
+            seq.pages.back() = dst;
+        }
+        seq.seqlen += num_tokens;
+        while (int(seq.pages.size()) * page_size_ < seq.seqlen) { seq.pages.push_back(allocate_page()); }
+    }
+
+    // Removes a page from the free list, for incref of a page that nothing holds
+    void take_free_page(int page) {
+        for (size_t i = 0; i < free_pages_.size(); ++i) {
+            if (free_pages_[i] == page) {
+                free_pages_[i] = free_pages_.back();
+                free_pages_.pop_back();
+                return;
+            }
+        }
+        assert(false && "page is neither free nor held");
+    }
+
+    int page_size_;
+    std::vector<int> refcount_;
+    std::vector<int> free_pages_;
+    std::unordered_map<int64_t, Sequence> sequences_;
+    int64_t next_seq_id_ = 0;
+};
+
+} // namespace flash
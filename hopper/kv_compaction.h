@@ -0,0 +1,138 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Compaction of a paged KV cache managed by KVBlockManager. After a while of allocating and freeing, the pages of a
+// sequence are scattered over the cache. plan_compaction plans page moves that give each sequence a run of
+// consecutive pages, which keeps the reads of its KV sequential (and lets page_size < kBlockN tiles span consecutive
+// pages). A move (src, dst) copies page src to the free page dst, after which src is free; the moves are in order.
+//
+// Only pages held by one sequence and nothing else are moved: pages shared by forked sequences or held by a
+// PrefixCache stay where they are, and a sequence's run is made of its other pages. Sequences whose pages are already
+// consecutive are left alone, and the others are placed first-fit around them. A cycle of moves (a page whose target
+// holds a page that has to go where the first one is) goes through a free page, so there must be at least one.
+// With max_moves > 0 only the first max_moves moves are returned, to bound the bandwidth spent per call: the cache is
+// then consistent but only partly compacted, and planning again continues from there.
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "kv_block_manager.h"
+
+namespace flash {
+
+// Number of places where a sequence's next page isn't the one after its current page, over all these sequences
+inline int num_page_breaks(KVBlockManager const& manager, std::vector<int64_t> const& seq_ids) {
+    int breaks = 0;
+    for (int64_t seq_id : seq_ids) {
+        std::vector<int> const& pages = manager.pages(seq_id);
+        for (size_t i = 1; i < pages.size(); ++i) { breaks += pages[i] != pages[i - 1] + 1; }
+    }
+    return breaks;
+}
+
+inline std::vector<PageCopy> plan_compaction(KVBlockManager const& manager, int max_moves = 0) {
+    int const num_pages = manager.num_pages();
+    std::vector<int64_t> const seq_ids = manager.sequence_ids();
+    // References from sequences to each page
+    std::vector<int> seq_refs(num_pages, 0);
+    for (int64_t seq_id : seq_ids) {
+        for (int page : manager.pages(seq_id)) { ++seq_refs[page]; }
+    }
+    auto movable = [&](int page) { return manager.refcount(page) == 1 && seq_refs[page] == 1; };
+
+    // The movable pages of each sequence, in order, for the sequences where they aren't consecutive
+    std::vector<std::vector<int>> runs;
+    std::vector<bool> fixed(num_pages, false);
+    for (int page = 0; page < num_pages; ++page) { fixed[page] = manager.refcount(page) > 0 && !movable(page); }
+    for (int64_t seq_id : seq_ids) {
+        std::vector<int> run;
+        for (int page : manager.pages(seq_id)) {
+            if (movable(page)) { run.push_back(page); }
+        }
+        bool consecutive = true;
+        for (size_t i = 1; i < run.size(); ++i) { consecutive &= run[i] == run[i - 1] + 1; }
+        if (consecutive) {
+            for (int page : run) { fixed[page] = true; }
+        } else {
+            runs.push_back(std::move(run));
+        }
+    }
+
+    // First-fit target pages for each run. A run that doesn't fit stays where it is, which can take slots given to
+    // the runs before it, so the placement starts over without it.
+    std::unordered_map<int, int> target;  // By current page, for the pages that move
+    std::vector<bool> placed(runs.size(), true);
+    for (bool done = false; !done; ) {
+        done = true;
+        target.clear();
+        std::vector<bool> used = fixed;
+        for (size_t r = 0; r < runs.size() && done; ++r) {
+            if (!placed[r]) { continue; }
+            int const len = runs[r].size();
+            int start = -1;
+            for (int page = 0, free_len = 0; page < num_pages && start < 0; ++page) {
+                free_len = used[page] ? 0 : free_len + 1;
+                if (free_len == len) { start = page - len + 1; }
+            }
+            if (start < 0) {
+                placed[r] = false;
+                for (int page : runs[r]) { fixed[page] = true; }
+                done = false;
+                continue;
+            }
+            for (int i = 0; i < len; ++i) {
+                used[start + i] = true;
+                if (runs[r][i] != start + i) { target[runs[r][i]] = start + i; }
+            }
+        }
+    }
+
+    // Moves: a page goes to its target as soon as that is free. When none can, one of them steps aside to a free page
+    // that isn't anyone's target, which breaks the cycle.
+    std::set<int> free_pages;
+    for (int page = 0; page < num_pages; ++page) {
+        if (manager.refcount(page) == 0) { free_pages.insert(page); }
+    }
+    std::unordered_map<int, int> waiting;  // Page waiting for each target
+    std::vector<int> ready;
+    for (auto const& [page, t] : target) {
+        waiting[t] = page;
+        if (free_pages.count(t)) { ready.push_back(t); }
+    }
+    std::sort(ready.begin(), ready.end(), std::greater<int>());  // Deterministic order, lowest target first
+    std::vector<PageCopy> moves;
+    auto move = [&](int src, int dst) {
+        moves.push_back({src, dst});
+        free_pages.erase(dst);
+        free_pages.insert(src);
+        if (waiting.count(src)) { ready.push_back(src); }
+    };
+    while (!waiting.empty() && (max_moves <= 0 || int(moves.size()) < max_moves)) {
+        if (!ready.empty()) {
+            int const t = ready.back();
+            ready.pop_back();
+            int const page = waiting.at(t);
+            waiting.erase(t);
+            move(page, t);
+            continue;
+        }
+        int aside = -1;
+        for (int page : free_pages) {
+            if (!waiting.count(page)) { aside = page; break; }
+        }
+        if (aside < 0) { break; }
+        auto const [t, page] = *waiting.begin();
+        move(page, aside);
+        waiting[t] = aside;
+    }
+    return moves;
+}
+
+} // namespace flash
@@ -0,0 +1,217 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Tiers for the pages of a paged KV cache that doesn't fit in device memory. The pages that KVBlockManager hands out
+// (and that its page tables hold) are then logical pages, and KVPageStore keeps each one in a slot of one of three
+// tiers: the device pool (k_cache / v_cache, the only one the kernels read), pinned host memory, and a spill file.
+// Before a forward pass, make_resident brings the pages of its page table to the device, in page table order,
+// demoting the least recently used device pages to the host and the least recently used host pages to the file to
+// make room. Pages of the current step are pinned so that prefetching the next step's pages can't demote them.
+// Moving a page down a tier when all of them are full needs a free slot somewhere, so the tiers together need more
+// slots than there are pages in use.
+// KVPageStore only does the bookkeeping and returns the transfers to do, in order: moving the data is up to the
+// caller (TieredKVCache in tiered_kv_cache.h), so the policy can be tested without a device.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace flash {
+
+enum class Tier : int { kNone = -1, kDevice = 0, kHost = 1, kFile = 2 };
+
+struct PageTransfer {
+    int page;
+    Tier from;  // kNone for a page that has no data yet: there is nothing to copy
+    int from_slot;
+    Tier to;
+    int to_slot;
+};
+
+class KVPageStore {
+public:
+    struct Stats {
+        int64_t num_device_hits = 0;  // Pages already on the device when needed
+        int64_t num_host_loads = 0;   // Host -> device
+        int64_t num_file_loads = 0;   // File -> device
+        int64_t num_host_spills = 0;  // Device -> host
+        int64_t num_file_spills = 0;  // Host -> file
+    };
+
+    KVPageStore(int num_pages, int num_device_slots, int num_host_slots, int num_file_slots)
+        : location_(num_pages, {Tier::kNone, -1}), last_use_(num_pages, 0), pinned_(num_pages, false) {
+        int const num_slots[3] = {num_device_slots, num_host_slots, num_file_slots};
+        for (int tier = 0; tier < 3; ++tier) {
+            for (int slot = num_slots[tier] - 1; slot >= 0; --slot) { free_slots_[tier].push_back(slot); }
+        }
+    }
+
+    int num_pages() const { return int(location_.size()); }
+    Tier tier(int page) const { return location_[page].first; }
+    int slot(int page) const { return location_[page].second; }
+    int num_free_slots(Tier tier) const { return int(free_slots_[int(tier)].size()); }
+    Stats const& stats() const { return stats_; }
+
+    // Brings pages to the device, in order, and appends the transfers this takes. With pin, the pages stay on the
+    // device until the next call with pin (the pages of the previous step are unpinned first). Pages this call brings
+    // in are not demoted to make room for the later ones. Returns false if the device can't hold them all, after
+    // bringing in as many as it can: the transfers so far still have to be done.
+    bool make_resident(std::vector<int> const& pages, bool pin, std::vector<PageTransfer>* transfers) {
+        if (pin) {
+            for (int page : pinned_pages_) { pinned_[page] = false; }
+            pinned_pages_.clear();
+        }
+        std::vector<int> protected_pages;  // Pinned for this call only
+        bool ok = true;
+        for (int page : pages) {
+            touch(page);
+            if (!pinned_[page]) {
+                pinned_[page] = true;
+                (pin ? pinned_pages_ : protected_pages).push_back(page);
+            }
+            if (tier(page) == Tier::kDevice) {
+                ++stats_.num_device_hits;
+                continue;
+            }
+            int const device_slot = take_slot(Tier::kDevice, transfers);
+            if (device_slot < 0) { ok = false; break; }
+            move(page, Tier::kDevice, device_slot, transfers);
+        }
+        for (int page : protected_pages) { pinned_[page] = false; }
+        return ok;
+    }
+
+    // Forgets a page (e.g. freed by KVBlockManager) and frees its slot
+    void discard(int page) {
+        if (tier(page) == Tier::kNone) { return; }
+        release_slot(page);
+        location_[page] = {Tier::kNone, -1};
+    }
+
+private:
+    void touch(int page) {
+        if (tier(page) == Tier::kDevice || tier(page) == Tier::kHost) {
+            lru_[int(tier(page))].erase({last_use_[page], page});
+            lru_[int(tier(page))].insert({clock_ + 1, page});
+        }
+        last_use_[page] = ++clock_;
+    }
+
+    // A free slot of the tier, making one by demoting its least recently used unpinned page if needed.
+    // -1 if there is none.
+    int take_slot(Tier t, std::vector<PageTransfer>* transfers) {
+        std::vector<int>& free = free_slots_[int(t)];
+        if (free.empty() && t != Tier::kFile) {
+            auto& lru = lru_[int(t)];
+            auto victim = std::find_if(lru.begin(), lru.end(), [&](auto const& entry) { return !pinned_[entry.second]; });
+            if (victim != lru.end()) {
+                int const page = victim->second;
+                Tier const lower = Tier(int(t) + 1);
+                int const lower_slot = take_slot(lower, transfers);
+                if (lower_slot >= 0) { move(page, lower, lower_slot, transfers); }
+            }
+        }
+        if (free.empty()) { return -1; }
+        int const slot = free.back();
+        free.pop_back();
+        return slot;
+    }
+
+    void release_slot(int page) {
+        Tier const t = tier(page);
+        if (t == Tier::kDevice || t == Tier::kHost) { lru_[int(t)].erase({last_use_[page], page}); }
+        free_slots_[int(t)].push_back(slot(page));
+    }
+
+    void move(int page, Tier to, int to_slot, std::vector<PageTransfer>* transfers) {
+        Tier const from = tier(page);
+        transfers->push_back({page, from, slot(page), to, to_slot});
+        if (from == Tier::kHost && to == Tier::kDevice) { ++stats_.num_host_loads; }
+        if (from == Tier::kFile && to == Tier::kDevice) { ++stats_.num_file_loads; }
+        if (to == Tier::kHost) { ++stats_.num_host_spills; }
+        if (to == Tier::kFile) { ++stats_.num_file_spills; }
+        if (from != Tier::kNone) { release_slot(page); }
+        location_[page] = {to, to_slot};
+        if (to == Tier::kDevice || to == Tier::kHost) { lru_[int(to)].insert({last_use_[page], page}); }
+    }
+
+    std::vector<std::pair<Tier, int>> location_;
+    std::vector<int64_t> last_use_;
+    std::vector<bool> pinned_;
+    std::vector<int> pinned_pages_;
+    std::vector<int> free_slots_[3];
+    std::set<std::pair<int64_t, int>> lru_[2];  // (last use, page) of the device and host pages
+    int64_t clock_ = 0;
+    Stats stats_;
+};
+
+// Spill file for the file tier: a header, then num_slots slots of slot_bytes (the K page, then the V page), mapped
+// into memory. The header is padded to 4096 bytes so that slots start page-aligned if slot_bytes is a multiple of 4096.
+struct SpillFileHeader {
+    char magic[8];  // "FA3KVSPL"
+    uint32_t version;
+    uint32_t header_bytes;
+    int64_t slot_bytes;
+    int64_t num_slots;
+};
+
+class SpillFile {
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr int64_t kHeaderBytes = 4096;
+
+    // Creates (or truncates) the file. error() is non-empty if that failed.
+    SpillFile(std::string const& path, int64_t slot_bytes, int64_t num_slots)
+        : path_(path), slot_bytes_(slot_bytes), num_slots_(num_slots) {
+        size_ = kHeaderBytes + slot_bytes * num_slots;
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd_ < 0) { error_ = "Could not create spill file " + path + ": " + std::strerror(errno); return; }
+        if (::ftruncate(fd_, size_) != 0) { error_ = "Could not resize spill file " + path + ": " + std::strerror(errno); return; }
+        void* data = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED) { error_ = "Could not map spill file " + path + ": " + std::strerror(errno); return; }
+        data_ = static_cast<char*>(data);
+        SpillFileHeader header{{'F', 'A', '3', 'K', 'V', 'S', 'P', 'L'}, kVersion, uint32_t(kHeaderBytes), slot_bytes, num_slots};
+        std::memcpy(data_, &header, sizeof(header));
+    }
+
+    ~SpillFile() {
+        if (data_) { ::munmap(data_, size_); }
+        if (fd_ >= 0) { ::close(fd_); }
+    }
+
+    SpillFile(SpillFile const&) = delete;
+    SpillFile& operator=(SpillFile const&) = delete;
+
+    std::string const& error() const { return error_; }
+    std::string const& path() const { return path_; }
+    int64_t slot_bytes() const { return slot_bytes_; }
+    int64_t num_slots() const { return num_slots_; }
+    char* slot(int64_t i) const { return data_ + kHeaderBytes + i * slot_bytes_; }
+
+    // Starts reading the slot from disk in the background, ahead of a load
+    void will_need(int64_t i) const {
+        uintptr_t const page_mask = uintptr_t(::sysconf(_SC_PAGESIZE)) - 1;
+        uintptr_t const begin = reinterpret_cast<uintptr_t>(slot(i)) & ~page_mask;
+        ::madvise(reinterpret_cast<void*>(begin), reinterpret_cast<uintptr_t>(slot(i)) + slot_bytes_ - begin, MADV_WILLNEED);
+    }
+
+private:
+    std::string path_, error_;
+    int64_t slot_bytes_, num_slots_, size_;
+    int fd_ = -1;
+    char* data_ = nullptr;
+};
+
+} // namespace flash
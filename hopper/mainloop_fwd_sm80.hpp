@@ -213,6 +213,9 @@ struct CollectiveMainloopFwdSm80 {
         int const* const seqused_k = nullptr;
         int const* const leftpad_k = nullptr;
         int const* const seqlens_rotary = nullptr;
+        uint64_t const* const tree_ancestors = nullptr;
+        int64_t const tree_ancestors_batch_stride = 0;
+        int const tree_size = 0;
     };
 
     // Device side kernel params
@@ -259,6 +262,9 @@ struct CollectiveMainloopFwdSm80 {
         int const* const seqused_k = nullptr;
         int const* const leftpad_k = nullptr;
         int const* const seqlens_rotary = nullptr;
+        uint64_t const* const tree_ancestors = nullptr;
+        int64_t const tree_ancestors_batch_stride = 0;
+        int const tree_size = 0;
     };
 
     static Params
@@ -301,7 +307,8 @@ struct CollectiveMainloopFwdSm80 {
                 !Split ? 1 : args.num_splits,
                 args.kv_batch_idx,
                 args.cu_seqlens_q, args.cu_seqlens_k, args.cu_seqlens_k_new,
-                args.seqused_q, args.seqused_k, args.leftpad_k, args.seqlens_rotary};
+                args.seqused_q, args.seqused_k, args.leftpad_k, args.seqlens_rotary,
+                args.tree_ancestors, args.tree_ancestors_batch_stride, args.tree_size};
     }
 
     template <typename SharedStorage, typename FrgTensorO, typename Softmax>
@@ -553,7 +560,9 @@ struct CollectiveMainloopFwdSm80 {
         flash::Mask<kBlockM, kBlockN, PackGQA, TiledMma> mask(
             thread_idx, seqlen_q, seqlen_k, params.window_size_left, params.window_size_right, 0 /*sink_token_length*/,
             params.attention_chunk_divmod,
-            params.qhead_per_khead_divmod
+            params.qhead_per_khead_divmod,
+            params.tree_ancestors == nullptr ? nullptr : params.tree_ancestors + bidb * params.tree_ancestors_batch_stride,
+            params.tree_size
         );
 
         float softcap_val = params.softcap_val;
@@ -627,8 +636,10 @@ struct CollectiveMainloopFwdSm80 {
         if constexpr (Is_causal || Is_local) { // Separate iterations with causal or local masking
             auto mask_fn = [&](auto& tSrS, int n_block) { mask.template apply<false /*Seqlenk_mask*/, Is_causal, Is_local>(tSrS, m_block, n_block); };
             int const m_idx_min = !PackGQA ? m_block * kBlockM : params.qhead_per_khead_divmod.divide(m_block * kBlockM);
-            int const n_block_min_causal_local_mask =
-                std::max(n_block_min, (m_idx_min + seqlen_k - seqlen_q + params.window_size_right) / kBlockN);
+            // With a tree mask, the keys of the tree left of the diagonal need masking too
+            int const n_idx_min_causal_local_mask = m_idx_min + seqlen_k - seqlen_q + params.window_size_right;
+            int const n_block_min_causal_local_mask = std::max(n_block_min, (params.tree_ancestors == nullptr
+                ? n_idx_min_causal_local_mask : std::min(n_idx_min_causal_local_mask, seqlen_k - params.tree_size)) / kBlockN);
             #pragma unroll 1
             for (; n_block >= n_block_min_causal_local_mask; --n_block) {
                 fwd_step(n_block, mask_fn, cute::false_type{} /*is_first_iter*/, cute::true_type{} /*check_inf*/);
@@ -24,12 +24,18 @@ struct Mask {
     int const window_size_left, window_size_right, sink_token_length;
     cutlass::FastDivmod const attention_chunk_divmod;
     cutlass::FastDivmod const qhead_per_khead_divmod;
+    // Tree mask (speculative decoding): the last tree_size queries and keys are the nodes of a draft tree, and
+    // bit j of tree_ancestors[i] says whether node i attends to node j (j is i or one of its ancestors).
+    // Applied on top of the causal mask, nullptr if there's no tree.
+    uint64_t const* const tree_ancestors;
+    int const tree_size;
 
     CUTLASS_DEVICE
     Mask(const int thread_idx, const int seqlen_q, const int seqlen_k,
          const int window_size_left, const int window_size_right, const int sink_token_length,
          cutlass::FastDivmod const &attention_chunk_divmod,
-         cutlass::FastDivmod const &qhead_per_khead_divmod)
+         cutlass::FastDivmod const &qhead_per_khead_divmod,
+         uint64_t const* tree_ancestors=nullptr, const int tree_size=0)
         : thread_idx(thread_idx)
         , seqlen_q(seqlen_q)
         , seqlen_k(seqlen_k)
@@ -38,6 +44,8 @@ struct Mask {
         , sink_token_length(sink_token_length)
         , attention_chunk_divmod(attention_chunk_divmod)
         , qhead_per_khead_divmod(qhead_per_khead_divmod)
+        , tree_ancestors(tree_ancestors)
+        , tree_size(tree_size)
     {
     };
 
@@ -99,6 +107,18 @@ struct Mask {
                         for (int n = 0; n < size<1>(tSrS_rowcol); ++n) {
                             if (int(get<Col>(t0ScS_rowcol(_0{}, n))) >= col_limit_right) { tSrS_rowcol(m, n) = -INFINITY; }
                         }
+                        if (tree_ancestors != nullptr) {
+                            int const tree_row = row_idx - (seqlen_q - tree_size);
+                            if (tree_row >= 0 && tree_row < tree_size) {
+                                uint64_t const ancestors = tree_ancestors[tree_row];
+                                int const tree_col_offset = seqlen_k - tree_size - n_block * kBlockN - thread_col_offset;
+                                #pragma unroll
+                                for (int n = 0; n < size<1>(tSrS_rowcol); ++n) {
+                                    int const tree_col = int(get<Col>(t0ScS_rowcol(_0{}, n))) - tree_col_offset;
+                                    if (tree_col >= 0 && tree_col < tree_size && !((ancestors >> tree_col) & 1)) { tSrS_rowcol(m, n) = -INFINITY; }
+                                }
+                            }
+                        }
                     }
                 } else {
                     int const local_row_offset_right = causal_row_offset + window_size_right;
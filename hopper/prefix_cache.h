@@ -0,0 +1,199 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Cache of the KV pages of token prefixes (e.g. shared system prompts), so that a new request only prefills the
+// tokens after its longest cached prefix: it starts as KVBlockManager::add_sequence(pages, num_tokens) and passes the
+// rest of its tokens as k_new / v_new with cache_seqlens = num_tokens.
+// The cache is a radix tree with one full page (page_size token ids) per edge: the node for a page is found by the
+// tokens of all the pages before it, so a page is only reused after the exact same prefix. Partial pages are not
+// cached since they are still written to. The cache holds a reference (KVBlockManager::incref) to each cached page,
+// and gives it back when the page is evicted. Leaves are evicted least recently used first when the cache holds more
+// than max_pages pages, or when the manager needs free pages (evict).
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "kv_block_manager.h"
+
+namespace flash {
+
+class PrefixCache {
+public:
+    struct Stats {
+        int64_t num_lookups = 0;
+        int64_t num_hits = 0;           // Lookups that reused at least one page
+        int64_t num_lookup_tokens = 0;  // Tokens that could have been reused, i.e. all but the last of each lookup
+        int64_t num_hit_tokens = 0;     // Tokens that were reused
+        int64_t num_inserted_pages = 0;
+        int64_t num_evicted_pages = 0;
+    };
+
+    // The manager must outlive the cache
+    PrefixCache(KVBlockManager& manager, int max_pages) : manager_(manager), max_pages_(max_pages) {
+        nodes_.push_back(Node{});  // Root, the empty prefix
+    }
+
+    ~PrefixCache() { clear(); }
+
+    int num_cached_pages() const { return num_cached_pages_; }
+    int max_pages() const { return max_pages_; }
+    KVBlockManager const& manager() const { return manager_; }
+    Stats const& stats() const { return stats_; }
+
+    // Fraction of the tokens that could have been reused that were
+    double token_hit_rate() const {
+        return stats_.num_lookup_tokens > 0 ? double(stats_.num_hit_tokens) / double(stats_.num_lookup_tokens) : 0.0;
+    }
+
+    // Cached pages of the longest prefix of tokens, and how many tokens they hold (a multiple of page_size).
+    // The last token is never matched, so that at least one token is left to compute the next token from.
+    std::pair<std::vector<int>, int> match(std::vector<int> const& tokens) {
+        int const page_size = manager_.page_size();
+        ++stats_.num_lookups;
+        stats_.num_lookup_tokens += std::max(int(tokens.size()) - 1, 0);
+        std::vector<int> pages;
+        int node = 0;
+        while ((int(pages.size()) + 1) * page_size < int(tokens.size())) {
+            int const child = find_child(node, tokens, int(pages.size()) * page_size);
+            if (child < 0) { break; }
+            node = child;
+            pages.push_back(nodes_[node].page);
+        }
+        touch(node);
+        int const num_tokens = int(pages.size()) * page_size;
+        stats_.num_hits += num_tokens > 0;
+        stats_.num_hit_tokens += num_tokens;
+        return {pages, num_tokens};
+    }
+
+    // Caches the full pages of a sequence: pages[i] holds tokens [i * page_size, (i + 1) * page_size).
+    // Pages of prefixes that are already cached are left alone. Returns the number of newly cached pages.
+    int insert(std::vector<int> const& tokens, std::vector<int> const& pages) {
+        int const page_size = manager_.page_size();
+        int const num_full_pages = std::min(int(tokens.size()) / page_size, int(pages.size()));
+        int node = 0, num_inserted = 0;
+        for (int i = 0; i < num_full_pages; ++i) {
+            int child = find_child(node, tokens, i * page_size);
+            if (child < 0) {
+                // Make room, but not by evicting the prefix being extended, which is the most recently used
+                touch(node);
+                while (num_cached_pages_ >= max_pages_ && !leaves_.empty() && leaves_.begin()->second != node) {
+                    evict_leaf(leaves_.begin()->second);
+                }
+                if (num_cached_pages_ >= max_pages_) { break; }
+                child = add_node(node, tokens, i * page_size, pages[i]);
+                ++num_inserted;
+            }
+            node = child;
+        }
+        touch(node);
+        stats_.num_inserted_pages += num_inserted;
+        return num_inserted;
+    }
+
+    // Evicts least recently used pages that only the cache holds, so they go back to the manager's free list, until
+    // num_pages are freed or there are no such pages left. Returns the number of pages freed.
+    int evict(int num_pages) {
+        int num_freed = 0;
+        bool evicted = true;
+        while (num_freed < num_pages && evicted) {
+            evicted = false;
+            for (auto const& [last_access, node] : leaves_) {
+                if (manager_.refcount(nodes_[node].page) == 1) {
+                    evict_leaf(node);
+                    ++num_freed;
+                    evicted = true;
+                    break;
+                }
+            }
+        }
+        return num_freed;
+    }
+
+    // Drops all the cached pages
+    void clear() {
+        while (!leaves_.empty()) { evict_leaf(leaves_.begin()->second); }
+    }
+
+private:
+    struct Node {
+        int page = -1;
+        int parent = -1;
+        int64_t last_access = 0;
+        std::vector<int> tokens;  // The page_size tokens of this page
+        std::map<std::vector<int>, int> children;
+    };
+
+    int find_child(int node, std::vector<int> const& tokens, int start) const {
+        std::vector<int> const key(tokens.begin() + start, tokens.begin() + start + manager_.page_size());
+        auto it = nodes_[node].children.find(key);
+        return it != nodes_[node].children.end() ? it->second : -1;
+    }
+
+    int add_node(int parent, std::vector<int> const& tokens, int start, int page) {
+        int id;
+        if (!free_nodes_.empty()) {
+            id = free_nodes_.back();
+            free_nodes_.pop_back();
+        } else {
+            id = int(nodes_.size());
+            nodes_.emplace_back();
+        }
+        Node& node = nodes_[id];
+        node.page = page;
+        node.parent = parent;
+        node.last_access = ++clock_;
+        node.tokens.assign(tokens.begin() + start, tokens.begin() + start + manager_.page_size());
+        node.children.clear();
+        if (parent != 0 && nodes_[parent].children.empty()) { leaves_.erase({nodes_[parent].last_access, parent}); }
+        nodes_[parent].children[node.tokens] = id;
+        leaves_.insert({node.last_access, id});
+        manager_.incref(page);
+        ++num_cached_pages_;
+        return id;
+    }
+
+    // Marks the node and the prefixes it extends as just used
+    void touch(int node) {
+        int64_t const now = ++clock_;
+        for (; node > 0; node = nodes_[node].parent) {
+            bool const is_leaf = nodes_[node].children.empty();
+            if (is_leaf) { leaves_.erase({nodes_[node].last_access, node}); }
+            nodes_[node].last_access = now;
+            if (is_leaf) { leaves_.insert({now, node}); }
+        }
+    }
+
+    void evict_leaf(int id) {
+        Node& node = nodes_[id];
+        assert(id > 0 && node.children.empty());
+        leaves_.erase({node.last_access, id});
+        Node& parent = nodes_[node.parent];
+        parent.children.erase(node.tokens);
+        if (node.parent != 0 && parent.children.empty()) { leaves_.insert({parent.last_access, node.parent}); }
+        manager_.decref(node.page);
+        node = Node{};
+        free_nodes_.push_back(id);
+        --num_cached_pages_;
+        ++stats_.num_evicted_pages;
+    }
+
+    KVBlockManager& manager_;
+    int max_pages_;
+    int num_cached_pages_ = 0;
+    int64_t clock_ = 0;
+    std::vector<Node> nodes_;
+    std::vector<int> free_nodes_;
+    std::set<std::pair<int64_t, int>> leaves_;  // (last access, node) of the nodes without children
+    Stats stats_;
+};
+
+} // namespace flash
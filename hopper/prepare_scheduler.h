@@ -0,0 +1,288 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "block_range.h"
+
+#ifndef FLASH_HOST_DEVICE
+#if defined(__CUDACC__)
+#define FLASH_HOST_DEVICE __host__ __device__ __forceinline__
+#else
+#define FLASH_HOST_DEVICE inline
+#endif
+#endif
+
+namespace flash {
+
+// Per-batch planning for varlen: how many m_blocks / n_blocks each sequence has, and how many splits
+// each sequence should use so that the whole grid has roughly 1.1 waves of blocks per SM.
+// Shared by the prepare_varlen_num_blocks kernel (flash_prepare_scheduler.cu) and the host planner below,
+// so that split decisions can be computed and checked without a GPU.
+struct PrepareSchedulerArgs {
+    int seqlen_q_static, seqlen_k_static, seqlen_k_new_static;
+    int const* cu_seqlens_q;
+    int const* cu_seqlens_k;
+    int const* cu_seqlens_k_new;
+    int const* seqused_q;
+    int const* seqused_k;
+    int const* leftpad_k;
+    int num_batch, num_head, qhead_per_khead, num_sm, num_splits_static;
+    int block_m, block_n;
+    // Only needed to estimate the cost of each tile for the LPT work list
+    bool is_causal = false, is_local = false;
+    int window_size_left = -1, window_size_right = -1, attention_chunk = 0;
+};
+
+// Params is Flash_fwd_params. Templated so that this header doesn't need flash.h (and cuda.h) on the host.
+template <typename Params>
+inline PrepareSchedulerArgs make_prepare_scheduler_args(Params const& params, bool packgqa, int blockM, int blockN) {
+    int qhead_per_khead = !packgqa ? 1 : (params.h + params.h_k - 1) / params.h_k;
+    return {params.seqlen_q, params.seqlen_k, params.seqlen_knew,
+            params.cu_seqlens_q, params.cu_seqlens_k, params.cu_seqlens_knew,
+            params.seqused_q, params.seqused_k, params.leftpad_k,
+            params.b, !packgqa ? params.h : params.h_k, qhead_per_khead, params.num_sm, params.num_splits,
+            blockM, blockN,
+            bool(params.is_causal), bool(params.is_local),
+            params.window_size_left, params.window_size_right, params.attention_chunk};
+}
+
+FLASH_HOST_DEVICE int get_varlen_seqlen_q(PrepareSchedulerArgs const& args, int bidb) {
+    if (args.seqused_q) {
+        return args.seqused_q[bidb];
+    } else if (args.cu_seqlens_q) {
+        return args.cu_seqlens_q[bidb + 1] - args.cu_seqlens_q[bidb];
+    } else {
+        return args.seqlen_q_static;
+    }
+}
+
+// Including the new keys / values appended by AppendKV, and excluding the left padding
+FLASH_HOST_DEVICE int get_varlen_seqlen_k(PrepareSchedulerArgs const& args, int bidb) {
+    int leftpad_k = args.leftpad_k != nullptr ? args.leftpad_k[bidb] : 0;
+    int seqlen;
+    if (args.seqused_k) {
+        seqlen = args.seqused_k[bidb];
+    } else if (args.cu_seqlens_k) {
+        seqlen = args.cu_seqlens_k[bidb + 1] - args.cu_seqlens_k[bidb];
+    } else {
+        seqlen = args.seqlen_k_static;
+    }
+    int seqlen_new = args.cu_seqlens_k_new
+        ? args.cu_seqlens_k_new[bidb + 1] - args.cu_seqlens_k_new[bidb]
+        : args.seqlen_k_new_static;
+    return seqlen - leftpad_k + seqlen_new;
+}
+
+FLASH_HOST_DEVICE int get_varlen_num_m_blocks(PrepareSchedulerArgs const& args, int bidb) {
+    int seqlen = get_varlen_seqlen_q(args, bidb) * args.qhead_per_khead;
+    return (seqlen + args.block_m - 1) / args.block_m;
+}
+
+FLASH_HOST_DEVICE int get_varlen_num_n_blocks(PrepareSchedulerArgs const& args, int bidb) {
+    return (get_varlen_seqlen_k(args, bidb) + args.block_n - 1) / args.block_n;
+}
+
+// total_blocks is the sum of num_m_blocks * num_n_blocks over the whole batch
+FLASH_HOST_DEVICE int get_varlen_blocks_per_sm(PrepareSchedulerArgs const& args, int total_blocks) {
+    // 10% margin
+    return static_cast<int>(ceilf(float(total_blocks) * 1.1f * float(args.num_head) / float(args.num_sm)));
+}
+
+FLASH_HOST_DEVICE int get_varlen_num_splits(PrepareSchedulerArgs const& args, int num_n_blocks, int total_blocks) {
+    int blocks_per_sm = get_varlen_blocks_per_sm(args, total_blocks);
+    // blocks_per_sm = std::max(1, blocks_per_sm);  // 1 is the minimum number of blocks per SM
+    int num_splits = (num_n_blocks + blocks_per_sm - 1) / blocks_per_sm;
+    num_splits = num_splits < args.num_splits_static ? num_splits : args.num_splits_static;
+    return num_splits > 1 ? num_splits : 1;
+}
+
+// Host version of prepare_varlen_num_blocks. seqlen pointers in args must be host pointers.
+inline void prepare_varlen_num_blocks_host(PrepareSchedulerArgs const& args, int* tile_count_semaphore, int* num_splits_dynamic_ptr) {
+    if (tile_count_semaphore) { *tile_count_semaphore = 0; }
+    int total_blocks = 0;
+    for (int bidb = 0; bidb < args.num_batch; ++bidb) {
+        total_blocks += get_varlen_num_m_blocks(args, bidb) * get_varlen_num_n_blocks(args, bidb);
+    }
+    for (int bidb = 0; bidb < args.num_batch; ++bidb) {
+        num_splits_dynamic_ptr[bidb] = get_varlen_num_splits(args, get_varlen_num_n_blocks(args, bidb), total_blocks);
+    }
+}
+
+// Incremental version of prepare_varlen_num_blocks_host for decode, where every sequence grows by the same number
+// of tokens at each step. The split count of a sequence only depends on its own num_n_blocks and on blocks_per_sm,
+// so advance() only revisits the sequences whose seqlen_k crosses a multiple of block_n, unless blocks_per_sm
+// changes. To find those without scanning the batch, sequences are bucketed by (seqlen_k - 1) % block_n at
+// construction: after growing by t tokens, bucket r has residue (r + t) % block_n.
+// Gives the same split counts as prepare_varlen_num_blocks_host on the grown seqused_k.
+class VarlenSchedulerPlanner {
+public:
+    // The seqlen pointers in args must be host pointers. They are only read in the constructor.
+    explicit VarlenSchedulerPlanner(PrepareSchedulerArgs const& args) : args_(args) {
+        int const num_batch = args.num_batch;
+        num_m_blocks_.resize(num_batch);
+        num_n_blocks_.resize(num_batch);
+        seqlen_k_.resize(num_batch);
+        num_splits_.resize(num_batch);
+        residue_buckets_.assign(args.block_n, {});
+        for (int bidb = 0; bidb < num_batch; ++bidb) {
+            num_m_blocks_[bidb] = get_varlen_num_m_blocks(args, bidb);
+            num_n_blocks_[bidb] = get_varlen_num_n_blocks(args, bidb);
+            seqlen_k_[bidb] = get_varlen_seqlen_k(args, bidb);
+            total_blocks_ += num_m_blocks_[bidb] * num_n_blocks_[bidb];
+            residue_buckets_[residue(seqlen_k_[bidb])].push_back(bidb);
+        }
+        for (int bidb = 0; bidb < num_batch; ++bidb) {
+            num_splits_[bidb] = get_varlen_num_splits(args_, num_n_blocks_[bidb], total_blocks_);
+        }
+        blocks_per_sm_ = get_varlen_blocks_per_sm(args_, total_blocks_);
+        args_.cu_seqlens_q = args_.cu_seqlens_k = args_.cu_seqlens_k_new = nullptr;
+        args_.seqused_q = args_.seqused_k = args_.leftpad_k = nullptr;
+    }
+
+    // Grow every sequence by num_tokens. Returns whether any split count changed.
+    bool advance(int num_tokens) {
+        assert(num_tokens >= 0);
+        std::vector<int> crossed;
+        if (num_tokens >= args_.block_n) {
+            // Every sequence crosses at least one boundary
+            for (int bidb = 0; bidb < args_.num_batch; ++bidb) {
+                int const num_n_blocks = (seqlen_k_[bidb] + num_tokens_advanced_ + num_tokens + args_.block_n - 1) / args_.block_n;
+                total_blocks_ += num_m_blocks_[bidb] * (num_n_blocks - num_n_blocks_[bidb]);
+                num_n_blocks_[bidb] = num_n_blocks;
+                crossed.push_back(bidb);
+            }
+        } else {
+            // A sequence with residue c gains one n_block iff c + num_tokens >= block_n
+            for (int c = args_.block_n - num_tokens; c < args_.block_n; ++c) {
+                for (int bidb : residue_buckets_[floor_mod(c - num_tokens_advanced_, args_.block_n)]) {
+                    ++num_n_blocks_[bidb];
+                    total_blocks_ += num_m_blocks_[bidb];
+                    crossed.push_back(bidb);
+                }
+            }
+        }
+        num_tokens_advanced_ += num_tokens;
+        bool changed = false;
+        auto update = [&](int bidb) {
+            int const num_splits = get_varlen_num_splits(args_, num_n_blocks_[bidb], total_blocks_);
+            changed |= num_splits != num_splits_[bidb];
+            num_splits_[bidb] = num_splits;
+        };
+        int const blocks_per_sm = get_varlen_blocks_per_sm(args_, total_blocks_);
+        if (blocks_per_sm != blocks_per_sm_) {
+            blocks_per_sm_ = blocks_per_sm;
+            for (int bidb = 0; bidb < args_.num_batch; ++bidb) { update(bidb); }
+        } else {
+            for (int bidb : crossed) { update(bidb); }
+        }
+        return changed;
+    }
+
+    std::vector<int> const& num_splits_dynamic() const { return num_splits_; }
+    int num_tokens_advanced() const { return num_tokens_advanced_; }
+
+private:
+    static int floor_mod(int x, int n) { return ((x % n) + n) % n; }
+    int residue(int seqlen_k) const { return floor_mod(seqlen_k - 1, args_.block_n); }
+
+    PrepareSchedulerArgs args_;
+    std::vector<int> num_m_blocks_, num_n_blocks_, num_splits_;
+    std::vector<int> seqlen_k_;  // At construction, sequences are now num_tokens_advanced_ longer
+    std::vector<std::vector<int>> residue_buckets_;  // By residue of the construction-time seqlen_k
+    int total_blocks_ = 0, blocks_per_sm_ = 0;
+    int num_tokens_advanced_ = 0;
+};
+
+// Longest-processing-time-first work list for the varlen persistent scheduler.
+// With causal / local masks the tiles of a varlen batch differ in cost by orders of magnitude (a tile visits
+// anywhere from 1 to seqlen_k / kBlockN n_blocks), and handing them out in batch order leaves the long tiles
+// of the last sequences for the end. Instead we bucket the (batch, head, m_block, split) tiles by the number
+// of n_blocks they visit (the same estimate BlockMN uses) and hand them out from the most expensive bucket down.
+// Tiles that visit kVarlenLptNumBuckets - 1 or more n_blocks all go into the first bucket.
+// Workspace layout (int32): [bucket counts / offsets (kVarlenLptNumBuckets)] [num_tiles] [padding]
+//                           [work list starting at kVarlenLptListOffset, 4 ints per tile]
+// Each work list entry is (m_block, bidh, bidb, 0), with bidh packed the same way as
+// VarlenDynamicPersistentTileScheduler::tile_idx_to_work_tile when there are several splits.
+static constexpr int kVarlenLptNumBuckets = 1024;
+static constexpr int kVarlenLptListOffset = kVarlenLptNumBuckets + 4;  // 16B aligned so the scheduler can load an int4
+
+// Upper bound on the number of tiles, for sizing the workspace. total_q is the total number of queries in the
+// batch and block_m_min the smallest kBlockM any kernel may be compiled with.
+inline int64_t get_varlen_lpt_workspace_size(int total_q, int num_batch, int num_head, int qhead_per_khead,
+                                             int num_splits, int block_m_min) {
+    int64_t max_num_m_blocks = (int64_t(total_q) * qhead_per_khead + block_m_min - 1) / block_m_min + num_batch;
+    return kVarlenLptListOffset + max_num_m_blocks * num_head * std::max(num_splits, 1) * 4;
+}
+
+FLASH_HOST_DEVICE int get_varlen_num_splits_or_static(PrepareSchedulerArgs const& args, int const* num_splits_dynamic_ptr, int bidb) {
+    return num_splits_dynamic_ptr ? num_splits_dynamic_ptr[bidb] : (args.num_splits_static > 1 ? args.num_splits_static : 1);
+}
+
+// Number of n_blocks the (m_block, split_idx) tile of sequence bidb visits
+FLASH_HOST_DEVICE int get_varlen_tile_num_n_blocks(PrepareSchedulerArgs const& args, int bidb, int m_block, int split_idx, int num_splits) {
+    BlockRange range = get_n_block_range(
+        get_varlen_seqlen_q(args, bidb), get_varlen_seqlen_k(args, bidb), args.block_m, args.block_n,
+        args.is_causal, args.is_local, args.qhead_per_khead > 1, num_splits > 1, m_block, split_idx, num_splits,
+        args.window_size_left, args.window_size_right,
+        IntDivmod{args.attention_chunk}, IntDivmod{args.qhead_per_khead});
+    return range.block_max > range.block_min ? range.block_max - range.block_min : 0;
+}
+
+// The most expensive tiles go into bucket 0
+FLASH_HOST_DEVICE int get_varlen_lpt_bucket(int num_n_blocks) {
+    return kVarlenLptNumBuckets - 1 - (num_n_blocks < kVarlenLptNumBuckets - 1 ? num_n_blocks : kVarlenLptNumBuckets - 1);
+}
+
+FLASH_HOST_DEVICE void write_varlen_lpt_tiles(PrepareSchedulerArgs const& args, int* work_list, int slot,
+                                              int bidb, int m_block, int split_idx, int num_splits) {
+    for (int bidh = 0; bidh < args.num_head; ++bidh) {
+        // Use the top 8 bits to store num_splits and the next 8 bits to store split_idx, as the scheduler does
+        // whenever the kernel is compiled with Split, even for sequences that end up with a single split
+        unsigned int bidh_packed = args.num_splits_static > 1
+            ? unsigned(bidh) + (unsigned(split_idx) << 16) + (unsigned(num_splits) << 24) : unsigned(bidh);
+        int* entry = work_list + int64_t(slot + bidh) * 4;
+        entry[0] = m_block;
+        entry[1] = int(bidh_packed);
+        entry[2] = bidb;
+        entry[3] = 0;
+    }
+}
+
+// Host version of prepare_varlen_lpt_work_list. Tiles in the same bucket are kept in batch order, while the device
+// version orders them by whichever thread block gets there first.
+inline void prepare_varlen_lpt_work_list_host(PrepareSchedulerArgs const& args, int const* num_splits_dynamic_ptr, int* workspace) {
+    std::fill(workspace, workspace + kVarlenLptListOffset, 0);
+    auto for_each_tile = [&](auto fn) {
+        for (int bidb = 0; bidb < args.num_batch; ++bidb) {
+            int const num_splits = get_varlen_num_splits_or_static(args, num_splits_dynamic_ptr, bidb);
+            int const num_m_blocks = get_varlen_num_m_blocks(args, bidb);
+            for (int split_idx = 0; split_idx < num_splits; ++split_idx) {
+                for (int m_block = 0; m_block < num_m_blocks; ++m_block) {
+                    fn(bidb, m_block, split_idx, num_splits,
+                       get_varlen_lpt_bucket(get_varlen_tile_num_n_blocks(args, bidb, m_block, split_idx, num_splits)));
+                }
+            }
+        }
+    };
+    for_each_tile([&](int, int, int, int, int bucket) { workspace[bucket] += args.num_head; });
+    int num_tiles = 0;
+    for (int bucket = 0; bucket < kVarlenLptNumBuckets; ++bucket) {
+        int const count = workspace[bucket];
+        workspace[bucket] = num_tiles;
+        num_tiles += count;
+    }
+    workspace[kVarlenLptNumBuckets] = num_tiles;
+    for_each_tile([&](int bidb, int m_block, int split_idx, int num_splits, int bucket) {
+        write_varlen_lpt_tiles(args, workspace + kVarlenLptListOffset, workspace[bucket], bidb, m_block, split_idx, num_splits);
+        workspace[bucket] += args.num_head;
+    });
+}
+
+} // namespace flash
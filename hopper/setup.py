@@ -64,6 +64,28 @@ DISABLE_SM8x = os.getenv("FLASH_ATTENTION_DISABLE_SM80", "FALSE") == "TRUE"
 
 ENABLE_VCOLMAJOR = os.getenv("FLASH_ATTENTION_ENABLE_VCOLMAJOR", "FALSE") == "TRUE"
 
+# KERNEL_MANIFEST: JSON file listing the kernel configs to compile (see load_manifest in generate_kernels.py).
+# Only these are instantiated, and features that none of them has are disabled as with FLASH_ATTENTION_DISABLE_*.
+KERNEL_MANIFEST = os.getenv("FLASH_ATTENTION_KERNEL_MANIFEST", "")
+if KERNEL_MANIFEST:
+    sys.path.insert(0, this_dir)
+    import generate_kernels
+
+    kernel_manifest = generate_kernels.load_manifest(KERNEL_MANIFEST)
+    for feature in generate_kernels.manifest_disabled_features(kernel_manifest):
+        globals()[f"DISABLE_{feature}"] = True
+
+# LAZY_KERNELS: link the kernels of each (arch, hdim) into their own shared library, loaded on first use
+# (kernel_registry.h), instead of into flash_attn_3_cuda. Shortens import time when only a few head dims are used.
+LAZY_KERNELS = os.getenv("FLASH_ATTENTION_LAZY_KERNELS", "FALSE") == "TRUE"
+if LAZY_KERNELS and not KERNEL_MANIFEST:
+    sys.path.insert(0, this_dir)
+    import generate_kernels
+
+# Instruction set for the vectorized inner loops of the CPU engine: "", "avx2", "avx512" or "native".
+# The default is portable scalar code that the compiler may auto-vectorize.
+CPU_ISA = os.getenv("FLASH_ATTENTION_CPU_ISA", "").lower()
+
 
 # HACK: we monkey patch pytorch's _write_ninja_file to pass
 # "-gencode arch=compute_sm90a,code=sm_90a" to files ending in '_sm90.cu',
@@ -468,8 +490,17 @@ if not SKIP_CUDA_BUILD:
         + (["-DFLASHATTENTION_DISABLE_HDIM256"] if DISABLE_HDIM256 else [])
         + (["-DFLASHATTENTION_DISABLE_SM8x"] if DISABLE_SM8x else [])
         + (["-DFLASHATTENTION_ENABLE_VCOLMAJOR"] if ENABLE_VCOLMAJOR else [])
+        + (["-DFLASHATTENTION_KERNEL_MANIFEST"] if KERNEL_MANIFEST else [])
+        + (["-DFLASHATTENTION_LAZY_KERNELS"] if LAZY_KERNELS else [])
     )
 
+    cpu_isa_args = {
+        "": [],
+        "avx2": ["-mavx2", "-mfma", "-mf16c"],
+        "avx512": ["-mavx512f", "-mavx2", "-mfma", "-mf16c"],
+        "native": ["-march=native"],
+    }[CPU_ISA]
+
     DTYPE_FWD_SM80 = ["bf16"] + (["fp16"] if not DISABLE_FP16 else [])
     DTYPE_FWD_SM90 = ["bf16"] + (["fp16"] if not DISABLE_FP16 else []) + (["e4m3"] if not DISABLE_FP8 else [])
     DTYPE_BWD = ["bf16"] + (["fp16"] if not DISABLE_FP16 else [])
@@ -499,14 +530,48 @@ if not SKIP_CUDA_BUILD:
                         for hdim, dtype, softcap in itertools.product(HEAD_DIMENSIONS_BWD, DTYPE_BWD, SOFTCAP)]
     sources_bwd_sm90 = [f"instantiations/flash_bwd_hdim{hdim}_{dtype}{softcap}_sm90.cu"
                         for hdim, dtype, softcap in itertools.product(HEAD_DIMENSIONS_BWD, DTYPE_BWD, SOFTCAP_ALL)]
+    if KERNEL_MANIFEST:
+        # Also writes instantiations_manifest/kernel_manifest.inc, which flash_api.cpp uses to report missing kernels
+        kernels = generate_kernels.main(os.path.join(this_dir, "instantiations_manifest"), kernel_manifest)
+        sources_fwd_sm80, sources_fwd_sm90, sources_bwd_sm80, sources_bwd_sm90 = [
+            [f"instantiations_manifest/{k.filename}" for k in kernels if k.direction == direction and (k.sm >= 90) == sm90]
+            for direction, sm90 in [("fwd", False), ("fwd", True), ("bwd", False), ("bwd", True)]
+        ]
     if DISABLE_BACKWARD:
         sources_bwd_sm90 = []
         sources_bwd_sm80 = []
+    kernel_modules = {}
+    if LAZY_KERNELS:
+        if get_platform() == "win_amd64":
+            raise RuntimeError("FLASH_ATTENTION_LAZY_KERNELS is only supported on Linux")
+        if KERNEL_MANIFEST:
+            kernels_dir = "instantiations_manifest"
+        else:
+            kernels_dir = "instantiations"
+            kernels = [
+                k for k in generate_kernels.get_all_kernels()
+                if not ((DISABLE_SM8x and k.sm < 90) or (DISABLE_BACKWARD and k.direction == "bwd")
+                        or (DISABLE_FP16 and k.dtype == "fp16") or (DISABLE_FP8 and k.dtype == "e4m3")
+                        or (DISABLE_SPLIT and k.split) or (DISABLE_PAGEDKV and k.paged_kv)
+                        or (DISABLE_SOFTCAP and k.softcap) or (DISABLE_PACKGQA and k.packgqa)
+                        or globals()[f"DISABLE_HDIM{k.head_dim}"])
+            ]
+        modules_dir = "instantiations_manifest" if KERNEL_MANIFEST else "instantiations_lazy"
+        for name, module_kernels in generate_kernels.write_kernel_modules(kernels, Path(this_dir) / modules_dir).items():
+            # Each module also needs the scheduler setup that the launch templates call
+            kernel_modules[name] = (
+                [f"{modules_dir}/flash_module_{name}.cu"]
+                + [f"{kernels_dir}/{k.filename}" for k in module_kernels]
+                + ["flash_prepare_scheduler.cu"]
+            )
+        sources_fwd_sm80, sources_fwd_sm90, sources_bwd_sm80, sources_bwd_sm90 = [], [], [], []
     sources = (
-        ["flash_api.cpp"]
+        ["flash_api.cpp", "flash_fwd_cpu.cpp"]
         + (sources_fwd_sm80 if not DISABLE_SM8x else []) + sources_fwd_sm90
         + (sources_bwd_sm80 if not DISABLE_SM8x else []) + sources_bwd_sm90
     )
+    if not DISABLE_BACKWARD:
+        sources += ["flash_bwd_cpu.cpp"]
     if not DISABLE_SPLIT:
         sources += ["flash_fwd_combine.cu"]
     sources += ["flash_prepare_scheduler.cu"]
@@ -542,12 +607,25 @@ if not SKIP_CUDA_BUILD:
             name="flash_attn_3_cuda",
             sources=sources,
             extra_compile_args={
-                "cxx": ["-O3", "-std=c++17"] + feature_args,
+                "cxx": ["-O3", "-std=c++17"] + feature_args + cpu_isa_args,
                 "nvcc": nvcc_threads_args() + nvcc_flags + cc_flag + feature_args,
             },
             include_dirs=include_dirs,
+            extra_link_args=["-ldl"] if LAZY_KERNELS else [],
         )
     )
+    for name, module_sources in kernel_modules.items():
+        ext_modules.append(
+            CUDAExtension(
+                name=f"flash_attn_3_kernels_{name}",
+                sources=module_sources,
+                extra_compile_args={
+                    "cxx": ["-O3", "-std=c++17"] + feature_args,
+                    "nvcc": nvcc_threads_args() + nvcc_flags + cc_flag + feature_args,
+                },
+                include_dirs=include_dirs,
+            )
+        )
 
 
 def get_package_version():
@@ -1120,3 +1120,154 @@ def test_flash_attn_combine(num_splits, seqlen, d, dtype):
     # # pytorch_profiler(torch.sum, lse_partial)
     # pytorch_profiler(flash_attn_combine, out_partial, lse_partial)
     # pytorch_profiler(torch.sum, out_partial)
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16])
+def test_flash_attn_workspace_arena(dtype):
+    if DISABLE_SPLIT:
+        pytest.skip()
+    import flash_attn_3_cuda
+    device = "cuda"
+    torch.random.manual_seed(0)
+    nheads, nheads_k, d, seqlen_k = 16, 4, 128, 2048
+    k_cache = torch.randn(8, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn(8, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    stats_before = flash_attn_3_cuda.workspace_arena_stats()
+    # Decode steps with a changing batch size, so the split-KV accumulators change size
+    for step in range(16):
+        batch_size = [1, 3, 8, 5][step % 4]
+        q = torch.randn(batch_size, 1, nheads, d, device=device, dtype=dtype)
+        cache_seqlens = torch.randint(1, seqlen_k, (batch_size,), dtype=torch.int32, device=device)
+        out = flash_attn_with_kvcache(q, k_cache[:batch_size], v_cache[:batch_size], cache_seqlens=cache_seqlens, num_splits=4)
+        out_ref = flash_attn_with_kvcache(q, k_cache[:batch_size], v_cache[:batch_size], cache_seqlens=cache_seqlens, num_splits=1)
+        assert (out - out_ref).abs().max().item() <= 1e-2
+    stats = flash_attn_3_cuda.workspace_arena_stats()
+    # After the first round of batch sizes, every workspace comes from the pool
+    assert stats["num_reused"] - stats_before["num_reused"] > 0
+    assert stats["bytes_reused"] > stats_before["bytes_reused"]
+    # Workspaces wanted during graph capture live in the graph's pool, so emptying the arena doesn't free them
+    q = torch.randn(8, 1, nheads, d, device=device, dtype=dtype)
+    cache_seqlens = torch.randint(1, seqlen_k, (8,), dtype=torch.int32, device=device)
+    kwargs = dict(cache_seqlens=cache_seqlens, num_splits=4)
+    stream = torch.cuda.Stream()
+    stream.wait_stream(torch.cuda.current_stream())
+    with torch.cuda.stream(stream):
+        out_ref = flash_attn_with_kvcache(q, k_cache, v_cache, **kwargs)
+    torch.cuda.current_stream().wait_stream(stream)
+    stats_before = flash_attn_3_cuda.workspace_arena_stats()
+    graph = torch.cuda.CUDAGraph()
+    with torch.cuda.graph(graph):
+        out = flash_attn_with_kvcache(q, k_cache, v_cache, **kwargs)
+    stats = flash_attn_3_cuda.workspace_arena_stats()
+    assert stats["num_allocated"] == stats_before["num_allocated"]
+    assert stats["num_reused"] == stats_before["num_reused"]
+    flash_attn_3_cuda.empty_workspace_arena()
+    assert flash_attn_3_cuda.workspace_arena_stats()["bytes_cached"] == 0
+    graph.replay()
+    torch.cuda.synchronize()
+    assert torch.equal(out, out_ref)
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16])
+@pytest.mark.parametrize("local", [False] + ([True] if not DISABLE_LOCAL else []))
+@pytest.mark.parametrize("d", [64, 128])
+def test_flash_attn_varlen_lpt(d, local, dtype):
+    device = "cuda"
+    torch.random.manual_seed(0)
+    nheads, nheads_k = 8, 2
+    # Prefill of very uneven lengths (the longest is over twice the mean), so tiles are handed out longest first
+    seqlens = torch.tensor([16, 2048, 7, 130, 1, 511, 64, 3000], dtype=torch.int32)
+    assert seqlens.max() * len(seqlens) >= 2 * seqlens.sum()
+    cu_seqlens = torch.nn.functional.pad(seqlens.cumsum(0, dtype=torch.int32), (1, 0)).to(device)
+    total = seqlens.sum().item()
+    q = torch.randn(total, nheads, d, device=device, dtype=dtype)
+    k = torch.randn(total, nheads_k, d, device=device, dtype=dtype)
+    v = torch.randn(total, nheads_k, d, device=device, dtype=dtype)
+    window_size = (-1, -1) if not local else (300, 0)
+    max_seqlen = seqlens.max().item()
+    # Fixed pack_gqa, since its heuristic depends on max_seqlen_q
+    out, _ = flash_attn_varlen_func(q, k, v, cu_seqlens, cu_seqlens, max_seqlen, max_seqlen, causal=not local,
+                                    window_size=window_size, pack_gqa=False)
+    for i in range(len(seqlens)):
+        start, end = cu_seqlens[i].item(), cu_seqlens[i + 1].item()
+        q_i, k_i, v_i = [x[start:end].unsqueeze(0) for x in (q, k, v)]
+        out_ref, _ = attention_ref(q_i, k_i, v_i, causal=not local, window_size=window_size)
+        out_pt, _ = attention_ref(q_i, k_i, v_i, causal=not local, window_size=window_size, upcast=False,
+                                  reorder_ops=True)
+        assert (out[start:end] - out_ref[0]).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+        # A batch of one keeps the batch order: the order of the tiles doesn't change their arithmetic
+        cu_seqlens_i = torch.tensor([0, end - start], dtype=torch.int32, device=device)
+        out_i, _ = flash_attn_varlen_func(q_i[0], k_i[0], v_i[0], cu_seqlens_i, cu_seqlens_i, end - start, end - start,
+                                          causal=not local, window_size=window_size, pack_gqa=False)
+        assert torch.equal(out[start:end], out_i)
+
+
+@pytest.mark.skipif(DISABLE_APPENDKV, reason="appending to the KV cache disabled")
+@pytest.mark.parametrize("page_size", [None] + ([16] if not DISABLE_PAGEDKV else []))
+@pytest.mark.parametrize("shared_tree", [False, True])
+@pytest.mark.parametrize("num_accepted", [0, 1])
+@pytest.mark.parametrize("tree_size", [1, 7, 64])
+def test_flash_attn_tree_mask(tree_size, num_accepted, shared_tree, page_size):
+    device = "cuda"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 4, 2, 64, 256
+    # The queries are the last accepted token(s), then the nodes of the draft tree
+    seqlen_new = num_accepted + tree_size
+    parents = torch.stack([
+        torch.tensor([int(torch.randint(-1, i, ())) for i in range(tree_size)], dtype=torch.int32)
+        for _ in range(1 if shared_tree else batch_size)
+    ]).to(device)
+    tree_parents = parents[0] if shared_tree else parents
+    q = torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype)
+    k_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    v_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    if page_size is None:
+        k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        page_table = None
+        k_cache_og, v_cache_og = k_cache.clone(), v_cache.clone()
+    else:
+        k_cache_og, v_cache_og, page_table, k_cache, v_cache, _ = _generate_block_kvcache(
+            seqlen_k, page_size, batch_size, nheads_k, d, d, device, dtype, dtype)
+    cache_seqlens = torch.randint(1, seqlen_k - seqlen_new + 1, (batch_size,), dtype=torch.int32, device=device)
+    out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, cache_seqlens=cache_seqlens,
+                                  page_table=page_table, tree_parents=tree_parents, causal=True)
+    parents = parents.cpu()
+    for b in range(batch_size):
+        cache_seqlen = int(cache_seqlens[b])
+        for row in range(seqlen_new):
+            # Each query sees the cache, the accepted tokens up to itself, and the path from the root of the tree
+            path, node = [], row - num_accepted
+            while node >= 0:
+                path.insert(0, num_accepted + node)
+                node = int(parents[0 if shared_tree else b, node])
+            new_idx = list(range(min(row + 1, num_accepted))) + path
+            keys = torch.cat([k_cache_og[b, :cache_seqlen], k_new[b, new_idx]])
+            values = torch.cat([v_cache_og[b, :cache_seqlen], v_new[b, new_idx]])
+            q_row = q[b:b + 1, row:row + 1]
+            out_ref, _ = attention_ref(q_row, keys[None], values[None])
+            out_pt, _ = attention_ref(q_row, keys[None], values[None], upcast=False, reorder_ops=True)
+            assert (out[b, row] - out_ref[0, 0]).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+
+
+@pytest.mark.skipif(DISABLE_APPENDKV, reason="appending to the KV cache disabled")
+def test_flash_attn_tree_mask_invalid_parents():
+    # On the GPU, invalid parents trip a device-side assert, which leaves the CUDA context unusable: run it in a
+    # separate process
+    import subprocess
+    import sys
+    script = """
+import torch
+from flash_attn_interface import flash_attn_with_kvcache
+q = torch.randn(1, 4, 4, 64, device="cuda", dtype=torch.bfloat16)
+k_cache = torch.randn(1, 64, 2, 64, device="cuda", dtype=torch.bfloat16)
+cache_seqlens = torch.full((1,), 32, dtype=torch.int32, device="cuda")
+tree_parents = torch.arange(4, dtype=torch.int32, device="cuda")  # Each node its own parent
+flash_attn_with_kvcache(q, k_cache, k_cache.clone(), cache_seqlens=cache_seqlens, tree_parents=tree_parents, causal=True)
+torch.cuda.synchronize()
+"""
+    result = subprocess.run([sys.executable, "-c", script], cwd=os.path.dirname(os.path.abspath(__file__)),
+                            capture_output=True, text=True)
+    assert result.returncode != 0
+    assert "device-side assert" in result.stderr or "tree_parents" in result.stderr
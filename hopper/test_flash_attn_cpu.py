@@ -0,0 +1,892 @@
+import os
+import math
+import itertools
+
+import pytest
+import torch
+
+from einops import rearrange, repeat
+
+from test_util import (
+    attention_ref,
+    generate_qkv,
+    generate_random_padding_mask,
+)
+
+from flash_attn_interface import flash_attn_func, flash_attn_varlen_func, flash_attn_with_kvcache, get_scheduler_metadata
+from flash_attn_interface import get_incremental_scheduler_metadata, get_attention_plan, get_kv_block_manager, copy_kv_pages, get_prefix_cache, get_tiered_kv_cache
+from flash_attn_interface import quantize_kv, dequantize_kv
+
+
+DISABLE_PAGEDKV = os.getenv("FLASH_ATTENTION_DISABLE_PAGEDKV", "FALSE") == "TRUE"
+DISABLE_APPENDKV = os.getenv("FLASH_ATTENTION_DISABLE_APPENDKV", "FALSE") == "TRUE"
+DISABLE_LOCAL = os.getenv("FLASH_ATTENTION_DISABLE_LOCAL", "FALSE") == "TRUE"
+DISABLE_SOFTCAP = os.getenv("FLASH_ATTENTION_DISABLE_SOFTCAP", "FALSE") == "TRUE"
+DISABLE_FP16 = os.getenv("FLASH_ATTENTION_DISABLE_FP16", "FALSE") == "TRUE"
+DISABLE_BACKWARD = os.getenv("FLASH_ATTENTION_DISABLE_BACKWARD", "FALSE") == "TRUE"
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16] + ([torch.float16] if not DISABLE_FP16 else []))
+@pytest.mark.parametrize("mha_type", ["mha", "mqa", "gqa"])
+@pytest.mark.parametrize("softcap", [0.0] + ([15.0] if not DISABLE_SOFTCAP else []))
+@pytest.mark.parametrize("local", [False] + ([True] if not DISABLE_LOCAL else []))
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("d", [64, 128])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k",
+    [
+        (1, 1),
+        (1, 239),
+        (64, 128),
+        (113, 203),
+        (128, 217),
+        (256, 512),
+        (108, 256),
+        (203, 113),
+    ],
+)
+def test_flash_attn_cpu_output(seqlen_q, seqlen_k, d, causal, local, softcap, mha_type, dtype):
+    if causal and local:
+        pytest.skip()
+    device = "cpu"
+    torch.random.manual_seed(0)
+    batch_size = 3
+    nheads = 4
+    nheads_kv = nheads if mha_type == "mha" else (2 if mha_type == "gqa" else 1)
+    dv_vals = [256, d] if d <= 64 else [d]
+    attention_chunk_vals = [64, 0] if seqlen_q <= seqlen_k and (causal or local) else [0]
+    for dv, attention_chunk in itertools.product(dv_vals, attention_chunk_vals):
+        q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+        if softcap > 0.0:
+            # Ensure the values of qk are at least within softcap range.
+            q = (q * softcap / 4).to(dtype)
+        k = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype)
+        v = torch.randn(batch_size, seqlen_k, nheads_kv, dv, device=device, dtype=dtype)
+        window_size = (-1, -1) if not local else torch.randint(0, seqlen_k, (2,)).tolist()
+        out_ref, _ = attention_ref(q, k, v, None, None, causal=causal, window_size=window_size,
+                                   attention_chunk=attention_chunk, softcap=softcap)
+        out_pt, _ = attention_ref(q, k, v, None, None, causal=causal, window_size=window_size,
+                                  attention_chunk=attention_chunk, softcap=softcap, upcast=False, reorder_ops=True)
+        # Numerical error if we just do any arithmetic on out_ref
+        fwd_atol = 2 * (out_ref + 0.3 - 0.3 - out_ref).abs().max().item()
+        rtol = 2 if softcap == 0.0 else 3
+        out, lse = flash_attn_func(q, k, v, causal=causal, window_size=window_size,
+                                   attention_chunk=attention_chunk, softcap=softcap)
+        print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+        print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+        assert (out - out_ref).abs().max().item() <= rtol * (out_pt - out_ref).abs().max().item() + fwd_atol
+        if not causal and not local and softcap == 0.0:
+            qk = torch.einsum("bthd,bshd->bhts", q.float(), repeat(k.float(), "b s h d -> b s (h g) d", g=nheads // nheads_kv))
+            lse_ref = torch.logsumexp(qk * d ** -0.5, dim=-1)
+            assert torch.allclose(lse, lse_ref, atol=1e-3, rtol=1e-3)
+
+
+@pytest.mark.skipif(DISABLE_BACKWARD, reason="backward disabled")
+@pytest.mark.parametrize("dtype", [torch.bfloat16] + ([torch.float16] if not DISABLE_FP16 else []))
+@pytest.mark.parametrize("deterministic", [False, True])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("softcap", [0.0] + ([15.0] if not DISABLE_SOFTCAP else []))
+@pytest.mark.parametrize("local", [False] + ([True] if not DISABLE_LOCAL else []))
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("d", [64, 128])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k",
+    [
+        (1, 239),
+        (113, 203),
+        (128, 217),
+        (203, 113),
+    ],
+)
+def test_flash_attn_cpu_bwd(seqlen_q, seqlen_k, d, causal, local, softcap, mha_type, deterministic, dtype):
+    if causal and local:
+        pytest.skip()
+    device = "cpu"
+    torch.random.manual_seed(0)
+    batch_size = 3
+    nheads = 4
+    nheads_kv = nheads if mha_type == "mha" else 2
+    q_ref = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    if softcap > 0.0:
+        # Ensure the values of qk are at least within softcap range.
+        q_ref = (q_ref * softcap / 4).to(dtype)
+    q_ref = q_ref.requires_grad_()
+    k_ref = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype, requires_grad=True)
+    v_ref = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype, requires_grad=True)
+    q, k, v = [x.detach().requires_grad_() for x in (q_ref, k_ref, v_ref)]
+    window_size = (-1, -1) if not local else torch.randint(0, seqlen_k, (2,)).tolist()
+    out_ref, _ = attention_ref(q_ref, k_ref, v_ref, None, None, causal=causal, window_size=window_size, softcap=softcap)
+    out_pt, _ = attention_ref(q_ref, k_ref, v_ref, None, None, causal=causal, window_size=window_size, softcap=softcap,
+                              upcast=False, reorder_ops=True)
+    out, _ = flash_attn_func(q, k, v, causal=causal, window_size=window_size, softcap=softcap, deterministic=deterministic)
+    g = torch.randn_like(out)
+    dq, dk, dv = torch.autograd.grad(out, (q, k, v), g, retain_graph=True)
+    dq_ref, dk_ref, dv_ref = torch.autograd.grad(out_ref, (q_ref, k_ref, v_ref), g)
+    dq_pt, dk_pt, dv_pt = torch.autograd.grad(out_pt, (q_ref, k_ref, v_ref), g)
+    print(f"dQ max diff: {(dq - dq_ref).abs().max().item()}")
+    print(f"dK max diff: {(dk - dk_ref).abs().max().item()}")
+    print(f"dV max diff: {(dv - dv_ref).abs().max().item()}")
+    rtol = 2 if softcap == 0.0 else 3
+    dq_atol = 2 * (dq_ref + 0.3 - 0.3 - dq_ref).abs().max().item() + (0 if softcap == 0 else 3e-4)
+    assert (dq - dq_ref).abs().max().item() <= rtol * (dq_pt - dq_ref).abs().max().item() + dq_atol
+    dk_atol = 2 * (dk_ref + 0.3 - 0.3 - dk_ref).abs().max().item() + (0 if softcap == 0 else 3e-4)
+    assert (dk - dk_ref).abs().max().item() <= rtol * (dk_pt - dk_ref).abs().max().item() + dk_atol
+    dv_atol = 2 * (dv_ref + 0.3 - 0.3 - dv_ref).abs().max().item() + (0 if softcap == 0 else 3e-4)
+    assert (dv - dv_ref).abs().max().item() <= rtol * (dv_pt - dv_ref).abs().max().item() + dv_atol
+    if deterministic:
+        for _ in range(3):
+            dq1, dk1, dv1 = torch.autograd.grad(out, (q, k, v), g, retain_graph=True)
+            assert torch.equal(dq1, dq)
+            assert torch.equal(dk1, dk)
+            assert torch.equal(dv1, dv)
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16] + ([torch.float16] if not DISABLE_FP16 else []))
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("local", [False] + ([True] if not DISABLE_LOCAL else []))
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("add_unused_qkv", [False, True])
+@pytest.mark.parametrize("d", [64, 128])
+@pytest.mark.parametrize(
+    "seqlen_q,seqlen_k",
+    [
+        (1, 1),
+        (1, 147),
+        (113, 203),
+        (128, 217),
+        (227, 128),
+        (512, 256),
+    ],
+)
+def test_flash_attn_cpu_varlen_output(seqlen_q, seqlen_k, d, add_unused_qkv, causal, local, mha_type, dtype):
+    if causal and local:
+        pytest.skip()
+    device = "cpu"
+    torch.random.manual_seed(seqlen_q + seqlen_k + d + int(causal) * 2 + int(local))
+    batch_size = 5
+    nheads = 4
+    nheads_kv = nheads if mha_type == "mha" else 2
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype)
+    v = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype)
+    window_size = (-1, -1) if not local else torch.randint(0, seqlen_k, (2,)).tolist()
+    query_padding_mask = generate_random_padding_mask(seqlen_q, batch_size, device, mode="random", zero_lengths=False)
+    key_padding_mask = generate_random_padding_mask(seqlen_k, batch_size, device, mode="random", zero_lengths=True)
+    query_unused_mask, key_unused_mask = None, None
+    if add_unused_qkv:
+        another_mask = generate_random_padding_mask(seqlen_q, batch_size, device)
+        query_unused_mask = torch.logical_xor(torch.logical_or(query_padding_mask, another_mask),
+                                              torch.logical_and(query_padding_mask, another_mask))
+        query_padding_mask = torch.logical_and(query_padding_mask, another_mask)
+        another_mask = generate_random_padding_mask(seqlen_k, batch_size, device)
+        key_unused_mask = torch.logical_xor(torch.logical_or(key_padding_mask, another_mask),
+                                            torch.logical_and(key_padding_mask, another_mask))
+        key_padding_mask = torch.logical_and(key_padding_mask, another_mask)
+    (
+        q_unpad, k_unpad, v_unpad, _,
+        cu_seqlens_q, cu_seqlens_k, seqused_q, seqused_k, max_seqlen_q, max_seqlen_k,
+        q, k, v, _,
+        output_pad_fn, _, _,
+    ) = generate_qkv(q, k, v, query_padding_mask, key_padding_mask,
+                     query_unused_mask=query_unused_mask, key_unused_mask=key_unused_mask)
+    out_ref, _ = attention_ref(q, k, v, query_padding_mask, key_padding_mask, causal=causal, window_size=window_size)
+    out_pt, _ = attention_ref(q, k, v, query_padding_mask, key_padding_mask, causal=causal, window_size=window_size,
+                              upcast=False, reorder_ops=True)
+    if query_unused_mask is not None:
+        q_zero_masking = rearrange(query_unused_mask, "b s -> b s 1 1")
+    fwd_atol = 2 * (out_ref + 0.3 - 0.3 - out_ref).abs().max().item()
+    out_unpad, lse = flash_attn_varlen_func(
+        q_unpad, k_unpad, v_unpad,
+        cu_seqlens_q, cu_seqlens_k, max_seqlen_q, max_seqlen_k,
+        seqused_q=seqused_q, seqused_k=seqused_k,
+        causal=causal, window_size=window_size,
+    )
+    out = output_pad_fn(out_unpad)
+    if query_unused_mask is not None:
+        out.masked_fill_(q_zero_masking, 0.0)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + fwd_atol
+
+
+@pytest.mark.parametrize("dtype", [torch.bfloat16])
+@pytest.mark.parametrize("new_kv", [False] + ([True] if not DISABLE_APPENDKV else []))
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("has_batch_idx", [False, True])
+@pytest.mark.parametrize("page_size", [None] + ([16, 64] if not DISABLE_PAGEDKV else []))
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("d", [64, 128])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 128), (1, 339), (3, 1024), (64, 256)])
+def test_flash_attn_cpu_kvcache(seqlen_q, seqlen_k, d, mha_type, page_size, has_batch_idx, causal, new_kv, dtype):
+    if page_size is not None and (seqlen_k % page_size != 0 or has_batch_idx):
+        pytest.skip()
+    device = "cpu"
+    torch.random.manual_seed(0)
+    batch_size = 3
+    batch_size_cache = batch_size if not has_batch_idx else batch_size * 2
+    nheads = 4
+    nheads_k = nheads if mha_type == "mha" else 2
+    seqlen_new = seqlen_q
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype) if new_kv else None
+    v_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype) if new_kv else None
+    if page_size is None:
+        k_cache = torch.randn(batch_size_cache, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        v_cache = torch.randn(batch_size_cache, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        page_table = None
+    else:
+        num_blocks = seqlen_k // page_size * batch_size * 3
+        k_cache_paged = torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype)
+        v_cache_paged = torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype)
+        page_table = rearrange(torch.randperm(num_blocks, dtype=torch.int32, device=device)[:seqlen_k // page_size * batch_size],
+                               "(b nblocks) -> b nblocks", b=batch_size)
+        k_cache = rearrange(k_cache_paged[page_table.flatten()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=batch_size)
+        v_cache = rearrange(v_cache_paged[page_table.flatten()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=batch_size)
+    cache_seqlens = torch.randint(0, seqlen_k - (seqlen_new if new_kv else 0) + 1, (batch_size,), dtype=torch.int32, device=device)
+    cache_batch_idx = torch.randperm(batch_size_cache, dtype=torch.int32, device=device)[:batch_size] if has_batch_idx else None
+    arange = rearrange(torch.arange(seqlen_k, device=device), "s -> 1 s")
+    cache_seqlens_expanded = rearrange(cache_seqlens, "b -> b 1")
+    key_padding_mask = arange < cache_seqlens_expanded + (seqlen_new if new_kv else 0)
+    k_cache_ref = (k_cache if not has_batch_idx else k_cache[cache_batch_idx.long()]).clone()
+    v_cache_ref = (v_cache if not has_batch_idx else v_cache[cache_batch_idx.long()]).clone()
+    if new_kv:
+        update_mask = torch.logical_and(cache_seqlens_expanded <= arange, arange < cache_seqlens_expanded + seqlen_new)
+        k_cache_ref[update_mask] = rearrange(k_new, "b s ... -> (b s) ...")
+        v_cache_ref[update_mask] = rearrange(v_new, "b s ... -> (b s) ...")
+    k_cache_rep = repeat(k_cache_ref, "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    v_cache_rep = repeat(v_cache_ref, "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    out_ref, _ = attention_ref(q, k_cache_rep, v_cache_rep, None, key_padding_mask, causal=causal)
+    out_pt, _ = attention_ref(q, k_cache_rep, v_cache_rep, None, key_padding_mask, causal=causal,
+                              upcast=False, reorder_ops=True)
+    out = flash_attn_with_kvcache(
+        q,
+        k_cache if page_size is None else k_cache_paged,
+        v_cache if page_size is None else v_cache_paged,
+        k_new,
+        v_new,
+        cache_seqlens=cache_seqlens,
+        cache_batch_idx=cache_batch_idx,
+        page_table=page_table,
+        causal=causal,
+    )
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+    if new_kv:
+        if page_size is None:
+            k_cache_select = k_cache if not has_batch_idx else k_cache[cache_batch_idx.long()]
+            v_cache_select = v_cache if not has_batch_idx else v_cache[cache_batch_idx.long()]
+        else:
+            k_cache_select = rearrange(k_cache_paged[page_table.flatten()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=batch_size)
+            v_cache_select = rearrange(v_cache_paged[page_table.flatten()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=batch_size)
+        assert torch.equal(k_cache_select, k_cache_ref)
+        assert torch.equal(v_cache_select, v_cache_ref)
+
+
+@pytest.mark.parametrize("num_splits", [1, 8])
+@pytest.mark.parametrize("batch_size", [3, 992, 3000])
+def test_flash_attn_cpu_scheduler_metadata(batch_size, num_splits):
+    # The host planner has no batch size limit (the GPU kernel used to be limited to 992)
+    torch.random.manual_seed(0)
+    nheads, d, max_seqlen_k = 8, 128, 2048
+    cache_seqlens = torch.randint(1, max_seqlen_k + 1, (batch_size,), dtype=torch.int32)
+    num_splits_dynamic = get_scheduler_metadata(
+        batch_size, 1, max_seqlen_k, nheads, nheads, d, cache_seqlens, num_splits=num_splits, pack_gqa=False,
+    )
+    assert num_splits_dynamic.shape == (batch_size,)
+    kBlockM, kBlockN = 64, 64  # tile_size_fwd_cpu for hdim 128
+    num_n_blocks = (cache_seqlens + kBlockN - 1) // kBlockN
+    total_blocks = num_n_blocks.sum().item()  # 1 m_block per batch
+    blocks_per_sm = math.ceil(torch.tensor(total_blocks, dtype=torch.float32).mul(1.1).mul(nheads).div(torch.get_num_threads()).item())
+    num_splits_ref = ((num_n_blocks + blocks_per_sm - 1) // blocks_per_sm).clamp(1, num_splits).to(torch.int32)
+    assert torch.equal(num_splits_dynamic, num_splits_ref)
+
+
+@pytest.mark.parametrize("batch_size", [3, 257])
+@pytest.mark.parametrize("num_tokens", [1, 3, 100])
+def test_flash_attn_cpu_incremental_scheduler_metadata(batch_size, num_tokens):
+    torch.random.manual_seed(0)
+    nheads, nheads_k, d, max_seqlen_k = 8, 2, 128, 8192
+    cache_seqlens = torch.randint(0, 2048, (batch_size,), dtype=torch.int32)
+    kwargs = dict(num_splits=8, pack_gqa=True)
+    metadata = get_incremental_scheduler_metadata(batch_size, 1, max_seqlen_k, nheads, nheads_k, d, cache_seqlens, **kwargs)
+    for step in range(50):
+        cache_seqlens += num_tokens
+        metadata.advance(num_tokens)
+        metadata_ref = get_scheduler_metadata(batch_size, 1, max_seqlen_k, nheads, nheads_k, d, cache_seqlens, **kwargs)
+        assert torch.equal(metadata.metadata, metadata_ref)
+    assert metadata.num_tokens_advanced == 50 * num_tokens
+
+
+@pytest.mark.parametrize("page_size", [None] + ([16] if not DISABLE_PAGEDKV else []))
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("seqlen_q", [1, 3])
+def test_flash_attn_cpu_attention_plan(seqlen_q, causal, page_size):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, nheads_k, d, seqlen_k = 3, 4, 2, 128, 256
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    if page_size is None:
+        k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+        page_table = None
+    else:
+        num_blocks = seqlen_k // page_size * batch_size
+        k_cache = torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype)
+        v_cache = torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype)
+        page_table = rearrange(torch.randperm(num_blocks, dtype=torch.int32, device=device), "(b nblocks) -> b nblocks", b=batch_size)
+    cache_seqlens = torch.randint(1, seqlen_k // 2, (batch_size,), dtype=torch.int32, device=device)
+    plan = get_attention_plan(q, k_cache, v_cache, cache_seqlens, page_table=page_table, causal=causal)
+    out_given = torch.empty_like(q)
+    # Decode steps, with the inputs updated in place as a serving loop would
+    for step in range(4):
+        q.copy_(torch.randn_like(q))
+        cache_seqlens += 7
+        out_ref = flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, page_table=page_table, causal=causal)
+        out, softmax_lse = plan.run(q, k_cache, v_cache, cache_seqlens, page_table, None)
+        assert torch.equal(out, out_ref)
+        plan.run(q, k_cache, v_cache, cache_seqlens, page_table, out_given)
+        assert torch.equal(out_given, out_ref)
+    with pytest.raises(RuntimeError):
+        plan.run(q[:1], k_cache, v_cache, cache_seqlens, page_table, None)
+
+
+@pytest.mark.parametrize("causal", [False, True])
+def test_flash_attn_cpu_attention_plan_splits(causal):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    # Long-context decode with few heads, so that the number of splits of a batch follows its length
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 2, 1, 128, 4096
+    q = torch.randn(batch_size, 1, nheads, d, device=device, dtype=dtype)
+    k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    cache_seqlens = torch.tensor([16, 40], dtype=torch.int32, device=device)
+    plan = get_attention_plan(q, k_cache, v_cache, cache_seqlens, causal=causal, num_splits=8)
+    splits_short = plan.num_splits_dynamic
+    # The sequences grow between decode steps: run() picks the splits for the current lengths
+    for seqlens in ([16, 40], [1000, 40], [seqlen_k, 3000]):
+        cache_seqlens.copy_(torch.tensor(seqlens, dtype=torch.int32))
+        out, _ = plan.run(q, k_cache, v_cache, cache_seqlens, None, None)
+        fresh = get_attention_plan(q, k_cache, v_cache, cache_seqlens.clone(), causal=causal, num_splits=8)
+        assert plan.num_splits_dynamic == fresh.num_splits_dynamic
+        out_ref = flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, causal=causal)
+        assert torch.equal(out, out_ref)
+    # With enough threads, the long sequences are split and the short ones weren't
+    if torch.get_num_threads() >= 4:
+        assert plan.num_splits_dynamic != splits_short
+
+
+@pytest.mark.skipif(DISABLE_PAGEDKV, reason="paged KV disabled")
+@pytest.mark.parametrize("page_size", [1, 16])
+@pytest.mark.parametrize("prompt_len", [16, 37])
+def test_flash_attn_cpu_kv_block_manager(prompt_len, page_size):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    num_beams, nheads, nheads_k, d, num_pages = 4, 4, 2, 64, 64
+    manager = get_kv_block_manager(num_pages, page_size)
+    k_cache = torch.zeros(num_pages, page_size, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.zeros_like(k_cache)
+
+    def write(seq, k, v):
+        # Writes the last k.shape[0] tokens of seq, which were just appended
+        pages, seqlen = manager.pages(seq), manager.seqlen(seq)
+        for i, pos in enumerate(range(seqlen - k.shape[0], seqlen)):
+            k_cache[pages[pos // page_size], pos % page_size] = k[i]
+            v_cache[pages[pos // page_size], pos % page_size] = v[i]
+
+    k_prompt = torch.randn(prompt_len, nheads_k, d, device=device, dtype=dtype)
+    v_prompt = torch.randn_like(k_prompt)
+    prompt = manager.add_sequence([], 0)
+    assert manager.append(prompt, prompt_len).shape == (0, 2)
+    write(prompt, k_prompt, v_prompt)
+    num_prompt_pages = (prompt_len + page_size - 1) // page_size
+    beams = [manager.fork(prompt) for _ in range(num_beams)]
+    manager.free_sequence(prompt)
+    assert all(manager.refcount(page) == num_beams for page in manager.pages(beams[0]))
+    assert manager.num_free_pages == num_pages - num_prompt_pages
+    k_ref = [[k_prompt] for _ in beams]
+    v_ref = [[v_prompt] for _ in beams]
+    for step in range(3):
+        copies = manager.append_batch(beams, [1] * num_beams)
+        if step == 0 and prompt_len % page_size != 0:
+            # The shared partial page is copied for all but the last beam
+            assert copies.shape == (num_beams - 1, 2)
+        else:
+            assert copies.shape == (0, 2)
+        copy_kv_pages(k_cache, v_cache, copies)
+        for b, seq in enumerate(beams):
+            k_new, v_new = torch.randn(1, nheads_k, d, dtype=dtype), torch.randn(1, nheads_k, d, dtype=dtype)
+            write(seq, k_new, v_new)
+            k_ref[b].append(k_new)
+            v_ref[b].append(v_new)
+    # Full prompt pages are still shared
+    assert all(manager.refcount(page) == num_beams for page in manager.pages(beams[0])[:prompt_len // page_size])
+    page_table, cache_seqlens = manager.page_table(beams, 0, k_cache.device)
+    assert page_table.dtype == torch.int32 and cache_seqlens.tolist() == [prompt_len + 3] * num_beams
+    seqlen = prompt_len + 3
+    k_ref, v_ref = torch.stack([torch.cat(k) for k in k_ref]), torch.stack([torch.cat(v) for v in v_ref])
+    # The pages of each beam hold its tokens: the copies happened before the beams wrote to them
+    k_paged = rearrange(k_cache[page_table.flatten().long()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=num_beams)
+    v_paged = rearrange(v_cache[page_table.flatten().long()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=num_beams)
+    assert torch.equal(k_paged[:, :seqlen], k_ref) and torch.equal(v_paged[:, :seqlen], v_ref)
+    q = torch.randn(num_beams, 1, nheads, d, device=device, dtype=dtype)
+    out = flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, page_table=page_table, causal=True)
+    out_ref = flash_attn_with_kvcache(q, k_ref, v_ref, causal=True)
+    assert (out - out_ref).abs().max().item() <= 1e-2
+    for seq in beams:
+        manager.free_sequence(seq)
+    assert manager.num_free_pages == num_pages
+    with pytest.raises(RuntimeError):
+        manager.append(manager.add_sequence([], 0), num_pages * page_size + 1)
+
+
+@pytest.mark.skipif(DISABLE_PAGEDKV or DISABLE_APPENDKV, reason="paged KV or appending to the KV cache disabled")
+@pytest.mark.parametrize("page_size", [4, 16])
+def test_flash_attn_cpu_prefix_cache(page_size):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    nheads, nheads_k, d, num_pages, vocab = 4, 2, 64, 64, 100
+    manager = get_kv_block_manager(num_pages, page_size)
+    cache = get_prefix_cache(manager, 8)
+    k_cache = torch.zeros(num_pages, page_size, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.zeros_like(k_cache)
+    # K and V of a token only depend on the token here, so equal prefixes have equal KV
+    k_emb = torch.randn(vocab, nheads_k, d, device=device, dtype=dtype)
+    v_emb = torch.randn(vocab, nheads_k, d, device=device, dtype=dtype)
+    system_prompt = torch.randint(0, vocab, (2 * page_size + 3,)).tolist()
+
+    def prefill(tokens):
+        pages, num_cached = cache.match(tokens)
+        seq = manager.add_sequence(pages, num_cached)
+        num_new = len(tokens) - num_cached
+        assert manager.append(seq, num_new).shape == (0, 2)  # Cached pages are full, nothing to copy
+        page_table, seqused_k = manager.page_table([seq], 0, k_cache.device)
+        t = torch.tensor(tokens)
+        q = torch.randn(1, len(tokens), nheads, d, device=device, dtype=dtype)
+        out = flash_attn_with_kvcache(
+            q[:, num_cached:], k_cache, v_cache, k_emb[t[num_cached:]][None], v_emb[t[num_cached:]][None],
+            cache_seqlens=seqused_k - num_new, page_table=page_table, causal=True,
+        )
+        out_ref, _ = flash_attn_func(q, k_emb[t][None], v_emb[t][None], causal=True)
+        assert (out - out_ref[:, num_cached:]).abs().max().item() <= 1e-2
+        cache.insert(tokens, manager.pages(seq))
+        manager.free_sequence(seq)
+        return num_cached
+
+    assert prefill(system_prompt + [1, 2, 3]) == 0
+    assert cache.num_cached_pages == (len(system_prompt) + 3) // page_size
+    for user_prompt in [[4, 5], [6] * (page_size + 1), [7]]:
+        assert prefill(system_prompt + user_prompt) >= 2 * page_size
+    stats = cache.stats()
+    assert stats["num_lookups"] == 4 and stats["num_hits"] == 3
+    assert 0.0 < cache.token_hit_rate < 1.0
+    # The cache stays under its budget, and gives back the pages only it holds
+    assert cache.num_cached_pages <= 8
+    assert manager.num_free_pages == num_pages - cache.num_cached_pages
+    num_cached_pages = cache.num_cached_pages
+    assert cache.evict(num_pages) == num_cached_pages
+    assert manager.num_free_pages == num_pages and cache.num_cached_pages == 0
+
+
+@pytest.mark.skipif(DISABLE_PAGEDKV, reason="paged KV disabled")
+@pytest.mark.parametrize("max_moves", [0, 3])
+def test_flash_attn_cpu_kv_compaction(max_moves):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    nheads, nheads_k, d, num_pages, page_size = 4, 2, 64, 48, 4
+    manager = get_kv_block_manager(num_pages, page_size)
+    k_cache = torch.randn(num_pages, page_size, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn_like(k_cache)
+    # Sequences growing in turns interleave their pages, then every other one finishes
+    seqs = [manager.add_sequence([], 0) for _ in range(8)]
+    for _ in range(4):
+        for seq in seqs:
+            manager.append(seq, page_size)
+    for seq in seqs[::2]:
+        manager.free_sequence(seq)
+    seqs = seqs[1::2]
+    assert manager.num_page_breaks > 0
+    page_table, cache_seqlens = manager.page_table(seqs, 0, k_cache.device)
+    k_before, v_before = k_cache[page_table.long()].clone(), v_cache[page_table.long()].clone()
+    q = torch.randn(len(seqs), 1, nheads, d, device=device, dtype=dtype)
+    out_before = flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, page_table=page_table)
+    for _ in range(100):
+        moves = manager.compact(k_cache, v_cache, max_moves)
+        if moves.shape[0] == 0:
+            break
+        assert max_moves == 0 or moves.shape[0] <= max_moves
+        # Each step leaves a consistent cache
+        page_table, cache_seqlens = manager.page_table(seqs, 0, k_cache.device)
+        assert torch.equal(k_cache[page_table.long()], k_before) and torch.equal(v_cache[page_table.long()], v_before)
+    assert manager.num_page_breaks == 0
+    out = flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens, page_table=page_table)
+    assert torch.equal(out, out_before)
+
+
+@pytest.mark.skipif(DISABLE_PAGEDKV or DISABLE_APPENDKV, reason="paged KV or appending to the KV cache disabled")
+@pytest.mark.parametrize("num_file_pages", [0, 16])
+def test_flash_attn_cpu_tiered_kv_cache(num_file_pages, tmp_path):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    nheads, nheads_k, d, page_size = 4, 2, 64, 4
+    num_device_pages, num_host_pages = 8, 4 if num_file_pages else 24
+    num_pages = num_device_pages + num_host_pages + num_file_pages - 1
+    manager = get_kv_block_manager(num_pages, page_size)
+    # A simulated device pool on the CPU
+    k_cache = torch.zeros(num_device_pages, page_size, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.zeros_like(k_cache)
+    tiered = get_tiered_kv_cache(k_cache, v_cache, num_pages, num_host_pages, num_file_pages, str(tmp_path / "kv.spill"))
+    seqs = [manager.add_sequence([], 0) for _ in range(5)]
+    k_ref = {seq: torch.empty(0, nheads_k, d, dtype=dtype) for seq in seqs}
+    v_ref = {seq: torch.empty(0, nheads_k, d, dtype=dtype) for seq in seqs}
+    # Two sequences at a time, each step appending tokens to both: the others get spilled in between
+    batches = [[seqs[i % 5], seqs[(i + 2) % 5]] for i in range(12)]
+    for step, batch in enumerate(batches):
+        seqlen_new = 3 if step < 5 else 1
+        manager.append_batch(batch, [seqlen_new] * len(batch))
+        page_table, seqused_k = manager.page_table(batch, 0, None)
+        device_page_table = tiered.prepare(page_table, seqused_k)
+        if step + 1 < len(batches):
+            tiered.prefetch(*manager.page_table(batches[step + 1], 0, None))
+        q = torch.randn(len(batch), seqlen_new, nheads, d, dtype=dtype)
+        k_new = torch.randn(len(batch), seqlen_new, nheads_k, d, dtype=dtype)
+        v_new = torch.randn_like(k_new)
+        out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, cache_seqlens=seqused_k - seqlen_new,
+                                      page_table=device_page_table, causal=True)
+        for b, seq in enumerate(batch):
+            k_ref[seq] = torch.cat([k_ref[seq], k_new[b]])
+            v_ref[seq] = torch.cat([v_ref[seq], v_new[b]])
+            out_ref, _ = flash_attn_func(q[b:b + 1], k_ref[seq][None], v_ref[seq][None], causal=True)
+            assert (out[b:b + 1] - out_ref).abs().max().item() <= 1e-2
+    stats = tiered.stats()
+    assert stats["num_host_spills"] > 0 and stats["num_host_loads"] + stats["num_file_loads"] > 0
+    if num_file_pages:
+        assert stats["num_file_spills"] > 0 and (tmp_path / "kv.spill").read_bytes()[:8] == b"FA3KVSPL"
+    freed = [page for page in manager.pages(seqs[0]) if manager.refcount(page) == 1]
+    manager.free_sequence(seqs[0])
+    tiered.discard(freed)
+    assert all(tiered.tier(page) == -1 for page in freed)
+
+
+@pytest.mark.skipif(DISABLE_APPENDKV, reason="appending to the KV cache disabled")
+@pytest.mark.parametrize("shared_tree", [False, True])
+@pytest.mark.parametrize("num_accepted", [0, 1])
+@pytest.mark.parametrize("tree_size", [1, 7, 64])
+def test_flash_attn_cpu_tree_mask(tree_size, num_accepted, shared_tree):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 4, 2, 64, 256
+    # The queries are the last accepted token(s), then the nodes of the draft tree
+    seqlen_new = num_accepted + tree_size
+    parents = torch.stack([
+        torch.tensor([int(torch.randint(-1, i, ())) for i in range(tree_size)], dtype=torch.int32)
+        for _ in range(1 if shared_tree else batch_size)
+    ])
+    tree_parents = parents[0] if shared_tree else parents
+    q = torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype)
+    k_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    v_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    cache_seqlens = torch.randint(1, seqlen_k - seqlen_new + 1, (batch_size,), dtype=torch.int32, device=device)
+    k_cache_og, v_cache_og = k_cache.clone(), v_cache.clone()
+    out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, cache_seqlens=cache_seqlens,
+                                  tree_parents=tree_parents, causal=True)
+    for b in range(batch_size):
+        cache_seqlen = int(cache_seqlens[b])
+        for row in range(seqlen_new):
+            # Each query sees the cache, the accepted tokens up to itself, and the path from the root of the tree
+            path, node = [], row - num_accepted
+            while node >= 0:
+                path.insert(0, num_accepted + node)
+                node = int(parents[0 if shared_tree else b, node])
+            new_idx = list(range(min(row + 1, num_accepted))) + path
+            keys = torch.cat([k_cache_og[b, :cache_seqlen], k_new[b, new_idx]])
+            values = torch.cat([v_cache_og[b, :cache_seqlen], v_new[b, new_idx]])
+            out_ref, _ = flash_attn_func(q[b:b + 1, row:row + 1], keys[None], values[None], causal=True)
+            assert (out[b, row] - out_ref[0, 0]).abs().max().item() <= 1e-2
+    with pytest.raises(RuntimeError):
+        flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens,
+                                tree_parents=torch.arange(tree_size, dtype=torch.int32), causal=True)
+
+
+@pytest.mark.skipif(DISABLE_PAGEDKV or DISABLE_APPENDKV, reason="paged KV or appending to the KV cache disabled")
+@pytest.mark.parametrize("bits", [8, 4])
+@pytest.mark.parametrize("seqlen_new", [1, 3])
+def test_flash_attn_cpu_quantized_kvcache(seqlen_new, bits):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, nheads_k, d, page_size, seqlen_k = 3, 4, 2, 128, 16, 256
+    num_blocks = seqlen_k // page_size * batch_size * 2
+    k_cache, k_cache_scale = quantize_kv(torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype), bits)
+    v_cache, v_cache_scale = quantize_kv(torch.randn(num_blocks, page_size, nheads_k, d, device=device, dtype=dtype), bits)
+    assert k_cache.shape[-1] == d * bits // 8
+    page_table = rearrange(torch.randperm(num_blocks, dtype=torch.int32, device=device)[:seqlen_k // page_size * batch_size],
+                           "(b nblocks) -> b nblocks", b=batch_size)
+    q = torch.randn(batch_size, seqlen_new, nheads, d, device=device, dtype=dtype)
+    k_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    v_new = torch.randn(batch_size, seqlen_new, nheads_k, d, device=device, dtype=dtype)
+    cache_seqlens = torch.randint(0, seqlen_k - seqlen_new + 1, (batch_size,), dtype=torch.int32, device=device)
+    out = flash_attn_with_kvcache(q, k_cache, v_cache, k_new, v_new, k_cache_scale=k_cache_scale,
+                                  v_cache_scale=v_cache_scale, cache_seqlens=cache_seqlens, page_table=page_table,
+                                  causal=True)
+    to_seq = lambda x: rearrange(x[page_table.flatten()], "(b nblocks) block_size ... -> b (nblocks block_size) ...", b=batch_size)
+    # The new keys / values are quantized as they are appended
+    arange = rearrange(torch.arange(seqlen_k, device=device), "s -> 1 s")
+    cache_seqlens_expanded = rearrange(cache_seqlens, "b -> b 1")
+    update_mask = torch.logical_and(cache_seqlens_expanded <= arange, arange < cache_seqlens_expanded + seqlen_new)
+    for cache, scale, new in [(k_cache, k_cache_scale, k_new), (v_cache, v_cache_scale, v_new)]:
+        new_q, new_scale = quantize_kv(rearrange(new, "b s ... -> (b s) ..."), bits)
+        assert torch.equal(to_seq(cache)[update_mask], new_q)
+        assert torch.equal(to_seq(scale)[update_mask], new_scale)
+    k_ref = repeat(dequantize_kv(to_seq(k_cache), to_seq(k_cache_scale), bits), "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    v_ref = repeat(dequantize_kv(to_seq(v_cache), to_seq(v_cache_scale), bits), "b s h d -> b s (h g) d", g=nheads // nheads_k)
+    key_padding_mask = arange < cache_seqlens_expanded + seqlen_new
+    out_ref, _ = attention_ref(q.float(), k_ref, v_ref, None, key_padding_mask, causal=True)
+    print(f"Output max diff: {(out.float() - out_ref).abs().max().item()}")
+    assert (out.float() - out_ref).abs().max().item() <= 1e-2
+
+
+@pytest.mark.parametrize("varlen", [False, True])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("seqlen_q", [1, 3])
+@pytest.mark.parametrize("num_splits", [0, 3, 8])
+def test_flash_attn_cpu_split_kv(num_splits, seqlen_q, causal, varlen):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    # Long-context decode: few heads, so that the splits are what keeps the threads busy
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 2, 1, 128, 4096
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    # With cache_seqlens, the number of splits of each sequence is decided by the host planner
+    cache_seqlens = torch.tensor([37, seqlen_k], dtype=torch.int32, device=device) if varlen else None
+    kwargs = dict(cache_seqlens=cache_seqlens, causal=causal, return_softmax_lse=True)
+    out, lse = flash_attn_with_kvcache(q, k_cache, v_cache, num_splits=num_splits, **kwargs)
+    out_ref, lse_ref = flash_attn_with_kvcache(q, k_cache, v_cache, num_splits=1, **kwargs)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"LSE max diff: {(lse - lse_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 1e-2
+    assert (lse - lse_ref).abs().max().item() <= 1e-4
+
+
+@pytest.mark.parametrize("work_stealing", [False, True])
+def test_flash_attn_cpu_work_stealing(work_stealing):
+    import flash_attn_3_cuda
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    nheads, d = 4, 128
+    # One long sequence among short ones, and sequences without keys
+    seqlens_q = torch.tensor([1, 300, 7, 1, 64, 0, 3], dtype=torch.int32)
+    seqlens_k = torch.tensor([1, 700, 0, 90, 64, 5, 33], dtype=torch.int32)
+    cu_seqlens_q = torch.nn.functional.pad(seqlens_q.cumsum(0, dtype=torch.int32), (1, 0))
+    cu_seqlens_k = torch.nn.functional.pad(seqlens_k.cumsum(0, dtype=torch.int32), (1, 0))
+    q = torch.randn(seqlens_q.sum().item(), nheads, d, device=device, dtype=dtype)
+    k = torch.randn(seqlens_k.sum().item(), nheads, d, device=device, dtype=dtype)
+    v = torch.randn(seqlens_k.sum().item(), nheads, d, device=device, dtype=dtype)
+    # One split per sequence, so that the number of tasks below doesn't depend on the number of threads
+    kwargs = dict(max_seqlen_q=seqlens_q.max().item(), max_seqlen_k=seqlens_k.max().item(), causal=True, num_splits=1)
+    flash_attn_3_cuda.set_cpu_work_stealing(work_stealing)
+    flash_attn_3_cuda.reset_cpu_thread_stats()
+    try:
+        out, lse = flash_attn_varlen_func(q, k, v, cu_seqlens_q, cu_seqlens_k, **kwargs)
+        stats = flash_attn_3_cuda.cpu_thread_stats()
+    finally:
+        flash_attn_3_cuda.set_cpu_work_stealing(True)
+    kBlockM = 64  # tile_size_fwd_cpu for hdim 128
+    # Only the tiles with queries are tasks, one per (m_block, head) with a single split
+    assert sum(stats["num_tasks"]) == nheads * ((seqlens_q + kBlockM - 1) // kBlockM).sum().item()
+    if not work_stealing:
+        assert sum(stats["num_steals"]) == 0
+    assert all(0 <= busy <= wall for busy, wall in zip(stats["busy_ns"], stats["wall_ns"]))
+    for i in range(len(seqlens_q)):
+        q_i = q[cu_seqlens_q[i]:cu_seqlens_q[i + 1]].unsqueeze(0)
+        k_i = k[cu_seqlens_k[i]:cu_seqlens_k[i + 1]].unsqueeze(0)
+        v_i = v[cu_seqlens_k[i]:cu_seqlens_k[i + 1]].unsqueeze(0)
+        if q_i.shape[1] == 0 or k_i.shape[1] == 0:
+            continue
+        out_ref, _ = attention_ref(q_i, k_i, v_i, causal=True)
+        out_pt, _ = attention_ref(q_i, k_i, v_i, causal=True, upcast=False, reorder_ops=True)
+        out_i = out[cu_seqlens_q[i]:cu_seqlens_q[i + 1]].unsqueeze(0)
+        assert (out_i - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+
+
+@pytest.mark.parametrize("num_splits", [1, 3])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("seqlen_q", [1, 5, 100])
+def test_flash_attn_cpu_pack_gqa(seqlen_q, causal, num_splits):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 16, 2, 128, 300
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v_cache = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    cache_seqlens = torch.tensor([seqlen_k // 3, seqlen_k], dtype=torch.int32, device=device)
+    kwargs = dict(cache_seqlens=cache_seqlens, causal=causal, num_splits=num_splits, return_softmax_lse=True)
+    out, lse = flash_attn_with_kvcache(q, k_cache, v_cache, pack_gqa=True, **kwargs)
+    out_nopack, lse_nopack = flash_attn_with_kvcache(q, k_cache, v_cache, pack_gqa=False, **kwargs)
+    # Packing the query heads of a KV head into M changes which tile a row is in, not its arithmetic, but the
+    # splits of a packed tile can cover different n_blocks
+    if num_splits == 1:
+        assert torch.equal(out, out_nopack)
+        assert torch.equal(lse, lse_nopack)
+    assert (out - out_nopack).abs().max().item() <= 1e-2
+    assert (lse - lse_nopack).abs().max().item() <= 1e-4
+    key_padding_mask = rearrange(torch.arange(seqlen_k, device=device), "s -> 1 s") < rearrange(cache_seqlens, "b -> b 1")
+    out_ref, _ = attention_ref(q, k_cache, v_cache, None, key_padding_mask, causal=causal)
+    out_pt, _ = attention_ref(q, k_cache, v_cache, None, key_padding_mask, causal=causal, upcast=False, reorder_ops=True)
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+    # Decode with GQA packs by default
+    plan = get_attention_plan(q[:, :1], k_cache, v_cache, cache_seqlens, causal=causal)
+    assert plan.pack_gqa
+
+
+@pytest.mark.skipif(DISABLE_LOCAL, reason="local attention disabled")
+@pytest.mark.parametrize("num_splits", [1, 4])
+@pytest.mark.parametrize("window_left,attention_chunk", [(255, 0), (1000, 0), (-1, 512), (700, 512)])
+@pytest.mark.parametrize("seqlen_q", [1, 150])
+def test_flash_attn_cpu_sliding_window(seqlen_q, window_left, attention_chunk, num_splits):
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    # Long context with a short window: only the n_blocks the window sees are loaded, the boundary ones masked
+    batch_size, nheads, nheads_k, d, seqlen_k = 2, 4, 2, 128, 4096
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype)
+    k = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    v = torch.randn(batch_size, seqlen_k, nheads_k, d, device=device, dtype=dtype)
+    window_size = (window_left, 0)
+    out, lse = flash_attn_func(q, k, v, causal=True, window_size=window_size, attention_chunk=attention_chunk,
+                               num_splits=num_splits)
+    out_ref, _ = attention_ref(q, k, v, causal=True, window_size=window_size, attention_chunk=attention_chunk)
+    out_pt, _ = attention_ref(q, k, v, causal=True, window_size=window_size, attention_chunk=attention_chunk,
+                              upcast=False, reorder_ops=True)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+
+
+@pytest.mark.skipif(DISABLE_BACKWARD, reason="backward disabled")
+@pytest.mark.parametrize("varlen", [False, True])
+@pytest.mark.parametrize("mha_type", ["mha", "gqa"])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("seqlen_q,seqlen_k", [(1, 239), (37, 70), (113, 203)])
+def test_flash_attn_cpu_dropout(seqlen_q, seqlen_k, causal, mha_type, varlen):
+    import flash_attn_3_cuda
+    from flash_attn_interface import _flash_attn_forward, _flash_attn_backward
+    device = "cpu"
+    dtype = torch.bfloat16
+    torch.random.manual_seed(0)
+    batch_size, nheads, d, dropout_p = 2, 4, 64, 0.17
+    nheads_kv = nheads if mha_type == "mha" else 2
+    seed, offset = 0x1234_5678_9abc_def0, 4096
+    rng_state = torch.tensor([seed, offset], dtype=torch.int64)
+
+    def philox(seed, subsequence, offset):  # Philox-4x32-7, as in philox.cuh
+        m = 0xFFFFFFFF
+        x, y, z, w = offset & m, offset >> 32, subsequence & m, subsequence >> 32
+        kx, ky = seed & m, seed >> 32
+        for _ in range(7):
+            res0, res1 = 0xD2511F53 * x, 0xCD9E8D57 * z
+            x, y, z, w = (res1 >> 32) ^ y ^ kx, res1 & m, (res0 >> 32) ^ w ^ ky, res0 & m
+            kx, ky = (kx + 0x9E3779B9) & m, (ky + 0xBB67AE85) & m
+        return x, y, z, w
+
+    # Known-answer test of Random123 for philox4x32_7 with a zero counter and key
+    assert philox(0, 0, 0) == (0x5F6FB709, 0x0D893F64, 0x4F121F81, 0x4F730A48)
+    # Mask of flash-attention 2 (dropout.h): one philox call per lane of a warp per 16 x 32 block, and a byte of the
+    # random bits per element, picked by its place in the MMA accumulator layout
+    p_dropout_in_uint8_t = math.floor(torch.tensor(1 - dropout_p, dtype=torch.float32).item() * 255)
+    mask_ref = torch.empty(batch_size, nheads, seqlen_q, seqlen_k, dtype=torch.bool)
+    for b, h, block_row, block_col in itertools.product(range(batch_size), range(nheads),
+                                                        range((seqlen_q + 15) // 16), range((seqlen_k + 31) // 32)):
+        rnd = [philox(seed, block_row | (block_col << 32), offset + (b * nheads + h) * 32 + lane) for lane in range(32)]
+        for r in range(block_row * 16, min(block_row * 16 + 16, seqlen_q)):
+            for c in range(block_col * 32, min(block_col * 32 + 32, seqlen_k)):
+                word = rnd[(r % 8) * 4 + (c % 8) // 2][(c % 32) // 8]
+                byte = (word >> (16 * ((r % 16) // 8) + 8 * (c % 2))) & 0xFF
+                mask_ref[b, h, r, c] = byte <= p_dropout_in_uint8_t
+    mask = flash_attn_3_cuda.dropout_mask(rng_state, batch_size, nheads, seqlen_q, seqlen_k, dropout_p)
+    assert torch.equal(mask, mask_ref)
+
+    q = torch.randn(batch_size, seqlen_q, nheads, d, device=device, dtype=dtype, requires_grad=True)
+    k = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype, requires_grad=True)
+    v = torch.randn(batch_size, seqlen_k, nheads_kv, d, device=device, dtype=dtype, requires_grad=True)
+    softmax_scale = d ** (-0.5)
+    # With varlen, each sequence gets the mask of its batch index, at its positions within the sequence
+    query_padding_mask = generate_random_padding_mask(seqlen_q, batch_size, device) if varlen else None
+    key_padding_mask = generate_random_padding_mask(seqlen_k, batch_size, device) if varlen else None
+    (
+        q_unpad, k_unpad, v_unpad, _,
+        cu_seqlens_q, cu_seqlens_k, _, _, max_seqlen_q, max_seqlen_k,
+        q, k, v, _,
+        output_pad_fn, dq_pad_fn, dk_pad_fn,
+    ) = generate_qkv(q, k, v, query_padding_mask, key_padding_mask)
+    if not varlen:
+        q_unpad, k_unpad, v_unpad, cu_seqlens_q, cu_seqlens_k, max_seqlen_q, max_seqlen_k = q, k, v, None, None, None, None
+        output_pad_fn = dq_pad_fn = dk_pad_fn = lambda x: x
+    out_unpad, lse, _, _, rng_state_out = _flash_attn_forward(
+        q_unpad, k_unpad, v_unpad, None, None, None, None, cu_seqlens_q, cu_seqlens_k, None, None, None,
+        max_seqlen_q, max_seqlen_k, None, None, None, None, None, None,
+        None, None, None, softmax_scale, causal, dropout_p=dropout_p, rng_state=rng_state,
+    )
+    assert torch.equal(rng_state_out, rng_state)
+    out = output_pad_fn(out_unpad)
+    out_ref, _ = attention_ref(q, k, v, query_padding_mask, key_padding_mask, causal=causal, dropout_p=dropout_p,
+                               dropout_mask=mask)
+    out_pt, _ = attention_ref(q, k, v, query_padding_mask, key_padding_mask, causal=causal, dropout_p=dropout_p,
+                              dropout_mask=mask, upcast=False, reorder_ops=True)
+    print(f"Output max diff: {(out - out_ref).abs().max().item()}")
+    print(f"Pytorch max diff: {(out_pt - out_ref).abs().max().item()}")
+    assert (out - out_ref).abs().max().item() <= 2 * (out_pt - out_ref).abs().max().item() + 1e-5
+
+    # The backward regenerates the same mask from rng_state
+    g_unpad = torch.randn_like(out_unpad)
+    g = output_pad_fn(g_unpad)
+    dq_unpad, dk_unpad, dv_unpad = torch.empty_like(q_unpad), torch.empty_like(k_unpad), torch.empty_like(v_unpad)
+    _flash_attn_backward(g_unpad, q_unpad, k_unpad, v_unpad, out_unpad, lse, cu_seqlens_q, cu_seqlens_k, None, None,
+                         max_seqlen_q, max_seqlen_k, dq_unpad, dk_unpad, dv_unpad, softmax_scale, causal,
+                         dropout_p=dropout_p, rng_state=rng_state)
+    dq, dk, dv = dq_pad_fn(dq_unpad), dk_pad_fn(dk_unpad), dk_pad_fn(dv_unpad)
+    dq_ref, dk_ref, dv_ref = torch.autograd.grad(out_ref, (q, k, v), g)
+    dq_pt, dk_pt, dv_pt = torch.autograd.grad(out_pt, (q, k, v), g)
+    for name, grad, grad_ref, grad_pt in [("dQ", dq, dq_ref, dq_pt), ("dK", dk, dk_ref, dk_pt), ("dV", dv, dv_ref, dv_pt)]:
+        print(f"{name} max diff: {(grad - grad_ref).abs().max().item()}")
+        atol = 2 * (grad_ref + 0.3 - 0.3 - grad_ref).abs().max().item()
+        assert (grad - grad_ref).abs().max().item() <= 2 * (grad_pt - grad_ref).abs().max().item() + atol
+
+    # Without an rng_state the seed comes from the default CPU generator, so torch.manual_seed makes it reproducible
+    if not varlen:
+        torch.random.manual_seed(1)
+        out0, _ = flash_attn_func(q, k, v, causal=causal, dropout_p=dropout_p)
+        torch.random.manual_seed(1)
+        out1, _ = flash_attn_func(q, k, v, causal=causal, dropout_p=dropout_p)
+    else:
+        torch.random.manual_seed(1)
+        out0, lse0, _, _, rng_state0 = _flash_attn_forward(
+            q_unpad, k_unpad, v_unpad, None, None, None, None, cu_seqlens_q, cu_seqlens_k, None, None, None,
+            max_seqlen_q, max_seqlen_k, None, None, None, None, None, None,
+            None, None, None, softmax_scale, causal, dropout_p=dropout_p,
+        )
+        torch.random.manual_seed(1)
+        out1, _ = flash_attn_varlen_func(q_unpad, k_unpad, v_unpad, cu_seqlens_q, cu_seqlens_k, max_seqlen_q,
+                                         max_seqlen_k, causal=causal, deterministic=True, dropout_p=dropout_p)
+        # The autograd backward uses the rng_state its forward drew
+        out1.backward(g_unpad)
+        _flash_attn_backward(g_unpad, q_unpad, k_unpad, v_unpad, out0, lse0, cu_seqlens_q, cu_seqlens_k, None, None,
+                             max_seqlen_q, max_seqlen_k, dq_unpad, dk_unpad, dv_unpad, softmax_scale, causal,
+                             deterministic=True, dropout_p=dropout_p, rng_state=rng_state0)
+        assert torch.equal(q_unpad.grad, dq_unpad)
+        assert torch.equal(k_unpad.grad, dk_unpad)
+        assert torch.equal(v_unpad.grad, dv_unpad)
+    assert torch.equal(out0, out1)
@@ -0,0 +1,204 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Paged KV cache with more pages than fit on the device: the pages the kernels read (the device pool k_cache /
+// v_cache), backed by pinned host memory and a spill file. KVPageStore (kv_page_store.h) decides where each page goes;
+// this does the copies. page_table holds the logical pages (e.g. from KVBlockManager); prepare() makes the pages the
+// forward pass reads resident and returns the page table into the device pool to pass to it.
+//
+// The copies to and from the device run on a side stream, ordered after the work already queued on the current
+// stream, so prefetch() of the next step's pages overlaps with the current step. prepare() makes the current stream
+// wait for them. Spilling to the file reads the host slot on the CPU, so it first waits for the side stream. Loading
+// from the file copies the mapping (which prefetch() asks the OS to read ahead) into one of a few pinned staging
+// slots on the CPU, then to the device on the side stream; a staging slot is reused once its last copy is done. On
+// the CPU (a simulated device pool) the copies are synchronous.
+
+#include <ATen/ATen.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <c10/cuda/CUDAGuard.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "kv_page_store.h"
+
+namespace flash {
+
+class TieredKVCache {
+public:
+    TieredKVCache(at::Tensor k_cache,  // (num_device_slots, page_size, h_k, d)
+                  at::Tensor v_cache,  // (num_device_slots, page_size, h_k, dv)
+                  int num_pages, int num_host_slots, int num_file_slots, std::string const& spill_path)
+        : k_cache_(k_cache), v_cache_(v_cache),
+          store_(num_pages, int(k_cache.size(0)), num_host_slots, num_file_slots) {
+        TORCH_CHECK(k_cache.size(0) == v_cache.size(0) && k_cache.size(1) == v_cache.size(1),
+                    "k_cache and v_cache must have the same number of pages and page size");
+        TORCH_CHECK(k_cache[0].is_contiguous() && v_cache[0].is_contiguous(), "k_cache and v_cache pages must be contiguous");
+        auto host_opts = k_cache.options().device(at::kCPU).pinned_memory(k_cache.is_cuda());
+        k_host_ = at::empty({num_host_slots, k_cache.size(1), k_cache.size(2), k_cache.size(3)}, host_opts);
+        v_host_ = at::empty({num_host_slots, v_cache.size(1), v_cache.size(2), v_cache.size(3)}, host_opts.dtype(v_cache.dtype()));
+        k_page_bytes_ = k_cache[0].nbytes();
+        v_page_bytes_ = v_cache[0].nbytes();
+        if (num_file_slots > 0) {
+            TORCH_CHECK(!spill_path.empty(), "A spill file path is needed for num_file_slots > 0");
+            spill_file_ = std::make_unique<SpillFile>(spill_path, k_page_bytes_ + v_page_bytes_, num_file_slots);
+            TORCH_CHECK(spill_file_->error().empty(), spill_file_->error());
+        }
+        if (k_cache.is_cuda()) {
+            copy_stream_ = at::cuda::getStreamFromPool(false, k_cache.device().index());
+            if (num_file_slots > 0) {
+                k_stage_ = at::empty({kNumStagingSlots, k_cache.size(1), k_cache.size(2), k_cache.size(3)}, host_opts);
+                v_stage_ = at::empty({kNumStagingSlots, v_cache.size(1), v_cache.size(2), v_cache.size(3)}, host_opts.dtype(v_cache.dtype()));
+                stage_copied_.resize(kNumStagingSlots);
+            }
+        }
+    }
+
+    // Page table into the device pool for this page table of logical pages (b, max_num_pages_per_seq), after making
+    // the pages of the first ceil(seqused_k / page_size) entries of each row resident (all of them without seqused_k).
+    at::Tensor prepare(at::Tensor const& page_table, std::optional<at::Tensor> const& seqused_k) {
+        std::vector<int> const pages = pages_read(page_table, seqused_k);
+        std::vector<PageTransfer> transfers;
+        bool const ok = store_.make_resident(pages, /*pin=*/true, &transfers);
+        run(transfers);
+        TORCH_CHECK(ok, "The device pool (", k_cache_.size(0), " pages) can't hold the ", pages.size(), " pages of this batch");
+        if (copy_stream_.has_value()) {
+            at::cuda::CUDAEvent copied;
+            copied.record(copy_stream_.value());
+            copied.block(at::cuda::getCurrentCUDAStream(k_cache_.device().index()));
+        }
+        at::Tensor const table_cpu = page_table.to(at::kCPU, at::kInt).contiguous();
+        at::Tensor device_table = at::zeros(table_cpu.sizes(), table_cpu.options().pinned_memory(k_cache_.is_cuda()));
+        int const* logical = table_cpu.data_ptr<int>();
+        int* physical = device_table.data_ptr<int>();
+        std::vector<int> const num_used = num_pages_used(table_cpu, seqused_k);
+        for (int64_t b = 0; b < table_cpu.size(0); ++b) {
+            for (int j = 0; j < num_used[b]; ++j) {
+                int64_t const i = b * table_cpu.size(1) + j;
+                physical[i] = store_.slot(logical[i]);
+            }
+        }
+        return device_table.to(k_cache_.device(), /*non_blocking=*/true);
+    }
+
+    // Starts bringing the pages of the next step to the device, as far as they fit next to the current step's
+    // pages, without waiting for the copies
+    void prefetch(at::Tensor const& page_table, std::optional<at::Tensor> const& seqused_k) {
+        std::vector<int> const pages = pages_read(page_table, seqused_k);
+        if (spill_file_) {
+            for (int page : pages) {
+                if (store_.tier(page) == Tier::kFile) { spill_file_->will_need(store_.slot(page)); }
+            }
+        }
+        std::vector<PageTransfer> transfers;
+        store_.make_resident(pages, /*pin=*/false, &transfers);
+        run(transfers);
+    }
+
+    // For pages that were freed, so that their slots can be reused without copying them around
+    void discard(std::vector<int> const& pages) {
+        for (int page : pages) {
+            TORCH_CHECK(page >= 0 && page < store_.num_pages(), "Page ", page, " out of range");
+            store_.discard(page);
+        }
+    }
+
+    int tier(int page) const { return int(store_.tier(page)); }
+    KVPageStore::Stats const& stats() const { return store_.stats(); }
+    std::string spill_path() const { return spill_file_ ? spill_file_->path() : ""; }
+
+private:
+    std::vector<int> num_pages_used(at::Tensor const& table_cpu, std::optional<at::Tensor> const& seqused_k) const {
+        std::vector<int> num_used(table_cpu.size(0), int(table_cpu.size(1)));
+        if (seqused_k.has_value()) {
+            at::Tensor const seqused = seqused_k.value().to(at::kCPU, at::kInt).contiguous();
+            TORCH_CHECK(seqused.numel() == table_cpu.size(0), "seqused_k must have one entry per row of page_table");
+            int const page_size = k_cache_.size(1);
+            for (int64_t b = 0; b < table_cpu.size(0); ++b) {
+                num_used[b] = std::min(int(table_cpu.size(1)), (seqused.data_ptr<int>()[b] + page_size - 1) / page_size);
+            }
+        }
+        return num_used;
+    }
+
+    // The pages the forward pass reads, in the order it reads them
+    std::vector<int> pages_read(at::Tensor const& page_table, std::optional<at::Tensor> const& seqused_k) const {
+        TORCH_CHECK(page_table.dim() == 2, "page_table must have shape (batch_size, max_num_pages_per_seq)");
+        at::Tensor const table_cpu = page_table.to(at::kCPU, at::kInt).contiguous();
+        std::vector<int> const num_used = num_pages_used(table_cpu, seqused_k);
+        std::vector<int> pages;
+        for (int64_t b = 0; b < table_cpu.size(0); ++b) {
+            for (int j = 0; j < num_used[b]; ++j) {
+                int const page = table_cpu.data_ptr<int>()[b * table_cpu.size(1) + j];
+                TORCH_CHECK(page >= 0 && page < store_.num_pages(), "Page ", page, " out of range");
+                pages.push_back(page);
+            }
+        }
+        return pages;
+    }
+
+    void run(std::vector<PageTransfer> const& transfers) {
+        if (transfers.empty()) { return; }
+        std::optional<c10::cuda::CUDAStreamGuard> stream_guard;
+        if (copy_stream_.has_value()) {
+            // After the kernels that read or write the pages being moved out
+            at::cuda::CUDAEvent queued;
+            queued.record(at::cuda::getCurrentCUDAStream(k_cache_.device().index()));
+            queued.block(copy_stream_.value());
+            stream_guard.emplace(copy_stream_.value());
+        }
+        for (PageTransfer const& t : transfers) {
+            if (t.from == Tier::kDevice && t.to == Tier::kHost) {
+                k_host_[t.to_slot].copy_(k_cache_[t.from_slot], /*non_blocking=*/true);
+                v_host_[t.to_slot].copy_(v_cache_[t.from_slot], /*non_blocking=*/true);
+            } else if (t.from == Tier::kHost && t.to == Tier::kFile) {
+                if (copy_stream_.has_value()) { copy_stream_.value().synchronize(); }
+                char* slot = spill_file_->slot(t.to_slot);
+                std::memcpy(slot, k_host_[t.from_slot].data_ptr(), k_page_bytes_);
+                std::memcpy(slot + k_page_bytes_, v_host_[t.from_slot].data_ptr(), v_page_bytes_);
+            } else if (t.from == Tier::kHost && t.to == Tier::kDevice) {
+                k_cache_[t.to_slot].copy_(k_host_[t.from_slot], /*non_blocking=*/true);
+                v_cache_[t.to_slot].copy_(v_host_[t.from_slot], /*non_blocking=*/true);
+            } else if (t.from == Tier::kFile && t.to == Tier::kDevice) {
+                char* slot = spill_file_->slot(t.from_slot);
+                if (copy_stream_.has_value()) {
+                    int const stage = next_stage_;
+                    next_stage_ = (next_stage_ + 1) % kNumStagingSlots;
+                    stage_copied_[stage].synchronize();
+                    std::memcpy(k_stage_[stage].data_ptr(), slot, k_page_bytes_);
+                    std::memcpy(v_stage_[stage].data_ptr(), slot + k_page_bytes_, v_page_bytes_);
+                    k_cache_[t.to_slot].copy_(k_stage_[stage], /*non_blocking=*/true);
+                    v_cache_[t.to_slot].copy_(v_stage_[stage], /*non_blocking=*/true);
+                    stage_copied_[stage].record(copy_stream_.value());
+                } else {
+                    auto host_opts = k_cache_.options().device(at::kCPU);
+                    k_cache_[t.to_slot].copy_(at::from_blob(slot, k_cache_[0].sizes(), host_opts));
+                    v_cache_[t.to_slot].copy_(at::from_blob(slot + k_page_bytes_, v_cache_[0].sizes(), host_opts.dtype(v_cache_.dtype())));
+                }
+            }
+            // From kNone: the page has no data yet
+        }
+    }
+
+    // Pinned pages that loads from the file go through, and when each one's last copy to the device is done
+    static constexpr int kNumStagingSlots = 8;
+
+    at::Tensor k_cache_, v_cache_, k_host_, v_host_;
+    at::Tensor k_stage_, v_stage_;
+    std::vector<at::cuda::CUDAEvent> stage_copied_;
+    int next_stage_ = 0;
+    int64_t k_page_bytes_, v_page_bytes_;
+    KVPageStore store_;
+    std::unique_ptr<SpillFile> spill_file_;
+    std::optional<at::cuda::CUDAStream> copy_stream_;
+};
+
+} // namespace flash
@@ -8,6 +8,7 @@
 #include "cutlass/arch/barrier.h"
 
 #include "named_barrier.hpp"
+#include "prepare_scheduler.h"
 #include "utils.h"
 
 namespace flash {
@@ -26,6 +27,7 @@ struct TileSchedulerArguments {
     int const* const seqused = nullptr;
     // int const* const num_m_blocks_ptr = nullptr;
     int const* const num_splits_dynamic_ptr = nullptr;
+    int const* const varlen_lpt_workspace = nullptr;  // Only used by VarlenDynamicPersistentTileScheduler
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -381,6 +383,7 @@ public:
         int const* const seqused;
         // int* const num_m_blocks_ptr;
         int const* const num_splits_dynamic_ptr;
+        int const* const varlen_lpt_workspace;
     };
 
     static Params
@@ -396,7 +399,7 @@ public:
                 cutlass::FastDivmod(!Split ? 1 : args.num_splits),
                 args.tile_count_semaphore, args.cu_seqlens, args.seqused,
                 // args.num_m_blocks_ptr,
-                args.num_splits_dynamic_ptr};
+                args.num_splits_dynamic_ptr, args.varlen_lpt_workspace};
     }
 
     static dim3
@@ -443,6 +446,12 @@ public:
     CUTLASS_DEVICE
     WorkTileInfo
     tile_idx_to_work_tile(Params const& params, int next_tile_idx, WorkTileInfo const& current_work) const {
+        if (params.varlen_lpt_workspace) {
+            // Tiles were sorted by cost by prepare_varlen_lpt_work_list, most expensive first
+            if (next_tile_idx >= params.varlen_lpt_workspace[kVarlenLptNumBuckets]) { return {next_tile_idx, 0, 0, params.num_batch}; }
+            int4 work = reinterpret_cast<int4 const*>(params.varlen_lpt_workspace + kVarlenLptListOffset)[next_tile_idx];
+            return {next_tile_idx, work.x, work.y, work.z};
+        }
         int lane = threadIdx.x % cutlass::NumThreadsPerWarp;
         auto get_num_m_blocks = [&] (int bidb_start) {
             int batch_idx = lane + bidb_start;
@@ -0,0 +1,261 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Host-only replay of the forward tile schedulers in tile_scheduler.hpp. Given the per-sequence lengths of a batch,
+// this enumerates tiles in the order each scheduler hands them out, costs each tile by the number of n_blocks it
+// visits (get_n_block_range, same as BlockMN), and list-schedules them onto num_sm SMs. It assumes one CTA per SM,
+// which holds for the sm90 kernels. Used by benchmark_tile_scheduler.cpp.
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "block_range.h"
+#include "prepare_scheduler.h"
+
+namespace flash {
+
+namespace sim {
+
+// VarlenDynamicPersistentLPT is VarlenDynamicPersistent consuming the work list of prepare_varlen_lpt_work_list
+enum class Scheduler { SingleTile, StaticPersistent, DynamicPersistent, VarlenDynamicPersistent, VarlenDynamicPersistentLPT };
+
+inline char const* scheduler_name(Scheduler s) {
+    switch (s) {
+        case Scheduler::SingleTile: return "SingleTile";
+        case Scheduler::StaticPersistent: return "StaticPersistent";
+        case Scheduler::DynamicPersistent: return "DynamicPersistent";
+        case Scheduler::VarlenDynamicPersistent: return "VarlenDynamicPersistent";
+        default: return "VarlenDynamicPersistentLPT";
+    }
+}
+
+struct Problem {
+    std::vector<int> seqlens_q, seqlens_k;  // One entry per sequence
+    int num_heads, num_heads_k;
+    int headdim, headdim_v, element_size = 2;
+    int kBlockM, kBlockN;
+    bool is_causal = false, is_local = false;
+    int window_size_left = -1, window_size_right = -1, attention_chunk = 0;
+    bool pack_gqa = false;
+    int num_splits = 1;
+    std::vector<int> num_splits_dynamic;  // Per sequence, empty if not using dynamic splits
+    int size_l2 = 32 * 1024 * 1024;  // Used by DynamicPersistent to size its L2 swizzle sections
+
+    int num_batch() const { return int(seqlens_q.size()); }
+    int qhead_per_khead() const { return num_heads / num_heads_k; }
+    int num_sched_heads() const { return pack_gqa ? num_heads_k : num_heads; }
+    int max_seqlen_q() const { return *std::max_element(seqlens_q.begin(), seqlens_q.end()); }
+    int max_seqlen_k() const { return *std::max_element(seqlens_k.begin(), seqlens_k.end()); }
+    int num_m_blocks(int bidb) const {
+        return (seqlens_q[bidb] * (pack_gqa ? qhead_per_khead() : 1) + kBlockM - 1) / kBlockM;
+    }
+    int splits(int bidb) const { return num_splits_dynamic.empty() ? num_splits : num_splits_dynamic[bidb]; }
+    std::vector<int> cu_seqlens_q() const {
+        std::vector<int> cu_seqlens(num_batch() + 1, 0);
+        for (int b = 0; b < num_batch(); ++b) { cu_seqlens[b + 1] = cu_seqlens[b] + seqlens_q[b]; }
+        return cu_seqlens;
+    }
+    // Same as make_prepare_scheduler_args. cu_seqlens_q must outlive the result.
+    PrepareSchedulerArgs prepare_scheduler_args(std::vector<int> const& cu_seqlens_q, int num_sm) const {
+        return {max_seqlen_q(), max_seqlen_k(), 0,
+                cu_seqlens_q.data(), nullptr, nullptr, nullptr, seqlens_k.data(), nullptr,
+                num_batch(), num_sched_heads(), pack_gqa ? qhead_per_khead() : 1, num_sm, num_splits, kBlockM, kBlockN,
+                is_causal, is_local, window_size_left, window_size_right, attention_chunk};
+    }
+};
+
+// Time for a tile = tile_ns + n_block_ns * (number of n_blocks visited). A CTA that finds its tile out of bounds
+// (SingleTile with varlen) exits after empty_tile_ns.
+struct CostModel {
+    double n_block_ns = 1000.0;
+    double tile_ns = 2000.0;
+    double empty_tile_ns = 500.0;
+};
+
+struct Tile {
+    int m_block, bidh, bidb, split_idx;
+    bool valid;
+};
+
+struct Result {
+    std::vector<double> sm_busy_ns;
+    std::vector<int> sm_num_tiles;
+    double makespan_ns = 0.0;
+    double mean_busy_ns = 0.0;
+    double tail_imbalance = 0.0;     // makespan / mean busy time - 1
+    double num_waves = 0.0;          // Tiles per SM, i.e. num_tiles / num_sm
+    int max_kv_heads_in_flight = 0;  // Distinct (batch, kv head) pairs being processed at the same time
+    double avg_kv_heads_in_flight = 0.0;
+};
+
+// Tiles in the order the scheduler hands them out (blockIdx order for SingleTile, tile_idx order otherwise)
+inline std::vector<Tile> tile_order(Problem const& p, Scheduler s) {
+    std::vector<Tile> tiles;
+    int const num_head = p.num_sched_heads();
+    int const num_batch = p.num_batch();
+    if (s == Scheduler::SingleTile) {
+        // grid = (num_m_blocks for max seqlen, num_splits * num_head, num_batch), blockIdx.x fastest
+        int const num_blocks = (p.max_seqlen_q() * (p.pack_gqa ? p.qhead_per_khead() : 1) + p.kBlockM - 1) / p.kBlockM;
+        for (int bidb = 0; bidb < num_batch; ++bidb) {
+            for (int y = 0; y < p.num_splits * num_head; ++y) {
+                for (int block = 0; block < num_blocks; ++block) {
+                    int const bidh = y / p.num_splits, split_idx = y % p.num_splits;
+                    bool const valid = block < p.num_m_blocks(bidb) && split_idx < p.splits(bidb);
+                    tiles.push_back({block, bidh, bidb, split_idx, valid});
+                }
+            }
+        }
+    } else if (s == Scheduler::StaticPersistent) {
+        int const num_blocks = p.num_m_blocks(0);
+        int const total = num_blocks * num_head * p.num_splits * num_batch;
+        for (int tile_idx = 0; tile_idx < total; ++tile_idx) {
+            int const block = tile_idx % num_blocks;
+            int const bidh_split = (tile_idx / num_blocks) % (num_head * p.num_splits);
+            int const bidb = tile_idx / (num_blocks * num_head * p.num_splits);
+            tiles.push_back({block, bidh_split / p.num_splits, bidb, bidh_split % p.num_splits, true});
+        }
+    } else if (s == Scheduler::DynamicPersistent) {
+        // Same L2 swizzle as DynamicPersistentTileScheduler::to_underlying_arguments / get_block_coord
+        int const num_blocks = p.num_m_blocks(0);
+        long long const size_one_kv_head = (long long)p.max_seqlen_k() * (p.headdim + p.headdim_v) * p.element_size * 2;
+        int swizzle = 1;
+        // Round up to a power of 2, like cutlass::find_log2
+        if (p.size_l2 >= size_one_kv_head) { while (swizzle < p.size_l2 / size_one_kv_head) { swizzle *= 2; } }
+        swizzle *= p.pack_gqa ? 1 : p.qhead_per_khead();
+        int const num_hb_remainder = (num_head * num_batch) % swizzle;
+        int const num_split_blocks = num_blocks * p.num_splits;
+        int const num_hb_quotient = (num_head * num_batch) / swizzle;
+        int const total = num_split_blocks * num_head * num_batch;
+        for (int tile_idx = 0; tile_idx < total; ++tile_idx) {
+            int const l2_major = swizzle * num_split_blocks;
+            int const bidhb = tile_idx / l2_major, l2_mod = tile_idx % l2_major;
+            int const minor = bidhb < num_hb_quotient ? swizzle : (num_hb_remainder > 0 ? num_hb_remainder : 1);
+            int block = l2_mod / minor;
+            int const bidhb_residual = l2_mod % minor;
+            int const bidhb_actual = bidhb * swizzle + bidhb_residual;
+            int const bidh = bidhb_actual % num_head, bidb = bidhb_actual / num_head;
+            int split_idx = 0;
+            if (p.num_splits > 1) { split_idx = block / num_blocks; block = block % num_blocks; }
+            // Longest-processing-time-first
+            block = num_blocks - 1 - block;
+            tiles.push_back({block, bidh, bidb, split_idx, true});
+        }
+    } else if (s == Scheduler::VarlenDynamicPersistentLPT) {
+        std::vector<int> const cu_seqlens_q = p.cu_seqlens_q();
+        PrepareSchedulerArgs const args = p.prepare_scheduler_args(cu_seqlens_q, 1);
+        int64_t const total_q = cu_seqlens_q.back();
+        std::vector<int> workspace(get_varlen_lpt_workspace_size(int(total_q), num_batch, num_head, args.qhead_per_khead, p.num_splits, p.kBlockM));
+        prepare_varlen_lpt_work_list_host(args, p.num_splits_dynamic.empty() ? nullptr : p.num_splits_dynamic.data(), workspace.data());
+        for (int tile_idx = 0; tile_idx < workspace[kVarlenLptNumBuckets]; ++tile_idx) {
+            int const* entry = workspace.data() + kVarlenLptListOffset + tile_idx * 4;
+            int const bidh = p.num_splits > 1 ? entry[1] & 0xFFFF : entry[1];
+            int const split_idx = p.num_splits > 1 ? (entry[1] >> 16) & 0xFF : 0;
+            tiles.push_back({entry[0], bidh, entry[2], split_idx, true});
+        }
+    } else {
+        // VarlenDynamicPersistentTileScheduler: batch-major, then (head, split), then m_block
+        for (int bidb = 0; bidb < num_batch; ++bidb) {
+            int const num_splits = p.splits(bidb);
+            for (int h_split = 0; h_split < num_head * num_splits; ++h_split) {
+                for (int block = 0; block < p.num_m_blocks(bidb); ++block) {
+                    tiles.push_back({block, h_split / num_splits, bidb, h_split % num_splits, true});
+                }
+            }
+        }
+    }
+    return tiles;
+}
+
+inline int num_n_blocks_visited(Problem const& p, Tile const& t) {
+    if (!t.valid) { return 0; }
+    int const num_splits = p.splits(t.bidb);
+    bool const split = num_splits > 1;
+    // Dynamic splits are passed to the mainloop in the top 16 bits of split_idx
+    int const split_idx = t.split_idx | (p.num_splits_dynamic.empty() ? 0 : num_splits << 16);
+    auto const range = get_n_block_range(
+        p.seqlens_q[t.bidb], p.seqlens_k[t.bidb], p.kBlockM, p.kBlockN,
+        p.is_causal, p.is_local, p.pack_gqa, split, t.m_block, split_idx, num_splits,
+        p.window_size_left, p.window_size_right,
+        IntDivmod{p.attention_chunk}, IntDivmod{p.qhead_per_khead()});
+    return std::max(range.block_max - range.block_min, 0);
+}
+
+inline Result simulate(Problem const& p, Scheduler s, int num_sm, CostModel const& cost = {}) {
+    std::vector<Tile> const tiles = tile_order(p, s);
+    Result r;
+    r.sm_busy_ns.assign(num_sm, 0.0);
+    r.sm_num_tiles.assign(num_sm, 0);
+    auto tile_cost = [&](Tile const& t) {
+        return t.valid ? cost.tile_ns + cost.n_block_ns * num_n_blocks_visited(p, t) : cost.empty_tile_ns;
+    };
+    int const qhead_per_khead_sched = p.pack_gqa ? 1 : p.qhead_per_khead();
+    // (start, end, kv head id) of each tile, to measure how many KV heads are live at once
+    std::vector<std::pair<double, std::pair<double, long long>>> intervals;
+    intervals.reserve(tiles.size());
+    auto record = [&](int sm, Tile const& t) {
+        double const start = r.sm_busy_ns[sm];
+        r.sm_busy_ns[sm] += tile_cost(t);
+        r.sm_num_tiles[sm] += 1;
+        if (t.valid) {
+            intervals.push_back({start, {r.sm_busy_ns[sm], (long long)t.bidb * p.num_heads_k + t.bidh / qhead_per_khead_sched}});
+        }
+    };
+    if (s == Scheduler::StaticPersistent) {
+        for (size_t i = 0; i < tiles.size(); ++i) { record(int(i % num_sm), tiles[i]); }
+    } else {
+        // Hardware block dispatch (SingleTile) and the semaphore (dynamic schedulers) both hand the next tile
+        // to the first SM that becomes free
+        using Entry = std::pair<double, int>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> free_sms;
+        for (int sm = 0; sm < num_sm; ++sm) { free_sms.push({0.0, sm}); }
+        for (Tile const& t : tiles) {
+            int const sm = free_sms.top().second;
+            free_sms.pop();
+            record(sm, t);
+            free_sms.push({r.sm_busy_ns[sm], sm});
+        }
+    }
+    r.makespan_ns = *std::max_element(r.sm_busy_ns.begin(), r.sm_busy_ns.end());
+    double total = 0.0;
+    for (double b : r.sm_busy_ns) { total += b; }
+    r.mean_busy_ns = total / num_sm;
+    r.tail_imbalance = r.mean_busy_ns > 0.0 ? r.makespan_ns / r.mean_busy_ns - 1.0 : 0.0;
+    r.num_waves = double(tiles.size()) / num_sm;
+    // Sweep over tile start / end events, counting tiles per KV head
+    std::vector<std::pair<double, std::pair<int, long long>>> events;
+    for (auto const& iv : intervals) {
+        events.push_back({iv.first, {1, iv.second.second}});
+        events.push_back({iv.second.first, {-1, iv.second.second}});
+    }
+    std::sort(events.begin(), events.end(), [](auto const& a, auto const& b) {
+        return a.first != b.first ? a.first < b.first : a.second.first < b.second.first;  // Ends before starts
+    });
+    std::multiset<long long> live;
+    double weighted = 0.0, last_time = 0.0;
+    int distinct = 0;
+    for (auto const& e : events) {
+        weighted += distinct * (e.first - last_time);
+        last_time = e.first;
+        if (e.second.first > 0) {
+            if (live.count(e.second.second) == 0) { ++distinct; }
+            live.insert(e.second.second);
+        } else {
+            live.erase(live.find(e.second.second));
+            if (live.count(e.second.second) == 0) { --distinct; }
+        }
+        r.max_kv_heads_in_flight = std::max(r.max_kv_heads_in_flight, distinct);
+    }
+    r.avg_kv_heads_in_flight = r.makespan_ns > 0.0 ? weighted / r.makespan_ns : 0.0;
+    return r;
+}
+
+} // namespace sim
+
+} // namespace flash
@@ -76,3 +76,25 @@ constexpr std::tuple<int, int, int, int, bool> tile_size_fwd_sm8x(
         return {128, 64, 8, 2, false};
     }
 }
+
+// Return {kBlockM, kBlockN}
+// The CPU engine converts Q, K and V tiles to fp32 in per-thread scratch, so we size the tiles to keep
+// the K and V tiles (kBlockN x (headdim + headdim_v) floats) within L2.
+constexpr std::tuple<int, int> tile_size_fwd_cpu(int headdim, int headdim_v) {
+    int const max_headdim = headdim > headdim_v ? headdim : headdim_v;
+    if (max_headdim <= 64) {
+        return {64, 128};
+    } else if (max_headdim <= 128) {
+        return {64, 64};
+    } else if (max_headdim <= 256) {
+        return {32, 64};
+    } else {
+        return {32, 32};
+    }
+}
+
+// Return {kBlockM, kBlockN}
+// mha_bwd sizes dQaccum / dPsum from these, so they need to match what run_mha_bwd_cpu uses.
+constexpr std::tuple<int, int> tile_size_bwd_cpu(int headdim) {
+    return {headdim <= 128 ? 64 : 32, 64};
+}
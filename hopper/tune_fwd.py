@@ -0,0 +1,139 @@
+# Fills the tuning table read by mha_fwd (tuning_table.h) for the current GPU.
+# For each problem class (head dim, causal, paged, dtype, power-of-2 buckets of seqlen_q, seqlen_k and
+# batch * nheads_kv), this times the forward pass with every valid choice of num_splits / pack_gqa / pagedkv_tma,
+# and records the best one if it beats the heuristics. Use the table with
+#   FLASH_ATTENTION_TUNING_TABLE=tuning_table.txt python ...
+# Example:
+#   python tune_fwd.py --output tuning_table.txt --headdim 128 --nheads 32 --nheads-kv 8 --page-size 0 256
+
+import argparse
+import itertools
+import math
+import os
+import tempfile
+
+import torch
+import torch.utils.benchmark as benchmark
+
+import flash_attn_3_cuda
+from flash_attn_interface import flash_attn_with_kvcache
+
+
+TABLE_VERSION = 2  # Must match flash::TuningTable::kVersion
+
+
+def timeit(fn):
+    torch.cuda.synchronize()
+    for _ in range(5):
+        fn()
+    return benchmark.Timer(stmt="fn()", globals={"fn": fn}).timeit(20).mean
+
+
+def round_up_headdim(headdim):
+    for d in (64, 96, 128, 192, 256):
+        if headdim <= d:
+            return d
+    return 256
+
+
+def round_up_to_power_of_2(x):
+    return 1 if x <= 1 else 1 << (x - 1).bit_length()
+
+
+def tuning_key(arch, headdim, causal, dtype, page_size, seqlen_q, seqlen_k, batch, nheads_kv):
+    # Same normalization as mha_fwd: causal with a single query is the same as non-causal, except for the
+    # hdim 128 paged KV special case
+    if seqlen_q == 1 and causal and (headdim <= 64 or headdim > 128 or not page_size):
+        causal = False
+    d = round_up_headdim(headdim)
+    return (arch, d, d, int(causal), 0, 1 if dtype == torch.float8_e4m3fn else 2, int(bool(page_size)), 0,
+            round_up_to_power_of_2(seqlen_q), round_up_to_power_of_2(seqlen_k), round_up_to_power_of_2(batch * nheads_kv))
+
+
+def write_table(path, entries):
+    with open(path, "w") as f:
+        f.write(f"version {TABLE_VERSION}\n")
+        f.write("# arch headdim headdim_v causal local element_size paged softcap seqlen_q seqlen_k batch_heads_k num_splits pack_gqa pagedkv_tma\n")
+        for key, config in sorted(entries.items()):
+            f.write(" ".join(str(v) for v in (*key, *config)) + "\n")
+
+
+def make_inputs(batch, seqlen_q, seqlen_k, nheads, nheads_kv, headdim, dtype, page_size):
+    device = "cuda"
+    q = torch.randn(batch, seqlen_q, nheads, headdim, device=device, dtype=torch.bfloat16).to(dtype)
+    cache_seqlens = torch.full((batch,), seqlen_k, dtype=torch.int32, device=device)
+    if not page_size:
+        k_cache = torch.randn(batch, seqlen_k, nheads_kv, headdim, device=device, dtype=torch.bfloat16).to(dtype)
+        v_cache = torch.randn_like(k_cache)
+        page_table = None
+    else:
+        num_pages_per_seq = math.ceil(seqlen_k / page_size)
+        k_cache = torch.randn(batch * num_pages_per_seq, page_size, nheads_kv, headdim, device=device, dtype=torch.bfloat16).to(dtype)
+        v_cache = torch.randn_like(k_cache)
+        page_table = torch.randperm(batch * num_pages_per_seq, dtype=torch.int32, device=device).reshape(batch, num_pages_per_seq)
+    return q, k_cache, v_cache, cache_seqlens, page_table
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fill the forward tuning table for the current GPU")
+    parser.add_argument("--output", default="tuning_table.txt")
+    parser.add_argument("--headdim", type=int, nargs="+", default=[64, 128, 256])
+    parser.add_argument("--nheads", type=int, default=32)
+    parser.add_argument("--nheads-kv", type=int, default=8)
+    parser.add_argument("--dtype", choices=["bf16", "fp16", "fp8"], default="bf16")
+    parser.add_argument("--page-size", type=int, nargs="+", default=[0], help="0 means no paged KV")
+    parser.add_argument("--batch", type=int, nargs="+", default=[1, 8, 32, 128])
+    parser.add_argument("--seqlen-q", type=int, nargs="+", default=[1, 4, 64, 1024])
+    parser.add_argument("--seqlen-k", type=int, nargs="+", default=[512, 2048, 8192, 32768])
+    parser.add_argument("--min-speedup", type=float, default=1.02,
+                        help="Only record a config if it is at least this much faster than the heuristics")
+    args = parser.parse_args()
+    dtype = {"bf16": torch.bfloat16, "fp16": torch.float16, "fp8": torch.float8_e4m3fn}[args.dtype]
+    props = torch.cuda.get_device_properties(torch.cuda.current_device())
+    arch = props.major * 10 + props.minor
+    qhead_per_khead = args.nheads // args.nheads_kv
+
+    # Time of each candidate config, summed over the shapes that fall into the same table entry
+    times = {}
+    heuristic_times = {}
+    tmp_table = os.path.join(tempfile.mkdtemp(), "candidate.txt")
+    for headdim, page_size, causal, seqlen_q, seqlen_k in itertools.product(
+        args.headdim, args.page_size, [False, True], args.seqlen_q, args.seqlen_k
+    ):
+        if seqlen_q > seqlen_k:
+            continue
+        num_splits_candidates = [1, 2, 4, 8, 16, 32, 64]
+        pack_gqa_candidates = [0, 1] if qhead_per_khead > 1 else [-1]
+        pagedkv_tma_candidates = [0, 1] if page_size and arch >= 90 else [-1]
+        for batch in args.batch:
+            key = tuning_key(arch, headdim, causal, dtype, page_size, seqlen_q, seqlen_k, batch, args.nheads_kv)
+            q, k_cache, v_cache, cache_seqlens, page_table = make_inputs(
+                batch, seqlen_q, seqlen_k, args.nheads, args.nheads_kv, headdim, dtype, page_size)
+            fn = lambda: flash_attn_with_kvcache(q, k_cache, v_cache, cache_seqlens=cache_seqlens,
+                                                 page_table=page_table, causal=causal)
+            flash_attn_3_cuda.load_tuning_table("")
+            heuristic_times[key] = heuristic_times.get(key, 0.0) + timeit(fn)
+            for config in itertools.product(num_splits_candidates, pack_gqa_candidates, pagedkv_tma_candidates):
+                write_table(tmp_table, {key: config})
+                flash_attn_3_cuda.load_tuning_table(tmp_table)
+                try:
+                    t = timeit(fn)
+                except RuntimeError:  # e.g. a combination that this build doesn't support
+                    t = math.inf
+                times.setdefault(key, {})
+                times[key][config] = times[key].get(config, 0.0) + t
+    flash_attn_3_cuda.load_tuning_table("")
+
+    entries = {}
+    for key, config_times in times.items():
+        config, t = min(config_times.items(), key=lambda kv: kv[1])
+        speedup = heuristic_times[key] / t
+        print(f"{key}: best {config} {t * 1e6:.1f}us, heuristics {heuristic_times[key] * 1e6:.1f}us, speedup {speedup:.3f}")
+        if speedup >= args.min_speedup:
+            entries[key] = config
+    write_table(args.output, entries)
+    print(f"Wrote {len(entries)} entries to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,163 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// On-disk overrides for the forward launch heuristics (get_pagedkv_tma, get_num_splits, get_pack_gqa in
+// flash_api.cpp). The tile shapes in tile_size.h are compile-time constants of each instantiated kernel, so what
+// can be chosen at runtime is which of the instantiated kernels runs: Split, PackGQA and PagedKVNonTMA, each of which
+// comes with its own tile shape. The table stores the choice measured to be fastest for a problem class and
+// tune_fwd.py fills it. Without a table, or for problems not in it, the heuristics are used unchanged.
+//
+// File format, one entry per line, '#' starts a comment:
+//   version 2
+//   arch headdim headdim_v causal local element_size paged softcap seqlen_q seqlen_k batch_heads_k num_splits pack_gqa pagedkv_tma
+// headdim / headdim_v are the rounded head dimensions the kernels are instantiated for, seqlen_q / seqlen_k / batch_heads_k
+// the power-of-2 bucket (see seqlen_bucket) of seqlen_q, seqlen_k and batch size * number of KV heads, and
+// num_splits = 0, pack_gqa = -1 or pagedkv_tma = -1 mean "use the heuristic". batch_heads_k is part of the key since
+// it decides how many tiles there are to fill the SMs with, and so the best number of splits.
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+namespace flash {
+
+// Smallest power of 2 >= seqlen
+inline int seqlen_bucket(int seqlen) {
+    int bucket = 1;
+    while (bucket < seqlen && bucket < (1 << 30)) { bucket *= 2; }
+    return bucket;
+}
+
+struct TuningKey {
+    int arch, headdim, headdim_v;
+    bool is_causal, is_local;
+    int element_size;
+    bool paged, softcap;
+    int seqlen_q, seqlen_k;  // Buckets
+    int batch_heads_k;  // Bucket of b * h_k
+
+    bool operator==(TuningKey const& other) const {
+        return arch == other.arch && headdim == other.headdim && headdim_v == other.headdim_v
+            && is_causal == other.is_causal && is_local == other.is_local && element_size == other.element_size
+            && paged == other.paged && softcap == other.softcap
+            && seqlen_q == other.seqlen_q && seqlen_k == other.seqlen_k && batch_heads_k == other.batch_heads_k;
+    }
+};
+
+struct TuningKeyHash {
+    size_t operator()(TuningKey const& k) const {
+        uint64_t h = 0;
+        for (int64_t v : {int64_t(k.arch), int64_t(k.headdim), int64_t(k.headdim_v), int64_t(k.is_causal),
+                          int64_t(k.is_local), int64_t(k.element_size), int64_t(k.paged), int64_t(k.softcap),
+                          int64_t(k.seqlen_q), int64_t(k.seqlen_k), int64_t(k.batch_heads_k)}) {
+            h = (h ^ uint64_t(v)) * 0x100000001b3ull;
+        }
+        return size_t(h);
+    }
+};
+
+struct TuningConfig {
+    int num_splits = 0;    // 0: heuristic
+    int pack_gqa = -1;     // -1: heuristic, 0 / 1: off / on
+    int pagedkv_tma = -1;  // -1: heuristic, 0 / 1: off / on
+};
+
+// Params is Flash_fwd_params. Templated so that this header doesn't need flash.h (and cuda.h) on the host.
+template <typename Params>
+inline TuningKey make_tuning_key(Params const& params) {
+    return {params.arch, params.d_rounded, params.dv_rounded, bool(params.is_causal), bool(params.is_local),
+            params.is_e4m3 ? 1 : 2, params.page_table != nullptr, params.softcap > 0.f,
+            seqlen_bucket(params.seqlen_q), seqlen_bucket(params.seqlen_k), seqlen_bucket(params.b * params.h_k)};
+}
+
+class TuningTable {
+public:
+    static constexpr int kVersion = 2;
+
+    // Returns false and sets error if the file can't be read, has a different version, or has a malformed line
+    bool load(std::string const& path, std::string* error) {
+        std::ifstream f(path);
+        if (!f) { *error = "can't open " + path; return false; }
+        std::string line;
+        int version = -1, line_num = 0;
+        while (std::getline(f, line)) {
+            ++line_num;
+            line = line.substr(0, line.find('#'));
+            std::istringstream ss(line);
+            std::string first;
+            if (!(ss >> first)) { continue; }
+            if (version < 0) {
+                if (first != "version" || !(ss >> version)) { *error = path + ": expected 'version N' on the first line"; return false; }
+                if (version != kVersion) {
+                    *error = path + ": version " + std::to_string(version) + ", expected " + std::to_string(kVersion);
+                    return false;
+                }
+                continue;
+            }
+            TuningKey key;
+            TuningConfig config;
+            int is_causal, is_local, paged, softcap;
+            std::istringstream entry(line);
+            if (!(entry >> key.arch >> key.headdim >> key.headdim_v >> is_causal >> is_local >> key.element_size
+                        >> paged >> softcap >> key.seqlen_q >> key.seqlen_k >> key.batch_heads_k
+                        >> config.num_splits >> config.pack_gqa >> config.pagedkv_tma)) {
+                *error = path + ":" + std::to_string(line_num) + ": malformed entry";
+                return false;
+            }
+            key.is_causal = is_causal; key.is_local = is_local; key.paged = paged; key.softcap = softcap;
+            key.seqlen_q = seqlen_bucket(key.seqlen_q);
+            key.seqlen_k = seqlen_bucket(key.seqlen_k);
+            key.batch_heads_k = seqlen_bucket(key.batch_heads_k);
+            entries_[key] = config;
+        }
+        if (version < 0) { *error = path + ": empty table"; return false; }
+        return true;
+    }
+
+    TuningConfig const* lookup(TuningKey const& key) const {
+        auto it = entries_.find(key);
+        return it != entries_.end() ? &it->second : nullptr;
+    }
+
+    void set(TuningKey const& key, TuningConfig const& config) { entries_[key] = config; }
+    size_t size() const { return entries_.size(); }
+
+    // The table used by mha_fwd. Loaded from $FLASH_ATTENTION_TUNING_TABLE on first use, or replaced by set_global
+    // (e.g. by the tuning harness). load_error is set if the environment variable is set but the table can't be used.
+    static std::shared_ptr<TuningTable const> global(std::string* load_error = nullptr) {
+        std::lock_guard<std::mutex> lock(global_mutex());
+        static bool initialized = false;
+        static std::string error;
+        if (!initialized) {
+            initialized = true;
+            if (char const* path = std::getenv("FLASH_ATTENTION_TUNING_TABLE"); path && path[0] != '\0') {
+                auto table = std::make_shared<TuningTable>();
+                if (table->load(path, &error)) { global_table() = table; }
+            }
+        }
+        if (load_error) { *load_error = error; }
+        return global_table();
+    }
+
+    static void set_global(std::shared_ptr<TuningTable const> table) {
+        global();  // Make sure the environment variable doesn't override this later
+        std::lock_guard<std::mutex> lock(global_mutex());
+        global_table() = std::move(table);
+    }
+
+private:
+    static std::mutex& global_mutex() { static std::mutex m; return m; }
+    static std::shared_ptr<TuningTable const>& global_table() { static std::shared_ptr<TuningTable const> t; return t; }
+
+    std::unordered_map<TuningKey, TuningConfig, TuningKeyHash> entries_;
+};
+
+} // namespace flash
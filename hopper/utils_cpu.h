@@ -0,0 +1,574 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// Host-side helpers for the CPU attention engine. The vector paths are selected at compile time
+// (see FLASH_ATTENTION_CPU_ISA in setup.py); without any ISA flags we fall back to scalar loops
+// that the compiler is free to auto-vectorize.
+
+namespace flash {
+
+namespace cpu {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Storage types for 16-bit floats on the host. We only ever convert them to and from fp32.
+struct half_t { uint16_t x; };
+struct bfloat16_t { uint16_t x; };
+
+inline float bits_to_float(uint32_t u) { float f; std::memcpy(&f, &u, sizeof(f)); return f; }
+inline uint32_t float_to_bits(float f) { uint32_t u; std::memcpy(&u, &f, sizeof(u)); return u; }
+
+inline float to_float(float x) { return x; }
+inline float to_float(bfloat16_t x) { return bits_to_float(uint32_t(x.x) << 16); }
+inline float to_float(half_t x) {
+#if defined(__F16C__)
+    return _cvtsh_ss(x.x);
+#else
+    uint32_t const sign = uint32_t(x.x & 0x8000) << 16;
+    uint32_t const exp = (x.x >> 10) & 0x1F;
+    uint32_t mant = x.x & 0x3FF;
+    if (exp == 0x1F) { return bits_to_float(sign | 0x7F800000 | (mant << 13)); }  // Inf / NaN
+    if (exp == 0) {
+        if (mant == 0) { return bits_to_float(sign); }
+        // Subnormal: renormalize
+        int e = -1;
+        do { mant <<= 1; ++e; } while ((mant & 0x400) == 0);
+        return bits_to_float(sign | uint32_t(127 - 15 - e) << 23 | (mant & 0x3FF) << 13);
+    }
+    return bits_to_float(sign | (exp + 127 - 15) << 23 | mant << 13);
+#endif
+}
+
+template <typename T> inline T from_float(float x);
+template <> inline float from_float<float>(float x) { return x; }
+template <> inline bfloat16_t from_float<bfloat16_t>(float x) {
+    uint32_t u = float_to_bits(x);
+    if ((u & 0x7FFFFFFF) > 0x7F800000) { return {uint16_t((u >> 16) | 0x40)}; }  // Quiet NaN
+    u += 0x7FFF + ((u >> 16) & 1);  // Round to nearest even
+    return {uint16_t(u >> 16)};
+}
+template <> inline half_t from_float<half_t>(float x) {
+#if defined(__F16C__)
+    return {uint16_t(_cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT))};
+#else
+    uint32_t const u = float_to_bits(x);
+    uint16_t const sign = uint16_t((u >> 16) & 0x8000);
+    uint32_t const abs = u & 0x7FFFFFFF;
+    if (abs > 0x7F800000) { return {uint16_t(sign | 0x7E00)}; }  // NaN
+    if (abs >= 0x477FF000) { return {uint16_t(sign | 0x7C00)}; }  // Overflow to Inf after rounding
+    if (abs < 0x38800000) {  // Subnormal or zero in fp16
+        if (abs < 0x33000000) { return {sign}; }
+        uint32_t const e = abs >> 23;
+        uint32_t const mant = (abs & 0x7FFFFF) | 0x800000;
+        // Express the value in units of 2^-24 (the fp16 subnormal step), rounding to nearest even
+        uint32_t const s = 126 - e;
+        uint32_t q = mant >> s;
+        uint32_t const rem = mant & ((1u << s) - 1);
+        uint32_t const halfway = 1u << (s - 1);
+        if (rem > halfway || (rem == halfway && (q & 1))) { ++q; }
+        return {uint16_t(sign | q)};
+    }
+    uint32_t v = abs - 0x38000000;  // Rebias exponent from 127 to 15
+    v += 0xFFF + ((v >> 13) & 1);  // Round to nearest even
+    return {uint16_t(sign | (v >> 13))};
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__AVX512F__)
+static constexpr int kVecWidth = 16;
+#elif defined(__AVX2__)
+static constexpr int kVecWidth = 8;
+#else
+static constexpr int kVecWidth = 1;
+#endif
+
+#if defined(__AVX512F__)
+// 2^x for x <= 0 (we only ever call this on x - max). Inputs below -126 (including -inf) return 0.
+inline __m512 exp2_ps(__m512 x) {
+    __m512 const xc = _mm512_max_ps(x, _mm512_set1_ps(-126.f));
+    __m512 const xi = _mm512_roundscale_ps(xc, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 const f = _mm512_sub_ps(xc, xi);
+    // Minimax polynomial for 2^f on [0, 1), max rel error ~2e-7
+    __m512 p = _mm512_set1_ps(1.8775767e-3f);
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(8.9893397e-3f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(5.5826318e-2f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(2.4015361e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(6.9315308e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(9.9999994e-1f));
+    __m512i const e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(xi), _mm512_set1_epi32(127)), 23);
+    __m512 const r = _mm512_castsi512_ps(_mm512_add_epi32(_mm512_castps_si512(p), _mm512_sub_epi32(e, _mm512_castps_si512(_mm512_set1_ps(1.f)))));
+    __mmask16 const underflow = _mm512_cmp_ps_mask(x, _mm512_set1_ps(-126.f), _CMP_LT_OQ);
+    return _mm512_mask_blend_ps(underflow, r, _mm512_setzero_ps());
+}
+inline float reduce_add(__m512 v) { return _mm512_reduce_add_ps(v); }
+inline float reduce_max(__m512 v) { return _mm512_reduce_max_ps(v); }
+#endif
+
+#if defined(__AVX2__)
+inline __m256 exp2_ps(__m256 x) {
+    __m256 const xc = _mm256_max_ps(x, _mm256_set1_ps(-126.f));
+    __m256 const xi = _mm256_floor_ps(xc);
+    __m256 const f = _mm256_sub_ps(xc, xi);
+    __m256 p = _mm256_set1_ps(1.8775767e-3f);
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(8.9893397e-3f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5826318e-2f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.4015361e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.9315308e-1f));
+    p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.9999994e-1f));
+    __m256i const e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(xi), _mm256_set1_epi32(127)), 23);
+    __m256 const r = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), _mm256_sub_epi32(e, _mm256_castps_si256(_mm256_set1_ps(1.f)))));
+    __m256 const underflow = _mm256_cmp_ps(x, _mm256_set1_ps(-126.f), _CMP_LT_OQ);
+    return _mm256_blendv_ps(r, _mm256_setzero_ps(), underflow);
+}
+inline float reduce_add(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+inline float reduce_max(__m256 v) {
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Convert n elements of a row to fp32.
+template <typename Element>
+inline void load_row(Element const* __restrict__ src, float* __restrict__ dst, int n) {
+    int i = 0;
+    if constexpr (std::is_same_v<Element, bfloat16_t>) {
+#if defined(__AVX512F__)
+        for (; i + 16 <= n; i += 16) {
+            __m256i const h = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+            _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16)));
+        }
+#elif defined(__AVX2__)
+        for (; i + 8 <= n; i += 8) {
+            __m128i const h = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+            _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16)));
+        }
+#endif
+    } else if constexpr (std::is_same_v<Element, half_t>) {
+#if defined(__AVX512F__)
+        for (; i + 16 <= n; i += 16) {
+            _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i))));
+        }
+#elif defined(__F16C__)
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i))));
+        }
+#endif
+    }
+    for (; i < n; ++i) { dst[i] = to_float(src[i]); }
+}
+
+// Convert n fp32 values to Element and store them.
+template <typename Element>
+inline void store_row(float const* __restrict__ src, Element* __restrict__ dst, int n) {
+    int i = 0;
+    if constexpr (std::is_same_v<Element, half_t>) {
+#if defined(__AVX512F__)
+        for (; i + 16 <= n; i += 16) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        }
+#elif defined(__F16C__)
+        for (; i + 8 <= n; i += 8) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        }
+#endif
+    }
+    for (; i < n; ++i) { dst[i] = from_float<Element>(src[i]); }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Quantized KV cache rows, symmetric with one fp32 scale per row: x ~= scale * q, with q an int8 in [-127, 127]
+// or an int4 in [-7, 7]. int4 values are packed two per byte, element 2i in the low nibble of byte i.
+struct int4x2_t { uint8_t x; };
+
+template <typename Storage> struct QuantTraits;
+template <> struct QuantTraits<int8_t> { static constexpr int kMax = 127; };
+template <> struct QuantTraits<int4x2_t> { static constexpr int kMax = 7; };
+
+// Quantize n fp32 values into dst and return the scale. Rounds to nearest even, as torch.round does.
+template <typename Storage>
+inline float quantize_row(float const* __restrict__ src, Storage* __restrict__ dst, int n) {
+    constexpr int kMax = QuantTraits<Storage>::kMax;
+    float amax = 0.f;
+    for (int i = 0; i < n; ++i) { amax = std::max(amax, std::abs(src[i])); }
+    float const row_scale = amax / kMax;
+    auto quantize = [&](float x) {
+        return row_scale > 0.f ? int(std::min(std::max(std::nearbyint(x / row_scale), float(-kMax)), float(kMax))) : 0;
+    };
+    if constexpr (std::is_same_v<Storage, int8_t>) {
+        for (int i = 0; i < n; ++i) { dst[i] = int8_t(quantize(src[i])); }
+    } else {
+        for (int i = 0; i < n / 2; ++i) {
+            dst[i].x = uint8_t((quantize(src[2 * i]) & 0xF) | (quantize(src[2 * i + 1]) & 0xF) << 4);
+        }
+    }
+    return row_scale;
+}
+
+// Convert n quantized elements of a row to fp32.
+inline void dequantize_row(int8_t const* __restrict__ src, float const row_scale, float* __restrict__ dst, int n) {
+    int i = 0;
+#if defined(__AVX512F__)
+    __m512 const s = _mm512_set1_ps(row_scale);
+    for (; i + 16 <= n; i += 16) {
+        __m512i const q = _mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(q), s));
+    }
+#elif defined(__AVX2__)
+    __m256 const s = _mm256_set1_ps(row_scale);
+    for (; i + 8 <= n; i += 8) {
+        __m256i const q = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(q), s));
+    }
+#endif
+    for (; i < n; ++i) { dst[i] = float(src[i]) * row_scale; }
+}
+
+inline void dequantize_row(int4x2_t const* __restrict__ src, float const row_scale, float* __restrict__ dst, int n) {
+    for (int i = 0; i < n / 2; ++i) {
+        // Sign-extend each nibble
+        dst[2 * i] = float(int8_t(uint8_t(src[i].x << 4)) >> 4) * row_scale;
+        dst[2 * i + 1] = float(int8_t(src[i].x) >> 4) * row_scale;
+    }
+}
+
+inline float dot(float const* __restrict__ a, float const* __restrict__ b, int n) {
+    int i = 0;
+    float sum = 0.f;
+#if defined(__AVX512F__)
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) { acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0); }
+    sum = reduce_add(_mm512_add_ps(acc0, acc1));
+#elif defined(__AVX2__)
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) { acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0); }
+    sum = reduce_add(_mm256_add_ps(acc0, acc1));
+#endif
+    for (; i < n; ++i) { sum += a[i] * b[i]; }
+    return sum;
+}
+
+// y += alpha * x
+inline void axpy(float const alpha, float const* __restrict__ x, float* __restrict__ y, int n) {
+    int i = 0;
+#if defined(__AVX512F__)
+    __m512 const a = _mm512_set1_ps(alpha);
+    for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))); }
+#elif defined(__AVX2__)
+    __m256 const a = _mm256_set1_ps(alpha);
+    for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i))); }
+#endif
+    for (; i < n; ++i) { y[i] += alpha * x[i]; }
+}
+
+inline void scale(float* __restrict__ x, float const alpha, int n) {
+    int i = 0;
+#if defined(__AVX512F__)
+    __m512 const a = _mm512_set1_ps(alpha);
+    for (; i + 16 <= n; i += 16) { _mm512_storeu_ps(x + i, _mm512_mul_ps(a, _mm512_loadu_ps(x + i))); }
+#elif defined(__AVX2__)
+    __m256 const a = _mm256_set1_ps(alpha);
+    for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(x + i, _mm256_mul_ps(a, _mm256_loadu_ps(x + i))); }
+#endif
+    for (; i < n; ++i) { x[i] *= alpha; }
+}
+
+inline float max(float const* __restrict__ x, int n) {
+    int i = 0;
+    float m = -INFINITY;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_set1_ps(-INFINITY);
+    for (; i + 16 <= n; i += 16) { acc = _mm512_max_ps(acc, _mm512_loadu_ps(x + i)); }
+    m = reduce_max(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) { acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i)); }
+    m = reduce_max(acc);
+#endif
+    for (; i < n; ++i) { m = std::max(m, x[i]); }
+    return m;
+}
+
+// x = exp2(x * scale - max_scaled) in place, returns the sum of the results.
+// Entries that are -inf (masked out) become exactly 0.
+inline float scale_apply_exp2(float* __restrict__ x, float const scale, float const max_scaled, int n) {
+    int i = 0;
+    float sum = 0.f;
+#if defined(__AVX512F__)
+    __m512 const s = _mm512_set1_ps(scale), m = _mm512_set1_ps(max_scaled);
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        __m512 const p = exp2_ps(_mm512_fmsub_ps(_mm512_loadu_ps(x + i), s, m));
+        _mm512_storeu_ps(x + i, p);
+        acc = _mm512_add_ps(acc, p);
+    }
+    sum = reduce_add(acc);
+#elif defined(__AVX2__)
+    __m256 const s = _mm256_set1_ps(scale), m = _mm256_set1_ps(max_scaled);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 const p = exp2_ps(_mm256_fmsub_ps(_mm256_loadu_ps(x + i), s, m));
+        _mm256_storeu_ps(x + i, p);
+        acc = _mm256_add_ps(acc, p);
+    }
+    sum = reduce_add(acc);
+#endif
+    for (; i < n; ++i) {
+        x[i] = exp2f(x[i] * scale - max_scaled);
+        sum += x[i];
+    }
+    return sum;
+}
+
+inline void apply_softcap(float* __restrict__ x, float const softcap, int n) {
+    for (int i = 0; i < n; ++i) { x[i] = std::tanh(x[i] * softcap); }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per-thread counters of the work-stealing regions (parallel_for_ranges), summed over regions until reset_stats().
+// busy_ns / wall_ns is the thread's utilization.
+struct ThreadStats {
+    int64_t num_tasks = 0;
+    int64_t num_steals = 0;  // Ranges taken from other threads
+    int64_t busy_ns = 0;  // Time spent running tasks
+    int64_t wall_ns = 0;  // Duration of the regions the thread took part in
+};
+
+// A minimal persistent thread pool. Work is handed out dynamically through an atomic counter,
+// which plays the same role as tile_count_semaphore does for the persistent GPU schedulers.
+class ThreadPool {
+
+public:
+
+    static ThreadPool& get() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Run fn(task_idx, thread_idx) for every task_idx in [0, num_tasks) on up to num_threads
+    // threads (including the calling thread). thread_idx is in [0, num_threads) and can be used
+    // to index per-thread scratch buffers.
+    template <typename Fn>
+    void parallel_for(int num_tasks, int num_threads, Fn&& fn) {
+        if (num_tasks <= 0) { return; }
+        num_threads = std::max(1, std::min(num_threads, num_tasks));
+        if (num_threads == 1) {
+            for (int i = 0; i < num_tasks; ++i) { fn(i, 0); }
+            return;
+        }
+        // Only one parallel region at a time. Nested regions run serially on the caller.
+        std::unique_lock<std::mutex> region_lock(region_mutex_, std::try_to_lock);
+        if (!region_lock.owns_lock()) {
+            for (int i = 0; i < num_tasks; ++i) { fn(i, 0); }
+            return;
+        }
+        std::atomic<int> next_task{0};
+        run_region(num_threads, [&](int thread_idx) {
+            for (int task = next_task.fetch_add(1, std::memory_order_relaxed); task < num_tasks;
+                 task = next_task.fetch_add(1, std::memory_order_relaxed)) {
+                fn(task, thread_idx);
+            }
+        });
+    }
+
+    // Like parallel_for, but thread t starts with the tasks [range_begin[t], range_begin[t + 1]) and runs them in
+    // order, so that the caller can give each thread consecutive tasks of about the same cost. With work stealing,
+    // a thread that is done takes the back half of the remaining range of another thread, until no thread has
+    // any tasks left. Without, this is a static partition.
+    template <typename Fn>
+    void parallel_for_ranges(std::vector<int> const& range_begin, Fn&& fn) {
+        int const num_threads = int(range_begin.size()) - 1;
+        if (num_threads <= 0 || range_begin.back() <= range_begin.front()) { return; }
+        std::unique_lock<std::mutex> region_lock(region_mutex_, std::try_to_lock);
+        if (!region_lock.owns_lock()) {
+            for (int i = range_begin.front(); i < range_begin.back(); ++i) { fn(i, 0); }
+            return;
+        }
+        if (int(stats_.size()) < num_threads) { stats_.resize(num_threads); }
+        // The remaining range of each thread, with begin in the low 32 bits and end in the high 32 bits. The owner
+        // takes tasks from the front and thieves from the back, both with a CAS on the whole range.
+        struct alignas(64) Range { std::atomic<uint64_t> range; };
+        std::vector<Range> ranges(num_threads);
+        auto pack = [](int begin, int end) { return uint64_t(uint32_t(begin)) | (uint64_t(uint32_t(end)) << 32); };
+        for (int t = 0; t < num_threads; ++t) { ranges[t].range.store(pack(range_begin[t], range_begin[t + 1]), std::memory_order_relaxed); }
+        bool const steal = work_stealing_;
+        using clock = std::chrono::steady_clock;
+        auto const region_start = clock::now();
+        auto body = [&](int thread_idx) {
+            ThreadStats stats;  // Added to stats_ at the end, to not share cache lines with the other threads
+            std::atomic<uint64_t>& own = ranges[thread_idx].range;
+            while (true) {
+                uint64_t r = own.load(std::memory_order_acquire);
+                int begin = int(uint32_t(r)), end = int(r >> 32);
+                if (begin < end) {
+                    if (!own.compare_exchange_weak(r, pack(begin + 1, end), std::memory_order_acq_rel)) { continue; }
+                    auto const task_start = clock::now();
+                    fn(begin, thread_idx);
+                    stats.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - task_start).count();
+                    ++stats.num_tasks;
+                    continue;
+                }
+                if (!steal) { break; }
+                // Our range is empty, so nobody else writes to it until we put the stolen tasks there
+                bool stolen = false;
+                for (int i = 1; i < num_threads && !stolen; ++i) {
+                    std::atomic<uint64_t>& victim = ranges[(thread_idx + i) % num_threads].range;
+                    uint64_t v = victim.load(std::memory_order_acquire);
+                    while (int(uint32_t(v)) < int(v >> 32)) {
+                        int const v_begin = int(uint32_t(v)), v_end = int(v >> 32);
+                        int const mid = v_begin + (v_end - v_begin) / 2;
+                        if (victim.compare_exchange_weak(v, pack(v_begin, mid), std::memory_order_acq_rel)) {
+                            own.store(pack(mid, v_end), std::memory_order_release);
+                            ++stats.num_steals;
+                            stolen = true;
+                            break;
+                        }
+                    }
+                }
+                if (!stolen) { break; }
+            }
+            ThreadStats& total = stats_[thread_idx];
+            total.num_tasks += stats.num_tasks;
+            total.num_steals += stats.num_steals;
+            total.busy_ns += stats.busy_ns;
+        };
+        if (num_threads == 1) {
+            body(0);
+        } else {
+            run_region(num_threads, body);
+        }
+        int64_t const wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - region_start).count();
+        for (int t = 0; t < num_threads; ++t) { stats_[t].wall_ns += wall_ns; }
+    }
+
+    // Work stealing in parallel_for_ranges, on by default. Turning it off gives the static partition to compare with.
+    void set_work_stealing(bool work_stealing) {
+        std::lock_guard<std::mutex> region_lock(region_mutex_);
+        work_stealing_ = work_stealing;
+    }
+
+    std::vector<ThreadStats> stats() {
+        std::lock_guard<std::mutex> region_lock(region_mutex_);
+        return stats_;
+    }
+
+    void reset_stats() {
+        std::lock_guard<std::mutex> region_lock(region_mutex_);
+        stats_.clear();
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : workers_) { t.join(); }
+    }
+
+private:
+
+    ThreadPool() = default;
+
+    // Run body(thread_idx) on the calling thread (thread_idx 0) and num_threads - 1 workers, and wait for all of
+    // them. The caller holds region_mutex_.
+    void run_region(int num_threads, std::function<void(int)> body) {
+        ensure_workers(num_threads - 1);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = body;
+            num_active_ = num_threads - 1;
+            num_pending_ = num_threads - 1;
+            ++generation_;
+        }
+        cv_.notify_all();
+        body(0);
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [&] { return num_pending_ == 0; });
+        job_ = nullptr;
+    }
+
+    void ensure_workers(int num_workers) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (int(workers_.size()) < num_workers) {
+            int const worker_idx = int(workers_.size());
+            workers_.emplace_back([this, worker_idx] { worker_loop(worker_idx); });
+        }
+    }
+
+    void worker_loop(int worker_idx) {
+        uint64_t seen_generation = 0;
+        while (true) {
+            std::function<void(int)> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+                if (stop_) { return; }
+                seen_generation = generation_;
+                // Workers beyond the number requested for this region sit this one out
+                if (worker_idx >= num_active_) { continue; }
+                job = job_;
+            }
+            job(worker_idx + 1);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--num_pending_ == 0) { done_cv_.notify_one(); }
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex region_mutex_;
+    std::mutex mutex_;
+    std::condition_variable cv_, done_cv_;
+    std::function<void(int)> job_;
+    uint64_t generation_ = 0;
+    int num_active_ = 0, num_pending_ = 0;
+    bool stop_ = false;
+    bool work_stealing_ = true;
+    std::vector<ThreadStats> stats_;
+
+};
+
+} // namespace cpu
+
+} // namespace flash
@@ -0,0 +1,172 @@
+/******************************************************************************
+ * Copyright (c) 2024, Jay Shah, Ganesh Bikshandi, Ying Zhang, Vijay Thakkar, Pradeep Ramani, Tri Dao.
+ ******************************************************************************/
+
+#pragma once
+
+// Pool for the forward pass workspaces that don't outlive the call in practice: the split-KV accumulators
+// (out_accum, softmax_lse_accum), the scheduler semaphore / num_splits_dynamic metadata and the varlen LPT work list.
+// They are needed at every call and their size changes with the batch and num_splits, so allocating them each time
+// would churn and fragment the caching allocator in a long-running server.
+//
+// Buffers are rounded up to a size class (4 per power of 2, so at most 25% is wasted) and kept per device and stream.
+// When the last tensor using a buffer goes away it goes back to the pool of the stream it was allocated on, where the
+// next call can take it: work on that stream is ordered after the previous use, as with the caching allocator.
+// The idle bytes of a stream are capped at a few times its largest request over the last kWindow requests, so the
+// pool follows the worst case of the shapes currently in use instead of keeping every size class ever seen.
+// Buffers wanted while a CUDA graph is captured come from at::empty instead, so that they live in the graph's private
+// pool for as long as the graph: a pooled buffer could be handed out again, or freed by empty_cache(), while the graph
+// still writes into it.
+
+#include <ATen/ATen.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGraphsC10Utils.h>
+#include <c10/util/Exception.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace flash {
+
+// Smallest size class >= bytes: 512 bytes, then 2^k, 1.25 * 2^k, 1.5 * 2^k and 1.75 * 2^k
+inline int64_t workspace_size_class(int64_t bytes) {
+    int64_t constexpr kMinBytes = 512;
+    if (bytes <= kMinBytes) { return kMinBytes; }
+    int64_t pow2 = kMinBytes;
+    while (pow2 * 2 <= bytes) { pow2 *= 2; }
+    int64_t const step = pow2 / 4;
+    return (bytes + step - 1) / step * step;
+}
+
+class WorkspaceArena {
+public:
+    struct Stats {
+        int64_t bytes_allocated = 0;  // New buffers from the caching allocator
+        int64_t bytes_reused = 0;     // Requests served from the pool
+        int64_t num_allocated = 0;
+        int64_t num_reused = 0;
+        int64_t bytes_cached = 0;     // Currently idle in the pool
+    };
+
+    // Never destroyed, since tensors from the arena can be freed during interpreter shutdown
+    static WorkspaceArena& instance() {
+        static WorkspaceArena* arena = new WorkspaceArena();
+        return *arena;
+    }
+
+    // Uninitialized tensor, like at::empty, on the current stream of options.device()
+    at::Tensor empty(at::IntArrayRef sizes, at::TensorOptions const& options) {
+        at::Device const device = options.device();
+        if (device.is_cuda() && c10::cuda::currentStreamCaptureStatusMayInitCtx() != c10::cuda::CaptureStatus::None) {
+            return at::empty(sizes, options);
+        }
+        int64_t numel = 1;
+        for (int64_t s : sizes) { numel *= s; }
+        int64_t const bytes = workspace_size_class(numel * int64_t(options.dtype().itemsize()));
+        int64_t const stream_id = device.is_cuda() ? int64_t(at::cuda::getCurrentCUDAStream(device.index()).id()) : 0;
+        Key const key{int(device.type()), int(device.index()), stream_id};
+        at::Tensor buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Pool& pool = pools_[key];
+            if (++pool.num_requests % kWindow == 0) {
+                pool.prev_max_request = pool.max_request;
+                pool.max_request = 0;
+            }
+            pool.max_request = std::max(pool.max_request, bytes);
+            std::vector<at::Tensor>& free = pool.free[bytes];
+            if (!free.empty()) {
+                buffer = std::move(free.back());
+                free.pop_back();
+                pool.bytes_cached -= bytes;
+                stats_.bytes_reused += bytes;
+                ++stats_.num_reused;
+                stats_.bytes_cached -= bytes;
+            } else {
+                stats_.bytes_allocated += bytes;
+                ++stats_.num_allocated;
+            }
+            // Shapes that haven't been asked for in a while
+            trim(pool);
+        }
+        if (!buffer.defined()) {
+            try {
+                buffer = at::empty({bytes}, options.dtype(at::kByte));
+            } catch (c10::OutOfMemoryError const&) {
+                // The idle buffers may be what the caching allocator is missing
+                empty_cache();
+                buffer = at::empty({bytes}, options.dtype(at::kByte));
+            }
+        }
+        void* ptr = buffer.data_ptr();
+        return at::from_blob(ptr, sizes, [this, key, bytes, buffer](void*) { release(key, bytes, buffer); }, options);
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Gives the idle buffers back to the caching allocator
+    void empty_cache() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& [key, pool] : pools_) {
+            pool.free.clear();
+            pool.bytes_cached = 0;
+        }
+        stats_.bytes_cached = 0;
+    }
+
+private:
+    // Device type, device index, stream id
+    using Key = std::tuple<int, int, int64_t>;
+
+    // Requests over which the largest one is remembered, and the multiple of it that a stream can keep idle: a
+    // forward call takes out_accum, softmax_lse_accum and the scheduler metadata, all at most as large as out_accum
+    static constexpr int64_t kWindow = 256;
+    static constexpr int64_t kMaxCachedRequests = 4;
+
+    struct Pool {
+        std::unordered_map<int64_t, std::vector<at::Tensor>> free;  // Idle buffers by size class
+        int64_t bytes_cached = 0;
+        int64_t num_requests = 0;
+        int64_t max_request = 0, prev_max_request = 0;  // Largest size class in the current and previous window
+    };
+
+    WorkspaceArena() = default;
+
+    void release(Key const& key, int64_t bytes, at::Tensor const& buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Pool& pool = pools_[key];
+        pool.free[bytes].push_back(buffer);
+        pool.bytes_cached += bytes;
+        stats_.bytes_cached += bytes;
+        trim(pool);
+    }
+
+    // Frees idle buffers, largest first, until the pool is within kMaxCachedRequests times its largest recent request
+    void trim(Pool& pool) {
+        int64_t const limit = kMaxCachedRequests * std::max(pool.max_request, pool.prev_max_request);
+        while (pool.bytes_cached > limit) {
+            auto largest = pool.free.end();
+            for (auto it = pool.free.begin(); it != pool.free.end(); ++it) {
+                if (!it->second.empty() && (largest == pool.free.end() || it->first > largest->first)) { largest = it; }
+            }
+            int64_t const bytes = largest->first;
+            largest->second.pop_back();
+            if (largest->second.empty()) { pool.free.erase(largest); }
+            pool.bytes_cached -= bytes;
+            stats_.bytes_cached -= bytes;
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::map<Key, Pool> pools_;
+    Stats stats_;
+};
+
+} // namespace flash
@@ -0,0 +1,86 @@
+import pytest
+import torch
+
+from flash_attn.utils.chunked_prefill import ChunkedPrefillPlanner
+
+
+class ToyBlockManager:
+    """The KVBlockManager methods the planner uses, without page sharing"""
+
+    def __init__(self, num_pages, page_size):
+        self.page_size, self.free, self.seqs = page_size, list(range(num_pages)), {}
+
+    @property
+    def num_free_pages(self):
+        return len(self.free)
+
+    def add_sequence(self, pages, num_tokens):
+        self.seqs[len(self.seqs)] = ([], 0)
+        return len(self.seqs) - 1
+
+    def pages_needed(self, seq_id, num_tokens):
+        pages, seqlen = self.seqs[seq_id]
+        return -(-(seqlen + num_tokens) // self.page_size) - len(pages)
+
+    def append_batch(self, seq_ids, num_tokens):
+        for seq_id, n in zip(seq_ids, num_tokens):
+            pages, seqlen = self.seqs[seq_id]
+            pages += [self.free.pop(0) for _ in range(self.pages_needed(seq_id, n))]
+            self.seqs[seq_id] = (pages, seqlen + n)
+        return torch.empty(0, 2, dtype=torch.long)
+
+    def page_table(self, seq_ids, max_pages_per_seq, device):
+        max_pages = max(len(self.seqs[s][0]) for s in seq_ids)
+        table = torch.tensor([self.seqs[s][0] + [0] * (max_pages - len(self.seqs[s][0])) for s in seq_ids], dtype=torch.int32)
+        return table, torch.tensor([self.seqs[s][1] for s in seq_ids], dtype=torch.int32)
+
+    def free_sequence(self, seq_id):
+        self.free += self.seqs.pop(seq_id)[0]
+
+
+@pytest.mark.parametrize("chunk_multiple", [1, 16])
+@pytest.mark.parametrize("max_num_batched_tokens", [32, 256])
+def test_chunked_prefill_planner(max_num_batched_tokens, chunk_multiple):
+    torch.random.manual_seed(0)
+    manager = ToyBlockManager(num_pages=256, page_size=16)
+    planner = ChunkedPrefillPlanner(max_num_batched_tokens, chunk_multiple=chunk_multiple, block_manager=manager)
+    prompt_lens = {i: int(n) for i, n in enumerate(torch.randint(1, 300, (8,)))}
+    max_new_tokens = {i: int(n) for i, n in enumerate(torch.randint(1, 20, (8,)))}
+    for i in range(8):
+        planner.add_request(i, prompt_lens[i], max_new_tokens[i])
+    num_computed = {i: 0 for i in range(8)}
+    num_generated = {i: 0 for i in range(8)}
+    while planner.has_unfinished_requests():
+        step = planner.plan()
+        assert 0 < step.num_tokens <= max_num_batched_tokens
+        assert step.cu_seqlens_q.tolist() == [0] + torch.tensor(step.query_lens).cumsum(0).tolist()
+        assert step.max_seqlen_q == max(step.query_lens)
+        assert torch.equal(step.seqused_k, step.cache_seqlens + torch.tensor(step.query_lens, dtype=torch.int32))
+        # Decodes are never held back by prefills
+        decoding = [seq.request_id for seq in planner.sequences if not seq.is_prefilling]
+        assert step.request_ids[: len(decoding)] == decoding and step.num_decode_tokens == len(decoding)
+        for request_id, start, n in zip(step.request_ids, step.cache_seqlens.tolist(), step.query_lens):
+            assert start == num_computed[request_id]
+            if start + n < prompt_lens[request_id]:
+                assert n % chunk_multiple == 0  # Only the last chunk of a prompt isn't aligned
+            num_computed[request_id] += n
+        # The page table covers each row's tokens, including this step's
+        assert step.page_table.shape[0] == len(step.request_ids)
+        assert step.page_table.shape[1] * manager.page_size >= int(step.seqused_k.max())
+        for i, request_id in enumerate(step.sample_request_ids):
+            assert num_computed[request_id] >= prompt_lens[request_id]
+            assert int(step.sample_indices[i]) == step.cu_seqlens_q[step.request_ids.index(request_id) + 1] - 1
+            num_generated[request_id] += 1
+        planner.update(step)
+    assert num_generated == max_new_tokens
+    assert all(num_computed[i] == prompt_lens[i] + max_new_tokens[i] - 1 for i in range(8))
+    assert manager.num_free_pages == 256
+
+
+def test_chunked_prefill_planner_out_of_pages():
+    manager = ToyBlockManager(num_pages=4, page_size=16)
+    planner = ChunkedPrefillPlanner(256, chunk_multiple=16, block_manager=manager)
+    planner.add_request(0, 100, 1)  # 7 pages
+    # Nothing is decoding, so an empty step would never make progress
+    with pytest.raises(RuntimeError, match="prefill request 0"):
+        planner.plan()
@@ -0,0 +1,52 @@
+import pytest
+import torch
+
+from flash_attn.utils.continuous_batching import ContinuousBatchingScheduler, Request
+
+
+@pytest.mark.parametrize("max_num_batched_tokens", [8, 64])
+@pytest.mark.parametrize("max_batch_size", [1, 4])
+def test_continuous_batching_scheduler(max_batch_size, max_num_batched_tokens):
+    torch.random.manual_seed(0)
+    scheduler = ContinuousBatchingScheduler(max_batch_size, max_seqlen=64, max_num_batched_tokens=max_num_batched_tokens)
+    requests = [
+        Request(prompt=torch.randint(0, 100, (int(p),)).tolist(), max_new_tokens=int(n), eos_token_id=99)
+        for p, n in zip(torch.randint(1, 16, (20,)), torch.randint(1, 8, (20,)))
+    ]
+    # Half of them arrive later
+    for r in requests[:10]:
+        scheduler.add_request(r)
+    cache_len = {}  # Tokens in the KV cache of each slot
+    admitted, step_idx = [], 0
+    while scheduler.has_unfinished_requests() or step_idx < 5:
+        if step_idx == 5:
+            for r in requests[10:]:
+                scheduler.add_request(r)
+        step = scheduler.schedule()
+        batches = step.prefills + ([step.decode] if step.decode is not None else [])
+        assert step.num_tokens <= max_num_batched_tokens or (step.decode is None and len(step.prefills) == 1)
+        slots = [int(s) for b in batches for s in b.cache_batch_idx]
+        assert len(set(slots)) == len(slots) and all(0 <= s < max_batch_size for s in slots)
+        next_tokens, step_admitted = {}, []
+        for batch in batches:
+            is_prefill = any(batch is p for p in step.prefills)
+            assert batch.cache_batch_idx.dtype == torch.int32 and batch.cache_seqlens.dtype == torch.int32
+            for i, request_id in enumerate(batch.request_ids):
+                slot, seqlen = int(batch.cache_batch_idx[i]), int(batch.cache_seqlens[i])
+                if is_prefill:
+                    step_admitted.append(request_id)
+                    assert seqlen == 0
+                else:
+                    assert seqlen == cache_len[slot]
+                cache_len[slot] = seqlen + batch.input_ids.shape[1]
+                next_tokens[request_id] = int(torch.randint(0, 100, ()))
+        admitted += sorted(step_admitted)  # Prefills are grouped by prompt length within a step
+        scheduler.update(step, next_tokens, now=float(step_idx))
+        step_idx += 1
+    # First come first served, and every request generated until max_new_tokens or EOS
+    assert admitted == [r.request_id for r in requests]
+    for r in requests:
+        assert r.is_finished() and r.finish_time is not None
+        assert len(r.output) == r.max_new_tokens or r.output[-1] == 99
+    with pytest.raises(ValueError):
+        scheduler.add_request(Request(prompt=[0] * 60, max_new_tokens=8))